@@ -16,6 +16,8 @@ DEPENDFLAGS = -MM
 
 OPTFLAGS =  -O3
 MACHDBGFLAGS = -g
+# Apple LLVM has no OpenMP runtime: threaded code builds serially
+PARALLELFLAGS =
 GNU_ANSI_FLAGS = -Wall -pedantic
 ANSI_CXXFLAGS = ${GNU_ANSI_FLAGS}
 ANSI_CFLAGS = ${GNU_ANSI_FLAGS} -ansi
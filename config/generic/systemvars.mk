@@ -27,6 +27,7 @@ DEPENDFLAGS = -MM
 
 OPTFLAGS =  -O3 -fexpensive-optimizations ${ARCHFLAGS}
 MACHDBGFLAGS =
+PARALLELFLAGS = -fopenmp
 GNU_ANSI_FLAGS = -Wall -ansi -pedantic
 SGI_ANSI_FLAGS = -ansi -fullwarn
 ANSI_FLAGS = ${GNU_ANSI_FLAGS}
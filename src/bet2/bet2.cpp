@@ -75,8 +75,10 @@
 #include <stdio.h>
 #include <cmath>
 #include <algorithm>
+#include <stdexcept>
 
 #include "utils/options.h"
+#include "utils/threading.h"
 #include "newimage/newimageall.h"
 #include "meshclass/meshclass.h"
 
@@ -408,7 +410,9 @@ bet_parameters adjust_initial_mesh(const volume<float> & image, Mesh& m, const d
 
 
 
-double step_of_computation(const volume<float> & image, Mesh & m, const double bet_main_parameter, const int pass, const double increase_smoothing, const int iteration_number, double & l, const double t2, const double tm, const double t, const double E,const double F, const double zcog, const double radius, const double local_th=0., const int d1=7, const int d2=3){
+//one step of the surface evolution; the vertices only read the current
+//positions, so they are all updated in parallel
+double step_of_computation(const volume<float> & image, Flat_mesh & m, const double bet_main_parameter, const int pass, const double increase_smoothing, const int iteration_number, double & l, const double t2, const double tm, const double t, const double E,const double F, const double zcog, const double radius, const double local_th=0., const int d1=7, const int d2=3){
   double xdim = image.xdim();
   double ydim = image.ydim();
   double zdim = image.zdim();
@@ -417,23 +421,35 @@ double step_of_computation(const volume<float> & image, Mesh & m, const double b
   
   if (iteration_number==50 || iteration_number%100 == 0 )
     {
+      vector<double> ml(m.nvertices());
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+      for (int i=0; i<m.nvertices(); i++)
+	ml[i] = m.medium_distance_of_neighbours(i);
       l = 0;
       int counter = 0;
-      for (vector<Mpoint*>::iterator i = m._points.begin(); i!=m._points.end(); i++ )
+      for (int i=0; i<m.nvertices(); i++)
 	{
 	  counter++;
-	  l += (*i)->medium_distance_of_neighbours();
+	  l += ml[i];
 	}
       l/=counter;
     }
   
-  for (vector<Mpoint*>::iterator i = m._points.begin(); i!=m._points.end(); i++)
+  ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,256) if(Utilities::max_threads() > 1)
+#endif
+  for (int i=0; i<m.nvertices(); i++)
     {
+      if (err.occurred()) continue;
+      try {
       Vec sn, st, u1, u2, u3, u;
       double f2, f3=0;
       
-      Vec n = (*i)->local_normal();
-      Vec dv = (*i)->difference_vector();
+      Vec n = m.local_normal(i);
+      Vec dv = m.difference_vector(i);
       
       double tmp = dv|n;
       sn = n * tmp;
@@ -457,13 +473,13 @@ double step_of_computation(const volume<float> & image, Mesh & m, const double b
 	double local_t = bet_main_parameter;
 	if (local_th != 0.0)
 	  {
-	    local_t = Min(1., Max(0., bet_main_parameter + local_th*((*i)->get_coord().Z - zcog)/radius));
+	    local_t = Min(1., Max(0., bet_main_parameter + local_th*(m.get_coord(i).Z - zcog)/radius));
 	  }
 	
 	double Imin = tm;
 	double Imax = t;
 	
-	Pt p = (*i)->get_coord() + (-1)*n;
+	Pt p = m.get_coord(i) + (-1)*n;
 	double iv = p.X/xdim + .5, jv = p.Y/ydim +.5, kv = p.Z/zdim +.5; 
 	if (image.in_bounds((int)iv,(int) jv,(int) kv))
 	  {	
@@ -482,7 +498,7 @@ double step_of_computation(const volume<float> & image, Mesh & m, const double b
 		for (double gi=2.0; gi<d1; gi+=dscale)
 		  {
 		    //cout << gi << " " << endl;
-		    // the following is a quick calc of Pt p = (*i)->get_coord() + (-gi)*n;
+		    // the following is a quick calc of Pt p = m.get_coord(i) + (-gi)*n;
 		    iv-=nxv; jv-=nyv; kv-=nzv;
 		    im = image.value((int) (iv), (int) (jv), (int) (kv));
 		    Imin = Min(Imin, im);
@@ -512,8 +528,11 @@ double step_of_computation(const volume<float> & image, Mesh & m, const double b
             
       //cout<<"l "<<l<<"u1 "<<((u1*n).norm())<<"u2 "<<(u2|n)<<"u3 "<<(u3|n)<<endl;
       
-      (*i)->_update_coord = (*i)->get_coord() + u;
+      m.set_update_coord(i, m.get_coord(i) + u);
+      } catch(const std::exception& e) { err.set(e.what()); }
+      catch(...) { err.set("step_of_computation: unknown exception"); }
     }
+  if (err.occurred()) throw std::runtime_error(err.what());
 
   m.update();
   
@@ -793,10 +812,14 @@ int main(int argc, char *argv[]) {
   const double self_intersection_threshold = 4000;
   
   double l = 0;
-  for (int i=0; i<nb_iter; i++)
-    {
-      step_of_computation(testvol, m, bet_main_parameter, 0, 0, i, l, bp.t2, bp.tm, bp.t, E, F, bp.cog.Z, bp.radius, gradient_threshold.value());
-    }
+  {
+    Flat_mesh fm(m);
+    for (int i=0; i<nb_iter; i++)
+      {
+	step_of_computation(testvol, fm, bet_main_parameter, 0, 0, i, l, bp.t2, bp.tm, bp.t, E, F, bp.cog.Z, bp.radius, gradient_threshold.value());
+      }
+    fm.copy_to(m);
+  }
   
   double tmp = m.self_intersection(moriginal);
   if (verbose.value() && !generate_mesh.value())
@@ -818,13 +841,15 @@ int main(int argc, char *argv[]) {
       m = moriginal;
       l = 0;
       pass++;
+      Flat_mesh fm(m);
       for (int i=0; i<nb_iter; i++)
 	{
 	  double incfactor = pow (10.0,(double) pass + 1);
 	  if (i > .75 * (double)nb_iter)
 	    incfactor = 4.*(1. - i/(double)nb_iter) * (incfactor - 1.) + 1.;
-	  step_of_computation(testvol, m, bet_main_parameter, pass, incfactor, i, l, bp.t2, bp.tm, bp.t, E, F, bp.cog.Z, bp.radius, gradient_threshold.value());
+	  step_of_computation(testvol, fm, bet_main_parameter, pass, incfactor, i, l, bp.t2, bp.tm, bp.t, E, F, bp.cog.Z, bp.radius, gradient_threshold.value());
 	}
+      fm.copy_to(m);
       double tmp = m.self_intersection(moriginal);
   
       self_intersection = (tmp > self_intersection_threshold);
@@ -76,6 +76,7 @@
 #include "newimage/fmribmain.h"
 #include "newimage/newimageall.h"
 #include "utils/options.h"
+#include "utils/threading.h"
 #include "infer.h"
 #include "warpfns/warpfns.h"
 #include "warpfns/fnirt_file_reader.h"
@@ -263,84 +264,134 @@ void TransformToReference(triple<T> & coordlist, const Matrix& affine,
   coordlist.z = coord(3);
 }
 
+// Zero-padded read that, unlike operator() outside the image, leaves the
+// volume untouched and so can be used from several threads at once
+template <class T>
+inline T zpad(const volume<T>& vol, const int x, const int y, const int z)
+{
+  return vol.in_bounds(x,y,z) ? vol.value(x,y,z) : (T) 0;
+}
+
 template <class T>
 bool checkIfLocalMaxima(const int& index, const volume<int>& labelim, const volume<T>& zvol, const int& connectivity, const int& x, const int& y, const int& z )
 {	       
   if (connectivity==6)
-    return ( index==labelim(x,y,z) &&
-	     zvol(x,y,z)>zvol(x,  y,  z-1) &&
-	     zvol(x,y,z)>zvol(x,  y-1,z) &&
-	     zvol(x,y,z)>zvol(x-1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x+1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x,  y+1,z) &&
-	     zvol(x,y,z)>=zvol(x,  y,  z+1) );
+    return ( index==labelim.value(x,y,z) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x,  y,  z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x,  y-1,z) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x-1,y,  z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x+1,y,  z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x,  y+1,z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x,  y,  z+1) );
 
   else 
-    return ( index==labelim(x,y,z) &&
-	     zvol(x,y,z)>zvol(x-1,y-1,z-1) &&
-	     zvol(x,y,z)>zvol(x,  y-1,z-1) &&
-	     zvol(x,y,z)>zvol(x+1,y-1,z-1) &&
-	     zvol(x,y,z)>zvol(x-1,y,  z-1) &&
-	     zvol(x,y,z)>zvol(x,  y,  z-1) &&
-	     zvol(x,y,z)>zvol(x+1,y,  z-1) &&
-	     zvol(x,y,z)>zvol(x-1,y+1,z-1) &&
-	     zvol(x,y,z)>zvol(x,  y+1,z-1) &&
-	     zvol(x,y,z)>zvol(x+1,y+1,z-1) &&
-	     zvol(x,y,z)>zvol(x-1,y-1,z) &&
-	     zvol(x,y,z)>zvol(x,  y-1,z) &&
-	     zvol(x,y,z)>zvol(x+1,y-1,z) &&
-	     zvol(x,y,z)>zvol(x-1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x+1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x-1,y+1,z) &&
-	     zvol(x,y,z)>=zvol(x,  y+1,z) &&
-	     zvol(x,y,z)>=zvol(x+1,y+1,z) &&
-	     zvol(x,y,z)>=zvol(x-1,y-1,z+1) &&
-	     zvol(x,y,z)>=zvol(x,  y-1,z+1) &&
-	     zvol(x,y,z)>=zvol(x+1,y-1,z+1) &&
-	     zvol(x,y,z)>=zvol(x-1,y,  z+1) &&
-	     zvol(x,y,z)>=zvol(x,  y,  z+1) &&
-	     zvol(x,y,z)>=zvol(x+1,y,  z+1) &&
-	     zvol(x,y,z)>=zvol(x-1,y+1,z+1) &&
-	     zvol(x,y,z)>=zvol(x,  y+1,z+1) &&
-	     zvol(x,y,z)>=zvol(x+1,y+1,z+1) );
+    return ( index==labelim.value(x,y,z) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x-1,y-1,z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x,  y-1,z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x+1,y-1,z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x-1,y,  z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x,  y,  z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x+1,y,  z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x-1,y+1,z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x,  y+1,z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x+1,y+1,z-1) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x-1,y-1,z) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x,  y-1,z) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x+1,y-1,z) &&
+	     zpad(zvol,x,y,z)>zpad(zvol,x-1,y,  z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x+1,y,  z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x-1,y+1,z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x,  y+1,z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x+1,y+1,z) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x-1,y-1,z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x,  y-1,z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x+1,y-1,z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x-1,y,  z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x,  y,  z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x+1,y,  z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x-1,y+1,z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x,  y+1,z+1) &&
+	     zpad(zvol,x,y,z)>=zpad(zvol,x+1,y+1,z+1) );
+
+}
 
+template <class T>
+inline void add_voxel(cluster<T>& clust, const int label, const T oxyz, const int x, const int y, const int z, const bool minv)
+{
+  clust.originalLabel=label; //slightly wasteful, but doesn't really matter
+  clust.size++;
+  clust.cog.x+=((float) oxyz)*x;
+  clust.cog.y+=((float) oxyz)*y;
+  clust.cog.z+=((float) oxyz)*z;
+  clust.meanval+=(float) oxyz;
+  if ((clust.size==1) || ((oxyz>clust.maxval) && !minv ) || ((oxyz<clust.maxval) && minv )) {
+    clust.maxval = oxyz;
+    clust.maxpos.x = x;
+    clust.maxpos.y = y;
+    clust.maxpos.z = z;
+  }
 }
 
 template <class T>
-void get_stats(const volume<int>& labelim, const volume<T>& origim,vector<cluster<T> >& clusters,bool minv) 
+void finish_stats(vector<cluster<T> >& clusters)
+{
+  for (unsigned int n=0; n<clusters.size(); n++) {
+    if (clusters[n].size) {
+      clusters[n].cog.x /= clusters[n].meanval; //meanval is currently just sum
+      clusters[n].cog.y /= clusters[n].meanval;
+      clusters[n].cog.z /= clusters[n].meanval;
+      clusters[n].meanval /= clusters[n].size;
+    }
+  }
+}
+
+// Statistics for the input image, and the cope image if given, in a single
+// pass over the label image
+template <class T>
+void get_stats(const volume<int>& labelim, const volume<T>& origim, const volume<T>* copeim,
+	       vector<cluster<T> >& clusters, vector<cluster<T> >& clustersCope, bool minv) 
 {
   int labelnum = labelim.max();
   clusters.resize(labelnum);
+  if (copeim) clustersCope.resize(labelnum);
   for (int z=labelim.minz(); z<=labelim.maxz(); z++) {
     for (int y=labelim.miny(); y<=labelim.maxy(); y++) {
       for (int x=labelim.minx(); x<=labelim.maxx(); x++) {
-	int idx = labelim(x,y,z);
+	int idx = labelim.value(x,y,z);
 	if ( idx-- ) {
-	  clusters[idx].originalLabel=idx+1; //slightly wasteful, but doesn't really matter
-	  T oxyz = origim(x,y,z);
-	  clusters[idx].size++;
-	  clusters[idx].cog.x+=((float) oxyz)*x;
-	  clusters[idx].cog.y+=((float) oxyz)*y;
-	  clusters[idx].cog.z+=((float) oxyz)*z;
-	  clusters[idx].meanval+=(float) oxyz;
-	  if ((clusters[idx].size==1) || ((oxyz>clusters[idx].maxval) && !minv ) || ((oxyz<clusters[idx].maxval) && minv )) {
-	    clusters[idx].maxval = oxyz;
-	    clusters[idx].maxpos.x = x;
-	    clusters[idx].maxpos.y = y;
-	    clusters[idx].maxpos.z = z;
-	  }
+	  add_voxel(clusters[idx],idx+1,origim.value(x,y,z),x,y,z,minv);
+	  // bounds-checked, as the cope image need not match the stats image
+	  if (copeim) add_voxel(clustersCope[idx],idx+1,(*copeim)(x,y,z),x,y,z,minv);
 	}
       }
     }
   }
-  for (unsigned int n=0; n<clusters.size(); n++) {
-    if (clusters[n].size) {
-      clusters[n].cog.x /= clusters[n].meanval; //meanval is currently just sum
-      clusters[n].cog.y /= clusters[n].meanval;
-      clusters[n].cog.z /= clusters[n].meanval;
-      clusters[n].meanval /= clusters[n].size;
-    }
-  }
+  finish_stats(clusters);
+  if (copeim) finish_stats(clustersCope);
+}
+
+// Local maxima of every cluster, found in one pass over the label image
+// rather than one per cluster.  maxima[label] lists them in z,y,x scan order.
+template <class T>
+void get_local_maxima(const volume<int>& labelim, const volume<T>& zvol, const int connectivity,
+		      vector<vector<pair<T, triple<float> > > >& maxima)
+{
+  const int z0=labelim.minz(), nz=labelim.maxz()-labelim.minz()+1;
+  vector<vector<pair<int, pair<T, triple<float> > > > > slices(nz);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+  for (int z=z0; z<z0+nz; z++)
+    for (int y=labelim.miny(); y<=labelim.maxy(); y++)
+      for (int x=labelim.minx(); x<=labelim.maxx(); x++) {
+	int idx = labelim.value(x,y,z);
+	if ( idx && checkIfLocalMaxima(idx,labelim,zvol,connectivity,x,y,z) )
+	  slices[z-z0].push_back(make_pair(idx,make_pair(zvol.value(x,y,z),triple<float>(x,y,z))));
+      }
+  maxima.assign(labelim.max()+1,vector<pair<T, triple<float> > >());
+  for (int z=0; z<nz; z++)
+    for (unsigned int n=0; n<slices[z].size(); n++)
+      maxima[slices[z][n].first].push_back(slices[z][n].second);
 }
 
 template <class T, class S>
@@ -358,7 +409,7 @@ template <class T>
 void print_results(vector<cluster<T> >& clusters, 
 		   vector<cluster<T> >& clustersCope,
 		   const volume<T>& zvol, const volume<T>& cope, 
-		   const volume<int> &labelim)
+		   vector<vector<pair<T, triple<float> > > >& allmaxima)
 {
   bool doAffineTransform=false;
   bool doWarpfieldTransform=false;
@@ -451,14 +502,8 @@ void print_results(vector<cluster<T> >& clusters,
     volume<char> lmaxvol;
     copyconvert(zvol,lmaxvol);
     lmaxvol=0;
-    zvol.setextrapolationmethod(zeropad);
     for (int n=clusters.size()-1; n>=0; n--) {
-      vector<pair<T, triple<float> > > maxima;
-      for (int z=labelim.minz(); z<=labelim.maxz(); z++)
-	for (int y=labelim.miny(); y<=labelim.maxy(); y++)
-	  for (int x=labelim.minx(); x<=labelim.maxx(); x++)
-	    if ( checkIfLocalMaxima(clusters[n].originalLabel,labelim,zvol,numconnected.value(),x,y,z)) 
-	      maxima.push_back(make_pair(zvol(x,y,z),triple<float>(x,y,z)));
+      vector<pair<T, triple<float> > >& maxima = allmaxima[clusters[n].originalLabel];
       sort(maxima.rbegin(),maxima.rend());
       if (peakdist.value()>0) {
 	for(unsigned int source=0;source<maxima.size();source++)
@@ -519,18 +564,16 @@ int fmrib_main(int argc, char *argv[])
   labelim = connected_components(mask,numconnected.value());
   if (verbose.value())  print_volume_info(labelim,"Labelim");
   
-  // process according to the output format
-  vector<cluster<T> > clusters;
-  get_stats(labelim,zvol,clusters,minv.value());
+  // process according to the output format, and the cope image if entered
+  vector<cluster<T> > clusters, clustersCope;
+  if (!copename.unset()) read_volume(cope,copename.value());
+  get_stats(labelim,zvol,copename.unset() ? 0 : &cope,clusters,clustersCope,minv.value());
   int nOriginalLabels(clusters.size()+1); //0 is also a label of sorts
   if (verbose.value()) cout<<"Number of labels = "<<clusters.size()<<endl;
 
-  // process the cope image if entered
-  vector<cluster<T> > clustersCope;
-  if (!copename.unset()) {
-    read_volume(cope,copename.value());
-    get_stats(labelim,cope,clustersCope,minv.value());
-  }
+  vector<vector<pair<T, triple<float> > > > maxima;
+  if (outlmax.set() || outlmaxim.set())
+    get_local_maxima(labelim,zvol,numconnected.value(),maxima);
 
  sort(clusters.rbegin(),clusters.rend());        //Sort descending for threshold purposes
  sort(clustersCope.rbegin(),clustersCope.rend());
@@ -572,7 +615,7 @@ int fmrib_main(int argc, char *argv[])
   if (verbose.value()) {cout<<clusters.size()<<" labels in sortedidx"<<endl;}
 
   // print table
-  print_results(clusters, clustersCope, zvol, cope, labelim);
+  print_results(clusters, clustersCope, zvol, cope, maxima);
   
   labelim.setDisplayMaximumMinimum(0,0);
   // save relevant volumes
@@ -70,10 +70,12 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <vector>
 
 #include "smoothest.h"
 
 #include "utils/options.h"
+#include "utils/threading.h"
 
 #define _GNU_SOURCE 1
 #define POSIX_SOURCE 1
@@ -150,52 +152,115 @@ Interpolate interpolate;
 }
 
 //////////////////////////////////////////////////////////////////////////////
-// Standardise the residual field (assuming gaussianity)
-unsigned long standardise(volume<float>& mask, 
-			  volume4D<float>& R)
+// Reads a 4D image one volume at a time, so the residual series never has
+// to be held in memory.  Volumes come out in radiological order, to match
+// the mask as returned by read_volume.
+class VolumeStream {
+public:
+  VolumeStream(const string& filename) : nextvol(0)
+  {
+    IP = NewFslOpen(filename.c_str(), "r");
+    if (FslGetErrorFlag(IP)==1) { imthrow("Failed to read volume "+filename,22); }
+    short s5;
+    FslGetDim5(IP,&sx,&sy,&sz,&st,&s5);
+    if (st<1) st=1;
+    if (s5<1) s5=1;
+    st*=s5;
+    float tr;
+    FslGetVoxDim(IP,&dx,&dy,&dz,&tr);
+    swapLR = (FslGetLeftRightOrder(IP)==FSL_NEUROLOGICAL);  // as NEWIMAGE does
+    buffer.resize(sx*sy*sz);
+  }
+  ~VolumeStream() { FslClose(IP); }
+
+  int xsize() const { return sx; }
+  int ysize() const { return sy; }
+  int zsize() const { return sz; }
+  int tsize() const { return st; }
+  float xdim() const { return dx; }
+  float ydim() const { return dy; }
+  float zdim() const { return dz; }
+
+  // Reads the next volume into vol, indexed as (z*ysize+y)*xsize+x
+  void read_next(vector<float>& vol)
+  {
+    if (nextvol>=st) { imthrow("Read past the last volume",22); }
+    vol.resize(buffer.size());
+    FslReadBuffer(IP,&buffer[0]);
+    if (swapLR) {
+      for (size_t row=0; row<buffer.size(); row+=sx)
+	for (int x=0; x<sx; x++)
+	  vol[row+x] = buffer[row+sx-1-x];
+    } else {
+      vol = buffer;
+    }
+    nextvol++;
+  }
+
+private:
+  FSLIO* IP;
+  short sx, sy, sz, st;
+  float dx, dy, dz;
+  bool swapLR;
+  int nextvol;
+  vector<float> buffer;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Standardise the residual field (assuming gaussianity).  On return mean and
+// sd hold each voxel's temporal mean and standard deviation; voxels whose
+// variance is not positive are removed from the mask.
+unsigned long standardise(volume<float>& mask, const string& filename,
+			  vector<double>& mean, vector<double>& sd)
 {
+  VolumeStream R(filename);
+  const int M=R.tsize();
+  const int nx=R.xsize(), ny=R.ysize(), nz=R.zsize();
+  const size_t nvox=(size_t) nx*ny*nz;
+  float *mptr=mask.nsfbegin();
+
   unsigned long count = 0;
-  int M=R.tsize();
-
-  for (int z=mask.minz(); z<=mask.maxz(); z++) {
-    for (int y=mask.miny(); y<=mask.maxy(); y++) {
-      for (int x=mask.minx(); x<=mask.maxx(); x++) {
-
-	if( mask(x,y,z) > 0.5) {
-	  
-	  count ++;
-	  
-	  if( M > 2 ) {
-	    
-	    // For each voxel 
-	    //    calculate mean and standard deviation...
-	    double Sx = 0.0, SSx = 0.0;
-	    
-	    for ( int t = 0; t < M; t++ ) {
-	      double R_it = R(x,y,z,t);
-	      
-	      Sx += R_it;
-	      SSx += Sqr(R_it);
-	    }
-	    
-	    double mean = Sx / M;
-	    double sdsq = (SSx - (Sqr(Sx) / M)) / (M - 1) ;
-	    
-	    if (sdsq<=0) {
-	      // trap for differences between mask and invalid data
-	      mask(x,y,z)=0;
-	      count--;
-	    } else {
-	      //    ... and use them to standardise to N(0, 1).
-	      for ( unsigned short t = 0; t < M; t++ ) {
-		R(x,y,z,t) = (R(x,y,z,t) - mean) / sqrt(sdsq);
-	      }
-	    } 
-	  }
+  if (M <= 2) {
+    for (size_t i=0; i<nvox; i++) if (mptr[i] > 0.5) count++;
+    return count;
+  }
+
+  // For each voxel calculate mean and standard deviation...
+  vector<double> Sx(nvox,0.0), SSx(nvox,0.0);
+  vector<float> vol;
+  for ( int t = 0; t < M; t++ ) {
+    R.read_next(vol);
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+    for (int z=0; z<nz; z++) {
+      for (size_t i=(size_t) z*nx*ny; i<(size_t) (z+1)*nx*ny; i++) {
+	if (mptr[i] > 0.5) {
+	  double R_it = vol[i];
+	  Sx[i] += R_it;
+	  SSx[i] += Sqr(R_it);
 	}
       }
     }
-  }  
+  }
+
+  mean.resize(nvox);
+  sd.resize(nvox);
+  for (size_t i=0; i<nvox; i++) {
+    if (mptr[i] > 0.5) {
+      count ++;
+      mean[i] = Sx[i] / M;
+      double sdsq = (SSx[i] - (Sqr(Sx[i]) / M)) / (M - 1) ;
+      if (sdsq<=0) {
+	// trap for differences between mask and invalid data
+	mptr[i]=0;
+	count--;
+      } else {
+	//    ... and use them to standardise to N(0, 1).
+	sd[i] = sqrt(sdsq);
+      }
+    }
+  }
   return count;
 }
 
@@ -271,18 +336,21 @@ int main(int argc, char **argv) {
   if(verbose.value()) cerr << "done" << endl;
   
 
-  volume4D<float> R;
-  read_volume4D(R,datafilename);
-  if (verbose.value()) print_volume_info(R,"Data (residuals/zstat)");
+  VolumeStream R(datafilename);
+  if (verbose.value()) {
+    cout << "Data (residuals/zstat):: size = " << R.xsize() << " x " << R.ysize()
+	 << " x " << R.zsize() << " x " << R.tsize() << endl;
+  }
 
-  if (!samesize(R[0],mask)) {
+  if ((R.xsize()!=mask.xsize()) || (R.ysize()!=mask.ysize()) || (R.zsize()!=mask.zsize())) {
     cerr << "Mask and Data (residuals/zstat) volumes MUST be the same size!"
 	 << endl;
     exit(EXIT_FAILURE);
   }
 
   if(verbose.value()) cerr << "Standardising....";
-  unsigned long mask_volume = standardise(mask, R);
+  vector<double> vmean, vsd;
+  unsigned long mask_volume = standardise(mask, datafilename, vmean, vsd);
   if(verbose.value()) cerr << "done" << endl;
   
   if(verbose.value()) cerr << "Masked-in voxels = " << mask_volume << endl;
@@ -301,30 +369,69 @@ int main(int argc, char **argv) {
   enum {X = 0, Y, Z};
   double SSminus[3] = {0, 0, 0}, S2[3] = {0, 0, 0};
 
+  const int nx=R.xsize(), ny=R.ysize(), nz=R.zsize();
+  const bool standardised = (R.tsize() > 2);
+  const float *mptr = mask.nsfbegin();
   int zstart=1;
   if (!usez) zstart=0;
-  for ( unsigned short z = zstart; z < R.zsize() ; z++ )
-    for ( unsigned short y = 1; y < R.ysize() ; y++ )
-      for ( unsigned short x = 1; x < R.xsize() ; x++ )
-	// Sum over N
-	if( (mask(x, y, z)>0.5) &&
-	    (mask(x-1, y, z)>0.5) && 
-	    (mask(x, y-1, z)>0.5) && 
-	    ( (!usez) || (mask(x, y, z-1)>0.5) ) ) {
-	  
+
+  // Sum over N: only voxels whose backward neighbours are all in the mask
+  vector<char> edge((size_t) nx*ny*nz, 0);
+  for ( int z = zstart; z < nz ; z++ )
+    for ( int y = 1; y < ny ; y++ )
+      for ( int x = 1; x < nx ; x++ ) {
+	size_t i = ((size_t) z*ny + y)*nx + x;
+	if( (mptr[i]>0.5) &&
+	    (mptr[i-1]>0.5) && 
+	    (mptr[i-nx]>0.5) && 
+	    ( (!usez) || (mptr[i-nx*ny]>0.5) ) ) {
+	  edge[i] = 1;
 	  N++;
-	  
-	  for ( unsigned short t = 0; t < R.tsize(); t++ ) {
-	    // Sum over M
-	    SSminus[X] += R(x, y, z, t) * R(x-1, y, z, t);
-	    SSminus[Y] += R(x, y, z, t) * R(x, y-1, z, t);
-	    if (usez) SSminus[Z] += R(x, y, z, t) * R(x, y, z-1, t);
-
-	    S2[X] += 0.5 * (Sqr(R(x, y, z, t)) + Sqr(R(x-1, y, z, t)));
-	    S2[Y] += 0.5 * (Sqr(R(x, y, z, t)) + Sqr(R(x, y-1, z, t)));
-	    if (usez) S2[Z] += 0.5 * (Sqr(R(x, y, z, t)) + Sqr(R(x, y, z-1, t)));
-	  }
 	}
+      }
+
+  // Sum over M, one volume at a time.  Each slice keeps its own running
+  // sums so the result does not depend on the number of threads.
+  vector<double> slicesums((size_t) nz*6, 0.0);
+  vector<float> vol;
+  for ( int t = 0; t < R.tsize(); t++ ) {
+    R.read_next(vol);
+    if (standardised) {
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+      for (int z=0; z<nz; z++)
+	for (size_t i=(size_t) z*nx*ny; i<(size_t) (z+1)*nx*ny; i++)
+	  if (mptr[i] > 0.5) vol[i] = (vol[i] - vmean[i]) / vsd[i];
+    }
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+    for ( int z = zstart; z < nz ; z++ ) {
+      double ssx=0, ssy=0, ssz=0, s2x=0, s2y=0, s2z=0;
+      for ( int y = 1; y < ny ; y++ )
+	for ( int x = 1; x < nx ; x++ ) {
+	  size_t i = ((size_t) z*ny + y)*nx + x;
+	  if (!edge[i]) continue;
+	  ssx += vol[i] * vol[i-1];
+	  ssy += vol[i] * vol[i-nx];
+	  if (usez) ssz += vol[i] * vol[i-nx*ny];
+
+	  s2x += 0.5 * (Sqr(vol[i]) + Sqr(vol[i-1]));
+	  s2y += 0.5 * (Sqr(vol[i]) + Sqr(vol[i-nx]));
+	  if (usez) s2z += 0.5 * (Sqr(vol[i]) + Sqr(vol[i-nx*ny]));
+	}
+      double *acc = &slicesums[(size_t) z*6];
+      acc[0] += ssx; acc[1] += ssy; acc[2] += ssz;
+      acc[3] += s2x; acc[4] += s2y; acc[5] += s2z;
+    }
+  }
+  for ( int z = 0; z < nz ; z++ ) {
+    SSminus[X] += slicesums[z*6];   SSminus[Y] += slicesums[z*6+1];
+    SSminus[Z] += slicesums[z*6+2];
+    S2[X] += slicesums[z*6+3];      S2[Y] += slicesums[z*6+4];
+    S2[Z] += slicesums[z*6+5];
+  }
 
   double norm = 1.0/(double) N;
   double v = dof.value();	// v - degrees of freedom (nu)  
@@ -76,6 +76,7 @@ class ConvergenceDetector {
   virtual bool NeedSave() = 0;
   virtual bool NeedRevert() = 0;
   virtual float LMalpha() = 0;
+  virtual ConvergenceDetector* Clone() const = 0; // for use by another thread
 };
 
 class CountingConvergenceDetector : public ConvergenceDetector {
@@ -92,6 +93,8 @@ class CountingConvergenceDetector : public ConvergenceDetector {
     virtual bool NeedSave() { return false; }
     virtual bool NeedRevert() {return false; }
   virtual float LMalpha() {return 0.0;}
+  virtual CountingConvergenceDetector* Clone() const
+    { return new CountingConvergenceDetector(*this); }
   
   private:
     int its;
@@ -110,6 +113,8 @@ class FchangeConvergenceDetector : public ConvergenceDetector {
     virtual bool NeedSave() { return false; }
     virtual bool NeedRevert() {return false; }
   virtual float LMalpha() {return 0.0;}
+  virtual FchangeConvergenceDetector* Clone() const
+    { return new FchangeConvergenceDetector(*this); }
 
   private:
     int its;
@@ -151,6 +156,8 @@ class FreduceConvergenceDetector : public ConvergenceDetector {
   virtual bool NeedRevert();
   //virtual bool DoNoiseUpdate() {return true;}
   virtual float LMalpha() {return 0.0;}
+  virtual FreduceConvergenceDetector* Clone() const
+    { return new FreduceConvergenceDetector(*this); }
 
  private:
   int its;
@@ -200,12 +207,14 @@ class TrialModeConvergenceDetector : public ConvergenceDetector {
    : max(maxIts), maxT(maxTrials), chg(Fchange) {assert(max>0); assert(maxT>0); assert(chg>0); Reset(); }
   virtual void DumpTo(ostream& out, const string indent = "") const;
   virtual void Reset(double F=-99e99)
-  { its = 0; prev = F; trials = 0; save = true; revert = false; }
+  { its = 0; prev = F; trials = 0; save = true; revert = false; trialmode = false; }
   virtual bool UseF() const {return true;}
   virtual bool NeedSave();
   virtual bool NeedRevert();
   //virtual bool DoNoiseUpdate() {return true;} 
   virtual float LMalpha() {return 0.0;}
+  virtual TrialModeConvergenceDetector* Clone() const
+    { return new TrialModeConvergenceDetector(*this); }
  private:
   int its;
   int trials;
@@ -298,6 +307,8 @@ class LMConvergenceDetector : public ConvergenceDetector {
   virtual bool NeedRevert();
   //virtual bool DoNoiseUpdate();
   virtual float LMalpha();
+  virtual LMConvergenceDetector* Clone() const
+    { return new LMConvergenceDetector(*this); }
  private:
   int its;
   const int max;
@@ -78,14 +78,14 @@ using namespace MISCMATHS;
 
 MVNDist::MVNDist()
 {
-  Tracer_Plus tr("MVNDist::MVNDist()");
+  //    Tracer_Plus tr("MVNDist::MVNDist()");
   len = -1;
   precisionsValid = covarianceValid = false;
 }
 
 MVNDist::MVNDist(const MVNDist& from1, const MVNDist& from2)
 {
-  Tracer_Plus tr("MVNDist::MVNDist(from1,from2)");
+  //    Tracer_Plus tr("MVNDist::MVNDist(from1,from2)");
   len = from1.len + from2.len;
   means = from1.means & from2.means;
   precisionsValid = false;
@@ -146,7 +146,7 @@ const MVNDist& MVNDist::operator=(const MVNDist& from)
 void MVNDist::CopyFromSubmatrix(const MVNDist& from, int first, int last, 
     bool checkIndependence)
 {
-    Tracer_Plus tr("MVNDist::CopyFromSubmatrix");
+    //    Tracer_Plus tr("MVNDist::CopyFromSubmatrix");
     len = last-first+1;
     means = from.means.Rows(first, last);
     precisionsValid = from.precisionsValid;
@@ -202,12 +202,12 @@ void MVNDist::SetSize(int dim)
 // Accessors
 const SymmetricMatrix& MVNDist::GetPrecisions() const
 {
-  Tracer_Plus tr("MVNDist::GetPrecisions");
+  //    Tracer_Plus tr("MVNDist::GetPrecisions");
   if (len == -1) throw Logic_error("MVN is uninitialized!\n");
   assert(means.Nrows() == len);
   if (!precisionsValid)
     {
-      Tracer_Plus tr("MVNDist::GetPrecisions calculation");        
+      //    Tracer_Plus tr("MVNDist::GetPrecisions calculation");        
       assert(covarianceValid);
       // precisions and precisionsValid are mutable, 
       // so we can change them even in a const function
@@ -221,12 +221,12 @@ const SymmetricMatrix& MVNDist::GetPrecisions() const
 
 const SymmetricMatrix& MVNDist::GetCovariance() const
 {
-  Tracer_Plus tr("MVNDist::GetCovariance");    
+  //    Tracer_Plus tr("MVNDist::GetCovariance");    
   if (len == -1) throw Logic_error("MVN is uninitialized!\n");
   assert(means.Nrows() == len);
   if (!covarianceValid)
     {
-      Tracer_Plus tr("MVNDist::GetCovariance calculation");
+      //    Tracer_Plus tr("MVNDist::GetCovariance calculation");
       assert(precisionsValid);
       // covariance and covarianceValid are mutable, 
       // so we can change them even in a const function
@@ -253,7 +253,7 @@ const SymmetricMatrix& MVNDist::GetCovariance() const
 
 void MVNDist::SetPrecisions(const SymmetricMatrix& from)
 {
-  Tracer_Plus tr("MVNDist::SetPrecisions");
+  //    Tracer_Plus tr("MVNDist::SetPrecisions");
   assert(from.Nrows() == len);
   assert(means.Nrows() == len);
   precisions = from;
@@ -264,7 +264,7 @@ void MVNDist::SetPrecisions(const SymmetricMatrix& from)
 
 void MVNDist::SetCovariance(const SymmetricMatrix& from)
 {
-  Tracer_Plus tr("MVNDist::SetCovariance");
+  //    Tracer_Plus tr("MVNDist::SetCovariance");
   //cout << from.Nrows() << " ---- " << len << endl;  
   assert(from.Nrows() == len);
   assert(means.Nrows() == len);
@@ -276,7 +276,7 @@ void MVNDist::SetCovariance(const SymmetricMatrix& from)
 
 void MVNDist::DumpTo(ostream& out, const string indent) const
 { 
-  Tracer_Plus tr("MVNDist::Dump");
+  //    Tracer_Plus tr("MVNDist::Dump");
   out << indent << "MVNDist, with len == " << len 
        << ", precisionsValid == " << precisionsValid
        << ", covarianceValid == " << covarianceValid << endl;
@@ -0,0 +1,149 @@
+/*  dual.h - Forward-mode automatic differentiation for forward models
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2014 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#ifndef __FABBER_DUAL_H
+#define __FABBER_DUAL_H 1
+
+#include <cmath>
+#include "assert.h"
+
+// A value together with its derivatives with respect to the model
+// parameters.  Write the model equations as a template over the scalar type,
+// instantiate it with float/double in Evaluate() and with Dual in
+// Gradient(), and the Jacobian comes out exactly, in one pass, without
+// any finite differences.  Constants carry no derivatives (nd == 0).
+
+class Dual {
+public:
+  static const int MAXPARAMS = 32;
+
+  Dual(double val = 0.0) : v(val), nd(0) { }
+
+  // The i'th (1-based) of n parameters, with value val
+  static Dual Param(double val, int i, int n)
+    { assert(n <= MAXPARAMS && i >= 1 && i <= n);
+      Dual x(val); x.nd = n;
+      for (int k = 0; k < n; k++) x.d[k] = 0.0;
+      x.d[i-1] = 1.0;
+      return x; }
+
+  double value() const { return v; }
+  double deriv(int i) const { return (i <= nd) ? d[i-1] : 0.0; }  // 1-based
+
+  Dual& operator+=(const Dual& b) { return *this = *this + b; }
+  Dual& operator-=(const Dual& b) { return *this = *this - b; }
+  Dual& operator*=(const Dual& b) { return *this = *this * b; }
+  Dual& operator/=(const Dual& b) { return *this = *this / b; }
+
+  // r = f(a) with f'(a) == da
+  static Dual Chain(const Dual& a, double fa, double da)
+    { Dual r(fa); r.nd = a.nd;
+      for (int k = 0; k < a.nd; k++) r.d[k] = da*a.d[k];
+      return r; }
+
+  // r = f(a,b) with df/da == da, df/db == db
+  static Dual Chain(const Dual& a, const Dual& b, double f, double da, double db)
+    { Dual r(f); r.nd = (a.nd > b.nd) ? a.nd : b.nd;
+      for (int k = 0; k < r.nd; k++)
+	r.d[k] = ((k < a.nd) ? da*a.d[k] : 0.0) + ((k < b.nd) ? db*b.d[k] : 0.0);
+      return r; }
+
+  friend Dual operator+(const Dual& a, const Dual& b)
+    { return Chain(a, b, a.v + b.v, 1.0, 1.0); }
+  friend Dual operator-(const Dual& a, const Dual& b)
+    { return Chain(a, b, a.v - b.v, 1.0, -1.0); }
+  friend Dual operator*(const Dual& a, const Dual& b)
+    { return Chain(a, b, a.v * b.v, b.v, a.v); }
+  friend Dual operator/(const Dual& a, const Dual& b)
+    { return Chain(a, b, a.v / b.v, 1.0/b.v, -a.v/(b.v*b.v)); }
+  friend Dual operator-(const Dual& a)
+    { return Chain(a, -a.v, -1.0); }
+
+  friend bool operator<(const Dual& a, const Dual& b) { return a.v < b.v; }
+  friend bool operator>(const Dual& a, const Dual& b) { return a.v > b.v; }
+  friend bool operator<=(const Dual& a, const Dual& b) { return a.v <= b.v; }
+  friend bool operator>=(const Dual& a, const Dual& b) { return a.v >= b.v; }
+
+private:
+  double v;
+  int nd;
+  double d[MAXPARAMS];
+};
+
+inline Dual exp(const Dual& a) 
+{ double e = std::exp(a.value()); return Dual::Chain(a, e, e); }
+inline Dual log(const Dual& a)
+{ return Dual::Chain(a, std::log(a.value()), 1.0/a.value()); }
+inline Dual sqrt(const Dual& a)
+{ double s = std::sqrt(a.value()); return Dual::Chain(a, s, 0.5/s); }
+inline Dual pow(const Dual& a, double p)
+{ return Dual::Chain(a, std::pow(a.value(), p), p*std::pow(a.value(), p-1)); }
+inline Dual fabs(const Dual& a)
+{ return (a.value() < 0) ? -a : a; }
+
+#endif /* __FABBER_DUAL_H */
@@ -77,6 +77,7 @@
 
 ostream* EasyLog::filestream = NULL;
 string EasyLog::outDir = "";
+vector<ostream*> EasyLog::threadstreams;
 
 void EasyLog::StartLog(const string& basename, bool overwrite)
 {
@@ -169,14 +170,22 @@ map<string,int> Warning::issueCount;
 
 void Warning::IssueOnce(const string& text)
 {
+#ifdef _OPENMP
+#pragma omp critical(fabber_warning)
+#endif
   if (++issueCount[text] == 1)
     LOG_ERR_SAFE("WARNING ONCE: " << text << endl);
 }
 
 void Warning::IssueAlways(const string& text)
 {
-  ++issueCount[text];
-  LOG_ERR_SAFE("WARNING ALWAYS: " << text << endl);
+#ifdef _OPENMP
+#pragma omp critical(fabber_warning)
+#endif
+  {
+    ++issueCount[text];
+    LOG_ERR_SAFE("WARNING ALWAYS: " << text << endl);
+  }
 }
 
 void Warning::ReissueAll()
@@ -69,8 +69,10 @@
 #pragma once
 
 #include "utils/tracer_plus.h"
+#include "utils/threading.h"
 #include <iostream>
 #include <string>
+#include <vector>
 #include "assert.h"
 
 using namespace std;
@@ -115,7 +117,10 @@ using namespace Utilities;
 class EasyLog {
  public:
   static ostream* CurrentLog()
-    { assert(filestream != NULL); return filestream; }
+    { assert(filestream != NULL); 
+      if (!threadstreams.empty() && threadstreams[thread_num()] != NULL)
+        return threadstreams[thread_num()];
+      return filestream; }
   static const string& GetOutputDirectory()
     { assert(filestream != NULL); return outDir; }
 
@@ -128,9 +133,21 @@ class EasyLog {
   // only use this in situations where the log might not have been started..
   // e.g. in main()'s exception-handling routines
 
+  // Inside a parallel region each thread can send LOG to its own stream 
+  // (e.g. to buffer the output for one voxel).  Call StartThreadLogs before
+  // the region and StopThreadLogs after it; threads with no stream set 
+  // still write to the logfile.
+  static void StartThreadLogs(int nThreads)
+    { threadstreams.assign(nThreads, (ostream*) NULL); }
+  static void SetThreadLog(ostream* s)
+    { threadstreams.at(thread_num()) = s; }
+  static void StopThreadLogs()
+    { threadstreams.clear(); }
+
  private:
   static ostream* filestream;
   static string outDir;
+  static vector<ostream*> threadstreams;
 };
 
 // Other useful functions:
@@ -149,12 +149,13 @@ int main(int argc, char** argv)
       // Start timing/tracing if requested
       bool recordTimings = false;
   
+      // (the tracer isn't thread safe, so these also switch off threading)
       if (args.ReadBool("debug-timings")) 
-        { recordTimings = true; Tracer_Plus::settimingon(); }
+        { recordTimings = true; Tracer_Plus::settimingon(); set_max_threads(1); }
       if (args.ReadBool("debug-instant-stack")) 
-        { Tracer_Plus::setinstantstackon(); } // instant stack isn't used?
+        { Tracer_Plus::setinstantstackon(); set_max_threads(1); } // instant stack isn't used?
       if (args.ReadBool("debug-running-stack")) 
-        { Tracer_Plus::setrunningstackon(); }
+        { Tracer_Plus::setrunningstackon(); set_max_threads(1); }
       gzLog = args.ReadBool("gzip-log");
 
       Tracer_Plus tr("FABBER main (outer)");
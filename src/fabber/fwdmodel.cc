@@ -89,6 +89,18 @@ int FwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
   return false;
 }
 
+void FwdModel::EvaluateMany(const Matrix& params, Matrix& results) const
+{
+  ColumnVector p, result;
+  for (int c = 1; c <= params.Ncols(); c++)
+    {
+      p = params.Column(c);
+      Evaluate(p, result);
+      if (c == 1) results.ReSize(result.Nrows(), params.Ncols());
+      results.Column(c) = result;
+    }
+}
+
 int FwdModel::NumOutputs() const
 {
     ColumnVector params, result;
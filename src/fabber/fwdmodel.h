@@ -106,6 +106,12 @@ public:
 
   virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
   // evaluate the gradient, the int return is to indicate whether a valid gradient is returned by the model
+  // (see dual.h for a way of getting it exactly from the model equations)
+
+  virtual void EvaluateMany(const Matrix& params, Matrix& results) const;
+  // Evaluate the model at each column of params, giving the columns of
+  // results.  Default implementation calls Evaluate for each column; 
+  // override it if the work can be shared between parameter vectors.
                   
   virtual string ModelVersion() const; 
   // Return a CVS version info string
@@ -131,6 +137,10 @@ public:
                               const string& indent="") const;
   // Describe what a given parameter vector means (to LOG)
   // Default implementation uses NameParams to give reasonably meaningful output 
+
+  virtual FwdModel* Clone() const { return NULL; }
+  // A new identical copy of this model, for use by another thread.
+  // Models that return NULL (the default) are only ever used serially.
   
   
   // Static member function, to pick a forward model from a name
@@ -74,6 +74,7 @@
 #include "newimage/newimageall.h"
 using namespace NEWIMAGE;
 #include "easylog.h"
+#include "dual.h"
 
 string BuxtonFwdModel::ModelVersion() const
 {
@@ -142,7 +143,7 @@ void BuxtonFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void BuxtonFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("BuxtonFwdModel::Evaluate");
+  //    Tracer_Plus tr("BuxtonFwdModel::Evaluate");
 
     // ensure that values are reasonable
     // negative check
@@ -183,27 +184,84 @@ void BuxtonFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     ftiss2 = paramcpy(tiss2_index());
     delttiss2 = paramcpy(tiss2_index()+1);
   }
-    
+
+  vector<float> kc;
+  Kinetics(ftiss, delttiss, tautiss, T_1, T_1b, ftiss2, delttiss2, kc);
+
+    /* output */
+    result.ReSize(tis.Nrows()*repeats);
+    for(int it=1; it<=tis.Nrows(); it++)
+      {
+	// loop over the repeats
+	for (int rpt=1; rpt<=repeats; rpt++)
+	  {
+	    result( (it-1)*repeats+rpt ) = kc[it-1];
+	  }
+      }
+
+  return;
+}
+
+int BuxtonFwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
+{
+  //    Tracer_Plus tr("BuxtonFwdModel::Gradient");
+
+  // The same parameters as in Evaluate, but carrying their derivatives;
+  // those held at a limit are constant there.
+  int n = NumParams();
+  vector<Dual> p(n+1);
+  for (int i=1;i<=n;i++) {
+    if (params(i)<0) { p[i] = 0.0; }
+    else { p[i] = Dual::Param(params(i), i, n); }
+  }
+  if (params(tiss_index()+1)>timax-0.2) { p[tiss_index()+1] = timax-0.2; }
+
+  Dual ftiss = p[tiss_index()];
+  Dual delttiss = p[tiss_index()+1];
+  Dual tautiss = infertau ? p[tau_index()] : Dual(seqtau);
+  Dual T_1 = infert1 ? p[t1_index()] : Dual(t1);
+  Dual T_1b = infert1 ? p[t1_index()+1] : Dual(t1b);
+  Dual ftiss2 = twobol ? p[tiss2_index()] : Dual(0.0);
+  Dual delttiss2 = twobol ? p[tiss2_index()+1] : Dual(0.0);
+
+  vector<Dual> kc;
+  Kinetics(ftiss, delttiss, tautiss, T_1, T_1b, ftiss2, delttiss2, kc);
+
+  grad.ReSize(tis.Nrows()*repeats, n);
+  for(int it=1; it<=tis.Nrows(); it++)
+    for (int rpt=1; rpt<=repeats; rpt++)
+      for (int i=1; i<=n; i++)
+	grad( (it-1)*repeats+rpt, i ) = kc[it-1].deriv(i);
+
+  return true;
+}
+
+template<class T>
+void BuxtonFwdModel::Kinetics(T ftiss, T delttiss, T tautiss, T T_1, T T_1b,
+			      T ftiss2, T delttiss2, vector<T>& kc) const
+{
+  // Tissue curve (both boli) at each of the tis.  Written for any scalar 
+  // type: float in Evaluate and Dual in Gradient.
 
   //float lambda = 0.9;
 
-    float T_1app = 1/( 1/T_1 + 0.01/lambda );
-    float R = 1/T_1app - 1/T_1b;
+    T T_1app = 1/( 1/T_1 + 0.01/lambda );
+    T R = 1/T_1app - 1/T_1b;
 
-    float tau1 = delttiss;
-    float tau2 = delttiss + tautiss;
+    T tau1 = delttiss;
+    T tau2 = delttiss + tautiss;
 
     // for second bolus
-    float tau3 = delttiss2;
-    float tau4 = delttiss2 + tautiss;
+    T tau3 = delttiss2;
+    T tau4 = delttiss2 + tautiss;
 
-    float F=0;float F2=0;
-    float kctissue; float kctissue2;
+    T F=0;T F2=0;
+    T kctissue; T kctissue2;
  
 
     // loop over tis
     float ti;
-    result.ReSize(tis.Nrows()*repeats);
+    kc.resize(tis.Nrows());
 
     for(int it=1; it<=tis.Nrows(); it++)
       {
@@ -235,18 +293,8 @@ void BuxtonFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
 	else /*(ti > tau2)*/
 	  {kctissue2 = F2/R * (exp(R*tau4) - exp(R*tau3)); }
 	
-	/* output */
-	// loop over the repeats
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    result( (it-1)*repeats+rpt ) = kctissue + kctissue2;
-	  }
-
-
+	kc[it-1] = kctissue + kctissue2;
       }
-
-
-  return;
 }
 
 BuxtonFwdModel::BuxtonFwdModel(ArgsType& args)
@@ -351,7 +399,7 @@ void BuxtonFwdModel::NameParams(vector<string>& names) const
 /* taken from fwdmodel_asl_grase.cc (29-11-2007) */
 void BuxtonFwdModel::SetupARD( const MVNDist& theta, MVNDist& thetaPrior, double& Fard) const
 {
-  Tracer_Plus tr("BuxtonFwdModel::SetupARD");
+  //    Tracer_Plus tr("BuxtonFwdModel::SetupARD");
 
   int ardindex = ard_index();
 
@@ -379,7 +427,7 @@ void BuxtonFwdModel::UpdateARD(
 				const MVNDist& theta,
 				MVNDist& thetaPrior, double& Fard) const
 {
-  Tracer_Plus tr("BuxtonFwdModel::UpdateARD");
+  //    Tracer_Plus tr("BuxtonFwdModel::UpdateARD");
   
   int ardindex = ard_index();
 
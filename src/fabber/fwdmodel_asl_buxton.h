@@ -76,6 +76,7 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
   static void ModelUsage();
   virtual string ModelVersion() const;
                   
@@ -95,9 +96,15 @@ public:
 
   // Constructor
   BuxtonFwdModel(ArgsType& args);
+  virtual BuxtonFwdModel* Clone() const
+    { return new BuxtonFwdModel(*this); }
 
 
 protected: // Constants
+  template<class T>
+  void Kinetics(T ftiss, T delttiss, T tautiss, T T_1, T T_1b, 
+		T ftiss2, T delttiss2, vector<T>& kc) const;
+
 
   // Lookup the starting indices of the parameters
   int tiss_index() const {return 1;} //main tissue parameters: ftiss and delttiss always come first
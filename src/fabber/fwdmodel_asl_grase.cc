@@ -159,7 +159,7 @@ void GraseFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void GraseFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("GraseFwdModel::Evaluate");
+  //    Tracer_Plus tr("GraseFwdModel::Evaluate");
 
     // ensure that values are reasonable
     // negative check
@@ -622,7 +622,7 @@ void GraseFwdModel::NameParams(vector<string>& names) const
 
 void GraseFwdModel::SetupARD( const MVNDist& theta, MVNDist& thetaPrior, double& Fard) const
 {
-  Tracer_Plus tr("GraseFwdModel::SetupARD");
+  //    Tracer_Plus tr("GraseFwdModel::SetupARD");
 
  
 
@@ -654,7 +654,7 @@ void GraseFwdModel::UpdateARD(
 				const MVNDist& theta,
 				MVNDist& thetaPrior, double& Fard) const
 {
-  Tracer_Plus tr("GraseFwdModel::UpdateARD");
+  //    Tracer_Plus tr("GraseFwdModel::UpdateARD");
   
   int ardindex = ard_index();
 
@@ -98,6 +98,8 @@ public:
 
   // Constructor
   GraseFwdModel(ArgsType& args);
+  virtual GraseFwdModel* Clone() const
+    { return new GraseFwdModel(*this); }
 
 
 protected: // Constants
@@ -212,7 +212,7 @@ void ASL_PVC_FwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void ASL_PVC_FwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("ASL_PVC_FwdModel::Evaluate");
+  //    Tracer_Plus tr("ASL_PVC_FwdModel::Evaluate");
 
     // ensure that values are reasonable
     // negative check
@@ -716,7 +716,7 @@ void ASL_PVC_FwdModel::NameParams(vector<string>& names) const
 
 void ASL_PVC_FwdModel::SetupARD( const MVNDist& theta, MVNDist& thetaPrior, double& Fard)
 {
-  Tracer_Plus tr("ASL_PVC_FwdModel::SetupARD");
+  //    Tracer_Plus tr("ASL_PVC_FwdModel::SetupARD");
 
   if (doard)
     {
@@ -754,7 +754,7 @@ void ASL_PVC_FwdModel::UpdateARD(
 				const MVNDist& theta,
 				MVNDist& thetaPrior, double& Fard) const
 {
-  Tracer_Plus tr("ASL_PVC_FwdModel::UpdateARD");
+  //    Tracer_Plus tr("ASL_PVC_FwdModel::UpdateARD");
   
   if (doard)
     Fard=0;
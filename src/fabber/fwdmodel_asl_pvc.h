@@ -99,6 +99,8 @@ public:
 
   // Constructor
   ASL_PVC_FwdModel(ArgsType& args);
+  virtual ASL_PVC_FwdModel* Clone() const
+    { return new ASL_PVC_FwdModel(*this); }
 
 
 protected: // Constants
@@ -278,7 +278,7 @@ void QuasarFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("QuasarFwdModel::Evaluate");
+  //    Tracer_Plus tr("QuasarFwdModel::Evaluate");
 
     // ensure that values are reasonable
     // negative check
@@ -893,7 +893,7 @@ void QuasarFwdModel::NameParams(vector<string>& names) const
 
 void QuasarFwdModel::SetupARD( const MVNDist& theta, MVNDist& thetaPrior, double& Fard)
 {
-  Tracer_Plus tr("QuasarFwdModel::SetupARD");
+  //    Tracer_Plus tr("QuasarFwdModel::SetupARD");
 
   if (doard)
     {
@@ -931,7 +931,7 @@ void QuasarFwdModel::UpdateARD(
 				const MVNDist& theta,
 				MVNDist& thetaPrior, double& Fard) const
 {
-  Tracer_Plus tr("QuasarFwdModel::UpdateARD");
+  //    Tracer_Plus tr("QuasarFwdModel::UpdateARD");
   
   if (doard)
     Fard=0;
@@ -966,7 +966,7 @@ void QuasarFwdModel::UpdateARD(
 //Arterial
 
 ColumnVector QuasarFwdModel::kcblood_nodisp(const ColumnVector& tis, float deltblood, float taub, float T_1bin, float deltll,float T_1ll) const {
-  Tracer_Plus tr("QuasarFwdModel:kcblood_nodisp");
+  //    Tracer_Plus tr("QuasarFwdModel:kcblood_nodisp");
   ColumnVector kcblood(tis.Nrows());
   kcblood=0.0;
   float T_1b;
@@ -1003,7 +1003,7 @@ ColumnVector QuasarFwdModel::kcblood_nodisp(const ColumnVector& tis, float deltb
 }
 
 ColumnVector QuasarFwdModel::kcblood_gammadisp(const ColumnVector& tis, float deltblood, float taub, float T_1bin, float s, float p, float deltll,float T_1ll) const {
-  Tracer_Plus tr("QuasarFwdModel:kcblood_gammadisp");
+  //    Tracer_Plus tr("QuasarFwdModel:kcblood_gammadisp");
   ColumnVector kcblood(tis.Nrows());
   kcblood=0.0;
   float T_1b;
@@ -1038,7 +1038,7 @@ ColumnVector QuasarFwdModel::kcblood_gammadisp(const ColumnVector& tis, float de
 }
 
 ColumnVector QuasarFwdModel::kcblood_gvf(const ColumnVector& tis, float deltblood, float taub, float T_1bin, float s, float p, float deltll,float T_1ll) const {
-  Tracer_Plus tr("QuasarFwdModel:kcblood_gvf");
+  //    Tracer_Plus tr("QuasarFwdModel:kcblood_gvf");
   ColumnVector kcblood(tis.Nrows());
   kcblood=0.0;
   float T_1b;
@@ -1077,7 +1077,7 @@ ColumnVector QuasarFwdModel::kcblood_gvf(const ColumnVector& tis, float deltbloo
 }
 
 ColumnVector QuasarFwdModel::kcblood_gaussdisp(const ColumnVector& tis, float deltblood, float taub, float T_1bin, float sig1, float sig2, float deltll,float T_1ll) const {
-  Tracer_Plus tr("QuasarFwdModel:kcblood_normdisp");
+  //    Tracer_Plus tr("QuasarFwdModel:kcblood_normdisp");
   ColumnVector kcblood(tis.Nrows());
   kcblood=0.0;
   float T_1b;
@@ -1101,7 +1101,7 @@ ColumnVector QuasarFwdModel::kcblood_gaussdisp(const ColumnVector& tis, float de
 
 //Tissue
 ColumnVector QuasarFwdModel::kctissue_nodisp(const ColumnVector& tis, float delttiss, float tau, float T_1bin, float T_1app, float deltll,float T_1ll) const {
-  Tracer_Plus tr("QuasarFwdModel::kctissue_nodisp");
+  //    Tracer_Plus tr("QuasarFwdModel::kctissue_nodisp");
 ColumnVector kctissue(tis.Nrows());
  kctissue=0.0;
  float ti=0.0;
@@ -1136,7 +1136,7 @@ ColumnVector kctissue(tis.Nrows());
 }
 
 ColumnVector QuasarFwdModel::kctissue_gammadisp(const ColumnVector& tis, float delttiss, float tau, float T_1bin, float T_1app, float s, float p, float deltll,float T_1ll) const {
-  Tracer_Plus tr("QuasarFwdModel::kctissue_gammadisp");
+  //    Tracer_Plus tr("QuasarFwdModel::kctissue_gammadisp");
   ColumnVector kctissue(tis.Nrows());
   kctissue=0.0;
   float ti=0.0;
@@ -1184,7 +1184,7 @@ ColumnVector QuasarFwdModel::kctissue_gammadisp(const ColumnVector& tis, float d
 }
 
 ColumnVector QuasarFwdModel::kctissue_gvf(const ColumnVector& tis, float delttiss, float tau, float T_1bin, float T_1app, float s, float p, float deltll,float T_1ll) const {
-  Tracer_Plus tr("QuasarFwdModel::kctissue_gvf");
+  //    Tracer_Plus tr("QuasarFwdModel::kctissue_gvf");
   ColumnVector kctissue(tis.Nrows());
   kctissue=0.0;
   float ti=0.0;
@@ -1223,7 +1223,7 @@ ColumnVector QuasarFwdModel::kctissue_gvf(const ColumnVector& tis, float delttis
 }
 
 ColumnVector QuasarFwdModel::kctissue_gaussdisp(const ColumnVector& tis, float delttiss, float tau, float T_1bin, float T_1app, float sig1, float sig2, float deltll,float T_1ll) const {
-    Tracer_Plus tr("QuasarFwdModel::kctissue_gaussdisp");
+    //    Tracer_Plus tr("QuasarFwdModel::kctissue_gaussdisp");
 ColumnVector kctissue(tis.Nrows());
  kctissue=0.0;
  float ti=0.0;
@@ -1257,7 +1257,7 @@ ColumnVector kctissue(tis.Nrows());
 
 // --- useful general functions ---
 float QuasarFwdModel::icgf(float a, float x) const {
-  Tracer_Plus tr("QuasarFwdModel::icgf");
+  //    Tracer_Plus tr("QuasarFwdModel::icgf");
 
   //incomplete gamma function with a=k, based on the incomplete gamma integral
 
@@ -1265,7 +1265,7 @@ float QuasarFwdModel::icgf(float a, float x) const {
 }
 
 float QuasarFwdModel::gvf(float t, float s, float p) const {
-  Tracer_Plus tr("QuasarFwdModel::gvf");
+  //    Tracer_Plus tr("QuasarFwdModel::gvf");
 
   //The Gamma Variate Function (correctly normalised for area under curve) 
   // Form of Rausch 2000
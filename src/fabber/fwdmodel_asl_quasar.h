@@ -99,6 +99,8 @@ public:
 
   // Constructor
   QuasarFwdModel(ArgsType& args);
+  virtual QuasarFwdModel* Clone() const
+    { return new QuasarFwdModel(*this); }
 
 
 protected: // Constants
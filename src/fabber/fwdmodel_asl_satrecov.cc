@@ -121,7 +121,7 @@ void SatrecovFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void SatrecovFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("SatrecovFwdModel::Evaluate");
+  //    Tracer_Plus tr("SatrecovFwdModel::Evaluate");
 
     // ensure that values are reasonable
     // negative check
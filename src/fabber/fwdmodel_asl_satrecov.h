@@ -95,6 +95,8 @@ public:
 
   // Constructor
   SatrecovFwdModel(ArgsType& args);
+  virtual SatrecovFwdModel* Clone() const
+    { return new SatrecovFwdModel(*this); }
 
 
 protected: // Constants
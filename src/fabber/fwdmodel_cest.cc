@@ -73,7 +73,9 @@
 #include <stdexcept>
 #include "newimage/newimageall.h"
 #include "miscmaths/miscprob.h"
+#include "utils/threading.h"
 using namespace NEWIMAGE;
+using namespace Utilities;
 #include "easylog.h"
 
 string CESTFwdModel::ModelVersion() const
@@ -246,7 +248,7 @@ void CESTFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void CESTFwdModel::Initialise(MVNDist& posterior) const
 {
-  Tracer_Plus tr("CESTFwdModel::Initialise");
+  //    Tracer_Plus tr("CESTFwdModel::Initialise");
   //init the M0a value  - to max value in the z-spectrum
   posterior.means(1) = data.Maximum();
 
@@ -264,7 +266,7 @@ void CESTFwdModel::Initialise(MVNDist& posterior) const
 
 void CESTFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("CESTFwdModel::Evaluate");
+  //    Tracer_Plus tr("CESTFwdModel::Evaluate");
 
     // ensure that values are reasonable
     // negative check
@@ -493,6 +495,53 @@ void CESTFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) co
   return;
 }
 
+void CESTFwdModel::EvaluateMany(const Matrix& params, Matrix& results) const
+{
+  // Every parameter vector (e.g. each perturbed vector of a numerical 
+  // Jacobian) needs a full set of matrix exponentials and nothing is shared
+  // between them, so the columns are shared out between threads instead.
+  // Inside the voxel-parallel loop this region simply runs on one thread.
+  const int ncols = params.Ncols();
+  if (ncols == 0) return;
+  vector<ColumnVector> p(ncols), res(ncols);
+  for (int c = 1; c <= ncols; c++) p[c-1] = params.Column(c);
+
+  vector<char> failed(ncols, 0);
+  ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if((max_threads() > 1) && (ncols > 1))
+#endif
+  for (int c = 0; c < ncols; c++)
+    {
+      if (err.occurred()) continue;
+      failed[c] = 1;
+      try {
+	Evaluate(p[c], res[c]);
+	failed[c] = 0;
+      }
+      catch (const exception& e) {
+	err.set(e.what());
+      }
+      catch (Exception) {
+	err.set(Exception::what());
+      }
+      catch (...) {
+	err.set("CESTFwdModel::EvaluateMany: unknown exception");
+      }
+    }
+  if (err.occurred())
+    {
+      // Re-evaluate the first failed column serially so that its exception
+      // (e.g. overflow_error or a NEWMAT Exception) reaches DoVoxel with its
+      // original type, as it would from the serial code.
+      for (int c = 0; c < ncols; c++)
+	if (failed[c]) { Evaluate(p[c], res[c]); break; }
+      throw runtime_error(err.what());
+    }
+
+  results.ReSize(res[0].Nrows(), ncols);
+  for (int c = 1; c <= ncols; c++) results.Column(c) = res[c-1];
+}
 
 CESTFwdModel::CESTFwdModel(ArgsType& args)
 {
@@ -741,7 +790,7 @@ void CESTFwdModel::NameParams(vector<string>& names) const
 
 void CESTFwdModel::SetupARD( const MVNDist& theta, MVNDist& thetaPrior, double& Fard)
 {
-  Tracer_Plus tr("CESTFwdModel::SetupARD");
+  //    Tracer_Plus tr("CESTFwdModel::SetupARD");
 
   if (doard)
     {
@@ -776,7 +825,7 @@ void CESTFwdModel::UpdateARD(
 				const MVNDist& theta,
 				MVNDist& thetaPrior, double& Fard) const
 {
-  Tracer_Plus tr("CESTFwdModel::UpdateARD");
+  //    Tracer_Plus tr("CESTFwdModel::UpdateARD");
   
   if (doard)
     Fard=0;
@@ -816,7 +865,7 @@ ReturnMatrix CESTFwdModel::expm(Matrix inmatrix) const
 ReturnMatrix CESTFwdModel::expm_eig(Matrix inmatrix) const
 {
   // Do matrix exponential using eigen decomposition of the matrix
-  Tracer_Plus tr("CESTFwdModel::expm_eig");
+  //    Tracer_Plus tr("CESTFwdModel::expm_eig");
 
   SymmetricMatrix A;
   A << inmatrix; // a bit poor - the matrix coming in should be symmetric, but I haven't implemented this elsewhere in the code (yet!)
@@ -843,7 +892,7 @@ ReturnMatrix CESTFwdModel::expm_pade(Matrix inmatrix) const
 {
   // Do matrix exponential
   // Algorithm from Higham, SIAM J. Matrix Analysis App. 24(4) 2005, 1179-1193
-  Tracer_Plus tr("CESTFwdModel::expm");
+  //    Tracer_Plus tr("CESTFwdModel::expm");
 
   Matrix A = inmatrix;
   Matrix X(A.Nrows(),A.Ncols());
@@ -889,7 +938,7 @@ ReturnMatrix CESTFwdModel::expm_pade(Matrix inmatrix) const
 
 ReturnMatrix CESTFwdModel::PadeApproximant(Matrix inmatrix, int m) const
 {
-  Tracer_Plus tr("CESTFwdModel::PadeApproximant");
+  //    Tracer_Plus tr("CESTFwdModel::PadeApproximant");
 
   //cout << "PadeApproximant" << endl;
   //cout << inmatrix << endl;
@@ -946,7 +995,7 @@ ReturnMatrix CESTFwdModel::PadeApproximant(Matrix inmatrix, int m) const
 
 ReturnMatrix CESTFwdModel::PadeCoeffs(int m) const {
 
-  Tracer_Plus tr("CESTFwdModel::PadeCoeffs");
+  //    Tracer_Plus tr("CESTFwdModel::PadeCoeffs");
   ColumnVector C;
   C.ReSize(m+1);
 
@@ -976,7 +1025,7 @@ switch (m)
 
 void CESTFwdModel::Mz_spectrum(ColumnVector& Mz, const ColumnVector& wvec, const ColumnVector& w1, const ColumnVector& t, const ColumnVector& M0, const Matrix& wi, const Matrix& kij, const Matrix& T12) const {
 
-  Tracer_Plus tr("CESTFwdModel::Mz_spectrum");
+  //    Tracer_Plus tr("CESTFwdModel::Mz_spectrum");
 
 
   int nfreq = wvec.Nrows(); // total number of samples collected
@@ -1198,7 +1247,7 @@ ReturnMatrix CESTFwdModel::Mz_spectrum_lorentz(const ColumnVector& wvec, const C
   //Analytic *steady state* solution to the *one pool* Bloch equations
   // NB t is ignored becasue it is ss
 
-  Tracer_Plus tr("CESTFwdModel::Mz_spectrum_lorentz");
+  //    Tracer_Plus tr("CESTFwdModel::Mz_spectrum_lorentz");
 
   int nfreq = wvec.Nrows(); // total number of samples collected
 
@@ -1218,7 +1267,7 @@ ReturnMatrix CESTFwdModel::Mz_spectrum_lorentz(const ColumnVector& wvec, const C
 void CESTFwdModel::Ainverse(const Matrix A, RowVector& Ai) const {
   // More efficicent matrix inversion using the block structure of the problem
   // Implicitly assumes no exchange between pools (aside from water)
-  Tracer_Plus tr("CESTFwdModel::Ainverse");
+  //    Tracer_Plus tr("CESTFwdModel::Ainverse");
 
   int npool = A.Nrows()/3;
   int subsz = (npool-1)*3;
@@ -76,6 +76,8 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual void EvaluateMany(const Matrix& params, Matrix& results) const;
+  // Columns are evaluated in parallel; each needs its own matrix exponentials
   void Initialise(MVNDist& posterior) const;
 
    static void ModelUsage();
@@ -100,6 +102,8 @@ public:
 
   // Constructor
   CESTFwdModel(ArgsType& args);
+  virtual CESTFwdModel* Clone() const
+    { return new CESTFwdModel(*this); }
 
 
 protected: 
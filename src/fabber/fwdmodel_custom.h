@@ -90,6 +90,8 @@ using namespace std;
 class CustomFwdModel : public FwdModel {
  public:
   CustomFwdModel(ArgsType& args);
+  virtual CustomFwdModel* Clone() const
+    { return new CustomFwdModel(*this); }
   virtual ~CustomFwdModel() { return; } 	
 
   virtual void Evaluate(const ColumnVector& params, ColumnVector& result) const;
@@ -184,7 +184,7 @@ void DSCFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void DSCFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("DSCFwdModel::Evaluate");
+  //    Tracer_Plus tr("DSCFwdModel::Evaluate");
 
     // ensure that values are reasonable
     // negative check
@@ -92,6 +92,8 @@ public:
 
   // Constructor
   DSCFwdModel(ArgsType& args);
+  virtual DSCFwdModel* Clone() const
+    { return new DSCFwdModel(*this); }
 
 protected: 
 
@@ -105,7 +105,7 @@ void FlobsFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void FlobsFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-  Tracer_Plus tr("FlobsFwdModel::Evaluate");
+  //    Tracer_Plus tr("FlobsFwdModel::Evaluate");
 
   assert(params.Nrows() == NumParams());
   
@@ -97,6 +97,8 @@ public:
 
   // Constructor
   FlobsFwdModel(ArgsType& args, bool sepScale) ;
+  virtual FlobsFwdModel* Clone() const
+    { return new FlobsFwdModel(*this); }
   // Usage info
   static void ModelUsage();
 
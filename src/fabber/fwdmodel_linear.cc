@@ -133,14 +133,15 @@ void LinearFwdModel::Evaluate(const ColumnVector& params,
   result = jacobian * (params - centre) + offset;
 }
 
-void LinearizedFwdModel::ReCentre(const ColumnVector& about)
+void LinearizedFwdModel::ReCentre(const ColumnVector& about, 
+				  const FwdModel* model)
 {
-  Tracer_Plus tr("LinearizedFwdModel::ReCentre");
+  //    Tracer_Plus tr("LinearizedFwdModel::ReCentre");
   assert(about == about); // isfinite
 
   // Store new centre & offset
   centre = about;
-  fcn->Evaluate(centre, offset);
+  model->Evaluate(centre, offset);
   if (0*offset != 0*offset) 
     {
       LOG_ERR("about:\n" << about);
@@ -154,25 +155,30 @@ void LinearizedFwdModel::ReCentre(const ColumnVector& about)
   
   // try and get the gradient from the model first
   int gradfrommodel=false;
-  gradfrommodel = fcn->Gradient(centre,jacobian);
+  gradfrommodel = model->Gradient(centre,jacobian);
 
   if (!gradfrommodel) {
-  ColumnVector centre2, centre3;
-  ColumnVector offset2, offset3;
-  for (int i = 1; i <= centre.Nrows(); i++)
+  // Take derivatives numerically: all the perturbed parameter vectors 
+  // (+delta in column 2i-1, -delta in column 2i) go to the model in one call
+  int nParams = centre.Nrows();
+  Matrix centres(nParams, 2*nParams);
+  Matrix offsets;
+  for (int i = 1; i <= nParams; i++)
     {
       double delta = centre(i) * 1e-5;
       if (delta<0) delta = -delta;
       if (delta<1e-10) delta = 1e-10;
 
-      // Take derivative numerically
-      centre3 = centre;
-      centre2 = centre;
-      centre2(i) += delta;
-      centre3(i) -= delta;
-      fcn->Evaluate(centre2, offset2);
-      fcn->Evaluate(centre3, offset3);
-      jacobian.Column(i) = (offset2 - offset3) / (centre2(i) - centre3(i));
+      centres.Column(2*i-1) = centre;
+      centres.Column(2*i) = centre;
+      centres(i,2*i-1) += delta;
+      centres(i,2*i) -= delta;
+    }
+  model->EvaluateMany(centres, offsets);
+  for (int i = 1; i <= nParams; i++)
+    {
+      jacobian.Column(i) = (offsets.Column(2*i-1) - offsets.Column(2*i)) 
+	/ (centres(i,2*i-1) - centres(i,2*i));
 
       /*
 if (i==4)
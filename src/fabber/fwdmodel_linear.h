@@ -75,6 +75,8 @@ class LinearFwdModel : public FwdModel {
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
                       ColumnVector& result) const;
+  virtual int Gradient(const ColumnVector& params, Matrix& grad) const
+    { grad = jacobian; return true; } // exact, whatever params are
   virtual int NumParams() const { return centre.Nrows(); }
   virtual void DumpParameters(const ColumnVector& vec,
                               const string& indent = "") const;                            
@@ -92,6 +94,8 @@ class LinearFwdModel : public FwdModel {
     
   // Upgrading to a full externally-accessible model type
   LinearFwdModel(ArgsType& args);
+  virtual LinearFwdModel* Clone() const
+    { return new LinearFwdModel(*this); }
   virtual string ModelVersion() const;
   static void ModelUsage();
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const;
@@ -123,11 +127,17 @@ public:
   // given LinearizedFwdModel, rather than using it as its nonlinear model!
   LinearizedFwdModel(const LinearizedFwdModel& from) 
     : LinearFwdModel(from), fcn(from.fcn) { return; }
+  virtual LinearizedFwdModel* Clone() const
+    { return new LinearizedFwdModel(*this); }
 
-  void ReCentre(const ColumnVector& about);
+  void ReCentre(const ColumnVector& about) { ReCentre(about, fcn); }
   // centre=about; offset=fcn(about); 
   // jacobian = numerical differentiation about centre
 
+  void ReCentre(const ColumnVector& about, const FwdModel* model);
+  // As above, but evaluating model (a copy of fcn, e.g. one belonging to 
+  // another thread) instead of fcn itself
+
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const
     { assert(fcn); fcn->HardcodedInitialDists(prior, posterior); }
 
@@ -153,7 +153,7 @@ void pcASLFwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void pcASLFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-    Tracer_Plus tr("pcASLFwdModel::Evaluate");
+    //    Tracer_Plus tr("pcASLFwdModel::Evaluate");
 
     double R0 = params(R0index());
     if (R0<1) R0=1; //R0 cannot be negative, or very small for the matter
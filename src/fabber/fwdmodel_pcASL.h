@@ -106,6 +106,8 @@ public:
 
   // Constructor
   pcASLFwdModel(ArgsType& args);
+  virtual pcASLFwdModel* Clone() const
+    { return new pcASLFwdModel(*this); }
   // Usage info
   static void ModelUsage();
 
@@ -86,7 +86,7 @@ string Q2tipsFwdModel::ModelVersion() const
 
 void Q2tipsFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-    Tracer_Plus tr("Q2tipsFwdModel::Evaluate");
+    //    Tracer_Plus tr("Q2tipsFwdModel::Evaluate");
     // Adapted from original_fwdmodel.m
     
     // Parameterization used in most recent results:
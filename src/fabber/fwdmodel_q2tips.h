@@ -84,5 +84,7 @@ public:
 
   // Constructor
   Q2tipsFwdModel(ArgsType& args) : Quipss2FwdModel(args) { }
+  virtual Q2tipsFwdModel* Clone() const
+    { return new Q2tipsFwdModel(*this); }
 
 };
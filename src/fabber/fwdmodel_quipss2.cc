@@ -137,7 +137,7 @@ void Quipss2FwdModel::HardcodedInitialDists(MVNDist& prior,
 
 void Quipss2FwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
-    Tracer_Plus tr("Quipss2FwdModel::Evaluate");
+    //    Tracer_Plus tr("Quipss2FwdModel::Evaluate");
     // Adapted from original_fwdmodel.m
     
     // Parameterization used in most recent results:
@@ -105,6 +105,8 @@ public:
 
   // Constructor
   Quipss2FwdModel(ArgsType& args);
+  virtual Quipss2FwdModel* Clone() const
+    { return new Quipss2FwdModel(*this); }
   // Usage info
   static void ModelUsage();
 
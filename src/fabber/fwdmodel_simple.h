@@ -138,6 +138,8 @@ public:
 
   // Constructor
   SimpleFwdModel(ArgsType& args);
+  virtual SimpleFwdModel* Clone() const
+    { return new SimpleFwdModel(*this); }
 
   //  SimpleFwdModel(const SimpleFwdModel& from); // copy constructor - default ok?
 
@@ -70,6 +70,8 @@ Copyright (C) 2007-2010 University of Oxford  */
 using namespace Utilities;
 #include "inference_spatialvb.h"
 #include "convergence.h"
+#include "miscmaths/SpMat.h"
+#include "utils/threading.h"
 
 #define NOCACHE 1
 
@@ -460,8 +462,12 @@ LOG_ERR("Using initial value for all deltas: " << delta(1) << endl);
 //LOG_ERR("Except delta(7) (dt) = " << delta(7) << endl);
 //  bool HackDelta7NextTime = true;
 vector<SymmetricMatrix> Sinvs(Nparams);
+// Spatial precision matrices of the Laplacian-type ('S' and 'p') priors.
+// These only couple voxels to their neighbours and neighbours-of-neighbours,
+// so they're kept sparse; for these parameters Sinvs[k-1] stays empty.
+vector<MISCMATHS::SpMat<double> > SinvsSparse(Nparams);
 
-SymmetricMatrix StS; // Cache for StS matrix in 'S' mode
+MISCMATHS::SpMat<double> StS; // Cache for StS matrix in 'S' mode
 
 const double globalF = 1234.5678; // no sensible updates yet
 //  if (needF)
@@ -534,32 +540,31 @@ if (StS.Nrows() == 0 && neighbours.size() > 0 && (shrinkageType == 'S' || shrink
 
     // NEW METHOD
     { Tracer_Plus tr("New method for generating StS matrix");
-    cout << "Attempting to allocate, Nvoxels = " << Nvoxels << endl;
-    StS.ReSize(Nvoxels);
-    cout << "Allocated" << endl;
-    StS = 0;
+    // Sparse: only voxels within two steps of each other are coupled, so 
+    // each column has at most 1 + N + N^2 entries.  StS is symmetric, so 
+    // column v is built from v's own neighbour lists.
+    StS = MISCMATHS::SpMat<double>(Nvoxels, Nvoxels);
     for (int v = 1; v <= Nvoxels; v++)
       {
         int Nv = neighbours[v-1].size(); // Number of neighbours v has
 
         // Diagonal value = N + (N+tiny)^2
-        StS(v,v) = Nv + (Nv+tiny)*(Nv+tiny);
+        StS.Set(v, v, Nv + (Nv+tiny)*(Nv+tiny));
 
 	// Off-diagonal value = num 2nd-order neighbours (with duplicates) - Aij(Ni+Nj+2*tiny)
 	for (vector<int>::iterator nidIt = neighbours[v-1].begin();
              nidIt != neighbours[v-1].end(); nidIt++)
           {
-            if (v < *nidIt)
-              StS(v,*nidIt) -= Nv + neighbours[*nidIt-1].size() + 2*tiny;
+            StS.AddTo(*nidIt, v, -(Nv + neighbours[*nidIt-1].size() + 2*tiny));
           }
 	for (vector<int>::iterator nidIt = neighbours2[v-1].begin();
              nidIt != neighbours2[v-1].end(); nidIt++)
           {
-            if (v < *nidIt)
-              StS(v,*nidIt) += 1;
+            StS.AddTo(*nidIt, v, 1);
           }
       }
-      cout << "Done generating StS matrix (New method)" << endl;
+      cout << "Done generating StS matrix (New method, " << StS.NZ() 
+	   << " non-zeros)" << endl;
     } // end NEW METHOD tracer block
 
     /* OLD METHOD
@@ -597,6 +602,46 @@ if (StS.Nrows() == 0 && neighbours.size() > 0 && (shrinkageType == 'S' || shrink
   }
 
 
+// Voxel updates can be shared out between threads, provided each thread has
+// its own copies of the (stateful) models.  The noise/linearization updates
+// are independent for every voxel.  The prior/theta updates are independent
+// within a colour of the neighbour graph (shrinkage priors only reach 
+// neighbours-of-neighbours); the dense R, D and F priors couple every voxel
+// to every other, so with those the prior/theta sweep stays serial.
+bool threaded = false;
+if (max_threads() > 1 && Nvoxels > 1 && !printF)
+  {
+    FwdModel* test = model->Clone();
+    threaded = (test != NULL);
+    delete test;
+  }
+const bool threadedTheta = threaded 
+  && spatialPriorsTypes.find_first_of("RDF") == string::npos;
+
+vector<int> voxelOrder;
+vector<int> colourStart;
+if (threadedTheta && shrinkageType != '-')
+  {
+    CalcColouring(shrinkageType == 'p' || shrinkageType == 'P' || shrinkageType == 'S',
+		  voxelOrder, colourStart);
+    assert((int)voxelOrder.size() == Nvoxels);
+    LOG_ERR("Updating voxels in " << colourStart.size()-1 
+	    << " independent colour groups\n");
+  }
+else
+  {
+    // One group, in the original (serial) voxel order
+    for (int v = 1; v <= Nvoxels; v++)
+      voxelOrder.push_back(v);
+    colourStart.push_back(0);
+    colourStart.push_back(Nvoxels);
+  }
+
+// Shared by all voxels: fill in the lazily-calculated covariance/precisions 
+// now, rather than from several threads at once
+initialFwdPrior->GetPrecisions();
+initialFwdPrior->GetCovariance();
+
 conv->Reset();
 bool isFirstIteration = true; // slightly different behaviour in first iteratio
 
@@ -655,7 +700,12 @@ conv->DumpTo(cout);
 
 		  Warning::IssueOnce("Hyperpriors on S prior: using q1 == " + stringify(q1) + ", q2 == " + stringify(q2));
 
-		  gk(k) = 1/( 0.5*(sigmak * StS).Trace() + (wk.t()*StS*wk).AsScalar() + 1/q1);
+		  // sigmak is diagonal, so Tr[sigmak*StS] only needs diag(StS)
+		  double trace = 0.0;
+		  for (int v = 1; v <= Nvoxels; v++)
+		    trace += sigmak(v) * StS(v,v);
+		  ColumnVector StSwk = StS * wk;
+		  gk(k) = 1/( 0.5*trace + DotProduct(wk, StSwk) + 1/q1);
 		  
 		  akmean(k) = gk(k) * (0.5*Nvoxels + q2);
 		}
@@ -987,30 +1037,30 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	      if (shrinkageType == 'S')
 		{ 
 		  assert(StS.Nrows() == Nvoxels);
-		  Sinvs.at(k-1) = StS * akmean(k);
+		  SinvsSparse.at(k-1) = StS;
+		  SinvsSparse[k-1] *= akmean(k);
 		}
 	      else
 		{
 		  assert(shrinkageType == 'p');
 
-		  // Build up the second-order matrix directly, row-by-row
-		  Matrix sTmp(Nvoxels, Nvoxels); 
-		  sTmp = 0;
+		  // Build up the second-order matrix directly, column-by-column
+		  // (it's symmetric, so column v is the same as row v)
+		  MISCMATHS::SpMat<double> sTmp(Nvoxels, Nvoxels); 
 		  
 		  for (int v = 1; v <= Nvoxels; v++)
 		    {
 		      
 		      // self = (2*Ndim)^2 + (nn)
-		      sTmp(v,v) = 4*spatialDims*spatialDims; // nn added later
+		      sTmp.Set(v, v, 4*spatialDims*spatialDims + neighbours[v-1].size());
 		      
 		      // neighbours = (2*Ndim) * -2
 		      for (vector<int>::iterator nidIt = neighbours[v-1].begin();
 			   nidIt != neighbours[v-1].end(); nidIt++)
 			{
 			  int nid = *nidIt; // neighbour ID (voxel number)
-			  assert(sTmp(v,nid) == 0);
-			  sTmp(v,nid) = -2 * 2 * spatialDims;
-			  sTmp(v,v) += 1;
+			  assert(sTmp(nid,v) == 0);
+			  sTmp.Set(nid, v, -2 * 2 * spatialDims);
 			}
 		      
 		      // neighbours2 = 1 (for each appearance)	    
@@ -1018,14 +1068,13 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 			   nidIt != neighbours2[v-1].end(); nidIt++)
 			{
 			  int nid2 = *nidIt; // neighbour ID (voxel number)
-			  sTmp(v,nid2) += 1; // not =1, because duplicates are ok.
+			  sTmp.AddTo(nid2, v, 1); // not =1, because duplicates are ok.
 			}
 		    }
 		  
-		  // Store back into Sinvs[k-1] and apply akmean(k)
-		  assert(sTmp == sTmp.t());
-		  Sinvs.at(k-1) << sTmp;
-		  Sinvs[k-1] *= akmean(k);
+		  // Store back into SinvsSparse[k-1] and apply akmean(k)
+		  SinvsSparse.at(k-1) = sTmp;
+		  SinvsSparse[k-1] *= akmean(k);
 		}
 	    }
 	}
@@ -1033,21 +1082,38 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
     
 
     // ITERATE OVER VOXELS
-    for (int v = 1; v <= Nvoxels; v++)
+    // One colour at a time; within a colour no voxel's prior depends on 
+    // another's posterior, so they can be shared out between threads.
+    ThreadedError err;
+    for (int c = 0; c+1 < (int)colourStart.size(); c++)
+    {
+#ifdef _OPENMP
+#pragma omp parallel if(threadedTheta)
+#endif
+    {
+    FwdModel* tmodel = threadedTheta ? model->Clone() : model;
+    NoiseModel* tnoise = threadedTheta ? noise->Clone() : noise;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (int i = colourStart[c]; i < colourStart[c+1]; i++)
       {
+	const int v = voxelOrder[i];
+	if (err.occurred()) continue;
+	try {
 	// some models may want extra information about the data
 	if (suppdata.Ncols() > 0) {
-	  model->pass_in_data(  data.Column(v) ,  suppdata.Column(v) );
+	  tmodel->pass_in_data(  data.Column(v) ,  suppdata.Column(v) );
 	}
 	else {
-	  model->pass_in_data(  data.Column(v) );
+	  tmodel->pass_in_data(  data.Column(v) );
 	}
-	model->pass_in_coords(coords.Column(v));
+	tmodel->pass_in_coords(coords.Column(v));
 	double &F = resultFs.at(v-1);  // short name
 
 	if (!continuingFromFile) {
 	  //voxelwise initialisation - only if we dont have initial values from a pre loaded MVN
-	  model->Initialise(fwdPosteriorVox[v-1]);
+	  tmodel->Initialise(fwdPosteriorVox[v-1]);
 	}
 
 	// from simple_do_vb_ar1c_spatial.m
@@ -1057,7 +1123,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 
 	if (shrinkageType == 'S')
 	  {
-	    Tracer_Plus tr("shrinkage spatial priors S");
+	    //    Tracer_Plus tr("shrinkage spatial priors S");
 	    Warning::IssueOnce("Using new S VB spatial thingy");
 
 	    assert(StS.Nrows() == Nvoxels);
@@ -1066,12 +1132,16 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	    ColumnVector contrib(Nparams); 
 	    contrib = 0;
 	    
-	    for (int i = 1; i <= Nvoxels; i++)
+	    // StS is symmetric, so row v is column v -- which only has 
+	    // entries for v's neighbours and neighbours-of-neighbours
+	    for (MISCMATHS::SpMat<double>::ColumnIterator it = StS.begin(v);
+		 it != StS.end(v); ++it)
 	      {
+		const int i = it.Row();
 		if (v != i)
 		  {
-		    weight += StS(v,i);
-		    contrib += StS(v,i) * fwdPosteriorVox[i-1].means;
+		    weight += *it;
+		    contrib += *it * fwdPosteriorVox[i-1].means;
 		  }
 	      }
 	    
@@ -1085,7 +1155,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	  }
 	else if (shrinkageType != '-')
 	  { 
-	    Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - shrinkage spatial priors");
+	    //    Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - shrinkage spatial priors");
 	    
 
 
@@ -1104,6 +1174,9 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	    
 	    double weight12 = 0; // weighted -1, may be duplicated
 	    ColumnVector contrib12(Nparams); contrib12 = 0.0;
+	    // (not used by the MRF priors, whose voxel colouring only keeps
+	    // first-order neighbours apart)
+	    if (shrinkageType != 'm' && shrinkageType != 'M')
 	    for (vector<int>::iterator nidIt = neighbours2[v-1].begin();
 		 nidIt != neighbours2[v-1].end(); nidIt++)
 	      // iterate over neighbour ids
@@ -1198,7 +1271,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	  { 
 	  
 	  // Use the new spatial priors
-	  Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - new spatial prior calculations");
+	  //    Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - new spatial prior calculations");
 
 	  // Marginalize out all the other voxels
 	  
@@ -1312,7 +1385,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	
 	if (needF)
 	  { 
-	    F = noise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
+	    F = tnoise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
 				       fwdPosteriorVox[v-1], fwdPriorVox[v-1],
 				       linearVox[v-1], data.Column(v) );
 	    F += Fard;
@@ -1324,7 +1397,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
         // Produces heaps of output and not very useful for debugging:
 	//        LOG << "Voxel " << v << " of " << Nvoxels << endl;
 	
-	noise->UpdateTheta( *noiseVox[v-1],  
+	tnoise->UpdateTheta( *noiseVox[v-1],  
 			    fwdPosteriorVox[v-1], fwdPriorVox[v-1], 
 			    linearVox[v-1], data.Column(v), 
 			    fwdPosteriorWithoutPrior.at(v-1));	
@@ -1332,7 +1405,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 
 	if (needF) 
 	  {
-	    F = noise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
+	    F = tnoise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
 				       fwdPosteriorVox[v-1], fwdPriorVox[v-1],
 				       linearVox[v-1], data.Column(v) );
 	    F += Fard;
@@ -1355,7 +1428,26 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	*/
 
 	
+	}
+	catch (const exception& e) {
+	  err.set(e.what());
+	}
+	catch (Exception) {
+	  err.set(Exception::what());
+	}
+	catch (...) {
+	  err.set("Exception in voxel " + stringify(v));
+	}
       } 
+    if (threadedTheta)
+      {
+	delete tmodel;
+	delete tnoise;
+      }
+    }
+    if (err.occurred())
+      throw Exception(err.what().c_str());
+    }
     // QUICK INTERRUPTION: Voxelwise calculations continue below.
 
     if (useSimultaneousEvidenceOptimization)
@@ -1389,6 +1481,13 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	// Build Ci
 	for (int k = 1; k <= Nparams; k++)
 	  {
+	    if (SinvsSparse[k-1].Nrows() > 0)
+	      {
+		SymmetricMatrix dense;
+		dense << SinvsSparse[k-1].AsNEWMAT();
+		Ci.SymSubMatrix(Nvoxels*(k-1)+1, Nvoxels*k) = dense;
+	      }
+	    else
 	    Ci.SymSubMatrix(Nvoxels*(k-1)+1, Nvoxels*k) = Sinvs[k-1];
 	    // off-diagonal blocks are zero, by definition of the our priors
 	    // (priors between parameters are independent)
@@ -1512,21 +1611,21 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	//	assert(initialFwdPrior->GetPrecisions() == IdentityMatrix(Nparams)); // now part of Sinvs
 	//	assert(initialFwdPrior->means == -initialFwdPrior->means);  // but this still applies
 	
-	vector<SymmetricMatrix> SigmaInv(Nparams);
-	vector<SymmetricMatrix> Sigma(Nparams);
+	// Only the diagonals of SigmaInv and Sigma are needed afterwards
+	vector<ColumnVector> SigmaInvDiag(Nparams);
+	vector<ColumnVector> SigmaDiag(Nparams);
 	vector<ColumnVector> Mu(Nparams);
 	
 	for (int k = 1; k <= Nparams; k++)
 	  {
 	    Tracer_Plus tr("useFullEvidenceOptimization calculations -- first loop");
-	    const SymmetricMatrix& Ci = Sinvs[k-1];
-	    SymmetricMatrix XXtr(Nvoxels);
+	    DiagonalMatrix XXtr(Nvoxels);
 	    ColumnVector XYtr(Nvoxels);
 
 	    ColumnVector XXtrMuOthers(Nvoxels);
 	    
 	    // Initialize to junk values
-	    XXtr = -999*IdentityMatrix(Nvoxels);
+	    XXtr = -999;
 	    XYtr = -999;
 	    
 	    for (int v = 1; v <= Nvoxels; v++)
@@ -1556,17 +1655,53 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	    //	    tmp4 = initialFwdPrior->means(k);
 	    //	    ColumnVector CiMu0 = Ci * tmp4;
 
-	    { Tracer_Plus tr("useFullEvidenceOptimization calculations -- 1a");
-	      SigmaInv.at(k-1) = XXtr + Ci;
-	    }
-	    { Tracer_Plus tr("useFullEvidenceOptimization calculations -- 1b");
-	      Sigma.at(k-1) = SigmaInv[k-1].i();
-	    }
-	    { Tracer_Plus tr("useFullEvidenceOptimization calculations -- 1c");
-	      //	      Mu.at(k-1) = Sigma[k-1] * (XYtr - XXtrMuOthers);
-	      //	      Mu.at(k-1) = Sigma[k-1] * (XYtr - XXtrMuOthers + CiMu0);
-	      Mu.at(k-1) = Sigma[k-1] * (XYtr - XXtrMuOthers);
-	    }
+	    if (SinvsSparse[k-1].Nrows() > 0 && !useCovarianceMarginalsRatherThanPrecisions)
+	      {
+		// Laplacian-type prior: SigmaInv is sparse and positive definite,
+		// so solve for Mu by conjugate gradients (starting from the 
+		// current posterior means) instead of inverting it
+		Tracer_Plus tr("useFullEvidenceOptimization calculations -- sparse CG");
+		MISCMATHS::SpMat<double> SigmaInv = SinvsSparse[k-1];
+		SigmaInvDiag.at(k-1).ReSize(Nvoxels);
+		ColumnVector muStart(Nvoxels);
+		for (int v = 1; v <= Nvoxels; v++)
+		  {
+		    SigmaInv.AddTo(v, v, XXtr(v));
+		    SigmaInvDiag[k-1](v) = SigmaInv(v,v);
+		    muStart(v) = fwdPosteriorVox[v-1].means(k) - initialFwdPrior->means(k);
+		  }
+		ColumnVector rhs = XYtr - XXtrMuOthers;
+		Mu.at(k-1) = SigmaInv.SolveForx(rhs, MISCMATHS::SYM_POSDEF,
+						1e-10, 10*Nvoxels, muStart);
+	      }
+	    else
+	      {
+		const SymmetricMatrix& Ci = Sinvs[k-1];
+		SymmetricMatrix SigmaInv;
+		SymmetricMatrix Sigma;
+		if (SinvsSparse[k-1].Nrows() > 0)
+		  SigmaInv << SinvsSparse[k-1].AsNEWMAT(); // need the full inverse
+		else
+		  SigmaInv = Ci;
+		{ Tracer_Plus tr("useFullEvidenceOptimization calculations -- 1a");
+		  SigmaInv += XXtr;
+		}
+		{ Tracer_Plus tr("useFullEvidenceOptimization calculations -- 1b");
+		  Sigma = SigmaInv.i();
+		}
+		{ Tracer_Plus tr("useFullEvidenceOptimization calculations -- 1c");
+		  //	      Mu.at(k-1) = Sigma * (XYtr - XXtrMuOthers);
+		  //	      Mu.at(k-1) = Sigma * (XYtr - XXtrMuOthers + CiMu0);
+		  Mu.at(k-1) = Sigma * (XYtr - XXtrMuOthers);
+		}
+		SigmaInvDiag.at(k-1).ReSize(Nvoxels);
+		SigmaDiag.at(k-1).ReSize(Nvoxels);
+		for (int v = 1; v <= Nvoxels; v++)
+		  {
+		    SigmaInvDiag[k-1](v) = SigmaInv(v,v);
+		    SigmaDiag[k-1](v) = Sigma(v,v);
+		  }
+	      }
 	  }
 	for (int v = 1; v <= Nvoxels; v++)
 	  {
@@ -1591,7 +1726,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 		//cout << "cov = \n" << cov << endl;
 
 		for (int k = firstParameterForFullEO; k <= Nparams; k++)
-		  cov(k,k) = Sigma[k-1](v,v);
+		  cov(k,k) = SigmaDiag[k-1](v);
 
 		fwdPosteriorVox[v-1].SetCovariance(cov);
 	      }
@@ -1611,7 +1746,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 		Warning::IssueOnce("Precision diagonal thingy");
 		//cout << "prec = \n" << prec << endl;
 		for (int k = firstParameterForFullEO; k <= Nparams; k++)
-		  prec(k,k) = SigmaInv[k-1](v,v);
+		  prec(k,k) = SigmaInvDiag[k-1](v);
 
 		if ((prec-precOld).MaximumAbsoluteValue() > 1e-10)
 		  LOG << "precBefore: " << precOld.AsColumn().t() << "precAfter: " << prec.AsColumn().t();
@@ -1627,24 +1762,38 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 
 
     // Back to your regularly-scheduled voxelwise calculations
+    // (no coupling between voxels here at all)
+    {
+    ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel if(threaded)
+#endif
+    {
+    FwdModel* tmodel = threaded ? model->Clone() : model;
+    NoiseModel* tnoise = threaded ? noise->Clone() : noise;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
     for (int v = 1; v <= Nvoxels; v++)
       {
+	if (err.occurred()) continue;
+	try {
 	// some models may want extra information about the data
 	if (suppdata.Ncols() > 0) {
-	  model->pass_in_data(  data.Column(v) ,  suppdata.Column(v) );
+	  tmodel->pass_in_data(  data.Column(v) ,  suppdata.Column(v) );
 	}
 	else {
-	  model->pass_in_data(  data.Column(v) );
+	  tmodel->pass_in_data(  data.Column(v) );
 	}
-	model->pass_in_coords(coords.Column(v));
+	tmodel->pass_in_coords(coords.Column(v));
 
 	double &F = resultFs.at(v-1);  // short name
 
-	noise->UpdateNoise( *noiseVox[v-1], *noiseVoxPrior[v-1], 
+	tnoise->UpdateNoise( *noiseVox[v-1], *noiseVoxPrior[v-1], 
         fwdPosteriorVox[v-1], linearVox[v-1], data.Column(v) );
 
 	if (needF) 
-	  F = noise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
+	  F = tnoise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
 				     fwdPosteriorVox[v-1], fwdPriorVox[v-1],
 				     linearVox[v-1], data.Column(v) );
 	if (printF) 
@@ -1655,17 +1804,35 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 
 	//* MOVED HERE on Michael's advice -- 2007-11-23
 	if (!lockedLinearEnabled)
-	  linearVox[v-1].ReCentre( fwdPosteriorVox[v-1].means );
+	  linearVox[v-1].ReCentre( fwdPosteriorVox[v-1].means, tmodel );
 	
 	if (needF) 
-	  F = noise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
+	  F = tnoise->CalcFreeEnergy( *noiseVox[v-1], *noiseVoxPrior[v-1], 
 				     fwdPosteriorVox[v-1], fwdPriorVox[v-1],
 				     linearVox[v-1], data.Column(v) );
 	if (printF) 
 	  LOG << "      Flin == " << F << endl;
 	// */
-	
+	}
+	catch (const exception& e) {
+	  err.set(e.what());
+	}
+	catch (Exception) {
+	  err.set(Exception::what());
+	}
+	catch (...) {
+	  err.set("Exception in voxel " + stringify(v));
+	}
       }
+    if (threaded)
+      {
+	delete tmodel;
+	delete tnoise;
+      }
+    }
+    if (err.occurred())
+      throw Exception(err.what().c_str());
+    }
 
 
     
@@ -1783,8 +1950,12 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
       vols.ReSize(Nparams, Nvoxels*Nvoxels);
       for (int k = 1; k <= Nparams; k++)
 	{
-	  assert(Sinvs.at(k-1).Nrows() == Nvoxels);
-	  Matrix full = Sinvs.at(k-1); // easier to visualize if in full form
+	  Matrix full; // easier to visualize if in full form
+	  if (SinvsSparse.at(k-1).Nrows() > 0)
+	    full = SinvsSparse[k-1].AsNEWMAT();
+	  else
+	    full = Sinvs.at(k-1);
+	  assert(full.Nrows() == Nvoxels);
 	  vols.Row(k) = full.AsColumn().t();
 	}
       
@@ -1994,6 +2165,48 @@ void SpatialVariationalBayes::CalcNeighbours(const volume<float>& mask)
 }
 #endif //__FABBER_LIBRARYONLY
 
+void SpatialVariationalBayes::CalcColouring(bool secondOrder, 
+		vector<int>& order, vector<int>& colourStart) const
+{
+  Tracer_Plus tr("SpatialVariationalBayes::CalcColouring");
+  const int nVoxels = neighbours.size();
+  assert(!secondOrder || (int)neighbours2.size() == nVoxels);
+
+  // Greedy: each voxel takes the lowest colour none of its (already 
+  // coloured) neighbours have.  used[c] == v marks colour c as taken for v.
+  vector<int> colour(nVoxels, -1);
+  vector<int> used;
+  for (int v = 1; v <= nVoxels; v++)
+    {
+      for (int l = 0; l < (secondOrder ? 2 : 1); l++)
+	{
+	  const vector<int>& nlist = (l == 0) ? neighbours[v-1] : neighbours2[v-1];
+	  for (vector<int>::const_iterator nidIt = nlist.begin();
+	       nidIt != nlist.end(); nidIt++)
+	    if (colour[*nidIt-1] >= 0)
+	      used[colour[*nidIt-1]] = v;
+	}
+      int c = 0;
+      while (c < (int)used.size() && used[c] == v)
+	c++;
+      if (c == (int)used.size())
+	used.push_back(0);
+      colour[v-1] = c;
+    }
+
+  // Sort by colour, keeping the original voxel order within each colour
+  const int nColours = used.size();
+  colourStart.assign(nColours+1, 0);
+  for (int v = 1; v <= nVoxels; v++)
+    colourStart[colour[v-1]+1]++;
+  for (int c = 0; c < nColours; c++)
+    colourStart[c+1] += colourStart[c];
+  vector<int> next(colourStart.begin(), colourStart.end()-1);
+  order.resize(nVoxels);
+  for (int v = 1; v <= nVoxels; v++)
+    order[next[colour[v-1]]++] = v;
+}
+
 #if defined(__FABBER_LIBRARYONLY_TESTWITHNEWIMAGE) || !defined(__FABBER_LIBRARYONLY)
 // Helper function, also used in fabber_library's test main()
 void ConvertMaskToVoxelCoordinates(const volume<float>& mask, Matrix& voxelCoords)
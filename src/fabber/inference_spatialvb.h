@@ -131,6 +131,13 @@ public:
 #endif //__FABBER_LIBRARYONLY
     void CalcNeighbours(const Matrix& voxelCoords);
 
+    // Greedy colouring of the neighbour graph (plus neighbours-of-neighbours
+    // if secondOrder): voxels order[colourStart[c]..colourStart[c+1]-1] all
+    // have colour c, and no two of them are coupled by the shrinkage prior.
+    // For first-order priors on a grid this is the usual red-black ordering.
+    void CalcColouring(bool secondOrder, vector<int>& order, 
+		       vector<int>& colourStart) const;
+
     //vector<string> imagepriorstr; now inherited from spatialvb
     
     // For the new (Sahani-based) smoothing method:    
@@ -68,6 +68,7 @@
 
 #include "inference_vb.h"
 #include "convergence.h"
+#include "utils/threading.h"
 
 #ifndef __FABBER_LIBRARYONLY
 using namespace NEWIMAGE;
@@ -224,6 +225,256 @@ void VariationalBayesInferenceTechnique::Setup(ArgsType& args)
   
 }
 
+void VariationalBayesInferenceTechnique::DoVoxel(int voxel,
+  const Matrix& data, const Matrix& coords, const Matrix& suppdata,
+  const vector<ColumnVector>& ImagePrior, 
+  const vector<MVNDist*>& continueFromDists, bool continuefromprevious,
+  FwdModel* model, NoiseModel* noise, const NoiseParams* noisePrior,
+  ConvergenceDetector* conv, ColumnVector& modelpred)
+{
+  // VB updates for one voxel. The model, noise model, noise prior and 
+  // convergence detector are passed in (rather than using the members) so 
+  // that each thread can work on its own copies; everything else here is
+  // either read only or belongs to this voxel.
+  const int Nvoxels = data.Ncols();
+  const bool continuingFromFile = (continueFromFile != "");
+  const int nFwdParams = initialFwdPrior->GetSize();
+  const int nNoiseParams = initialNoisePrior->OutputAsMVN().GetSize(); 
+
+  ColumnVector y = data.Column(voxel);
+  ColumnVector vcoords = coords.Column(voxel);
+  if (suppdata.Ncols() > 0) {
+    ColumnVector suppy = suppdata.Column(voxel);
+    model->pass_in_data( y , suppy );
+  }
+  else {
+    model->pass_in_data( y );
+  }
+  model->pass_in_coords(vcoords);
+  NoiseParams* noiseVox = NULL;
+
+  if (continuefromprevious) {
+    // noise params come from resultMVN
+    noiseVox = noise->NewParams();
+    noiseVox->InputFromMVN( resultMVNs.at(voxel-1)->GetSubmatrix(nFwdParams+1, nFwdParams+nNoiseParams) );
+  }
+  else if (initialNoisePosterior == NULL) // continuing noise params from file 
+  {
+    assert(continuingFromFile);
+    assert(continueFromDists.at(voxel-1)->GetSize() == nFwdParams+nNoiseParams);
+    noiseVox = noise->NewParams();
+    noiseVox->InputFromMVN( continueFromDists.at(voxel-1)
+	->GetSubmatrix(nFwdParams+1, nFwdParams+nNoiseParams) );
+  }  
+  else
+  {
+    noiseVox = initialNoisePosterior->Clone();
+    /* if (continuingFromFile)
+       assert(continueFromDists.at(voxel-1)->GetSize() == nFwdParams);*/
+  }
+  const NoiseParams* noiseVoxPrior = noisePrior;
+  NoiseParams* const noiseVoxSave = noiseVox->Clone();
+
+
+  // give an indication of the progress through the voxels
+  LOG << "  Voxel " << voxel << " of " << Nvoxels << endl;
+
+  //LOG_ERR("  Voxel " << voxel << " of " << Nvoxels << endl); 
+  //  << " sumsquares = " << (y.t() * y).AsScalar() << endl;
+  double F = 1234.5678;
+
+  MVNDist fwdPrior( *initialFwdPrior );
+  MVNDist fwdPosterior;
+  if (continuefromprevious) {
+    //use result from a previous run within fabber (presumably after motion correction)
+    fwdPosterior = resultMVNs.at(voxel-1)->GetSubmatrix(1, nFwdParams);
+  }
+  if (continuingFromFile)
+  {
+    //use results from a previous run loaded from a file
+    assert(initialFwdPosterior == NULL);
+    fwdPosterior = continueFromDists.at(voxel-1)->GetSubmatrix(1, nFwdParams);
+  }
+  else
+  { 
+    assert(initialFwdPosterior != NULL);
+    fwdPosterior = *initialFwdPosterior;
+    // any voxelwise initialisation
+    model->Initialise(fwdPosterior);
+  }
+
+
+  MVNDist fwdPosteriorSave(fwdPosterior);
+  MVNDist fwdPriorSave(fwdPrior);
+
+
+  LinearizedFwdModel linear( model );
+
+  // Setup for ARD (fwdmodel will decide if there is anything to be done)
+  double Fard = 0;
+  model->SetupARD( fwdPosterior, fwdPrior, Fard ); // THIS USES ARD IN THE MODEL AND IS DEPRECEATED
+  Fard = noise->SetupARD( model->ardindices, fwdPosterior, fwdPrior );
+
+  // Image priors
+  for (int k=1; k<=nFwdParams; k++) {
+    if (PriorsTypes[k-1] == 'I') {
+      ColumnVector thisimageprior;
+      thisimageprior = ImagePrior[k-1];
+      fwdPrior.means(k) = thisimageprior(voxel);
+    }
+  }
+
+  try
+    {
+      linear.ReCentre( fwdPosterior.means );
+
+
+      noise->Precalculate( *noiseVox, *noiseVoxPrior, y );
+
+      conv->Reset();
+
+      // START the VB updates and run through the relevant iterations (according to the convergence testing)
+      int iteration = 0; //count the iterations
+      do 
+	{
+	  if ( conv-> NeedRevert() ) //revert to previous solution if the convergence detector calls for it
+	    {
+	      *noiseVox = *noiseVoxSave;  // copy values, not pointers!
+	      fwdPosterior = fwdPosteriorSave;
+	      fwdPrior = fwdPriorSave; // need to revert prior too (in case ARD is in place)
+	      linear.ReCentre( fwdPosterior.means );
+	    }
+
+	  if (needF) { 
+	    F = noise->CalcFreeEnergy( *noiseVox, 
+				       *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
+	    F = F + Fard; }
+	  if (printF) 
+	    LOG << "      Fbefore == " << F << endl;
+
+
+	  // Save old values if called for
+	  if ( conv->NeedSave() )
+	  {
+	    *noiseVoxSave = *noiseVox;  // copy values, not pointers!
+	    fwdPosteriorSave = fwdPosterior;
+	    fwdPriorSave = fwdPrior;
+	  }
+
+	  // Do ARD updates (model will decide if there is anything to do here)
+	  if (iteration > 0) { 
+	    model->UpdateARD( fwdPosterior, fwdPrior, Fard ); // THIS USES ARD IN THE MODEL AND IS DEPRECEATED
+	    Fard = noise->UpdateARD( model->ardindices, fwdPosterior, fwdPrior );
+	  }
+
+	  // Theta update
+	  noise->UpdateTheta( *noiseVox, fwdPosterior, fwdPrior, linear, y, NULL, conv->LMalpha() );
+
+
+
+	  if (needF) {
+	    F = noise->CalcFreeEnergy( *noiseVox, 
+				       *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
+	    F = F + Fard; }
+	  if (printF) 
+	    LOG << "      Ftheta == " << F << endl;
+
+
+	  // Alpha & Phi updates
+	  noise->UpdateNoise( *noiseVox, *noiseVoxPrior, fwdPosterior, linear, y );
+
+	  if (needF) {
+	    F = noise->CalcFreeEnergy( *noiseVox, 
+				       *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
+	    F = F + Fard; }
+	  if (printF) 
+	  LOG << "      Fphi == " << F << endl;
+
+	  // Test of NoiseModel cloning:
+	  // NoiseModel* tmp = noise; noise = tmp->Clone(); delete tmp;
+
+	  // Linearization update
+	  // Update the linear model before doing Free eneergy calculation (and ready for next round of theta and phi updates)
+	  linear.ReCentre( fwdPosterior.means );
+
+
+	  if (needF) {
+	    F = noise->CalcFreeEnergy( *noiseVox, 
+				       *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
+	    F = F + Fard; }
+	  if (printF) 
+	    LOG << "      Fnoise == " << F << endl;
+
+
+	  iteration++;
+	}           
+      while ( !conv->Test( F ) );
+      // END of VB updates
+
+      // Revert to old values at last stage if required
+      if ( conv-> NeedRevert() )
+      {
+	*noiseVox = *noiseVoxSave;  // copy values, not pointers!
+	fwdPosterior = fwdPosteriorSave;
+	fwdPrior = fwdPriorSave;
+	linear.ReCentre( fwdPosterior.means ); //just in case we go on to use this in motion correction
+      }
+      conv->DumpTo(LOG, "    ");
+    } 
+  catch (const overflow_error& e)
+    {
+      LOG_ERR("    Went infinite!  Reason:" << endl
+	      << "      " << e.what() << endl);
+      //todo: write garbage or best guess to memory/file
+      if (haltOnBadVoxel) throw;
+      LOG_ERR("    Going on to the next voxel." << endl);
+    }
+  catch (Exception)
+    {
+      LOG_ERR("    NEWMAT Exception in this voxel:\n"
+	      << Exception::what() << endl);
+      if (haltOnBadVoxel) throw;
+      LOG_ERR("    Going on to the next voxel." << endl);  
+    }
+  catch (...)
+    {
+      LOG_ERR("    Other exception caught in main calculation loop!!\n");
+	//<< "    Use --halt-on-bad-voxel for more details." << endl;
+      if (haltOnBadVoxel) throw;
+      LOG_ERR("    Going on to the next voxel" << endl);
+    }
+
+  // now write the results to resultMVNs
+  try {
+
+    LOG << "    Final parameter estimates (" << fwdPosterior.means.Nrows() << "x" << fwdPosterior.means.Ncols() << ") are: " << fwdPosterior.means.t() << endl;
+    linear.DumpParameters(fwdPosterior.means, "      ");
+
+    //assert(resultMVNs.at(voxel-1) == NULL); // this is no longer a good check, since we might voerwrite previous results here
+    resultMVNs.at(voxel-1) = new MVNDist(
+      fwdPosterior, noiseVox->OutputAsMVN() );
+    if (needF)
+      resultFs.at(voxel-1) = F;
+    modelpred = linear.Offset(); // get the model prediction which is stored within the linearized forward model
+
+  } catch (...) {
+    // Even that can fail, due to results being singular
+    LOG << "    Can't give any sensible answer for this voxel; outputting zero +- identity\n";
+    MVNDist* tmp = new MVNDist();
+    tmp->SetSize(fwdPosterior.means.Nrows()
+		+ noiseVox->OutputAsMVN().means.Nrows());
+    tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
+    resultMVNs.at(voxel-1) = tmp;
+
+    if (needF)
+      resultFs.at(voxel-1) = F;
+    modelpred = linear.Offset(); // get the model prediction which is stored within the linearized forward model
+  }
+
+  delete noiseVox; noiseVox = NULL;
+  delete noiseVoxSave;
+}
+
 void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData) 
 {
   Tracer_Plus tr("VariationalBayesInferenceTechnique::DoCalculations");
@@ -286,7 +537,6 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
     
 
   const int nFwdParams = initialFwdPrior->GetSize();
-  const int nNoiseParams = initialNoisePrior->OutputAsMVN().GetSize(); 
 
   // sort out loading for 'I' prior
   vector<ColumnVector> ImagePrior(nFwdParams);
@@ -312,248 +562,132 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   }
  }
 
+  // Voxels are independent of each other, so they can be shared out between
+  // threads provided each thread has its own copy of the (stateful) models.
+  bool threaded = false;
+  if (max_threads() > 1 && Nvoxels > 1)
+    {
+      FwdModel* test = model->Clone();
+      threaded = (test != NULL);
+      delete test;
+    }
+
   // main loop over motion correction iterations and VB calculations
   bool continuefromprevious = false; //indicates that we should continue from a previous run (i.e. after a motion correction step)
   for (int step = 0; step <= Nmcstep; step++) {
     if (step>0) cout << endl << "Motion correction step " << step << " of " << Nmcstep << endl;
 
   // loop over voxels doing VB calculations
-  for (int voxel = 1; voxel <= Nvoxels; voxel++)
+  if (!threaded)
     {
-      ColumnVector y = data.Column(voxel);
-      ColumnVector vcoords = coords.Column(voxel);
-      if (suppdata.Ncols() > 0) {
-	ColumnVector suppy = suppdata.Column(voxel);
-	model->pass_in_data( y , suppy );
-      }
-      else {
-	model->pass_in_data( y );
-      }
-      model->pass_in_coords(vcoords);
-      NoiseParams* noiseVox = NULL;
-      
-      if (continuefromprevious) {
-	// noise params come from resultMVN
-	noiseVox = noise->NewParams();
-	noiseVox->InputFromMVN( resultMVNs.at(voxel-1)->GetSubmatrix(nFwdParams+1, nFwdParams+nNoiseParams) );
-      }
-      else if (initialNoisePosterior == NULL) // continuing noise params from file 
-      {
-        assert(continuingFromFile);
-        assert(continueFromDists.at(voxel-1)->GetSize() == nFwdParams+nNoiseParams);
-        noiseVox = noise->NewParams();
-        noiseVox->InputFromMVN( continueFromDists.at(voxel-1)
-            ->GetSubmatrix(nFwdParams+1, nFwdParams+nNoiseParams) );
-      }  
-      else
-      {
-        noiseVox = initialNoisePosterior->Clone();
-	/* if (continuingFromFile)
-	   assert(continueFromDists.at(voxel-1)->GetSize() == nFwdParams);*/
-      }
-      const NoiseParams* noiseVoxPrior = initialNoisePrior;
-      NoiseParams* const noiseVoxSave = noiseVox->Clone();
-      
-
-      // give an indication of the progress through the voxels
-      LOG << "  Voxel " << voxel << " of " << Nvoxels << endl;
-      if (fmod(voxel,floor(Nvoxels/10))==0) {cout << ". " << flush;}
-
-      //LOG_ERR("  Voxel " << voxel << " of " << Nvoxels << endl); 
-      //  << " sumsquares = " << (y.t() * y).AsScalar() << endl;
-      double F = 1234.5678;
-
-      MVNDist fwdPrior( *initialFwdPrior );
-      MVNDist fwdPosterior;
-      if (continuefromprevious) {
-	//use result from a previous run within fabber (presumably after motion correction)
-	fwdPosterior = resultMVNs.at(voxel-1)->GetSubmatrix(1, nFwdParams);
-      }
-      if (continuingFromFile)
-      {
-	//use results from a previous run loaded from a file
-        assert(initialFwdPosterior == NULL);
-        fwdPosterior = continueFromDists.at(voxel-1)->GetSubmatrix(1, nFwdParams);
-      }
-      else
-      { 
-        assert(initialFwdPosterior != NULL);
-        fwdPosterior = *initialFwdPosterior;
-	// any voxelwise initialisation
-	model->Initialise(fwdPosterior);
-      }
-
-
-      MVNDist fwdPosteriorSave(fwdPosterior);
-      MVNDist fwdPriorSave(fwdPrior);
-
-      
-      LinearizedFwdModel linear( model );
-      
-      // Setup for ARD (fwdmodel will decide if there is anything to be done)
-      double Fard = 0;
-      model->SetupARD( fwdPosterior, fwdPrior, Fard ); // THIS USES ARD IN THE MODEL AND IS DEPRECEATED
-      Fard = noise->SetupARD( model->ardindices, fwdPosterior, fwdPrior );
-
-      // Image priors
-      for (int k=1; k<=nFwdParams; k++) {
-	if (PriorsTypes[k-1] == 'I') {
-	  ColumnVector thisimageprior;
-	  thisimageprior = ImagePrior[k-1];
-	  fwdPrior.means(k) = thisimageprior(voxel);
-	}
-      }
-
-      try
+      for (int voxel = 1; voxel <= Nvoxels; voxel++)
 	{
-	  linear.ReCentre( fwdPosterior.means );
-	  
-
-	  noise->Precalculate( *noiseVox, *noiseVoxPrior, y );
-
-	  conv->Reset();
-
-	  // START the VB updates and run through the relevant iterations (according to the convergence testing)
-	  int iteration = 0; //count the iterations
-	  do 
+	  // give an indication of the progress through the voxels
+	  if (fmod(voxel,floor(Nvoxels/10))==0) {cout << ". " << flush;}
+	  ColumnVector pred;
+	  DoVoxel(voxel, data, coords, suppdata, ImagePrior, continueFromDists,
+		  continuefromprevious, model, noise, initialNoisePrior, conv, pred);
+	  modelpred.Column(voxel) = pred;
+	}
+    }
+  else
+    {
+      // Each thread gets its own copies of the models and buffers its LOG 
+      // output per voxel; the buffers are written out in voxel order so 
+      // the logfile reads exactly as it would from the serial loop. The
+      // progress dots follow the same order but only the master thread
+      // prints them.
+      ostream& logfile = LOG;
+      vector<string> voxlogs(Nvoxels);
+      vector<char> voxdone(Nvoxels, 0);
+      int nextlog = 0;
+      int dotsdue = 0, dotsshown = 0;
+      int badvoxel = 0;
+      ThreadedError err;
+      EasyLog::StartThreadLogs(max_threads());
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+      {
+	FwdModel* tmodel = model->Clone();
+	NoiseModel* tnoise = noise->Clone();
+	NoiseParams* tnoisePrior = initialNoisePrior->Clone();
+	ConvergenceDetector* tconv = conv->Clone();
+	ostringstream voxlog;
+	EasyLog::SetThreadLog(&voxlog);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+	for (int voxel = 1; voxel <= Nvoxels; voxel++)
+	  {
+	    if (err.occurred()) continue;
+	    voxlog.str("");
+	    ColumnVector pred;
+	    bool failed = true;
+	    try {
+	      DoVoxel(voxel, data, coords, suppdata, ImagePrior, continueFromDists,
+		      continuefromprevious, tmodel, tnoise, tnoisePrior, tconv, pred);
+	      failed = false;
+	    }
+	    catch (const exception& e) {
+	      err.set(e.what());
+	    }
+	    catch (Exception) {
+	      err.set(Exception::what());
+	    }
+	    catch (...) {
+	      err.set("Exception in voxel " + stringify(voxel));
+	    }
+#ifdef _OPENMP
+#pragma omp critical(fabber_vb_voxel)
+#endif
 	    {
-	      if ( conv-> NeedRevert() ) //revert to previous solution if the convergence detector calls for it
+	      if (failed)
 		{
-		  *noiseVox = *noiseVoxSave;  // copy values, not pointers!
-		  fwdPosterior = fwdPosteriorSave;
-		  fwdPrior = fwdPriorSave; // need to revert prior too (in case ARD is in place)
-		  linear.ReCentre( fwdPosterior.means );
+		  if (badvoxel == 0) badvoxel = voxel;
 		}
-	      
-	      if (needF) { 
-		F = noise->CalcFreeEnergy( *noiseVox, 
-					   *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
-		F = F + Fard; }
-	      if (printF) 
-		LOG << "      Fbefore == " << F << endl;
-
- 
-              // Save old values if called for
-	      if ( conv->NeedSave() )
-              {
-		*noiseVoxSave = *noiseVox;  // copy values, not pointers!
-                fwdPosteriorSave = fwdPosterior;
-		fwdPriorSave = fwdPrior;
-              }
-
-	      // Do ARD updates (model will decide if there is anything to do here)
-	      if (iteration > 0) { 
-		model->UpdateARD( fwdPosterior, fwdPrior, Fard ); // THIS USES ARD IN THE MODEL AND IS DEPRECEATED
-		Fard = noise->UpdateARD( model->ardindices, fwdPosterior, fwdPrior );
-	      }
-
-	      // Theta update
-	      noise->UpdateTheta( *noiseVox, fwdPosterior, fwdPrior, linear, y, NULL, conv->LMalpha() );
-
-
-      
-	      if (needF) {
-		F = noise->CalcFreeEnergy( *noiseVox, 
-					   *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
-		F = F + Fard; }
-	      if (printF) 
-		LOG << "      Ftheta == " << F << endl;
-	      
-	      
-	      // Alpha & Phi updates
-	      noise->UpdateNoise( *noiseVox, *noiseVoxPrior, fwdPosterior, linear, y );
-
-	      if (needF) {
-		F = noise->CalcFreeEnergy( *noiseVox, 
-					   *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
-		F = F + Fard; }
-	      if (printF) 
-	      LOG << "      Fphi == " << F << endl;
-
-	      // Test of NoiseModel cloning:
-	      // NoiseModel* tmp = noise; noise = tmp->Clone(); delete tmp;
-
-	      // Linearization update
-	      // Update the linear model before doing Free eneergy calculation (and ready for next round of theta and phi updates)
-	      linear.ReCentre( fwdPosterior.means );
-	      
-	      
-	      if (needF) {
-		F = noise->CalcFreeEnergy( *noiseVox, 
-					   *noiseVoxPrior, fwdPosterior, fwdPrior, linear, y);
-		F = F + Fard; }
-	      if (printF) 
-		LOG << "      Fnoise == " << F << endl;
-
-
-	      iteration++;
-	    }           
-	  while ( !conv->Test( F ) );
-	  // END of VB updates
-
-	  // Revert to old values at last stage if required
-	  if ( conv-> NeedRevert() )
-          {
-	    *noiseVox = *noiseVoxSave;  // copy values, not pointers!
-            fwdPosterior = fwdPosteriorSave;
-	    fwdPrior = fwdPriorSave;
-	    linear.ReCentre( fwdPosterior.means ); //just in case we go on to use this in motion correction
+	      else
+		{
+		  if (pred.Nrows() > 0) modelpred.Column(voxel) = pred;
+		  voxlogs[voxel-1] = voxlog.str();
+		  voxdone[voxel-1] = 1;
+		  while (nextlog < Nvoxels && voxdone[nextlog])
+		    {
+		      logfile << voxlogs[nextlog];
+		      string().swap(voxlogs[nextlog]);
+		      nextlog++;
+		      if (fmod(nextlog,floor(Nvoxels/10))==0) dotsdue++;
+		    }
+		}
+	      if (thread_num() == 0)
+		for (; dotsshown < dotsdue; dotsshown++) cout << ". " << flush;
+	    }
 	  }
-	  conv->DumpTo(LOG, "    ");
-	} 
-      catch (const overflow_error& e)
-	{
-	  LOG_ERR("    Went infinite!  Reason:" << endl
-		  << "      " << e.what() << endl);
-	  //todo: write garbage or best guess to memory/file
-	  if (haltOnBadVoxel) throw;
-	  LOG_ERR("    Going on to the next voxel." << endl);
-	}
-      catch (Exception)
-	{
-	  LOG_ERR("    NEWMAT Exception in this voxel:\n"
-		  << Exception::what() << endl);
-	  if (haltOnBadVoxel) throw;
-	  LOG_ERR("    Going on to the next voxel." << endl);  
-	}
-      catch (...)
+	EasyLog::SetThreadLog(NULL);
+	delete tmodel;
+	delete tnoise;
+	delete tnoisePrior;
+	delete tconv;
+      }
+      EasyLog::StopThreadLogs();
+      for (; dotsshown < dotsdue; dotsshown++) cout << ". " << flush;
+      if (err.occurred())
 	{
-	  LOG_ERR("    Other exception caught in main calculation loop!!\n");
-	    //<< "    Use --halt-on-bad-voxel for more details." << endl;
-	  if (haltOnBadVoxel) throw;
-	  LOG_ERR("    Going on to the next voxel" << endl);
+	  // write out whatever was logged before the failure
+	  for (; nextlog < Nvoxels; nextlog++)
+	    logfile << voxlogs[nextlog];
+	  // Re-run the failed voxel serially so that its exception reaches
+	  // the caller with its original type and message. Voxels are
+	  // independent, so it fails again in the same way.
+	  if (badvoxel > 0)
+	    {
+	      ColumnVector pred;
+	      DoVoxel(badvoxel, data, coords, suppdata, ImagePrior, continueFromDists,
+		      continuefromprevious, model, noise, initialNoisePrior, conv, pred);
+	    }
+	  throw Exception(err.what().c_str());
 	}
-      
-      // now write the results to resultMVNs
-      try {
-
-	LOG << "    Final parameter estimates (" << fwdPosterior.means.Nrows() << "x" << fwdPosterior.means.Ncols() << ") are: " << fwdPosterior.means.t() << endl;
-	linear.DumpParameters(fwdPosterior.means, "      ");
-	
-	//assert(resultMVNs.at(voxel-1) == NULL); // this is no longer a good check, since we might voerwrite previous results here
-	resultMVNs.at(voxel-1) = new MVNDist(
-	  fwdPosterior, noiseVox->OutputAsMVN() );
-	if (needF)
-	  resultFs.at(voxel-1) = F;
-	modelpred.Column(voxel) = linear.Offset(); // get the model prediction which is stored within the linearized forward model
-
-      } catch (...) {
-	// Even that can fail, due to results being singular
-	LOG << "    Can't give any sensible answer for this voxel; outputting zero +- identity\n";
-	MVNDist* tmp = new MVNDist();
-	tmp->SetSize(fwdPosterior.means.Nrows()
-		    + noiseVox->OutputAsMVN().means.Nrows());
-	tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
-	resultMVNs.at(voxel-1) = tmp;
-
-	if (needF)
-	  resultFs.at(voxel-1) = F;
-	modelpred.Column(voxel) = linear.Offset(); // get the model prediction which is stored within the linearized forward model
-      }
-      
-      delete noiseVox; noiseVox = NULL;
-      delete noiseVoxSave;
-    } //END of voxelwise updates
+    }
 
   //MOTION CORRECTION
   if (step<Nmcstep) { //dont do motion correction on the last run though as that would be a waste
@@ -112,5 +112,13 @@ class VariationalBayesInferenceTechnique : public InferenceTechnique {
       bool haltOnBadVoxel;
       bool printF;
       bool needF;
+
+      // VB updates for a single voxel, see DoCalculations
+      void DoVoxel(int voxel, const Matrix& data, const Matrix& coords, 
+		   const Matrix& suppdata, const vector<ColumnVector>& ImagePrior,
+		   const vector<MVNDist*>& continueFromDists, 
+		   bool continuefromprevious, FwdModel* model, NoiseModel* noise,
+		   const NoiseParams* noisePrior, ConvergenceDetector* conv, 
+		   ColumnVector& modelpred);
 };
 
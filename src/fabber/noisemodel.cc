@@ -131,7 +131,7 @@ NoiseModel* NoiseModel::NewFromName(const string& name, ArgsType& args)
 double NoiseModel::SetupARD(vector<int> ardindices,
 			  const MVNDist& theta,
 			  MVNDist& thetaPrior) const {
-  Tracer_Plus tr("Noisemodel::SetupARD");
+  //    Tracer_Plus tr("Noisemodel::SetupARD");
   double Fard=0;
 
   if (~ardindices.empty()) {
@@ -158,7 +158,7 @@ double NoiseModel::SetupARD(vector<int> ardindices,
 double NoiseModel::UpdateARD(vector<int> ardindices,
 			  const MVNDist& theta,
 			  MVNDist& thetaPrior) const {
-  Tracer_Plus tr("Noisemodel::UpdateARD");
+  //    Tracer_Plus tr("Noisemodel::UpdateARD");
   double Fard=0;
 
   if (~ardindices.empty()) {
@@ -94,8 +94,8 @@ class NoiseModel {
      
  public:
 
-  // Create a new identical copy of this object (e.g. for spatial vb)
-//  virtual NoiseModel* Clone() const = 0;
+  // Create a new identical copy of this object (e.g. for another thread)
+    virtual NoiseModel* Clone() const = 0;
     virtual NoiseParams* NewParams() const = 0;
 
   // Load priors from file, and also initialize posteriors
@@ -80,15 +80,11 @@ using namespace Utilities;
 // Covariance terms are at +/-1, so maximum possible offset from
 // the main diagonal is +/-3.   
 
-/*Ar1cNoiseModel* Ar1cNoiseModel::Clone() const
+Ar1cNoiseModel* Ar1cNoiseModel::Clone() const
 {
-  Ar1cNoiseModel* clone = new Ar1cNoiseModel(ar1Type, nPhis);
-  clone->prior = new Ar1cParameters(*prior);
-  clone->posterior = new Ar1cParameters(*posterior);
-  clone->alphaMat = alphaMat;
-
-  return clone;
-}*/
+  // The priors, posteriors and alpha matrix cache all live in Ar1cParams
+  return new Ar1cNoiseModel(ar1Type, nPhis);
+}
 
 // Constructor.  Mostly validates that values are sensible.
 Ar1cNoiseModel::Ar1cNoiseModel(const string& ar1CrossTerms, int numPhis)
@@ -114,7 +110,7 @@ Ar1cNoiseModel::Ar1cNoiseModel(const string& ar1CrossTerms, int numPhis)
 // Just convert a string into a number
 int Ar1cNoiseModel::NumAlphas() const
 {
-    Tracer_Plus("Ar1cNoiseModel::NumAlphas");
+    //    Tracer_Plus("Ar1cNoiseModel::NumAlphas");
     if (ar1Type == "same")
         return 3;
     else if (ar1Type == "dual")
@@ -181,7 +177,7 @@ private:
 
 double OperatorKLJ::operator()(const SymmetricBandMatrix& input) const
 { 
-  Tracer_Plus tr("OperatorKLJ::operator()");
+  //    Tracer_Plus tr("OperatorKLJ::operator()");
   
 //  assert(input.BandWidth().Lower() <= AR1_BANDWIDTH);
 //  return (k.t() * input * k).AsScalar()
@@ -204,7 +200,7 @@ void Ar1cNoiseModel::UpdateAlpha(
   	const LinearFwdModel& linear,
   	const ColumnVector& data) const
 {
-  Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha");
+  //    Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha");
 
   Ar1cParams& posterior = dynamic_cast<Ar1cParams&>(noise);
   const Ar1cParams& prior = dynamic_cast<const Ar1cParams&>(noisePrior);  
@@ -229,7 +225,7 @@ void Ar1cNoiseModel::UpdateAlpha(
 
   const int T = nAlphas; // use same code for nAlphas == 3 or 4
 
-  { Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha - precision calculations");
+  { // Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha - precision calculations");
   
   for (int i = 1; i <= nNoiseModels; i++)
   alphaPrecisions(i,i) += 
@@ -261,7 +257,7 @@ void Ar1cNoiseModel::UpdateAlpha(
       throw overflow_error("Negative variance!");
     }
 
-  } { Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha - mean calculations");
+  } { // Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha - mean calculations");
   ColumnVector tmp(T);
   tmp = prior.alpha.GetPrecisions() * prior.alpha.means;
   for (int i = 1; i <= nNoiseModels; i++)
@@ -286,7 +282,7 @@ void Ar1cNoiseModel::UpdateAlpha(
       // throw overflow_exception("Alpha > 1 detected");
     }
 
-  { Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha - alphaMat updates");
+  { // Tracer_Plus tr("Ar1cNoiseModel::UpdateAlpha - alphaMat updates");
   // Update the alpha marginals (used by phi and theta updates)
   alphaMat.Update(posterior, data.Nrows()/nPhis);
   }
@@ -301,7 +297,7 @@ void Ar1cNoiseModel::UpdatePhi(
     const LinearFwdModel& linear,
     const ColumnVector& data) const
 {
-    Tracer_Plus tr("Ar1cNoiseModel::UpdatePhi");
+    //    Tracer_Plus tr("Ar1cNoiseModel::UpdatePhi");
 
     Ar1cParams& posterior = dynamic_cast<Ar1cParams&>(noise);
     const Ar1cParams& prior = dynamic_cast<const Ar1cParams&>(noisePrior);  
@@ -313,7 +309,7 @@ void Ar1cNoiseModel::UpdatePhi(
 
     for (int i = 1; i <= nPhis; i++)
       {
-        { Tracer_Plus tr("Ar1cNoiseModel::UpdatePhi - main calculations");
+        { // Tracer_Plus tr("Ar1cNoiseModel::UpdatePhi - main calculations");
 	const SymmetricBandMatrix &Qi = alphaMat.GetMarginal(i);
 
 	double tmp = 
@@ -342,7 +338,7 @@ void Ar1cNoiseModel::UpdateTheta(
     float LMalpha
     ) const
 {	
-  Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta");
+  //    Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta");
 
   const Ar1cParams& posterior = dynamic_cast<const Ar1cParams&>(noise);
   const Ar1cMatrixCache& alphaMat = posterior.alphaMat;
@@ -359,7 +355,7 @@ void Ar1cNoiseModel::UpdateTheta(
         si_ci(i) = posterior.phis.at(i-1).b * posterior.phis.at(i-1).c;
     
     SymmetricBandMatrix X;
-    { Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - X calculations");
+    { // Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - X calculations");
     if (nPhis == 2)
         X = si_ci(1) * alphaMat.GetMarginal(1) + si_ci(2) * alphaMat.GetMarginal(2);
     else
@@ -369,7 +365,7 @@ void Ar1cNoiseModel::UpdateTheta(
 //    SymmetricMatrix Ltmp = J.t() * X * J;
     SymmetricMatrix Ltmp;
     { 
-      Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - L calculations");
+      //    Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - L calculations");
     
       Matrix Ltmp_tmp = J.t() * X * J;
       // LOG<<"Max error: "<<(Ltmp_tmp.t() - Ltmp_tmp).MaximumAbsoluteValue() 
@@ -381,7 +377,7 @@ void Ar1cNoiseModel::UpdateTheta(
 
     ColumnVector mTmp;
     { 
-      Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - m calculations");
+      //    Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - m calculations");
       mTmp = J.t() * X * (data - gml + J*ml);
      
       theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
@@ -391,7 +387,7 @@ void Ar1cNoiseModel::UpdateTheta(
 
     if (thetaWithoutPrior != NULL)
       {
-	Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - WithoutPrior calcs");
+	//    Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - WithoutPrior calcs");
 	thetaWithoutPrior->SetSize(theta.GetSize());
 
 	// Quick hack: prevent errors when thetaWithoutPrecisions is inverted
@@ -414,7 +410,7 @@ void Ar1cNoiseModel::UpdateTheta(
       }
 
     {
-      Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - Error checking");
+      //    Tracer_Plus tr("Ar1cNoiseModel::UpdateTheta - Error checking");
       LogAndSign chk = theta.GetPrecisions().LogDeterminant();
       if (chk.Sign() <= 0)
 	LOG 
@@ -439,7 +435,7 @@ double Ar1cNoiseModel::CalcFreeEnergy(
   	const LinearFwdModel& linear,
   	const ColumnVector& data) const
 {
-  Tracer_Plus tr("Ar1cNoiseModel::CalcFreeEnergy");
+  //    Tracer_Plus tr("Ar1cNoiseModel::CalcFreeEnergy");
 
   const Ar1cParams& posterior = dynamic_cast<const Ar1cParams&>(noise);
   const Ar1cParams& prior = dynamic_cast<const Ar1cParams&>(noisePrior);  
@@ -614,7 +610,7 @@ void Ar1cParams::Dump(const string indent) const
 
 void Ar1cMatrixCache::Update(const Ar1cParams& dist, int nTimes)
 {
-  Tracer_Plus tr("Ar1cMatrixCache::Update");
+  //    Tracer_Plus tr("Ar1cMatrixCache::Update");
 
 //  LOG << "In Ar1cMatrixCache::Update..." << endl;
   // Let's see if alphaMatrices have been defined yet
@@ -769,7 +765,7 @@ const SymmetricBandMatrix& Ar1cMatrixCache::GetMarginal(unsigned n) const
 void Ar1cNoiseModel::Precalculate( NoiseParams& noise, const NoiseParams& noisePrior, 
     const ColumnVector& sampleData ) const
 { 
-    Tracer_Plus tr("Ar1cMatrixCache::Precalculate");
+    //    Tracer_Plus tr("Ar1cMatrixCache::Precalculate");
 
     Ar1cParams& posterior = dynamic_cast<Ar1cParams&>(noise);
     const Ar1cParams& prior = dynamic_cast<const Ar1cParams&>(noisePrior);  
@@ -813,7 +809,7 @@ const MVNDist Ar1cParams::OutputAsMVN() const
 
 void Ar1cParams::InputFromMVN( const MVNDist& mvn )
 {
-    Tracer_Plus tr("Ar1cParams::InputFromMVN");
+    //    Tracer_Plus tr("Ar1cParams::InputFromMVN");
     // We must already know nAlpha & nPhi from the constructor!
     const unsigned nAlpha = alpha.means.Nrows();
     assert( nAlpha + phis.size() == (unsigned)mvn.GetSize() );
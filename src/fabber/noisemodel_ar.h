@@ -142,7 +142,7 @@ private:
 class Ar1cNoiseModel : public NoiseModel {
  public:
 
-//  virtual Ar1cNoiseModel* Clone() const;
+    virtual Ar1cNoiseModel* Clone() const;
   // makes a new identical copy of this object
   
     virtual Ar1cParams* NewParams() const
@@ -112,7 +112,7 @@ void WhiteNoiseModel::HardcodedInitialDists(NoiseParams& priorIn,
 
 const MVNDist WhiteParams::OutputAsMVN() const
 {
-  Tracer_Plus tr("WhiteParams::OutputAsMVN");
+  //    Tracer_Plus tr("WhiteParams::OutputAsMVN");
   
   assert((unsigned)nPhis == phis.size());
   MVNDist mvn( phis.size() );
@@ -141,7 +141,7 @@ void WhiteParams::InputFromMVN( const MVNDist& mvn )
 
 void WhiteParams::Dump(const string indent) const
 {
-  Tracer_Plus tr("WhiteParams::Dump");
+  //    Tracer_Plus tr("WhiteParams::Dump");
   assert( (unsigned)nPhis == phis.size() );
   for (unsigned i = 0; i < phis.size(); i++)
     {
@@ -171,7 +171,7 @@ WhiteNoiseModel::WhiteNoiseModel(ArgsType& args)
 
 void WhiteNoiseModel::MakeQis(int dataLen) const
 {
-  Tracer_Plus tr("WhiteNoiseModel::MakeQis");
+  //    Tracer_Plus tr("WhiteNoiseModel::MakeQis");
   if (!Qis.empty() && Qis[0].Nrows() == dataLen) 
     return;  // Qis are already up-to-date
 
@@ -237,7 +237,7 @@ void WhiteNoiseModel::UpdateNoise(
   	const LinearFwdModel& linear,
   	const ColumnVector& data) const
 {
-  Tracer_Plus tr("WhiteNoiseModel::UpdateNoise");
+  //    Tracer_Plus tr("WhiteNoiseModel::UpdateNoise");
   
   WhiteParams& posterior = dynamic_cast<WhiteParams&>(noise);
   const WhiteParams& prior = dynamic_cast<const WhiteParams&>(noisePrior);
@@ -288,7 +288,7 @@ void WhiteNoiseModel::UpdateTheta(
         MVNDist* thetaWithoutPrior,
 	float LMalpha) const
 {
-  Tracer_Plus tr("WhiteNoiseModel::UpdateTheta");
+  //    Tracer_Plus tr("WhiteNoiseModel::UpdateTheta");
 
   //cout << "start:" << theta.means.t() << endl;
 
@@ -356,7 +356,7 @@ void WhiteNoiseModel::UpdateTheta(
 
   if (thetaWithoutPrior != NULL)
     {
-      Tracer_Plus tr("WhiteNoiseModel::UpdateTheta - WithoutPrior calcs");
+      //    Tracer_Plus tr("WhiteNoiseModel::UpdateTheta - WithoutPrior calcs");
       thetaWithoutPrior->SetSize(theta.GetSize());
       
       thetaWithoutPrior->SetPrecisions(Ltmp);
@@ -394,7 +394,7 @@ double WhiteNoiseModel::CalcFreeEnergy(
   	const LinearFwdModel& linear,
   	const ColumnVector& data) const
 {
-    Tracer_Plus tr("WhiteNoiseModel::CalcFreeEnergy");
+    //    Tracer_Plus tr("WhiteNoiseModel::CalcFreeEnergy");
     const int nPhis = Qis.size();
     const WhiteParams& noise = dynamic_cast<const WhiteParams&>(noiseIn);
     const WhiteParams& noisePrior = dynamic_cast<const WhiteParams&>(noisePriorIn);
@@ -490,7 +490,7 @@ double WhiteNoiseModel::CalcFreeEnergy(
 
 /*
 void WhiteNoiseModel::SaveParams(const MVNDist& theta) {
-  Tracer_Plus tr("WhiteNoiseModel::SaveParams");
+  //    Tracer_Plus tr("WhiteNoiseModel::SaveParams");
   // save the current values of parameters 
   int nPhis = phis.size();
   assert(nPhis > 0);
@@ -504,7 +504,7 @@ void WhiteNoiseModel::SaveParams(const MVNDist& theta) {
 }
 
 void WhiteNoiseModel::RevertParams(MVNDist& theta) {
-  Tracer_Plus tr("WhiteNoiseModel::RevertParams");
+  //    Tracer_Plus tr("WhiteNoiseModel::RevertParams");
   int nPhis = phis.size();
   for (int i = 1; i <= nPhis; i++)
       {
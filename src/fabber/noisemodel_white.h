@@ -98,6 +98,9 @@ class WhiteNoiseModel : public NoiseModel {
     virtual WhiteParams* NewParams() const
         { return new WhiteParams( Qis.size() ); }
 
+    virtual WhiteNoiseModel* Clone() const
+        { return new WhiteNoiseModel(*this); }
+
     virtual void HardcodedInitialDists(NoiseParams& prior, 
         NoiseParams& posterior) const; 
 
@@ -0,0 +1,220 @@
+/*  bias_smooth.cc
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2014 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "bias_smooth.h"
+#include <cmath>
+#include <algorithm>
+
+using namespace NEWIMAGE;
+using namespace std;
+
+void BiasSmoother::Axis::setup(int npts, float sigma)
+{
+  n=npts;
+  factor=max(1,(int)(sigma/3.0));
+  factor=min(factor,n);
+  nc=(n+factor-1)/factor;
+  // Block averaging and linear interpolation each add about (f^2-1)/12
+  // and (f^2-1)/6 voxels^2 of variance, so the coarse kernel makes up the
+  // remainder.  Undecimated axes keep the full resolution kernel exactly.
+  int radius;
+  float sig=sigma;
+  if(factor>1) {
+    sig=sqrt(max(sigma*sigma-0.25*(factor*factor-1),0.0))/factor;
+    radius=(int)ceil(2.0*sig);
+  }
+  else
+    radius=2*(int)sigma;
+  ColumnVector kern=gaussian_kernel1D(sig, radius);
+  kernel.resize(kern.Nrows());
+  for(int i=0;i<kern.Nrows();i++)
+    kernel[i]=kern(i+1);
+  // coarse sample c sits at the centre of full-grid block [c*f,(c+1)*f-1]
+  lo.resize(n);
+  w.resize(n);
+  for(int i=0;i<n;i++) {
+    float u=(i-0.5*(factor-1))/factor;
+    u=max(0.0f,min(u,(float)(nc-1)));
+    lo[i]=min((int)u,max(nc-2,0));
+    w[i]=u-lo[i];
+  }
+}
+
+void BiasSmoother::setup(int nx, int ny, int nz, float sigmax, float sigmay, float sigmaz)
+{
+  m_ax[0].setup(nx,sigmax);
+  m_ax[1].setup(ny,sigmay);
+  m_ax[2].setup(nz,sigmaz);
+}
+
+volume<float> BiasSmoother::smooth(const volume<float>& vin) const
+{
+  const Axis &ax=m_ax[0], &ay=m_ax[1], &az=m_ax[2];
+  if(vin.xsize()!=ax.n || vin.ysize()!=ay.n || vin.zsize()!=az.n)
+    imthrow("BiasSmoother::smooth: volume does not match set up dimensions",3);
+  const int nx=ax.n, ny=ay.n, nz=az.n;
+  const int cx=ax.nc, cy=ay.nc, cz=az.nc;
+  const long cslice=(long)cx*cy;
+  vector<float> coarse(cslice*cz,0.0f), work(cslice*cz,0.0f);
+
+  // block means onto the coarse grid (partial blocks at the edges are
+  // averaged over the voxels they contain)
+  const float* in=vin.fbegin();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int k=0;k<cz;k++) {
+    float* dst=&coarse[k*cslice];
+    int z1=min((k+1)*az.factor,nz);
+    for(int z=k*az.factor;z<z1;z++)
+      for(int y=0;y<ny;y++) {
+	const float* src=in+((long)z*ny+y)*nx;
+	float* row=dst+(long)(y/ay.factor)*cx;
+	for(int x=0;x<nx;x++)
+	  row[x/ax.factor]+=src[x];
+      }
+    int nbz=z1-k*az.factor;
+    for(int j=0;j<cy;j++) {
+      int nby=min((j+1)*ay.factor,ny)-j*ay.factor;
+      for(int i=0;i<cx;i++) {
+	int nbx=min((i+1)*ax.factor,nx)-i*ax.factor;
+	dst[(long)j*cx+i]/=(float)(nbx*nby*nbz);
+      }
+    }
+  }
+
+  // separable zero-padded smoothing on the coarse grid: x, y, then z
+  const int rx=ax.kernel.size()/2, ry=ay.kernel.size()/2, rz=az.kernel.size()/2;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int k=0;k<cz;k++)
+    for(int j=0;j<cy;j++) {
+      const float* src=&coarse[k*cslice+(long)j*cx];
+      float* dst=&work[k*cslice+(long)j*cx];
+      for(int i=0;i<cx;i++) {
+	double val=0.0;
+	for(int m=max(-rx,-i);m<=min(rx,cx-1-i);m++)
+	  val+=ax.kernel[m+rx]*src[i+m];
+	dst[i]=val;
+      }
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int k=0;k<cz;k++)
+    for(int j=0;j<cy;j++) {
+      float* dst=&coarse[k*cslice+(long)j*cx];
+      for(int i=0;i<cx;i++) dst[i]=0.0f;
+      for(int m=max(-ry,-j);m<=min(ry,cy-1-j);m++) {
+	const float* src=&work[k*cslice+(long)(j+m)*cx];
+	float kv=ay.kernel[m+ry];
+	for(int i=0;i<cx;i++) dst[i]+=kv*src[i];
+      }
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int k=0;k<cz;k++) {
+    float* dst=&work[k*cslice];
+    for(long p=0;p<cslice;p++) dst[p]=0.0f;
+    for(int m=max(-rz,-k);m<=min(rz,cz-1-k);m++) {
+      const float* src=&coarse[(k+m)*cslice];
+      float kv=az.kernel[m+rz];
+      for(long p=0;p<cslice;p++) dst[p]+=kv*src[p];
+    }
+  }
+
+  // trilinear interpolation back onto the full grid
+  volume<float> vout(vin);
+  float* out=vout.nsfbegin();
+  const int hx=(cx>1?1:0), hy=(cy>1?1:0), hz=(cz>1?1:0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int z=0;z<nz;z++) {
+    const float* c0=&work[az.lo[z]*cslice];
+    const float* c1=c0+hz*cslice;
+    float wz=az.w[z];
+    for(int y=0;y<ny;y++) {
+      long o0=(long)ay.lo[y]*cx, o1=o0+hy*cx;
+      float wy=ay.w[y];
+      float* dst=out+((long)z*ny+y)*nx;
+      for(int x=0;x<nx;x++) {
+	int i0=ax.lo[x], i1=i0+hx;
+	float wx=ax.w[x];
+	float v00=(1-wx)*c0[o0+i0]+wx*c0[o0+i1];
+	float v01=(1-wx)*c0[o1+i0]+wx*c0[o1+i1];
+	float v10=(1-wx)*c1[o0+i0]+wx*c1[o0+i1];
+	float v11=(1-wx)*c1[o1+i0]+wx*c1[o1+i1];
+	dst[x]=(1-wz)*((1-wy)*v00+wy*v01)+wz*((1-wy)*v10+wy*v11);
+      }
+    }
+  }
+  return vout;
+}
@@ -0,0 +1,106 @@
+/*  bias_smooth.h
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2014 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#if !defined(bias_smooth_h)
+#define bias_smooth_h
+
+#include <vector>
+#include "newimage/newimageall.h"
+
+// Gaussian smoothing of the bias field numerator/denominator volumes.
+//
+// The bias field kernels are many voxels wide, so the field is smoothed on
+// a grid decimated by roughly a third of the kernel width in each
+// direction: blocks are averaged onto the coarse grid, smoothed there with
+// a kernel reduced to account for the block averaging and the final
+// interpolation, and trilinearly interpolated back onto the full grid.
+// When the kernel is narrow (sigma < 3 voxels) a direction is not decimated
+// and the result is the same zero-padded separable convolution as
+// convolve_separable().  All geometry, kernels and interpolation weights are
+// set up once and reused on every call.
+
+class BiasSmoother
+{
+ public:
+  BiasSmoother() {}
+  // sigmas are in voxels of a nx*ny*nz volume
+  void setup(int nx, int ny, int nz, float sigmax, float sigmay, float sigmaz);
+  NEWIMAGE::volume<float> smooth(const NEWIMAGE::volume<float>& vin) const;
+
+ private:
+  struct Axis {
+    int n, nc, factor;            // full size, decimated size, decimation
+    std::vector<float> kernel;    // smoothing kernel on the decimated grid
+    std::vector<int> lo;          // per full-grid index: lower coarse index
+    std::vector<float> w;         //   and weight of the upper neighbour
+    void setup(int npts, float sigma);
+  };
+  Axis m_ax[3];
+};
+
+#endif
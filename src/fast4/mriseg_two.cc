@@ -226,6 +226,9 @@ void ZMRISegmentation::BiasRemoval()
 
   if(biasfieldremoval) {
     volume<float> p_meaninvcov(m_BiasField),p_resmean(m_BiasField);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
     for(int z=0;z<m_nDepth;z++)
       for(int y=0;y<m_nHeight;y++)
 	for(int x=0;x<m_nWidth;x++)
@@ -248,6 +251,9 @@ void ZMRISegmentation::BiasRemoval()
 
 void ZMRISegmentation::Classification()
 {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
   for(int z=0;z<m_nDepth;z++)
     for(int y=0;y<m_nHeight;y++)
       for(int x=0;x<m_nWidth;x++)
@@ -270,7 +276,7 @@ void ZMRISegmentation::Classification(int x, int y, int z)
 
 NEWIMAGE::volume<float> ZMRISegmentation::Convolve(NEWIMAGE::volume<float>& resfieldimage)
 {
-  return convolve_separable(resfieldimage, kernelx, kernely, kernelz);
+  return m_smoother.smooth(resfieldimage);
 }
 
 
@@ -309,9 +315,12 @@ void ZMRISegmentation::pveClassification(int x, int y, int z)
 
 void ZMRISegmentation::pveClassification()
 {
-  for(int x=0;x<m_nWidth;x++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int z=0;z<m_nDepth;z++)
     for(int y=0;y<m_nHeight;y++)
-      for(int z=0;z<m_nDepth;z++)
+      for(int x=0;x<m_nWidth;x++)
 	pveClassification(x, y, z);
 }
 
@@ -328,6 +337,9 @@ float ZMRISegmentation::logGaussian(float y, float mu, float sigmasq)
 float ZMRISegmentation::MRFWeightsTotal()
 {
 double total=0.0f; //Internally a double to avoid truncation when adding small to large (shouldn't happen anyway with this loop style)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:total)
+#endif
   for(int z=0;z<m_nDepth;z++)
     for(int y=0;y<m_nHeight;y++)
       for(int x=0;x<m_nWidth;x++)
@@ -431,6 +443,9 @@ void ZMRISegmentation::TanakaPriorHyper()
 	  m_post=m_prob;
 	  if(verboseusage)
 	    cout << "Tanaka-inner-loop-iteration=" << iteration << " MRFWeightsTotal=" << MRFWeightsTotal() << " beta=" << betahtemp << endl;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	  for(int z=0;z<m_nDepth;z++)
 	    {
 	      for(int y=0;y<m_nHeight;y++)
@@ -482,25 +497,18 @@ void ZMRISegmentation::TanakaIterations()
 	}
   
   for(int iteration=0;iteration<5;iteration++) {
-    for(int z=0;z<m_nDepth;z++) 
-      for(int y=0;y<m_nHeight;y++)
-	for(int x=0;x<m_nWidth;x++)
-	  if(m_mask.value(x, y, z)==1) {
-	    double sum=0.0f;       //Very important for sum to be a double for JV's loop ( if sum is a double there as well ) and mine to match results - numerically sensitive
-	    for(int c=1;c<=nClasses;c++) {
-	      m_post.value(x, y, z, c)=exp(beta*MRFWeightsInner(x,y,z,c)-logGaussian(m_Mri.value(x, y, z), m_mean[c], m_variance[c]));
-              if(bapusedflag>=2) 
-		m_post.value(x, y, z, c)*=talpriors(x, y, z, c);
-	      sum+=m_post.value(x, y, z, c);
-	    }
-	    for(int c=1;c<=nClasses;c++)
-	    {
-	      if(sum>0.0f)
-		m_post.value(x, y, z, c)/=sum;
-	      else
-		m_post.value(x, y, z, c)=0.0f;
-	    }
-	  }
+    // The MRF couples each voxel to its 3x3x3 neighbourhood, so voxels with
+    // the same x, y and z parity never neighbour each other: each of these
+    // eight colours is updated in parallel, one colour after the other.
+    for(int colour=0;colour<8;colour++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+      for(int z=colour&1;z<m_nDepth;z+=2) 
+	for(int y=(colour>>1)&1;y<m_nHeight;y+=2)
+	  for(int x=(colour>>2)&1;x<m_nWidth;x+=2)
+	    if(m_mask.value(x, y, z)==1)
+	      TanakaUpdate(x, y, z);
 
       if(verboseusage)
 	cout << "Tanaka-inner-loop-iteration=" << iteration << " MRFWeightsTotal=" << MRFWeightsTotal() << " beta=" << beta << endl;
@@ -514,6 +522,25 @@ void ZMRISegmentation::TanakaIterations()
 }
 
 
+void ZMRISegmentation::TanakaUpdate(int x, int y, int z)
+{
+  double sum=0.0f;       //Very important for sum to be a double for JV's loop ( if sum is a double there as well ) and mine to match results - numerically sensitive
+  for(int c=1;c<=nClasses;c++) {
+    m_post.value(x, y, z, c)=exp(beta*MRFWeightsInner(x,y,z,c)-logGaussian(m_Mri.value(x, y, z), m_mean[c], m_variance[c]));
+    if(bapusedflag>=2) 
+      m_post.value(x, y, z, c)*=talpriors(x, y, z, c);
+    sum+=m_post.value(x, y, z, c);
+  }
+  for(int c=1;c<=nClasses;c++)
+  {
+    if(sum>0.0f)
+      m_post.value(x, y, z, c)/=sum;
+    else
+      m_post.value(x, y, z, c)=0.0f;
+  }
+}
+
+
  float ZMRISegmentation::PVEnergy(int x, int y, int z, float mu, float sigmasq)
 {
   float temp=m_Mri(x, y, z)-mu;
@@ -531,6 +558,9 @@ void ZMRISegmentation::PVClassificationStep()
     mixnum=2*nClasses-1;
   PVprob.reinitialize(m_nWidth, m_nHeight, m_nDepth, mixnum);
   PVprob=0.0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
   for(int z=0;z<m_nDepth;z++)
     for(int y=0;y<m_nHeight;y++)
       for(int x=0;x<m_nWidth;x++)
@@ -590,7 +620,9 @@ void ZMRISegmentation::ICMPV()
     mixnum=3;
   if(nClasses>3)
     mixnum=2*nClasses-1;
-  float* clique=new float[mixnum];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
   for(int z=0;z<m_nDepth;z++)
     for(int y=0;y<m_nHeight;y++)
       for(int x=0;x<m_nWidth;x++)
@@ -603,84 +635,98 @@ void ZMRISegmentation::ICMPV()
 	    }
 	}
 
+  // ICM sweep in the same eight parity colours as TanakaIterations()
   for(int iter=0;iter<1;iter++)
-    for(int z=0;z<m_nDepth;z++)
-      for(int y=0;y<m_nHeight;y++)
-	for(int x=0;x<m_nWidth;x++)
-	  if(m_mask.value(x, y, z)==1)
-	  {
-	    for(int type=0;type<mixnum;type++)
-	      clique[type]=0.0f;
-	    for(int n=-1;n<=1;n++)
-	      for(int m=-1;m<=1;m++)
-		for(int l=-1;l<=1;l++)	
-		  if(m_mask(x+l, y+m, z+n)==1)
-		  {
-		    float am=MRFWeightsAM(l, m, n);
-		    if(nClasses==3)
-		      for(int type=0;type<6;type++)
-		      {	
-			if(type==hardPV(x+l, y+m, z+n))
-			  clique[type]+=am*2;
-			else if((type==0)&&((hardPV(x+l, y+m, z+n)==3)||(hardPV(x+l, y+m, z+n)==4)))
-			  clique[type]+=am;
-			else if((type==1)&&((hardPV(x+l, y+m, z+n)==3)||(hardPV(x+l, y+m, z+n)==5)))
-			  clique[type]+=am;
-			else if((type==2)&&((hardPV(x+l, y+m, z+n)==4)||(hardPV(x+l, y+m, z+n)==5)))
-			  clique[type]+=am;
-			else if((type==3)&&((hardPV(x+l, y+m, z+n)==0)||(hardPV(x+l, y+m, z+n)==1)))
-			  clique[type]+=am;
-			else if((type==4)&&((hardPV(x+l, y+m, z+n)==0)||(hardPV(x+l, y+m, z+n)==2)))
-			  clique[type]+=am;
-			else if((type==5)&&((hardPV(x+l, y+m, z+n)==1)||(hardPV(x+l, y+m, z+n)==2)))
-			  clique[type]+=am;
-			else
-			  clique[type]-=am;
-			}
-		    if(nClasses>3)
-		      for(int type=0;type<mixnum;type++)
-		      {	
-			if(type==hardPV(x+l, y+m, z+n))
-			  clique[type]+=am*2;
-			else if((0<type)&&(type<nClasses-1)&&((hardPV(x+l, y+m, z+n)==(nClasses+type-1))||(hardPV(x+l, y+m, z+n)==(nClasses+type))))
-			  clique[type]+=am;
-			else if((type==0)&&((hardPV(x+l, y+m, z+n)==nClasses)))
-			  clique[type]+=am;
-			else if((type==(nClasses-1))&&((hardPV(x+l, y+m, z+n)==mixnum-1)))
-			  clique[type]+=am;
-			else if((type>(nClasses-1))&&((hardPV(x+l, y+m, z+n)==(type-nClasses))||(hardPV(x+l, y+m, z+n)==(type-nClasses+1))))
-			  clique[type]+=am;
-		        else 
-			  clique[type]-=am;
-		      }
-		    if(nClasses==2)
-		      for(int type=0;type<3;type++)
-		      {
-			if(type==hardPV(x+l, y+m, z+n))
-      			  clique[type]+=am*2;
-			else if((type==0)&&((hardPV(x+l, y+m, z+n)==2)))
-			  clique[type]+=am;
-			else if((type==1)&&((hardPV(x+l, y+m, z+n)==2)))
-			  clique[type]+=am;
-			else if((type==2)&&((hardPV(x+l, y+m, z+n)==0)||(hardPV(x+l, y+m, z+n)==1)))
-			  clique[type]+=am;
-			else 
-			  clique[type]-=am;
-		      }
-		  }
-	  
-	    float max=-1;
+    for(int colour=0;colour<8;colour++)
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+      vector<float> clique(mixnum);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(int z=colour&1;z<m_nDepth;z+=2)
+	for(int y=(colour>>1)&1;y<m_nHeight;y+=2)
+	  for(int x=(colour>>2)&1;x<m_nWidth;x+=2)
+	    if(m_mask.value(x, y, z)==1)
+	      ICMPVUpdate(x, y, z, mixnum, &clique[0]);
+    }
+}
+
+
+void ZMRISegmentation::ICMPVUpdate(int x, int y, int z, int mixnum, float* clique)
+{
+  for(int type=0;type<mixnum;type++)
+    clique[type]=0.0f;
+  for(int n=-1;n<=1;n++)
+    for(int m=-1;m<=1;m++)
+      for(int l=-1;l<=1;l++)	
+	if(m_mask(x+l, y+m, z+n)==1)
+	{
+	  float am=MRFWeightsAM(l, m, n);
+	  if(nClasses==3)
+	    for(int type=0;type<6;type++)
+	    {	
+	      if(type==hardPV(x+l, y+m, z+n))
+		clique[type]+=am*2;
+	      else if((type==0)&&((hardPV(x+l, y+m, z+n)==3)||(hardPV(x+l, y+m, z+n)==4)))
+		clique[type]+=am;
+	      else if((type==1)&&((hardPV(x+l, y+m, z+n)==3)||(hardPV(x+l, y+m, z+n)==5)))
+		clique[type]+=am;
+	      else if((type==2)&&((hardPV(x+l, y+m, z+n)==4)||(hardPV(x+l, y+m, z+n)==5)))
+		clique[type]+=am;
+	      else if((type==3)&&((hardPV(x+l, y+m, z+n)==0)||(hardPV(x+l, y+m, z+n)==1)))
+		clique[type]+=am;
+	      else if((type==4)&&((hardPV(x+l, y+m, z+n)==0)||(hardPV(x+l, y+m, z+n)==2)))
+		clique[type]+=am;
+	      else if((type==5)&&((hardPV(x+l, y+m, z+n)==1)||(hardPV(x+l, y+m, z+n)==2)))
+		clique[type]+=am;
+	      else
+		clique[type]-=am;
+	      }
+	  if(nClasses>3)
 	    for(int type=0;type<mixnum;type++)
+	    {	
+	      if(type==hardPV(x+l, y+m, z+n))
+		clique[type]+=am*2;
+	      else if((0<type)&&(type<nClasses-1)&&((hardPV(x+l, y+m, z+n)==(nClasses+type-1))||(hardPV(x+l, y+m, z+n)==(nClasses+type))))
+		clique[type]+=am;
+	      else if((type==0)&&((hardPV(x+l, y+m, z+n)==nClasses)))
+		clique[type]+=am;
+	      else if((type==(nClasses-1))&&((hardPV(x+l, y+m, z+n)==mixnum-1)))
+		clique[type]+=am;
+	      else if((type>(nClasses-1))&&((hardPV(x+l, y+m, z+n)==(type-nClasses))||(hardPV(x+l, y+m, z+n)==(type-nClasses+1))))
+		clique[type]+=am;
+	      else 
+		clique[type]-=am;
+	    }
+	  if(nClasses==2)
+	    for(int type=0;type<3;type++)
 	    {
-	      float prob=PVprob(x, y, z, type)*exp(pveBmixeltype*clique[type]);
-	      if(max<prob)
-		{
-		  hardPV(x, y, z)=type;
-		  max=prob;
-		}
-	    }  
-	  }
-  delete[] clique;
+	      if(type==hardPV(x+l, y+m, z+n))
+		clique[type]+=am*2;
+	      else if((type==0)&&((hardPV(x+l, y+m, z+n)==2)))
+		clique[type]+=am;
+	      else if((type==1)&&((hardPV(x+l, y+m, z+n)==2)))
+		clique[type]+=am;
+	      else if((type==2)&&((hardPV(x+l, y+m, z+n)==0)||(hardPV(x+l, y+m, z+n)==1)))
+		clique[type]+=am;
+	      else 
+		clique[type]-=am;
+	    }
+	}
+
+  float max=-1;
+  for(int type=0;type<mixnum;type++)
+  {
+    float prob=PVprob(x, y, z, type)*exp(pveBmixeltype*clique[type]);
+    if(max<prob)
+      {
+	hardPV(x, y, z)=type;
+	max=prob;
+      }
+  }
 }
 
 
@@ -692,6 +738,9 @@ void ZMRISegmentation::PVestimation()
   float mu=0.0f;
   float sigsq=0.0f;
   double step=(double)(1.0f/(double)(iterationspve));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(mu,sigsq)
+#endif
   for(int z=0;z<m_nDepth;z++)
     {
       for(int y=0;y<m_nHeight;y++)
@@ -922,31 +971,59 @@ void ZMRISegmentation::printVolumeTotals()
 
 void ZMRISegmentation::InitKernel(float kernalsize)
 {
-  float sigma=0.51*m_nbLowpass/m_nxdim;
-  int radius=2*(int)sigma;
-  kernelx=gaussian_kernel1D(sigma, radius);
-  sigma=0.51*m_nbLowpass/m_nydim;
-  radius=2*(int)sigma;
-  kernely=gaussian_kernel1D(sigma, radius);
-  sigma=0.51*m_nbLowpass/m_nzdim;
-  radius=2*(int)sigma;
-  kernelz=gaussian_kernel1D(sigma, radius);
+  m_smoother.setup(m_nWidth, m_nHeight, m_nDepth, 0.51*m_nbLowpass/m_nxdim, 0.51*m_nbLowpass/m_nydim, 0.51*m_nbLowpass/m_nzdim);
 }
 
 void ZMRISegmentation::MeansVariances(int numberofclasses, NEWIMAGE::volume4D<float>& probability )
 {
-  volume4D<float> meanP=m_Mri*probability;
-  volume4D<float> varianceP=m_Mri*meanP;
+  // weighted sums of 1, y and y^2 over the mask in a single pass, with
+  // per-thread partial sums instead of whole product volumes
+  vector<double> sumP(numberofclasses+1,0.0), sumPy(numberofclasses+1,0.0), sumPyy(numberofclasses+1,0.0);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+  {
+    vector<double> tP(numberofclasses+1,0.0), tPy(numberofclasses+1,0.0), tPyy(numberofclasses+1,0.0);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int z=0;z<m_nDepth;z++)
+      for(int y=0;y<m_nHeight;y++)
+	for(int x=0;x<m_nWidth;x++)
+	  if(m_mask.value(x, y, z)>0.5)
+	  {
+	    double yval=m_Mri.value(x, y, z);
+	    for(int c=1;c<=numberofclasses;c++)
+	    {
+	      double p=probability.value(x, y, z, c);
+	      tP[c]+=p;
+	      tPy[c]+=p*yval;
+	      tPyy[c]+=p*yval*yval;
+	    }
+	  }
+#ifdef _OPENMP
+#pragma omp critical(fast_meansvariances)
+#endif
+    for(int c=1;c<=numberofclasses;c++)
+    {
+      sumP[c]+=tP[c];
+      sumPy[c]+=tPy[c];
+      sumPyy[c]+=tPyy[c];
+    }
+  }
   for(int c=1;c<=numberofclasses;c++)
   {
-    m_mean[c] = meanP[c].sum(m_mask)/probability[c].sum(m_mask);
-    m_variance[c] = varianceP[c].sum(m_mask)/probability[c].sum(m_mask)-m_mean[c]*m_mean[c];
+    m_mean[c] = sumPy[c]/sumP[c];
+    m_variance[c] = sumPyy[c]/sumP[c]-m_mean[c]*m_mean[c];
   }
 }
 
 void ZMRISegmentation::Initclass()
 {
   m_prob=0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
   for(int z=0;z<m_nDepth;z++)
     for(int y=0;y<m_nHeight;y++)
       for(int x=0;x<m_nWidth;x++)
@@ -966,9 +1043,12 @@ void ZMRISegmentation::Initclass()
 
 void ZMRISegmentation::UpdateMembers(NEWIMAGE::volume4D<float>& probability)
 {
-  for(int x=0;x<m_nWidth;x++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int z=0;z<m_nDepth;z++)
     for(int y=0;y<m_nHeight;y++)
-      for(int z=0;z<m_nDepth;z++)
+      for(int x=0;x<m_nWidth;x++)
 	if(m_mask(x, y, z)==1) {
 	  float sum=0.0f;
 	  for(int c=0;c<nClasses;c++)
@@ -70,6 +70,7 @@
 #include "newimage/newimageall.h"
 #include "miscmaths/miscmaths.h"
 #include "utils/options.h"
+#include "bias_smooth.h"
 #include <vector>
 
 class ZMRISegmentation
@@ -105,6 +106,7 @@ private:
   float PVEnergy(int x, int y, int z, float mu, float sigma);
   void qsort();
   void TanakaIterations();
+  void TanakaUpdate(int x, int y, int z);
   void TanakaHyper();
   void TanakaPriorHyper();
   void Initialise();
@@ -122,6 +124,7 @@ private:
   void printVolumeTotals();
   void PVClassificationStep();
   void ICMPV();
+  void ICMPVUpdate(int x, int y, int z, int mixnum, float* clique);
   void PVEnergyInit();
   void PVestimation();
   void MeansVariances(int numberofclasses, NEWIMAGE::volume4D<float>& probability);
@@ -133,7 +136,7 @@ private:
   NEWIMAGE::volume <float>  m_Mricopy;
   NEWIMAGE::volume<float> m_Mri;
   NEWIMAGE::volume<float> m_mask;
-  ColumnVector kernelx, kernely, kernelz;
+  BiasSmoother m_smoother;
   vector<double> volumequant;
   vector<float> m_mean;
   vector<float> m_variance;
@@ -290,6 +290,9 @@ void ZMRIMULTISegmentation::Classification(int x, int y, int z)
 
 void ZMRIMULTISegmentation::Classification()
 {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
   for(int z=0;z<m_nDepth;z++)
       for(int y=0;y<m_nHeight;y++)
 	  for(int x=0;x<m_nWidth;x++)
@@ -316,9 +319,12 @@ void ZMRIMULTISegmentation::pveClassification(int x, int y, int z)
 
 void ZMRIMULTISegmentation::pveClassification()
 {
-   for(int x=0;x<m_nWidth;x++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+   for(int z=0;z<m_nDepth;z++)
      for(int y=0;y<m_nHeight;y++)
-       for(int z=0;z<m_nDepth;z++)
+       for(int x=0;x<m_nWidth;x++)
 	 pveClassification(x, y, z);
 }
 
@@ -337,9 +343,34 @@ float ZMRIMULTISegmentation::logGaussian(int classnumber, int x, int y, int z)
   else return 0.0;
 }
 
+// As above, but with the class normalising term log(sqrt(|2pi Sigma|))
+// supplied by the caller and a caller-owned buffer of numberofchannels
+// doubles, so no matrices are allocated or factorised per voxel
+float ZMRIMULTISegmentation::logGaussian(int classnumber, int x, int y, int z, double lognorm, double* submean)
+{
+  if((m_mask.value(x, y, z)>0)&&(classnumber<noclasses+1))
+    {
+      for(int i=1;i<=numberofchannels;i++)submean[i-1]=m_Mri[i].value(x, y, z)-m_mean(classnumber, i);
+      const Matrix& invcov=m_inv_co_variance[classnumber];
+      double sum=0.0;
+      for(int i=1;i<=numberofchannels;i++)
+	{
+	  double row=0.0;
+	  for(int j=1;j<=numberofchannels;j++)
+	    row+=invcov(i, j)*submean[j-1];
+	  sum+=submean[i-1]*row;
+	}
+      return (float)(0.5*sum+lognorm);
+    }
+  else return 0.0;
+}
+
 float ZMRIMULTISegmentation::MRFWeightsTotal()
 {
   double total=0.0f; //Internally a double to avoid truncation when adding small to large (shouldn't happen anyway with this loop style)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:total)
+#endif
   for(int z=0;z<m_nDepth;z++)
       for(int y=0;y<m_nHeight;y++)
 	  for(int x=0;x<m_nWidth;x++)
@@ -429,6 +460,9 @@ void ZMRIMULTISegmentation::TanakaPriorHyper()
       for(int iteration=0;iteration<5;iteration++)
 	{
 	  m_post=m_prob;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	  for(int z=0;z<m_nDepth;z++)
 	    {
 	      for(int y=0;y<m_nHeight;y++)
@@ -466,35 +500,27 @@ void ZMRIMULTISegmentation::TanakaPriorHyper()
 
 void ZMRIMULTISegmentation::TanakaIterations()
 {
+  vector<double> lognorm(noclasses+1, 0.0);
+  for(int c=1;c<noclasses+1;c++)
+    lognorm[c]=log(sqrt(abs(m_co_variance[c].Determinant()*M_2PI(numberofchannels))));
   for(int iteration=0;iteration<5;iteration++)
     {
-      for(int z=0;z<m_nDepth;z++)
+      // Voxels sharing x, y and z parity are never 26-neighbours, so each
+      // of the eight colours can be updated in parallel in turn
+      for(int colour=0;colour<8;colour++)
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
 	{
-	  for(int y=0;y<m_nHeight;y++)
-	    {
-	      for(int x=0;x<m_nWidth;x++)
-		{
-		  float sum=0.0f;
-		  if(m_mask.value(x, y, z)==1)
-		    {
-		      for(int c=1;c<noclasses+1;c++)
-			{
-			  float post=MRFWeightsInner(x,y,z,c);
-			  if(bapusedflag<2)
-			    sum+=m_post.value(x, y, z, c)=exp(beta*post-logGaussian(c, x, y, z));
-			  else
-			    sum+=m_post.value(x, y, z, c)=talpriors(x, y, z, c)*exp(beta*post-logGaussian(c, x, y, z));
-		      	}
-		      for(int c=1;c<noclasses+1;c++)
-			{
-			  if(sum>0.0f)
-			    m_post.value(x, y, z, c)/=sum;
-			  else
-			    m_post.value(x, y, z, c)=0.0f;
-			}
-		    }
-		}
-	    }
+	  vector<double> submean(numberofchannels);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+	  for(int z=colour&1;z<m_nDepth;z+=2)
+	    for(int y=(colour>>1)&1;y<m_nHeight;y+=2)
+	      for(int x=(colour>>2)&1;x<m_nWidth;x+=2)
+		if(m_mask.value(x, y, z)==1)
+		  TanakaUpdate(x, y, z, lognorm, &submean[0]);
 	}
     }
   if(verboseusage)
@@ -509,6 +535,26 @@ void ZMRIMULTISegmentation::TanakaIterations()
     }
 }
 
+void ZMRIMULTISegmentation::TanakaUpdate(int x, int y, int z, const vector<double>& lognorm, double* submean)
+{
+  float sum=0.0f;
+  for(int c=1;c<noclasses+1;c++)
+    {
+      float post=MRFWeightsInner(x,y,z,c);
+      if(bapusedflag<2)
+	sum+=m_post.value(x, y, z, c)=exp(beta*post-logGaussian(c, x, y, z, lognorm[c], submean));
+      else
+	sum+=m_post.value(x, y, z, c)=talpriors.value(x, y, z, c)*exp(beta*post-logGaussian(c, x, y, z, lognorm[c], submean));
+    }
+  for(int c=1;c<noclasses+1;c++)
+    {
+      if(sum>0.0f)
+	m_post.value(x, y, z, c)/=sum;
+      else
+	m_post.value(x, y, z, c)=0.0f;
+    }
+}
+
 float ZMRIMULTISegmentation::PVEnergy(int x, int y, int z, Matrix  mu, Matrix sigma, float detsigma)
 {
   if(m_mask(x, y, z)==1)
@@ -1295,65 +1341,60 @@ void ZMRIMULTISegmentation::Volumesquant(const NEWIMAGE::volume4D<float>& probs)
 
 void ZMRIMULTISegmentation::InitKernel()
 {
-  float sigma=(sqrt(m_nbLowpass/m_nxdim));
-  int radius=2*(int)sigma;
-  kernelx=gaussian_kernel1D(sigma, radius);
-  sigma=(sqrt(m_nbLowpass/m_nydim));
-  radius=2*(int)sigma;
-  kernely=gaussian_kernel1D(sigma, radius);
-  sigma=(sqrt(m_nbLowpass/m_nzdim));
-  radius=2*(int)sigma;
-  kernelz=gaussian_kernel1D(sigma, radius);
+  m_smoother.setup(m_nWidth, m_nHeight, m_nDepth, sqrt(m_nbLowpass/m_nxdim), sqrt(m_nbLowpass/m_nydim), sqrt(m_nbLowpass/m_nzdim));
 }
 
 NEWIMAGE::volume<float> ZMRIMULTISegmentation::Convolve(NEWIMAGE::volume<float>& resfieldimage)
 {
-  return convolve_separable(resfieldimage, kernelx, kernely, kernelz);
+  return m_smoother.smooth(resfieldimage);
 }
 
 void ZMRIMULTISegmentation::MeansVariances(int numberofclasses)
 {
-  float* normtemp=new float[noclasses+1];
-  for(int c=1;c<noclasses+1;c++)
-    normtemp[c]=0.0f;
-  for(int c=1;c<noclasses+1;c++)
-    {
-      m_co_variance[c]=0.0f;
-      for(int i=1;i<=numberofchannels;i++)
-	{
-	  m_mean(c, i)=0.0f;
-	}
-    }
-  for(int z=0;z<m_nDepth;z++)
-    {
+  int nclass=noclasses+1;
+  vector<double> normtemp(nclass, 0.0);
+  vector<double> meantemp(nclass*numberofchannels, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+  {
+    vector<double> norm(nclass, 0.0);
+    vector<double> mean(nclass*numberofchannels, 0.0);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int z=0;z<m_nDepth;z++)
       for(int y=0;y<m_nHeight;y++)
-	{
-	  for(int x=0;x<m_nWidth;x++)
-	    {
-	      if(m_mask(x, y, z)==1)
-		{
-		  for(int c=1;c<noclasses+1;c++)
-		    {
-		      float ppp=members(x, y, z, c-1);
-		      for(int i=1;i<=numberofchannels;i++)
-			{
-			  m_mean(c, i)+=ppp*m_Mri[i](x, y, z);
-			}
-		      normtemp[c]+=ppp;
-		    }
-		}
-	    }
-	}
+	for(int x=0;x<m_nWidth;x++)
+	  if(m_mask.value(x, y, z)==1)
+	    for(int c=1;c<noclasses+1;c++)
+	      {
+		float ppp=members.value(x, y, z, c-1);
+		for(int i=1;i<=numberofchannels;i++)
+		  mean[c*numberofchannels+i-1]+=ppp*m_Mri[i].value(x, y, z);
+		norm[c]+=ppp;
+	      }
+#ifdef _OPENMP
+#pragma omp critical(fast_multi_meansvariances)
+#endif
+    {
+      for(int c=1;c<noclasses+1;c++)
+	normtemp[c]+=norm[c];
+      for(int k=0;k<nclass*numberofchannels;k++)
+	meantemp[k]+=mean[k];
     }
+  }
   for(int c=1;c<=noclasses;c++)
     {      
-      if(normtemp[c]!=0.0)
-	for(int i=1;i<=numberofchannels;i++)
-	  m_mean(c, i)=m_mean(c, i)/normtemp[c];
+      for(int i=1;i<=numberofchannels;i++)
+	{
+	  m_mean(c, i)=meantemp[c*numberofchannels+i-1];
+	  if(normtemp[c]!=0.0)
+	    m_mean(c, i)=m_mean(c, i)/normtemp[c];
+	}
       m_co_variance[c]=covariancematrix(c-1, members);
       m_inv_co_variance[c]=m_co_variance[c].i();
     }
-   delete[] normtemp;  
 }
 
 void ZMRIMULTISegmentation::BiasRemoval()
@@ -1475,11 +1516,14 @@ NEWIMAGE::volume4D<float> ZMRIMULTISegmentation::Initclass(int noclasses)
 
 void ZMRIMULTISegmentation::UpdateMembers(NEWIMAGE::volume4D<float>& probability)
 {
-  for(int x=0;x<m_nWidth;x++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int z=0;z<m_nDepth;z++)
     {
       for(int y=0;y<m_nHeight;y++)
 	{
-	  for(int z=0;z<m_nDepth;z++)
+	  for(int x=0;x<m_nWidth;x++)
 	    { 
 	      if(m_mask(x, y, z)>0)
 		{
@@ -1723,6 +1767,9 @@ void ZMRIMULTISegmentation::mresmatrix()
   Matrix onecol(numberofchannels, 1);
   for(int channel=1;channel<=numberofchannels;channel++)
     {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
       for(int z=0;z<m_nDepth;z++)
 	{
 	  for(int y=0;y<m_nHeight;y++)
@@ -1757,34 +1804,48 @@ void ZMRIMULTISegmentation:: PVMeansVar(const NEWIMAGE::volume4D<float>& m_postt
 {
 }
 
-Matrix ZMRIMULTISegmentation:: covariancematrix(int classid, volume4D<float> probability)
+Matrix ZMRIMULTISegmentation:: covariancematrix(int classid, const volume4D<float>& probability)
 {
-  float tot=0.0f;
-  Matrix cov(numberofchannels, numberofchannels);cov=0.0;
+  double tot=0.0;
+  vector<double> covtemp(numberofchannels*numberofchannels, 0.0);
   if(classid<noclasses)
     {
-      for(int z=0;z<m_nDepth;z++)
-	{
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+      {
+	vector<double> cov(numberofchannels*numberofchannels, 0.0), submean(numberofchannels);
+	double ptot=0.0;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+	for(int z=0;z<m_nDepth;z++)
 	  for(int y=0;y<m_nHeight;y++)
-	    {
-	      for(int x=0;x<m_nWidth;x++)
-		{ 
-		  if(m_mask(x, y, z)==1)
-		    {
-		      for(int i=1;i<=numberofchannels;i++)
-			{
-			  for(int j=1;j<=numberofchannels;j++)
-			    {
-			      cov(i,j)+=probability(x, y, z, classid)*(m_Mri[i](x, y, z)-m_mean(classid+1, i))*(m_Mri[j](x, y, z)-m_mean(classid+1, j));
-			    }
-			}
-		      tot+=probability(x, y, z, classid);
-		    }
+	    for(int x=0;x<m_nWidth;x++)
+	      if(m_mask.value(x, y, z)==1)
+		{
+		  double p=probability.value(x, y, z, classid);
+		  for(int i=1;i<=numberofchannels;i++)
+		    submean[i-1]=m_Mri[i].value(x, y, z)-m_mean(classid+1, i);
+		  for(int i=0;i<numberofchannels;i++)
+		    for(int j=0;j<numberofchannels;j++)
+		      cov[i*numberofchannels+j]+=p*submean[i]*submean[j];
+		  ptot+=p;
 		}
-	    }
+#ifdef _OPENMP
+#pragma omp critical(fast_multi_covariance)
+#endif
+	{
+	  for(int k=0;k<numberofchannels*numberofchannels;k++)
+	    covtemp[k]+=cov[k];
+	  tot+=ptot;
 	}
+      }
     }
-   
+  Matrix cov(numberofchannels, numberofchannels);
+  for(int i=1;i<=numberofchannels;i++)
+    for(int j=1;j<=numberofchannels;j++)
+      cov(i, j)=covtemp[(i-1)*numberofchannels+j-1];
   cov/=tot;
   return cov; 
 }
@@ -70,6 +70,7 @@
 #include "newimage/newimageall.h"
 #include "miscmaths/miscmaths.h"
 #include "utils/options.h"
+#include "bias_smooth.h"
 
 
 using namespace MISCMATHS;
@@ -104,11 +105,12 @@ private:
   NEWIMAGE::volume<float> Convolve(NEWIMAGE::volume<float>& resfieldimage);
   NEWIMAGE::volume4D<float> InitclassAlt(int);
   NEWIMAGE::volume4D<float>  Initclass(int noclasses);
-  Matrix covariancematrix(int classid, volume4D<float> probability);
+  Matrix covariancematrix(int classid, const volume4D<float>& probability);
   float M_2PI(int numberofchan);
   float logpveGaussian(int x, int y, int z, Matrix mu, Matrix sig, float detsig);
   float PVEnergy(int x, int y, int z, Matrix mu, Matrix sigma, float sigdet);
   float logGaussian(int classnumber, int x, int y, int z);
+  float logGaussian(int classnumber, int x, int y, int z, double lognorm, double* submean);
   float pvmeans(int clas);
   float pvvar(int clas);
   void Volumesquant(const NEWIMAGE::volume4D<float>& probs);
@@ -141,6 +143,7 @@ private:
   void TanakaHyper();
   void TanakaPriorHyper();
   void TanakaIterations();
+  void TanakaUpdate(int x, int y, int z, const vector<double>& lognorm, double* submean);
   Matrix*  m_inv_co_variance;
   Matrix* m_co_variance;
   Matrix m_mean;
@@ -155,7 +158,7 @@ private:
   volume<float> pve_eng;
   volume<float> m_maskc;
   volume<int> m_mask;
-  ColumnVector kernelx, kernely, kernelz;
+  BiasSmoother m_smoother;
   float amx, amy, amz, amxy, amzx, amzy;
   double* volumequant;
   float* rhs;
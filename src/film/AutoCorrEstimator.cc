@@ -68,6 +68,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 #define WANT_STREAM
 
 #include "AutoCorrEstimator.h"
@@ -81,6 +82,109 @@ using namespace NEWIMAGE;
 
 namespace FILM {
 
+  // Number of voxels whose autocorrelations are estimated together
+  static const int ACBLOCK = 32;
+
+  FFTPlan::FFTPlan(int pn) :
+    n(pn),
+    bitrev(pn),
+    costab(pn/2+1),
+    sintab(pn/2+1)
+  {
+    int levels = 0;
+    while((1<<levels) < n) levels++;
+    if((1<<levels) != n)
+      throw Exception("FFTPlan: length must be a power of two");
+
+    for(int i = 0; i < n; i++)
+      {
+	int r = 0;
+	for(int b = 0; b < levels; b++)
+	  if(i & (1<<b)) r |= 1<<(levels-1-b);
+	bitrev[i] = r;
+      }
+
+    for(int k = 0; k <= n/2; k++)
+      {
+	costab[k] = cos(2*M_PI*k/n);
+	sintab[k] = sin(2*M_PI*k/n);
+      }
+  }
+
+  void FFTPlan::transform(double* re, double* im, bool inv) const
+  {
+    for(int i = 0; i < n; i++)
+      {
+	int j = bitrev[i];
+	if(j > i)
+	  {
+	    std::swap(re[i],re[j]);
+	    std::swap(im[i],im[j]);
+	  }
+      }
+
+    const double sgn = inv ? 1.0 : -1.0;
+    for(int len = 2; len <= n; len <<= 1)
+      {
+	const int half = len/2;
+	const int step = n/len;
+	for(int i = 0; i < n; i += len)
+	  {
+	    for(int k = 0; k < half; k++)
+	      {
+		const double wr = costab[k*step];
+		const double wi = sgn*sintab[k*step];
+		const int a = i+k;
+		const int b = a+half;
+		const double tr = re[b]*wr - im[b]*wi;
+		const double ti = re[b]*wi + im[b]*wr;
+		re[b] = re[a]-tr;
+		im[b] = im[a]-ti;
+		re[a] += tr;
+		im[a] += ti;
+	      }
+	  }
+      }
+
+    if(inv)
+      {
+	const double scale = 1.0/n;
+	for(int i = 0; i < n; i++)
+	  {
+	    re[i] *= scale;
+	    im[i] *= scale;
+	  }
+      }
+  }
+
+  // zr/zi hold the transform of x + iy for two real series x and y.
+  // Replace them in place by the power spectra |X|^2 (in zr) and |Y|^2 (in zi).
+  static void splitPowerSpectra(double* zr, double* zi, int n)
+  {
+    for(int k = 0; k <= n/2; k++)
+      {
+	const int m = (n-k)%n;
+	const double ar = zr[k]+zr[m], ai = zi[k]-zi[m];
+	const double br = zr[k]-zr[m], bi = zi[k]+zi[m];
+	const double px = 0.25*(ar*ar + ai*ai);
+	const double py = 0.25*(br*br + bi*bi);
+	zr[k] = zr[m] = px;
+	zi[k] = zi[m] = py;
+      }
+  }
+
+  // Unbiased sample variance, accumulated as in MISCMATHS::var
+  static float sampleVar(const double* x, int n)
+  {
+    if(n <= 1) return 0;
+    double mn = 0;
+    for(int t = 0; t < n; t++) mn += x[t];
+    mn /= n;
+    double v = 0;
+    for(int t = 0; t < n; t++) v += (x[t]-mn)*(x[t]-mn)/(n-1);
+    return v;
+  }
+
   void AutoCorrEstimator::setDesignMatrix(const Matrix& dm) {
     Tracer tr("AutoCorrEstimator::setDesignMatrix");
 
@@ -348,22 +452,40 @@ namespace FILM {
 	  lag = MISCMATHS::Min(40,int(sizeTS/4));
 
 	if(usan_thresh == 0) usan_thresh = establishUsanThresh(epivol); // Establish epi thresh to use:
-	volume4D<float> susan_vol(mask.xsize(),mask.ysize(),mask.zsize(),1);
+	volume<float> susan_in(mask.xsize(),mask.ysize(),mask.zsize());
+	susan_in.copyproperties(mask);
+	susan_in = 0;
 	volume<float> usan_area(mask.xsize(),mask.ysize(),mask.zsize());
 	volume<float> kernel;
 	kernel = gaussian_kernel3D(masksize,mask.xdim(),mask.ydim(),mask.zdim(),2.0);	
-	int factor = 10000;
+	const float factor = 10000;
+
+	// Each lag is a contiguous row of acEst, so it is scattered straight
+	// into the susan input (and gathered back) through a list of mask
+	// coordinates, rather than via temporary matrices and a 4D volume
+	vector<int> mx, my, mz;
+	mx.reserve(numTS); my.reserve(numTS); mz.reserve(numTS);
+	for (int z=mask.minz(); z<=mask.maxz(); z++)
+	  for (int y=mask.miny(); y<=mask.maxy(); y++)
+	    for (int x=mask.minx(); x<=mask.maxx(); x++)
+	      if (mask(x,y,z)>mask.maskThreshold()) {
+		mx.push_back(x); my.push_back(y); mz.push_back(z);
+	      }
+	if ((int)mx.size()!=numTS)
+	  throw Exception("Incompatible number of mask positions and autocorrelation estimates");
+
 	cout<< "Spatially smoothing auto corr estimates" << endl;
 	
 	for(int i=2 ; i <= lag; i++)
 	  {
 	    // setup susan input
-	    susan_vol.setmatrix(acEst.Row(i),mask); 
-	    susan_vol*=factor;
-	    susan_vol[0]=susan_convolve(susan_vol[0],kernel,1,0,1,&usan_area,usan_vol,usan_thresh*(float)usan_thresh);
+	    Real* acrow = acEst.Store() + (i-1)*numTS;
+	    for(int c = 0; c < numTS; c++)
+	      susan_in(mx[c],my[c],mz[c]) = ((float)acrow[c])*factor;
+	    volume<float> susan_out = susan_convolve(susan_in,kernel,1,0,1,&usan_area,usan_vol,usan_thresh*(float)usan_thresh);
 	    // insert output back into acEst
-            susan_vol/=factor;
-	    acEst.Row(i)=susan_vol.matrix(mask);
+	    for(int c = 0; c < numTS; c++)
+	      acrow[c] = susan_out(mx[c],my[c],mz[c])/factor;
 	    cout<< ".";
 	  }
 	
@@ -379,10 +501,12 @@ namespace FILM {
      if(lag==0)
        lag = MISCMATHS::Min(40,int(sizeTS/4));
      cout<< "Spatially smoothing auto corr estimates for surface" << endl;
+     const int nverts = surfaceData.getNumberOfVertices();
+     vector<float> scalars(nverts);
      for(int i=2 ; i <= lag; i++) {
-       vector<float> scalars;
-       for ( unsigned int point = 1; point<=surfaceData.getNumberOfVertices(); point++ )
-	 scalars.push_back( acEst(i,point) );
+       const Real* acrow = acEst.Store() + (i-1)*numTS;
+       for ( int point = 0; point < nverts; point++ )
+	 scalars[point] = acrow[point];
        surfaceData.clearScalars();
        surfaceData.insertScalars(scalars,0,"input field" );  //Add data to surface
        sc_smooth_gaussian_geodesic(  surfaceData , 0, sigma, extent , false);
@@ -400,10 +524,68 @@ namespace FILM {
     
     cout<< "Calculating raw AutoCorrs...";      
 
-    MISCMATHS::xcorr(xdata, acEst, lag, zeropad);
+    if(lag == 0)
+      lag = sizeTS;
+
+    // Equivalent to MISCMATHS::xcorr(xdata, acEst, lag, zeropad), but the
+    // voxels are handled in blocks sharing one FFT plan and work buffers,
+    // with two time series packed into each complex transform
+    FFTPlan plan(zeropad);
+    vector<double> re(ACBLOCK/2*zeropad);
+    vector<double> im(ACBLOCK/2*zeropad);
+
+    acEst.ReSize(lag, numTS);
+    acEst = 0;
+
+    for(int first = 0; first < numTS; first += ACBLOCK)
+      calcRawBlock(plan, first, MISCMATHS::Min(ACBLOCK, numTS-first), lag, &re[0], &im[0]);
 
     cout<< " Completed" << endl;  
   }
+
+  void AutoCorrEstimator::calcRawBlock(const FFTPlan& plan, int first, int count, int lag, double* re, double* im) {
+
+    const int npairs = (count+1)/2;
+    float varx[ACBLOCK];
+
+    // Gather the block: voxel v goes to the real (even v) or imaginary
+    // (odd v) part of pair v/2. Rows of xdata are contiguous over voxels.
+    std::fill(re, re + npairs*zeropad, 0.0);
+    std::fill(im, im + npairs*zeropad, 0.0);
+    const Real* xd = xdata.Store();
+    for(int t = 0; t < sizeTS; t++)
+      {
+	const Real* xrow = xd + t*numTS + first;
+	for(int v = 0; v < count; v++)
+	  ((v%2) ? im : re)[(v/2)*zeropad + t] = xrow[v];
+      }
+
+    for(int v = 0; v < count; v++)
+      varx[v] = sampleVar(((v%2) ? im : re) + (v/2)*zeropad, sizeTS);
+
+    for(int p = 0; p < npairs; p++)
+      {
+	double* zr = re + p*zeropad;
+	double* zi = im + p*zeropad;
+	plan.forward(zr, zi);
+	splitPowerSpectra(zr, zi, zeropad);
+	// both power spectra are real and even, so the inverse
+	// transform returns the two autocorrelations in zr and zi
+	plan.inverse(zr, zi);
+      }
+
+    // Scatter back, with the correction to make autocorr unbiased and normalised
+    Real* ac = acEst.Store();
+    for(int j = 0; j < lag; j++)
+      {
+	Real* acrow = ac + j*numTS + first;
+	for(int v = 0; v < count; v++)
+	  {
+	    const double r = ((v%2) ? im : re)[(v/2)*zeropad + j];
+	    acrow[v] = (j < lag-1) ? r/((sizeTS-j-1)*varx[v]) : r;
+	  }
+      }
+  }
   
   void AutoCorrEstimator::filter(const ColumnVector& filterFFT) {
 
@@ -452,52 +634,54 @@ namespace FILM {
     getSlepians(M, sizeTS, slepians);
 
     //LogSingleton::getInstance().out("slepians", slepians, false);
+
+    const int ntapers = slepians.Ncols();
+    FFTPlan plan(zeropad);
+    vector<double> x(sizeTS);
+    vector<double> re(zeropad), im(zeropad);
+    vector<double> pooled(zeropad), pooledim(zeropad);
     
-    ColumnVector x(zeropad);
-    x = 0;
-    ColumnVector fft_real;
-    ColumnVector fft_im;
-    ColumnVector dummy(zeropad);
-    ColumnVector dummy2;
-    ColumnVector realifft(zeropad);
-    dummy = 0;
-    
-    Matrix Sk(zeropad, slepians.Ncols());
     acEst.ReSize(sizeTS, numTS);
     acEst = 0;
 
     for(int i = 1; i <= numTS; i++) 
       {
-	// Compute FFT for each slepian taper
-	for(int k = 1; k <= slepians.Ncols(); k++) 
+	for(int t = 0; t < sizeTS; t++)
+	  x[t] = xdata(t+1,i);
+
+	// Compute FFT for each slepian taper, two tapers per transform,
+	// and pool the power spectra
+	std::fill(pooled.begin(), pooled.end(), 0.0);
+	for(int k = 1; k <= ntapers; k += 2) 
 	  {
-	    x.Rows(1,sizeTS) = SP(slepians.Column(k), xdata.Column(i));
-	   
-	    FFT(x, dummy, fft_real, fft_im);
-	    for(int j = 1; j <= zeropad; j++)
-	    {
-	      // (x+iy)(x-iy) = x^2 + y^2
-	      fft_real(j) = fft_real(j)*fft_real(j) + fft_im(j)*fft_im(j);
-	      Sk(j,k) = fft_real(j);
-	    }
+	    std::fill(re.begin(), re.end(), 0.0);
+	    std::fill(im.begin(), im.end(), 0.0);
+	    for(int t = 0; t < sizeTS; t++)
+	      {
+		re[t] = slepians(t+1,k)*x[t];
+		if(k < ntapers) im[t] = slepians(t+1,k+1)*x[t];
+	      }
+	    plan.forward(&re[0], &im[0]);
+	    splitPowerSpectra(&re[0], &im[0], zeropad);
+	    for(int j = 0; j < zeropad; j++)
+	      pooled[j] += re[j] + im[j];
 	  }
 
-	// Pool multitaper FFTs
-	fft_im = 0;
-	for(int j = 1; j <= zeropad; j++)
+	for(int j = 0; j < zeropad; j++)
 	  {
-	    fft_real(j) = MISCMATHS::mean(ColumnVector(Sk.Row(j).t())).AsScalar();
-	    
+	    pooled[j] /= ntapers;
+	    pooledim[j] = 0;
 	  }
 
 	// IFFT to get autocorr
-	FFTI(fft_real, fft_im, realifft, dummy2);
-	//LogSingleton::getInstance().out("Sk", Sk, false);
-	//LogSingleton::getInstance().out("realifft", realifft);
-	//LogSingleton::getInstance().out("fftreal", fft_real);
-	
-	float varx = MISCMATHS::var(ColumnVector(x.Rows(1,sizeTS))).AsScalar();
-	acEst.Column(i)=realifft.Rows(1,sizeTS)/varx;
+	plan.inverse(&pooled[0], &pooledim[0]);
+
+	// normalised by the variance of the last tapered series
+	for(int t = 0; t < sizeTS; t++)
+	  re[t] = slepians(t+1,ntapers)*x[t];
+	float varx = sampleVar(&re[0], sizeTS);
+	for(int t = 0; t < sizeTS; t++)
+	  acEst(t+1,i) = pooled[t]/varx;
       }
     countLargeE = 0;
     cout<< "Completed" << endl;
@@ -536,20 +720,19 @@ namespace FILM {
     cout<< "Tukey M = " << M << endl;
 
     cout<< "Tukey estimates... ";
-	
-    ColumnVector window(M);
 
+    // acEst is lag-major, so each lag is tapered across all voxels at once
+    Real* ac = acEst.Store();
     for(int j = 1; j <= M; j++)
       {
-	window(j) = 0.5*(1+cos(M_PI*j/(float(M))));
+	const double w = 0.5*(1+cos(M_PI*j/(float(M))));
+	Real* acrow = ac + (j-1)*numTS;
+	for(int i = 0; i < numTS; i++)
+	  acrow[i] *= w;
       }
-    
-    for(int i = 1; i <= xdata.Ncols(); i++) {
-	
-	acEst.SubMatrix(1,M,i,i) = SP(acEst.SubMatrix(1,M,i,i),window);
-	acEst.SubMatrix(M+1,sizeTS,i,i) = 0;
-	
-    }
+
+    std::fill(ac + M*numTS, ac + sizeTS*numTS, 0.0);
+
     countLargeE = 0;
     cout<< "Completed" << endl;
   }
@@ -560,63 +743,61 @@ namespace FILM {
     
     cout<< "Using New PAVA on AutoCorr estimates... ";
 
-    for(int i = 1; i <= numTS; i++) {
-	int stopat = (int)sizeTS/2;
-
-	// 5% point of distribution of autocorr about zero
-	const float th = (-1/sizeTS)+(2/sqrt(sizeTS));
+    const int stopat = (int)sizeTS/2;
 
-	ColumnVector values = acEst.Column(i);
-	ColumnVector zero(1);
-	zero = 0;
-	values = values.Rows(1,stopat) & zero;
-
-	ColumnVector gm(stopat + 1);
-	for(int j = 1; j <= stopat + 1; ++j)
-	  gm(j) = j;
-	  
-	ColumnVector weights(stopat+1);
-	weights = 1;
+    // 5% point of distribution of autocorr about zero
+    const float th = (-1/sizeTS)+(2/sqrt(sizeTS));
 
-	bool anyviolators = true;
+    // Pooled blocks are kept on a stack that is reused for every voxel.
+    // Merging the newest block into its predecessor while it is larger
+    // always pools the leftmost violating pair, i.e. the same sequence of
+    // merges as repeatedly rescanning the whole series.
+    vector<double> level(stopat+1);
+    vector<double> weight(stopat+1);
+    vector<int> length(stopat+1);
+    vector<double> fitted(stopat+1);
 
-	while(anyviolators) {
-	  anyviolators = false;
-	  
-	  for(int k = 2; k <= values.Nrows(); k++) {
-	    if(values(k) > values(k-1)) {
-	      anyviolators = true;
-	      values(k-1) = (values(k-1)*weights(k-1) + values(k)*weights(k))/(weights(k-1) + weights(k));
-	      values = values.Rows(1,k-1) & values.Rows(k+1,values.Nrows());
-	      weights(k-1) = weights(k) + weights(k-1);
-	      weights = weights.Rows(1,k-1) & weights.Rows(k+1,weights.Nrows());
-
-	      for(int j = 1; j <= stopat + 1; j++) {
-		if(gm(j) >= k)  
-		  gm(j) = gm(j)-1;
-	      }
+    for(int i = 1; i <= numTS; i++) {
 
-	      break;
-	    }
+	int nblocks = 0;
+	for(int k = 1; k <= stopat + 1; k++) {
+	  level[nblocks] = (k <= stopat) ? acEst(k,i) : 0.0;
+	  weight[nblocks] = 1;
+	  length[nblocks] = 1;
+	  nblocks++;
+
+	  while(nblocks > 1 && level[nblocks-1] > level[nblocks-2]) {
+	    const int b = nblocks-2;
+	    level[b] = (level[b]*weight[b] + level[b+1]*weight[b+1])/(weight[b] + weight[b+1]);
+	    weight[b] += weight[b+1];
+	    length[b] += length[b+1];
+	    nblocks--;
 	  }
 	}
-	
-	acEst.Column(i) = 0.0;
-	int j=1;
 
+	int pos = 0;
+	for(int b = 0; b < nblocks; b++)
+	  for(int l = 0; l < length[b]; l++)
+	    fitted[pos++] = level[b];
+
+	int j=1;
 	for(; j <= stopat; j++) {
-	  
-	  acEst(j,i) = values(int(gm(j)));
+	  acEst(j,i) = fitted[j-1];
 	  if(acEst(j,i) <= 0.0)
 	    {
 	      acEst(j,i) = 0.0;
 	      break;
  	    }
 	}
+
+	// clear the rest of the column
+	for(int r = MISCMATHS::Min(j+1, stopat+1); r <= sizeTS; r++)
+	  acEst(r,i) = 0.0;
 	
 	if(acEst(2,i) < th/2)
 	{
-	acEst.SubMatrix(2,stopat,i,i) = 0;
+	  for(int r = 2; r <= stopat; r++)
+	    acEst(r,i) = 0;
 	}
 
 	else if(j > 2)
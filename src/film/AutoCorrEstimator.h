@@ -71,6 +71,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <vector>
 #define WANT_STREAM
 #define WANT_MATH
 
@@ -83,6 +84,28 @@ using namespace MISCMATHS;
 using namespace fslsurface_name;
 
 namespace FILM {
+
+  // Radix-2 complex FFT of a fixed power-of-two length. The bit reversal
+  // permutation and twiddle factors are built once, so the same plan can be
+  // applied to every voxel. Data are held as separate real and imaginary
+  // arrays; the sign and scaling conventions match NEWMAT's FFT/FFTI.
+  class FFTPlan
+    {
+    public:
+      FFTPlan(int n);
+
+      void forward(double* re, double* im) const { transform(re,im,false); }
+      void inverse(double* re, double* im) const { transform(re,im,true); }
+      int size() const { return n; }
+
+    private:
+      void transform(double* re, double* im, bool inv) const;
+
+      int n;
+      vector<int> bitrev;
+      vector<double> costab;
+      vector<double> sintab;
+    };
      
   class AutoCorrEstimator
     {
@@ -141,6 +164,7 @@ namespace FILM {
       const AutoCorrEstimator& operator=(AutoCorrEstimator&);
       AutoCorrEstimator(AutoCorrEstimator&);
       void getSlepians(int M, int sizeTS, Matrix& slepians);
+      void calcRawBlock(const FFTPlan& plan, int first, int count, int lag, double* re, double* im);
 
       const Matrix& xdata;
       Matrix acEst;
@@ -70,11 +70,15 @@
 #include <sstream>
 #include <fstream>
 #include <stdio.h>
+#include <cstdlib>
 #include <cmath>
 #include <algorithm>
+#include <map>
+#include <stdexcept>
 #include "math.h"
 
 #include "utils/options.h"
+#include "utils/threading.h"
 #include "newimage/newimageall.h"
 #include "meshclass/meshclass.h"
 #include "shapeModel/shapeModel.h"
@@ -90,7 +94,7 @@ using namespace fslvtkio;
 
 
 string title="first University of Oxford (Brian Patenaude)";
-string examples="first -i <input image> -l <flirt matrix> -m <model>";
+string examples="first -i <input image> -l <flirt matrix> -m <model>\n       first -i <input image> -l <flirt matrix> --structures=<structure list>";
 
 
 Option<bool> verbose(string("-v,--verbose"), false, 
@@ -106,13 +110,13 @@ Option<string> inname(string("-i,--in"), string(""),
 					  true, requires_argument);
 Option<string> outname(string("-k,--outputName"), string(""),
 					   string("Output name"),
-					   true, requires_argument);
+					   false, requires_argument);
 Option<string> flirtmatname(string("-l,--flirtMatrix"), string(""),
 						 string("Filename of flirt matrix that transform input image to MNI space (output of first_flirt)"),
 						 true, requires_argument);
 Option<string> modelname(string("-m,--inputModel"), string(""),
 						 string("Filename of input model (the structure to be segmented)."),
-						 true, requires_argument);
+						 false, requires_argument);
 Option<string> modelname2(string("-p,--inputModel2"), string(""),
 						 string("Filename of second input model (the structure to be segmented)."),
 						 false, requires_argument);			
@@ -146,6 +150,10 @@ Option<bool> loadbvars(string("--loadbvars"), false,
 Option<bool> shcond(string("--shcond"), false,
 					   string("Use conditional shape probability"),
 					   false, no_argument);
+Option<string> structlist(string("--structures"), string(""),
+						 string("Text file listing several structures to fit to the same image in one run, one per line: \
+						 <model> <output name> [<intensity reference model>] [<number of modes>]. Replaces -m, -k, -p and --intref; -n is used where no number of modes is given."),
+						 false, requires_argument);
 int nonoptarg;
 
 ////////////////////////////////////////////////////////////////////////////
@@ -695,6 +703,33 @@ volume<short> make_mask_from_mesh(const volume<float> & image, const vector<floa
 }
 
 
+//trilinear interpolation with zero padding outside the image, as
+//volume::interpolate() gives with the default settings, but without
+//writing to the volume's extrapolation cache so threads can share it
+inline
+float sample_trilinear(const volume<float> & image, const float & x, const float & y, const float & z)
+{
+	int ix=(int) floor(x), iy=(int) floor(y), iz=(int) floor(z);
+	float dx=x-ix, dy=y-iy, dz=z-iz;
+	float v000=0, v001=0, v010=0, v011=0, v100=0, v101=0, v110=0, v111=0;
+	if (image.in_bounds(ix,iy,iz))       v000=image.value(ix,iy,iz);
+	if (image.in_bounds(ix,iy,iz+1))     v001=image.value(ix,iy,iz+1);
+	if (image.in_bounds(ix,iy+1,iz))     v010=image.value(ix,iy+1,iz);
+	if (image.in_bounds(ix,iy+1,iz+1))   v011=image.value(ix,iy+1,iz+1);
+	if (image.in_bounds(ix+1,iy,iz))     v100=image.value(ix+1,iy,iz);
+	if (image.in_bounds(ix+1,iy,iz+1))   v101=image.value(ix+1,iy,iz+1);
+	if (image.in_bounds(ix+1,iy+1,iz))   v110=image.value(ix+1,iy+1,iz);
+	if (image.in_bounds(ix+1,iy+1,iz+1)) v111=image.value(ix+1,iy+1,iz+1);
+	float temp1=(v100-v000)*dx+v000;
+	float temp2=(v101-v001)*dx+v001;
+	float temp3=(v110-v010)*dx+v010;
+	float temp4=(v111-v011)*dx+v011;
+	float temp5=(temp3-temp1)*dy+temp1;
+	float temp6=(temp4-temp2)*dy+temp2;
+	return (temp6-temp5)*dz+temp5;
+}
+
+
 float costfuncApp(const volume<float> & image, const shapeModel & model1, const vector<float> & vars, const bool & overide_fill)
 {
 	//do for a single shape
@@ -703,7 +738,6 @@ float costfuncApp(const volume<float> & image, const shapeModel & model1, const
 	//for (int i=0;i<10; i++)
 	// cout<<vars.at(i)<<" ";
 	// cout<<endl;
-	vector<float> dif;
 	vector<float> shape = model1.getDeformedGrid(vars);
 	//	cout<<" got shape"<<endl; 	
 	vector<float> igrid = model1.getDeformedIGrid(vars);
@@ -732,6 +766,9 @@ float costfuncApp(const volume<float> & image, const shapeModel & model1, const
 			if (verbose.value()) cout<<"found mode "<<mode_val<<endl;
 		}else{
 			model1.setMode(mode_val);
+#ifdef _OPENMP
+#pragma omp critical(first_output)
+#endif
 			cout<<"mode  "<<mode_val<<endl;
 		}
 	}
@@ -749,48 +786,47 @@ float costfuncApp(const volume<float> & image, const shapeModel & model1, const
 	const float ydim=image.ydim();
 	const float zdim=image.zdim();
 	
-	vector<float>::iterator nx_i=nx.begin();
-	vector<float>::iterator ny_i=ny.begin();
-	vector<float>::iterator nz_i=nz.begin();
-	vector<float>::iterator igrid_i=igrid.begin();
-	
-	float inc_x= 0.5/xdim;
-	float inc_y= 0.5/ydim;
-	float inc_z= 0.5/zdim;
-	int count=0;
-	for (vector<float>::iterator k = shape.begin(); k!= shape.end(); k+=3,nx_i++,ny_i++, nz_i++)
+	//each profile only depends on its own vertex, so sample them in parallel
+	//straight into their place in dif
+	const int nverts=static_cast<int>(shape.size()/3);
+	vector<float> dif(nverts*ipp);
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+	for (int v=0; v<nverts; v++)
 	{
-		inc_x = (*nx_i) * 0.5/xdim;
-		inc_y = (*ny_i) * 0.5/ydim;
-		inc_z = (*nz_i) * 0.5/zdim;
-		
+		float inc_x = nx[v] * 0.5/xdim;
+		float inc_y = ny[v] * 0.5/ydim;
+		float inc_z = nz[v] * 0.5/zdim;
 		
-		(*k)=(*k)/xdim - (ipp-1)*0.5 * inc_x ;
-		(*(k+1))=*(k+1)/ydim - (ipp-1)*0.5 * inc_y;
-		(*(k+2))= *(k+2)/zdim - (ipp-1)*0.5 * inc_z;
+		float px=shape[3*v]/xdim - (ipp-1)*0.5 * inc_x ;
+		float py=shape[3*v+1]/ydim - (ipp-1)*0.5 * inc_y;
+		float pz=shape[3*v+2]/zdim - (ipp-1)*0.5 * inc_z;
 		
-		for (int j=0;j<ipp;j++,igrid_i++, (*k)+=inc_x, (*(k+1))+=inc_y, (*(k+2))+=inc_z,count++)
-		{
-			dif.push_back(image.interpolate(*k,*(k+1),*(k+2))-(*igrid_i) - mean);
-			//	cout<<count<<" "<<*k<<" "<<*(k+1)<<" "<<*(k+2)<<" "<<(*igrid_i)<<" "<<igrid.at(count)<<" "<<mean<<" "<<dif.back()<<endl;
-		}
+		for (int j=0;j<ipp;j++, px+=inc_x, py+=inc_y, pz+=inc_z)
+			dif[v*ipp+j]=sample_trilinear(image,px,py,pz)-igrid[v*ipp+j] - mean;
 	}
 	//	cout<<"intesnity samples"<<endl;
 	//************Calculate conditional I | s *************************//
-	double probIcond=0;
-	vector<float> ::const_iterator ieigs_i = model1.ieigs.begin();
-	for (vector< vector<float> >::const_iterator col=model1.i_precision.begin(); col != model1.i_precision.end(); col++,ieigs_i++)
+	//project onto each precision mode in parallel, then sum in mode order
+	const int nicols=static_cast<int>(model1.i_precision.size());
+	const float errI=model1.Errs.at(1);
+	vector<double> iterms(nicols);
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+	for (int c=0; c<nicols; c++)
 	{
+		const vector<float> & col=model1.i_precision[c];
 		float multemp=0;
-		vector<float>::iterator dif_i=dif.begin();
-		//		cout<<"ceigs "<<1/(*ieigs_i) - 0.5*(1/model1.Errs.at(1))<<" "<<*ieigs_i<<"  "<<model1.Errs.at(1)<<endl;
+		for (unsigned int row=0; row<col.size(); row++)
+			multemp+=dif[row]*col[row];
 
-		for (vector<float>::const_iterator row=(*col).begin();row!=(*col).end(); row++, dif_i++)
-			multemp+=(*dif_i)*(*row);
-
-
-		probIcond+=multemp*multemp*(1/(*ieigs_i) - 0.5*(1/model1.Errs.at(1)));		
+		iterms[c]=multemp*multemp*(1/model1.ieigs[c] - 0.5*(1/errI));
 	}
+	double probIcond=0;
+	for (int c=0; c<nicols; c++)
+		probIcond+=iterms[c];
 	//cout<<"probicond "<<probIcond<<endl;
 	//the multiplication by n-1 or n is left out becomes constant in log cost
 	//probI*=M;//this multiplication is performed later
@@ -867,39 +903,61 @@ float costfuncApp(const volume<float> & image, const shapeModel & model1, const
 
 
 bool negGradient(const volume<float> & image, vector<float> & grad, const vector<float> & vars, const shapeModel & model1, const vector<bool> & select, const float & searchRes){
-	vector<float> gradtmp;
-	
 	float sumsq=0;
 	float costinit=0;	
 	costinit=costfuncApp(image, model1, vars,false);
 	
+	//the costs either side of every selected mode are independent, so
+	//evaluate them all together. The conditional shape prior goes through
+	//NEWMAT, which is not thread safe, so that case stays serial.
+	const int nvars=static_cast<int>(vars.size());
+	vector<float> costplus(nvars,0), costminus(nvars,0);
+	ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if((Utilities::max_threads() > 1) && !model1.getCondSet())
+#endif
+	for (int k=0; k<2*nvars; k++){
+		if (err.occurred()) continue;
+		const int i=k/2;
+		if (!select.at(i)) continue;
+		try {
+			vector<float> gradtmp=vars;
+			gradtmp.at(i)=gradtmp.at(i)+searchRes;
+			if (k%2==0){
+				costplus[i]=costfuncApp(image, model1, gradtmp,true);
+			}else{
+				gradtmp.at(i)=gradtmp.at(i)-2*searchRes;
+				costminus[i]=costfuncApp(image, model1, gradtmp,true);
+			}
+		} catch(const std::exception& e) {
+			err.set(e.what());
+		} catch(NEWMAT::Exception) {
+			err.set(NEWMAT::Exception::what());
+		} catch(...) {
+			err.set("negGradient: unknown exception");
+		}
+	}
+	if (err.occurred()) throw std::runtime_error(err.what());
+	
 	float opGrad=0;
 	//take gradient with respect to each mode
-	for (int i=0; i<static_cast<int>(vars.size()); i++){
+	for (int i=0; i<nvars; i++){
 		//select vector is a bool vector that selecting the mdoes over which to take gradient
 		if ( select.at(i)){
-		//	cout<<"select "<<i<<endl;
-			//save original mode parameters
-			gradtmp=vars;	
-			//increment the mode parameters
-			gradtmp.at(i)=gradtmp.at(i)+searchRes;
 			//order is reverse because negative gradient
-			//evaluate appropriate cost 
-			grad.at(i)=((costinit-costfuncApp(image, model1, gradtmp,true))/(searchRes*sqrt(model1.seigs.at(i))));//(pprev.at(i)))
+			grad.at(i)=((costinit-costplus[i])/(searchRes*sqrt(model1.seigs.at(i))));//(pprev.at(i)))
 
 			
 			//this handles hard max on mode parameters, not needed in practice
-			if (abs(gradtmp.at(i))>STDTRUNC){
+			float incremented=vars.at(i)+searchRes;
+			if (abs(incremented)>STDTRUNC){
 				//ignores gradient if goes beyond truncation
 				grad.at(i)=grad.at(i)*1e-11;
 			}
 			
-			//calculate cost difference in opposite direction
-			//make sure gradient not positive in both directions
-			gradtmp.at(i)=gradtmp.at(i)-2*searchRes;
-			
-			//evaluate appropriate cost 
-			opGrad=((costinit-costfuncApp(image, model1, gradtmp,true))/(-searchRes*sqrt(model1.seigs.at(i))));
+			//cost difference in opposite direction, to make sure gradient
+			//not positive in both directions
+			opGrad=((costinit-costminus[i])/(-searchRes*sqrt(model1.seigs.at(i))));
 			
 			
 			//impose rules 
@@ -1304,6 +1362,94 @@ void meshReg(Mesh* m, const string & flirtmatname){
 }
 
 
+void read_normalised_image(const string & imname, volume<float> & image)
+{
+	//load base volume
+	if (verbose.value()) cout<<"reading image "<<imname<<endl;
+
+	read_volume(image,imname);
+	
+	//normalize image intensities
+	if (verbose.value()) cout<<"normalize intensity..."<<endl;
+
+	image=(image-image.robustmin())*255/(image.robustmax()-image.robustmin());
+}
+
+void read_xfm(const string & xfmname, vector< vector<float> > & fmatv_org, vector< vector<float> > & fmatv)
+{
+	if (verbose.value()) cout<<"Reading transformation matrix "<<xfmname<<endl;
+	
+	Matrix fmatM(4,4);
+	ifstream ifmat;
+	ifmat.open(xfmname.c_str());
+	for (int i=0; i<4 ; i++)
+	{
+		for (int j=0; j<4 ; j++)
+		{
+			float ftemp;
+			ifmat>>ftemp;
+			if (verbose.value()) cout<<ftemp<<" ";
+			fmatM.element(i,j)=ftemp;
+		}
+		if (verbose.value()) cout<<endl;
+	}
+	
+	//keep the original for the bvars file, the model is registered with the inverse
+	xfm_NEWMAT_To_Vector(fmatM,fmatv_org);
+	fmatM=fmatM.i();
+	xfm_NEWMAT_To_Vector(fmatM,fmatv);
+}
+
+//fits an already registered intensity reference model and returns the mode
+//of the intensities inside it
+float fit_reference_mode(const volume<float> & image, const shapeModel & modelRef, const unsigned int & refModes, float & searchRes)
+{
+	vector<float> varsRef;
+	for (unsigned int i=0; i < refModes;i++)
+		varsRef.push_back(0);
+	vector<bool> selectRef;
+	vector<float> relStdRef;
+	for (unsigned int i=0;i<varsRef.size();i++)
+	{
+		selectRef.push_back(true);
+		relStdRef.push_back(STDTRUNC);
+		
+	}
+	conjGradient(image, modelRef,varsRef, relStdRef, selectRef, searchRes, 0.15);
+	//Has fit reference model
+	vector<float> shape = modelRef.getDeformedGrid(varsRef);
+	
+	int bounds[6]={0,0,0,0,0,0};
+	getBounds(shape,bounds,image.xdim(),image.ydim(),image.zdim());
+	
+	volume<short> mask=make_mask_from_mesh(image , shape, modelRef.cells,modelRef.getLabel(0), bounds);
+	vector<float> v_intens;
+	intensity_hist(image,mask,shape,modelRef.getLabel(0),v_intens, bounds);
+	
+	if (v_intens.size()<1)
+		throw firstException("WARNING: NO INTERIOR VOXELS TO ESTIMATE MODE");
+	return mode(v_intens);
+}
+
+void write_structure(const volume<float> & image, const shapeModel & model1, const vector<float> & vars, const string & imname, const string & modelname, const string & name_out, const vector< vector<float> > & fmatv_org, const bool & is_binary)
+{
+	if (verbose.value()) cout<<"Get deformed surface and fill."<<endl;
+	
+	//write output image	
+	vector<float> shape = model1.getDeformedGrid(vars);
+	int bounds[6]={0,0,0,0,0,0};
+	getBounds(shape,bounds,image.xdim(),image.ydim(),image.zdim());
+	volume<short> mask=make_mask_from_mesh(image, shape, model1.cells,model1.getLabel(0), bounds);
+
+	save_volume(mask, name_out);
+
+	vector<float> bvars_old=model1.getOrigSpaceBvars(vars);
+			
+	write_bvars(imname, modelname, bvars_old, name_out+".bvars",fmatv_org);
+	write_vtk(shape, model1.cells, name_out + ".vtk", is_binary);
+}
+
+
 int do_work(const string & inname, const string & modelname, const string & modelname2, const string & flirtmatname, const string & outname, const string & bmapname,const string & bvarsname, \
 			const int & nmodes, const bool & intref, const bool & multiImageInput, const bool & shcond, const bool & loadbvars, const bool & is_binary, const float & res_in) 
 { 
@@ -1319,8 +1465,6 @@ int do_work(const string & inname, const string & modelname, const string & mode
 	vector< vector<float> > smodes1, smodesRef;
 
 	vector< vector<float> > fmatv, fmatv_org; //transformation matrix
-	Matrix fmatM(4,4); //transformation matrix , NEWMAT form
-	Matrix fmatM_Prev(4,4); //transformation matrix from previous image , NEWMAT form
 	vector<string> image_list;
 	vector<string> xfm_list;
 	vector<string> out_list;
@@ -1370,14 +1514,6 @@ int do_work(const string & inname, const string & modelname, const string & mode
 		
 	}
 	
-	//-------------------SET PREVIOUS MATRIX TO IDENTITY--------------------//
-	for (unsigned int i=0;i<4;i++)
-		for (unsigned int j=0;j<4;j++)
-			if (i==j)
-				fmatM_Prev.element(i,j)=1;
-			else	
-				fmatM_Prev.element(i,j)=0;
-	
 	//--------------------LOOP OVER ALL IMAGES--------------------//
 	vector<string>::iterator xfm_iter=xfm_list.begin();
 	vector<string>::iterator out_iter=out_list.begin();
@@ -1394,39 +1530,11 @@ int do_work(const string & inname, const string & modelname, const string & mode
 			model1->setMode(0);
 		}
 		//------------------READ IN IMAGE AND NORMALIZE----------------------//
-		//load base volume
-		if (verbose.value()) cout<<"reading image "<<*im_iter<<endl;
-
 		volume<float> image;
-		read_volume(image,*im_iter);
-		
-		//normalize image intensities
-		if (verbose.value()) cout<<"normalize intensity..."<<endl;
-	
-		image=(image-image.robustmin())*255/(image.robustmax()-image.robustmin());
+		read_normalised_image(*im_iter,image);
 		
 		//------------------READ IN AND APPLY TRANSFORMATION MATRIX-----------------//
-		if (verbose.value()) cout<<"Reading transformation matrix "<<*xfm_iter<<endl;
-		
-		ifstream ifmat;
-		ifmat.open(xfm_iter->c_str());
-		for (int i=0; i<4 ; i++)
-		{
-			for (int j=0; j<4 ; j++)
-			{
-				float ftemp;
-				ifmat>>ftemp;
-				if (verbose.value()) cout<<ftemp<<" ";
-				fmatM.element(i,j)=ftemp;
-			}
-			if (verbose.value()) cout<<endl;
-		}
-		
-		//invert matrix and assigned previous for purpose of looping
-		xfm_NEWMAT_To_Vector(fmatM,fmatv_org);
-	fmatM=fmatM.i();
-//concert to vector form
-		xfm_NEWMAT_To_Vector(fmatM,fmatv);
+		read_xfm(*xfm_iter,fmatv_org,fmatv);
 		
 		//------------------FIT REFERENCE MODEL IF NECESSARY-----------------//
 		
@@ -1443,31 +1551,7 @@ int do_work(const string & inname, const string & modelname, const string & mode
 		
 			modelRef->registerModel(fmatv);
 			cout<<"done registering model"<<endl;
-			vector<float> varsRef;
-			for (unsigned int i=0; i < refModes;i++)
-				varsRef.push_back(0);
-			vector<bool> selectRef;
-			vector<float> relStdRef;
-			for (unsigned int i=0;i<varsRef.size();i++)
-			{
-				selectRef.push_back(true);
-				relStdRef.push_back(STDTRUNC);
-				
-			}
-			conjGradient(image, *modelRef,varsRef, relStdRef, selectRef, searchRes, 0.15);
-			//Has fit reference model
-			vector<float> shape = modelRef->getDeformedGrid(varsRef);
-			
-			int bounds[6]={0,0,0,0,0,0};
-			getBounds(shape,bounds,image.xdim(),image.ydim(),image.zdim());
-			
-			volume<short> mask=make_mask_from_mesh(image , shape, modelRef->cells,modelRef->getLabel(0), bounds);
-			vector<float> v_intens;
-			intensity_hist(image,mask,shape,modelRef->getLabel(0),v_intens, bounds);
-			
-			if (v_intens.size()<1)
-				throw firstException("WARNING: NO INTERIOR VOXELS TO ESTIMATE MODE");
-			float mode_val=mode(v_intens);
+			float mode_val=fit_reference_mode(image, *modelRef, refModes, searchRes);
 			
 			
 			if (verbose.value()) cout<<"found reference mode "<<mode_val<<endl;
@@ -1565,24 +1649,11 @@ int do_work(const string & inname, const string & modelname, const string & mode
 		}
 		
 		//----------------------------------FILL IMAGE AND WRITE OUTPUT------------------------------//
-		
-		if (verbose.value()) cout<<"Get deformed surface and fill."<<endl;
-		
-		//write output image	
-		vector<float> shape = model1->getDeformedGrid(vars);
-		int bounds[6]={0,0,0,0,0,0};
-		getBounds(shape,bounds,image.xdim(),image.ydim(),image.zdim());
-		volume<short> mask=make_mask_from_mesh(image, shape, model1->cells,model1->getLabel(0), bounds);
 		string name_out=*out_iter;
 		if (multiImageInput)
 			name_out+=outname;
 	
-		save_volume(mask, name_out);
-	
-		vector<float> bvars_old=model1->getOrigSpaceBvars(vars);
-				
-		write_bvars(*im_iter, modelname, bvars_old, name_out+".bvars",fmatv_org);
-		write_vtk(shape, model1->cells, name_out + ".vtk", is_binary);
+		write_structure(image, *model1, vars, *im_iter, modelname, name_out, fmatv_org, is_binary);
 
 
 		if (verbose.value()) cout<<"FIRST has completed subject "<<*im_iter<<endl;
@@ -1599,6 +1670,165 @@ int do_work(const string & inname, const string & modelname, const string & mode
 
 
 
+//Fits several structures to one image in a single process. The image and
+//transformation are read once, each distinct intensity reference model is
+//registered and fitted once and shared by every structure naming it, and
+//the structures are then fitted concurrently.
+int do_multi_work(const string & inname, const string & structname, const string & flirtmatname, const int & nmodes, const bool & is_binary, const float & res_in)
+{
+	const unsigned int refModes=10;
+
+	//-------------------READ STRUCTURE LIST------------------//
+	//after the output name, a purely numeric entry is that structure's
+	//number of modes and anything else is its intensity reference model
+	vector<string> model_list, out_list, ref_list;
+	vector<unsigned int> mode_list;
+	ifstream fin;
+	fin.open(structname.c_str());
+	if (!fin.is_open())
+		throw firstException("Could not open structure list.");
+	string line;
+	while (getline(fin,line))
+	{
+		istringstream ss(line);
+		string smodel, sout, sref, sword;
+		int smodes=nmodes;
+		if (!(ss>>smodel)) continue;
+		if (!(ss>>sout))
+			throw firstException("Each line of the structure list needs a model and an output name.");
+		while (ss>>sword)
+		{
+			if (sword.find_first_not_of("0123456789")==string::npos)
+				smodes=atoi(sword.c_str());
+			else
+				sref=sword;
+		}
+		if (smodes<=0)
+			throw firstException("Number of modes in the structure list must be positive.");
+		model_list.push_back(smodel);
+		out_list.push_back(sout);
+		ref_list.push_back(sref);
+		mode_list.push_back(smodes);
+		if (verbose.value()) cout<<"Structure "<<smodel<<" "<<sout<<" "<<sref<<" "<<smodes<<endl;
+	}
+	if (model_list.empty())
+		throw firstException("No structures found in structure list.");
+	const int nstruct=static_cast<int>(model_list.size());
+
+	//------------------READ IN IMAGE AND TRANSFORMATION ONCE----------------------//
+	volume<float> image;
+	read_normalised_image(inname,image);
+	vector< vector<float> > fmatv, fmatv_org;
+	read_xfm(flirtmatname,fmatv_org,fmatv);
+
+	//------------------READ AND REGISTER MODELS-----------------//
+	//registration uses NEWMAT so is done here, before any threads start
+	vector<shapeModel*> models;
+	for (int i=0; i<nstruct; i++)
+	{
+		models.push_back(loadAndCreateShapeModel(model_list[i], mode_list[i]));
+		models.back()->registerModel(fmatv);
+	}
+
+	vector<string> refnames;
+	map<string,int> refindex;
+	vector<int> struct_ref(nstruct,-1);
+	for (int i=0; i<nstruct; i++)
+		if (!ref_list[i].empty())
+		{
+			if (refindex.find(ref_list[i])==refindex.end())
+			{
+				refindex[ref_list[i]]=refnames.size();
+				refnames.push_back(ref_list[i]);
+			}
+			struct_ref[i]=refindex[ref_list[i]];
+		}
+	const int nref=static_cast<int>(refnames.size());
+	vector<shapeModel*> refmodels;
+	for (int r=0; r<nref; r++)
+	{
+		refmodels.push_back(loadAndCreateShapeModel(refnames[r], refModes));
+		refmodels.back()->registerModel(fmatv);
+	}
+
+	//------------------FIT REFERENCE MODELS-----------------//
+	//as in a separate run, the search resolution a structure starts from is
+	//whatever its reference fit finished with
+	vector<float> ref_mode(nref,0), ref_res(nref,res_in);
+	ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if((Utilities::max_threads() > 1) && (nref > 1))
+#endif
+	for (int r=0; r<nref; r++)
+	{
+		if (err.occurred()) continue;
+		try {
+			ref_mode[r]=fit_reference_mode(image, *refmodels[r], refModes, ref_res[r]);
+			if (verbose.value()) cout<<"found reference mode "<<ref_mode[r]<<endl;
+		} catch(const std::exception& e) {
+			err.set(e.what());
+		} catch(NEWMAT::Exception) {
+			err.set(NEWMAT::Exception::what());
+		} catch(...) {
+			err.set("do_multi_work: unknown exception");
+		}
+	}
+	if (err.occurred()) throw std::runtime_error(err.what());
+
+	//------------------FIT STRUCTURES-----------------//
+	//with a single structure the threads are left to the profile sampling
+	vector< vector<float> > vars(nstruct);
+	for (int i=0; i<nstruct; i++)
+		vars[i].assign(mode_list[i],0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if((Utilities::max_threads() > 1) && (nstruct > 1))
+#endif
+	for (int i=0; i<nstruct; i++)
+	{
+		if (err.occurred()) continue;
+		try {
+			float searchRes=res_in;
+			if (struct_ref[i]>=0)
+			{
+				models[i]->setFoundMode(true);
+				models[i]->setMode(ref_mode[struct_ref[i]]);
+				searchRes=ref_res[struct_ref[i]];
+			}
+			vector<bool> select(mode_list[i],true);
+			vector<float> relStd(mode_list[i],STDTRUNC);
+			conjGradient(image, *models[i], vars[i], relStd, select, searchRes, 0.15);
+		} catch(const std::exception& e) {
+			err.set(e.what());
+		} catch(NEWMAT::Exception) {
+			err.set(NEWMAT::Exception::what());
+		} catch(...) {
+			err.set("do_multi_work: unknown exception");
+		}
+	}
+	if (err.occurred()) throw std::runtime_error(err.what());
+
+	//----------------------------------FILL IMAGE AND WRITE OUTPUT------------------------------//
+	for (int i=0; i<nstruct; i++)
+	{
+		if (verbose.value())
+		{
+			cout<<"Final mode parameters for "<<model_list[i]<<" are: "<<endl;
+			for (unsigned int m=0; m<mode_list[i]; m++)
+				cout<<vars[i].at(m)<<" ";
+			cout<<endl;
+		}
+		write_structure(image, *models[i], vars[i], inname, model_list[i], out_list[i], fmatv_org, is_binary);
+		delete models[i];
+	}
+	for (int r=0; r<nref; r++)
+		delete refmodels[r];
+
+	if (verbose.value()) cout<<"FIRST has completed all structures."<<endl;
+
+	return 0;
+}
+
+
 int main(int argc,char *argv[])
 {
 	
@@ -1623,6 +1853,7 @@ int main(int argc,char *argv[])
 		options.add(bvarsname);
 		options.add(shcond);
 		options.add(loadbvars);
+		options.add(structlist);
 		nonoptarg = options.parse_command_line(argc, argv);
 		
 		// line below stops the program if the help was requested or 
@@ -1633,6 +1864,23 @@ int main(int argc,char *argv[])
 			exit(EXIT_FAILURE);
 		}
 		
+		if (structlist.set())
+		{
+			if (multiImageInput.value() || shcond.value() || loadbvars.value() || intref.value())
+			{
+				cerr<<"--structures cannot be combined with --multiImageInput, --shcond, --loadbvars or --intref"<<endl;
+				exit(EXIT_FAILURE);
+			}
+			do_multi_work(inname.value(), structlist.value(), flirtmatname.value(), nmodes.value(), binarySurfaceOutput.value(), 0.5);
+			return 0;
+		}
+		if (modelname.unset() || outname.unset())
+		{
+			options.usage();
+			cerr<<endl<<"Both -m and -k are required unless --structures is given"<<endl;
+			exit(EXIT_FAILURE);
+		}
+		
 		// Call the local functions
 
 		do_work(inname.value(),modelname.value(),modelname2.value(), flirtmatname.value(), outname.value(), bmapname.value(), bvarsname.value(), \
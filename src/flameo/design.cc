@@ -84,7 +84,7 @@ namespace Gs {
 
   ReturnMatrix Design::getdm(int x, int y, int z, int g) const {
 
-    Tracer_Plus trace("Design::getdm x y z g");  
+    //    Tracer_Plus trace("Design::getdm x y z g");  
  
     Matrix pdm = getdm(x,y,z);	 
 	
@@ -118,7 +118,7 @@ namespace Gs {
   // returns design matrix with any voxelwise zero evs removed
   ReturnMatrix Design::getdm(int x, int y, int z) const { 
 
-    Tracer_Plus trace("Design::getdm x y z");  
+    //    Tracer_Plus trace("Design::getdm x y z");  
 
     Matrix ret=dm;
 
@@ -80,6 +80,7 @@
 #include "gsmanager.h"
 #include "gsoptions.h"
 #include "utils/tracer_plus.h"
+#include "utils/threading.h"
 #include "miscmaths/miscprob.h"
 #include "stdlib.h"
 
@@ -116,6 +117,11 @@ int main(int argc, char *argv[])
     if(opts.timingon.value())
       Tracer_Plus::settimingon();
 
+    // the tracing/timing stacks and the per-voxel debug output are not
+    // thread safe, so keep to a single thread when they are wanted
+    if(opts.debuglevel.value()>0 || opts.timingon.value())
+      set_max_threads(1);
+
 
 //     ColumnVector storen(10000);
 //     ColumnVector store(10000);
@@ -72,6 +72,7 @@
 #include "miscmaths/miscprob.h"
 #include "newimage/newimageall.h"
 #include "utils/tracer_plus.h"
+#include "utils/threading.h"
 //#include "mcmc.h"
 #include "mcmc_mh.h"
 #include "miscmaths/t2z.h"
@@ -105,7 +106,7 @@ namespace Gs {
   }
   
   void Gsmanager::do_kmeans(const Matrix& data,vector<int>& z,const int k,Matrix& means){
-    Tracer tr("Gsmanager::do_kmeans");  
+    //    Tracer tr("Gsmanager::do_kmeans");  
 
     // note that first class is restricted to having a mean of zero
 
@@ -507,7 +508,7 @@ namespace Gs {
 
   void Gsmanager::multitfit(const Matrix& x, ColumnVector& m, SymmetricMatrix& covar, float& v, bool fixmean/*=false*/) const
   {
-    Tracer_Plus trace("Gsmanager::multitfit");
+    //    Tracer_Plus trace("Gsmanager::multitfit");
 
     int n = x.Ncols();
     int P = x.Nrows();
@@ -760,6 +761,11 @@ namespace Gs {
   {
     Tracer_Plus trace("Gsmanager::run");
 
+    // the z conversion singletons are created lazily, which must not
+    // happen for the first time inside one of the threaded voxel loops
+    T2z::getInstance();
+    F2z::getInstance();
+
     if(opts.runmode.value()==string("fe"))
       {
 	// check that varcope data is available
@@ -1031,7 +1037,7 @@ namespace Gs {
   void Gsmanager::fixed_effects_onvoxel(const ColumnVector& Y, const Matrix& z, const ColumnVector& S, ColumnVector& gam, SymmetricMatrix& gamcovariance)
   {
  
-    Tracer_Plus trace("Gsmanager::fixed_effects_onvoxel");
+    //    Tracer_Plus trace("Gsmanager::fixed_effects_onvoxel");
 
     // calc gam
     DiagonalMatrix iU(ntpts);
@@ -1049,81 +1055,115 @@ namespace Gs {
 
   }
 
+  void Gsmanager::masked_voxels(vector<int>& vx, vector<int>& vy, vector<int>& vz, bool mcmc_only) const
+  {
+    vx.clear(); vy.clear(); vz.clear();
+
+    for(int x = 0; x < xsize; x++)
+      for(int y = 0; y < ysize; y++)
+	for(int z = 0; z < zsize; z++)
+	  {
+	    if(design.getmask()(x,y,z) && (!mcmc_only || mcmc_mask(x,y,z)))
+	      {
+		vx.push_back(x);
+		vy.push_back(y);
+		vz.push_back(z);
+	      }
+	  }
+  }
+
+  void Gsmanager::report_progress(int& vox2, int& voxout) const
+  {
+#ifdef _OPENMP
+#pragma omp critical(gsmanager_progress)
+#endif
+    {
+      vox2++;
+      if(vox2 > voxout*nmaskvoxels/100.0)
+	{
+	  //cout<<(voxout+1)<<'%' <<'\r';		
+	  cout << " " << (voxout+1);
+	  cout.flush();
+	  voxout++;
+	}
+    }
+  }
+
   void Gsmanager::fixed_effects()
   {
     Tracer_Plus trace("Gsmanager::fixed_effects");
   
-    Matrix dm = design.getdm();    
+    const Matrix& globaldm = design.getdm();    
 
     // loop through voxels calling fixed effects inference on each
     OUT(nmaskvoxels);
+
+    vector<int> vx, vy, vz;
+    masked_voxels(vx, vy, vz, false);
     
     int vox2=0;
     int voxout=0;
-    for(int x = 0; x < xsize; x++)
-      for(int y = 0; y < ysize; y++)
-	for(int z = 0; z < zsize; z++)
-	  {
-	    if(design.getmask()(x,y,z))
-	      {
-		vox2++;
-		if(vox2 > voxout*nmaskvoxels/100.0)
-		  {
-		    //cout<<(voxout+1)<<'%' <<'\r';		
-		    cout << " " << (voxout+1);
-		    cout.flush();
-		    voxout++;
-		  }
+    ThreadedError err;
 
-		if(design.is_voxelwise_dm())
-		  {
-		    dm = design.getdm(x,y,z);
-		  }	       
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+    for(int v = 0; v < int(vx.size()); v++)
+      {
+	if(err.occurred()) continue;
+	const int x = vx[v], y = vy[v], z = vz[v];
+	try
+	  {
+	    report_progress(vox2, voxout);
 
-		//	cout << x << "," << y << "," << z << endl;
+	    Matrix voxdm;
+	    if(design.is_voxelwise_dm())
+	      {
+		voxdm = design.getdm(x,y,z);
+	      }	       
+	    const Matrix& dm = design.is_voxelwise_dm() ? voxdm : globaldm;
 
-		// setup data
-		ColumnVector Y = design.getcopedata().voxelts(x,y,z);
-		ColumnVector S = design.getvarcopedata().voxelts(x,y,z);
+	    // setup data
+	    ColumnVector Y = design.getcopedata().voxelts(x,y,z);
+	    ColumnVector S = design.getvarcopedata().voxelts(x,y,z);
 
-		ColumnVector gam;
-		SymmetricMatrix gamcovariance;
+	    ColumnVector gam;
+	    SymmetricMatrix gamcovariance;
 
-		fixed_effects_onvoxel(Y, dm, S, gam, gamcovariance);
+	    fixed_effects_onvoxel(Y, dm, S, gam, gamcovariance);
   
-		// insert any zero EV PEs back in
-		gam = design.insert_zeroev_pes(x,y,z,gam);		    
+	    // insert any zero EV PEs back in
+	    gam = design.insert_zeroev_pes(x,y,z,gam);		    
 
-		if(!opts.no_pe_output.value())
+	    if(!opts.no_pe_output.value())
+	      {
+		// store results for gam:
+		for(int e = 0; e < nevs; e++)
 		  {
-		    // store results for gam:
-		    for(int e = 0; e < nevs; e++)
-		      {
-			pes[e](x,y,z) = gam(e+1);
-		      }
+		    pes[e](x,y,z) = gam(e+1);
 		  }
+	      }
 		   
-		// insert any zero EV PEs back in
-		gamcovariance = design.insert_zeroev_covpes(x,y,z,gamcovariance);
-		    		
-// 		if(!opts.no_pe_output.value())
-// 		  {
-// 		    // store results for gam covariance
-// 		    ColumnVector gamcovariance2;
-// 		    reshape(gamcovariance2, gamcovariance, nevs*nevs, 1);		
-// 		    cov_pes.setvoxelts(gamcovariance2,x,y,z);
-// 		  }
+	    // insert any zero EV PEs back in
+	    gamcovariance = design.insert_zeroev_covpes(x,y,z,gamcovariance);
 		
-		fe_contrasts(gam,gamcovariance,x,y,z);
-	      }
+	    fe_contrasts(gam,gamcovariance,x,y,z);
+	  }
+	catch(Exception& e)
+	  {
+	    err.set(e.what());
 	  }
+      }
+    if(err.occurred())
+      throw Exception(err.what().c_str());
+
     cout << endl;
   }	
 
   void Gsmanager::flame_stage1_onvoxel(const vector<ColumnVector>& Yg, const ColumnVector& Y, const vector<Matrix>& zg, const Matrix& z, const vector<ColumnVector>& Sg, const ColumnVector& S, ColumnVector& beta, ColumnVector& gam, SymmetricMatrix& gamcovariance, vector<float>& marg, vector<ColumnVector>& weights_g, int& nparams, int px, int py, int pz)
   {
  
-    Tracer_Plus trace("Gsmanager::flame_stage1_onvoxel");
+    //    Tracer_Plus trace("Gsmanager::flame_stage1_onvoxel");
 
     ////////////////////////////////////////////////////////////
     // runs flame stage 1 on a voxel without outlier inference
@@ -1664,7 +1704,7 @@ namespace Gs {
 
   void Gsmanager::flame_stage1_onvoxel_inferoutliers(const vector<ColumnVector>& Yg, const ColumnVector& Y, const vector<Matrix>& zg, const Matrix& z, const vector<ColumnVector>& Sg, const ColumnVector& S, ColumnVector& beta, ColumnVector& gam, SymmetricMatrix& gamcovariance, ColumnVector& global_prob_outlier, vector<ColumnVector>& prob_outlier_g,  ColumnVector& prob_outlier, ColumnVector& beta_outlier, vector<float>& marg, vector<ColumnVector>& weights_g, int& nparams, vector<bool>& no_outliers, int px, int py, int pz)
   {
-    Tracer_Plus trace("Gsmanager::flame_stage1_onvoxel_inferoutliers");
+    //    Tracer_Plus trace("Gsmanager::flame_stage1_onvoxel_inferoutliers");
 
     ////////////////////////////////////////////////////////////
     // runs flame stage 1 on a voxel with outlier inference 
@@ -2238,23 +2278,26 @@ namespace Gs {
 
     // loop through voxels calling flame stage 1 on each
     OUT(nmaskvoxels);
+
+    vector<int> vx, vy, vz;
+    masked_voxels(vx, vy, vz, false);
+
     int vox2=0;
     int voxout=0;
-    for(int x = 0; x < xsize; x++)
-      for(int y = 0; y < ysize; y++)
-	for(int z = 0; z < zsize; z++)
-	  {
-	    if(design.getmask()(x,y,z))
-	      //           if(x==20 && y==36 && z==0)		      
+    ThreadedError err;
+
+    // per-voxel cost varies enormously (e.g. with outlier inference),
+    // so voxels are handed out to the threads in small chunks
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,4)
+#endif
+    for(int v = 0; v < int(vx.size()); v++)
+      {
+	if(err.occurred()) continue;
+	const int x = vx[v], y = vy[v], z = vz[v];
+	try
 	      {
-		vox2++;
-		if(vox2 > voxout*nmaskvoxels/100.0)
-		  {
-		    //cout<<(voxout+1)<<'%' <<'\r';		
-		    cout << " " << (voxout+1);
-		    cout.flush();
-		    voxout++;
-		  }
+		report_progress(vox2, voxout);
 		//		cout << x << "," << y << "," << z << endl;       
 		// setup data
 	// 	ColumnVector Y = design.getcopedata().voxelts(x,y,z);
@@ -2391,7 +2434,14 @@ namespace Gs {
 		else
 		  flame1_contrasts(gam,gamcovariance,x,y,z);	  
 	      }
+	catch(Exception& e)
+	  {
+	    err.set(e.what());
 	  }
+      }
+    if(err.occurred())
+      throw Exception(err.what().c_str());
+
     cout << endl;
 
     if(opts.infer_outliers.value() && opts.sigma_smooth_globalproboutlier.value()>0)
@@ -2485,44 +2535,43 @@ namespace Gs {
 
       }
 
-    Matrix gamsamples(nevs, nsamples);
-    Matrix betasamples(ngs, nsamples);
-    Matrix phisamples(ntpts, nsamples);
-    ColumnVector likelihood_samples(nsamples);
-    vector<ColumnVector> sssamples(design.getnumfcontrasts()+1);
-
-    for(int f = 0; f < design.getnumfcontrasts()+1; f++)
-      {
-	sssamples[f].ReSize(nsamples);
-	sssamples[f] = 0;
-      }
-
-
     cout << "Metropolis Hasting Sampling" << endl;
     cout << "Number of voxels=" << nmaskvoxels << endl;
     cout << "Percentage done:" << endl;
+
+    vector<int> vx, vy, vz;
+    masked_voxels(vx, vy, vz, true);
+
     int vox2=0;
     int voxout=0;
-
-    for(int x = 0; x < xsize; x++)
-      for(int y = 0; y < ysize; y++)
-	for(int z = 0; z < zsize; z++)
-	  {
-	    if(design.getmask()(x,y,z))
-	      {		
-		if(mcmc_mask(x,y,z))
+    ThreadedError err;
+
+    // each voxel's chain is seeded afresh from opts.seed inside Mcmc_Mh,
+    // so the samples do not depend on how voxels are shared out
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+    for(int v = 0; v < int(vx.size()); v++)
+      {
+	if(err.occurred()) continue;
+	const int x = vx[v], y = vy[v], z = vz[v];
+	try
 		  {
-		    vox2++;
+		    report_progress(vox2, voxout);
+
+		    Matrix gamsamples(nevs, nsamples);
+		    Matrix betasamples(ngs, nsamples);
+		    Matrix phisamples(ntpts, nsamples);
+		    ColumnVector likelihood_samples(nsamples);
+		    vector<ColumnVector> sssamples(design.getnumfcontrasts()+1);
 		    gamsamples = 0;
 		    betasamples = 0;
 		    phisamples = 0;
-
-		    if(vox2 > voxout*nmaskvoxels/100.0)
+		    likelihood_samples = 0;
+		    for(int f = 0; f < design.getnumfcontrasts()+1; f++)
 		      {
-			//cout<<(voxout+1)<<'%' <<'\r';		
-			cout << " " << (voxout+1);
-			cout.flush();
-			voxout++;
+			sssamples[f].ReSize(nsamples);
+			sssamples[f] = 0;
 		      }
 
 		    if(opts.debuglevel.value()==2)
@@ -2557,8 +2606,6 @@ namespace Gs {
 			betac(g+1) = beta_c[g](x,y,z);
 		      }
 
-		    srand(opts.seed.value());
-
 		    // get ready the outlier results		    
 		    ColumnVector prob_outlier_mcmc(ntpts);
 		    vector<float> global_prob_outlier_mcmc(ngs);
@@ -2618,6 +2665,9 @@ namespace Gs {
 		    flame2_contrasts(gamsamples,x,y,z);
 
 		    if((std::abs(zts[0](x,y,z)-zflame1lowerts[0](x,y,z))>3))
+#ifdef _OPENMP
+#pragma omp critical(gsmanager_progress)
+#endif
 		      {
 			cout << endl << "WARNING: FLAME stage 2 has given an abnormally large difference to stage 1" << endl;
 			cout << "x=" << x << ",y=" << y << ",z=" << z << endl;
@@ -2667,8 +2717,13 @@ namespace Gs {
 
 		      }
 		  }	      	    
-	      }
+	catch(Exception& e)
+	  {
+	    err.set(e.what());
 	  }
+      }
+    if(err.occurred())
+      throw Exception(err.what().c_str());
 	  
     if(opts.verbose.value())
       {
@@ -2814,7 +2869,7 @@ namespace Gs {
 
   void Gsmanager::fe_contrasts(const ColumnVector& mn, const SymmetricMatrix& covariance, int px, int py, int pz)
   {
-    Tracer_Plus trace("Gsmanager::fe_contrasts");    
+    //    Tracer_Plus trace("Gsmanager::fe_contrasts");    
 
     // contrasts for fixed effects
 
@@ -2848,7 +2903,7 @@ namespace Gs {
 
   void Gsmanager::flame1_contrasts(const ColumnVector& mn, const SymmetricMatrix& covariance, int px, int py, int pz)
   {
-    Tracer_Plus trace("Gsmanager::flame1_contrasts");    
+    //    Tracer_Plus trace("Gsmanager::flame1_contrasts");    
     
     for(int t = 0; t < design.getnumtcontrasts(); t++)
       {
@@ -2907,7 +2962,7 @@ namespace Gs {
 
   void Gsmanager::flame1_contrasts_with_outliers(const ColumnVector& mn, const SymmetricMatrix& covariance, int px, int py, int pz)
   {
-    Tracer_Plus trace("Gsmanager::flame1_contrasts_with_outliers");    
+    //    Tracer_Plus trace("Gsmanager::flame1_contrasts_with_outliers");    
     
     for(int t = 0; t < design.getnumtcontrasts(); t++)
       {
@@ -2991,7 +3046,7 @@ namespace Gs {
 
   void Gsmanager::flame2_contrasts(const Matrix& gamsamples, int px, int py, int pz)
   {
-    Tracer_Plus trace("Gsmanager::flame2_contrasts");   
+    //    Tracer_Plus trace("Gsmanager::flame2_contrasts");   
     
     for(int t = 0; t < design.getnumtcontrasts(); t++)
       {
@@ -3059,7 +3114,7 @@ namespace Gs {
  
   void Gsmanager::t_mcmc_contrast(const Matrix& gamsamples, const RowVector& tcontrast, float& cope, float& varcope, float& t, float& dof, float& z, int px, int py, int pz)
   {
-    Tracer_Plus trace("Gsmanager::t_mcmc_contrast");
+    //    Tracer_Plus trace("Gsmanager::t_mcmc_contrast");
  
     //gamsamples(nevs, nsamples);
   
@@ -3119,7 +3174,7 @@ namespace Gs {
 
   void Gsmanager::f_mcmc_contrast(const Matrix& gamsamples, const Matrix& fcontrast, float& f, float& dof1, float& dof2, float& z, int px, int py, int pz)
   {
-    Tracer_Plus trace("Gsmanager::f_mcmc_contrast");
+    //    Tracer_Plus trace("Gsmanager::f_mcmc_contrast");
     
     //gamsamples(nevs, nsamples);
     
@@ -148,6 +148,11 @@ namespace Gs {
       void flame_stage1_inferoutliers();
       void init_flame_stage1_inferoutliers();
 
+      // masked voxel coordinates in x-y-z loop order, the unit of work
+      // handed out to threads by the voxelwise inference loops
+      void masked_voxels(vector<int>& vx, vector<int>& vy, vector<int>& vz, bool mcmc_only) const;
+      void report_progress(int& vox2, int& voxout) const;
+
       // functions to perform the different inference approaches
       void fixed_effects(); 
       void ols(); 
@@ -80,10 +80,44 @@ using namespace NEWIMAGE;
 
 namespace Gs {
 
+  Mcmc_Rng::Mcmc_Rng(int seed) :
+    fpos(3),
+    rpos(0)
+  {
+    state[0] = (seed==0) ? 1 : seed;
+    for(int i = 1; i < 31; i++)
+      {
+	long word = (int)state[i-1];
+	long hi = word/127773;
+	long lo = word%127773;
+	word = 16807*lo - 2836*hi;
+	if(word < 0) word += 2147483647;
+	state[i] = word;
+      }
+
+    for(int i = 0; i < 310; i++)
+      next();
+  }
+
+  int Mcmc_Rng::next()
+  {
+    state[fpos] += state[rpos];
+    int result = state[fpos] >> 1;
+
+    if(++fpos >= 31)
+      {
+	fpos = 0;
+	++rpos;
+      }
+    else if(++rpos >= 31)
+      rpos = 0;
+
+    return result;
+  }
 
   void Mcmc_Mh::setup()
   {
-    Tracer_Plus trace("Mcmc_Mh::setup");
+    //    Tracer_Plus trace("Mcmc_Mh::setup");
     
     beta_naccepted = 0;
     phi_naccepted = 0;
@@ -180,7 +214,7 @@ namespace Gs {
 
   void Mcmc_Mh::jump()
   {
-    Tracer_Plus trace("Mcmc_Mh::jump");
+    //    Tracer_Plus trace("Mcmc_Mh::jump");
         
     //    all_jump();
 
@@ -221,7 +255,7 @@ namespace Gs {
 
   void Mcmc_Mh::beta_jump()
   {
-    Tracer_Plus trace("Mcmc_Mh::beta_jump");
+    //    Tracer_Plus trace("Mcmc_Mh::beta_jump");
 
 //     if(sampcount>9844)
 //        GsOptions::getInstance().debuglevel.set_value("2");
@@ -234,7 +268,7 @@ namespace Gs {
 	ColumnVector logprec_ontwo_old = logprec_ontwo;
 
 	// propose new value	
-	beta_latest(g) += normrnd().AsScalar()*beta_proposal_std(g);	  
+	beta_latest(g) += rng.norm()*beta_proposal_std(g);	  
 
 	// use when sampling from log(variance)
 	//	if(abs(beta_latest(g)) > 50) {beta_latest(g) = beta_old; beta_nrejected(g)++; return;}
@@ -246,7 +280,7 @@ namespace Gs {
 	float beta_prior_energy_new = beta_prior_energy(g);
 
 	// calculate acceptance threshold
-	float tmp = unifrnd().AsScalar();
+	float tmp = rng.unif();
 	float energy_new = likelihood_energy_new + beta_prior_energy_new;
 	float energy_old = likelihood_energy_old + beta_prior_energy_old(g);
 
@@ -301,7 +335,7 @@ namespace Gs {
 
   void Mcmc_Mh::phi_jump()
   {
-    Tracer_Plus trace("Mcmc_Mh::phi_jump");
+    //    Tracer_Plus trace("Mcmc_Mh::phi_jump");
 
 //     if(sampcount>9844)
 //        GsOptions::getInstance().debuglevel.set_value("2");
@@ -314,7 +348,7 @@ namespace Gs {
 	ColumnVector logprec_ontwo_old = logprec_ontwo;
 
 	// propose new value	
-	phi_latest(t) += normrnd().AsScalar()*phi_proposal_std(t);	  
+	phi_latest(t) += rng.norm()*phi_proposal_std(t);	  
 
 	if(phi_latest(t) <= 0) {phi_latest(t) = phi_old; phi_nrejected(t)++; return;}
 	
@@ -323,7 +357,7 @@ namespace Gs {
 	float beta_prior_energy_new = beta_prior_energy(design.getgroup(t));
 
 	// calculate acceptance threshold
-	float tmp = unifrnd().AsScalar();
+	float tmp = rng.unif();
 	float energy_new = likelihood_energy_new + phi_prior_energy_new + beta_prior_energy_new;
 	float energy_old = likelihood_energy_old + phi_prior_energy_old(t) + beta_prior_energy_old(design.getgroup(t));
 
@@ -414,7 +448,7 @@ namespace Gs {
 
   void Mcmc_Mh::gamma_jump()
   {
-    Tracer_Plus trace("Mcmc_Mh::gamma_jump");
+    //    Tracer_Plus trace("Mcmc_Mh::gamma_jump");
     
     for(int e = 1; e <= nevs; e++)
       {
@@ -423,13 +457,13 @@ namespace Gs {
 	ColumnVector sumovere_old = sumovere;
 
 	// propose new values	
-	gamma_latest(e) += normrnd().AsScalar()*gamma_proposal_std(e);      
+	gamma_latest(e) += rng.norm()*gamma_proposal_std(e);      
 
 	float likelihood_energy_new = likelihood_energy(e,gamma_old,false);	
 
 	// calculate acceptance threshold
 
-	float tmp = unifrnd().AsScalar();
+	float tmp = rng.unif();
 
 	bool accept = exp(likelihood_energy_old - likelihood_energy_new) > tmp;
 
@@ -502,7 +536,7 @@ namespace Gs {
 
   float Mcmc_Mh::likelihood_energy(const int echanged, const float gamma_old, const bool betachanged)
   {
-    Tracer_Plus trace("Mcmc_Mh::likelihood_energy");
+    //    Tracer_Plus trace("Mcmc_Mh::likelihood_energy");
 
     float en = 0.0;
 
@@ -582,7 +616,7 @@ namespace Gs {
 
   float Mcmc_Mh::beta_prior_energy(int g)
   {
-    Tracer_Plus trace("Mcmc_Mh::beta_prior_energy");
+    //    Tracer_Plus trace("Mcmc_Mh::beta_prior_energy");
     
     float en = 0.0;
     
@@ -594,7 +628,7 @@ namespace Gs {
 
   float Mcmc_Mh::phi_prior_energy(int t)
   {
-    Tracer_Plus trace("Mcmc_Mh::phi_prior_energy");
+    //    Tracer_Plus trace("Mcmc_Mh::phi_prior_energy");
     
     // p276 Lee
     float S = dofvarcopedata(t)/varcopedata(t);
@@ -605,7 +639,7 @@ namespace Gs {
 
   void Mcmc_Mh::sample(int samp)
   {
-    Tracer_Plus trace("Mcmc_Mh::sample");
+    //    Tracer_Plus trace("Mcmc_Mh::sample");
 
     sampcount++;    
 
@@ -690,7 +724,7 @@ namespace Gs {
 
   void Mcmc_Mh::run()
   {
-    Tracer_Plus trace("Mcmc_Mh::run");
+    //    Tracer_Plus trace("Mcmc_Mh::run");
     
     int samples = 1;
     int jumps = 0;
@@ -76,6 +76,7 @@
 
 #include "gsoptions.h"
 #include "newimage/newimageall.h"
+#include "miscmaths/miscprob.h"
 #include "newmat.h"
 #include "design.h"
 
@@ -83,6 +84,26 @@ using namespace NEWIMAGE;
 using namespace NEWMAT;
 
 namespace Gs {
+
+  // Random number stream owned by a single chain. It runs the same additive
+  // feedback generator as glibc's rand(), and maps it to uniform/normal
+  // deviates as MISCMATHS::unifrnd()/normrnd() do, so a chain seeded with
+  // --seed draws the same numbers as when every voxel reseeded the global
+  // generator, while chains running in different threads stay independent.
+  class Mcmc_Rng
+    {
+    public:
+      Mcmc_Rng(int seed);
+
+      int next();
+      double unif() { return (next()+1)/double(2147483647+2.0); }
+      double norm() { return MISCMATHS::ndtri(unif()); }
+
+    private:
+      unsigned int state[31];
+      int fpos;
+      int rpos;
+    };
     
   class Mcmc_Mh
     {
@@ -155,7 +176,8 @@ namespace Gs {
 	prob_outlier(pprob_outlier),
 	global_prob_outlier(pglobal_prob_outlier),
 	beta_outlier(pbeta_outlier),
-	infer_outliers(pinfer_outliers)
+	infer_outliers(pinfer_outliers),
+	rng(opts.seed.value())
 	{ 
 	}
 
@@ -276,6 +298,8 @@ namespace Gs {
       const vector<float>& beta_outlier;
 
       bool infer_outliers;
+
+      Mcmc_Rng rng;
  
     };
 }   
@@ -65,6 +65,7 @@
 #include <sstream>
 #include <cmath>
 #include <set>
+#include "utils/threading.h"
 
 #define GL_GLEXT_PROTOTYPES
 
@@ -818,46 +819,66 @@ namespace fslsurface_name {
 	void fslSurface<T,T2>::calculateNormals( bool normalize, bool reverse_winding){
 	//	cout<<"normals calculate normals"<<endl;
 		
-		for (typename vector<T2>::iterator i_faces = faces.begin() ; i_faces != faces.end() ; i_faces+=3)
+		//face normals are computed in parallel, then each vertex sums the normals of its faces in face order,
+		//which is the order a single pass over the faces adds them in
+		int ntri = faces.size()/3;
+		vector<float> face_normals(ntri*3);
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+		for (int i = 0 ; i < ntri ; ++i)
 		{ 
-			
+			typename vector<T2>::const_iterator i_faces = faces.begin() + 3*i;
 			vec3<float> p0 = vec3<float>( vertices[*i_faces].x	,	vertices[*i_faces].y	,	vertices[*i_faces].z	);
             vec3<float> p2 = vec3<float>(	vertices[*(i_faces+1)].x	,	vertices[*(i_faces+1)].y	,	vertices[*(i_faces+1)].z);
             vec3<float> p1 = vec3<float>(	vertices[*(i_faces+2)].x	,	vertices[*(i_faces+2)].y	,	vertices[*(i_faces+2)].z);
             vec3<float> n = normal<float>(subtract<float>(p0,p2),subtract<float>(p0,p1));
-			vertices[	*(i_faces)	].nx  +=   n.x;
-            vertices[	*(i_faces)	].ny  +=   n.y;
-            vertices[	*(i_faces)	].nz  +=   n.z;
-			
-			vertices[*(i_faces+1)].nx  +=   n.x;
-            vertices[*(i_faces+1)].ny  +=   n.y;
-            vertices[*(i_faces+1)].nz  +=   n.z;
-			
-			vertices[*(i_faces+2)].nx  +=   n.x;
-            vertices[*(i_faces+2)].ny  +=   n.y;
-            vertices[*(i_faces+2)].nz  +=   n.z;
-			//	cout<<"normals "<<n.x<<" "<<n.y<<" "<<n.z<<endl;
-			
+			face_normals[3*i] = n.x;
+			face_normals[3*i+1] = n.y;
+			face_normals[3*i+2] = n.z;
 		}
-		//cout<<"norm 000 "<<vertices[0].nx<<" "<<vertices[0].ny<<" "<<vertices[0].nz<<endl;
-		if (normalize)
-		for ( typename vector< vertex<T> >::iterator i_vert = vertices.begin(); i_vert != vertices.end() ; i_vert++)
+		
+		//faces of each vertex (once per corner), in face order
+		int nverts = vertices.size();
+		vector<int> vert_start(nverts+1,0);
+		for (typename vector<T2>::iterator i_faces = faces.begin() ; i_faces != faces.end() ; ++i_faces)
+			++vert_start[*i_faces+1];
+		for (int i = 0 ; i < nverts ; ++i)
+			vert_start[i+1] += vert_start[i];
+		vector<int> vert_faces(faces.size());
+		vector<int> next(vert_start.begin(), vert_start.end()-1);
+		for (unsigned int i = 0 ; i < faces.size() ; ++i)
+			vert_faces[next[faces[i]]++] = i/3;
+		
+#ifdef _OPENMP
+#pragma omp parallel for if(Utilities::max_threads() > 1)
+#endif
+		for (int i = 0 ; i < nverts ; ++i)
 		{
-			float norm = sqrt( i_vert->nx* i_vert->nx +  i_vert->ny* i_vert->ny + i_vert->nz* i_vert->nz);
-			i_vert->nx /= norm;
-            i_vert->ny /= norm;
-			i_vert->nz /= norm;
+			typename vector< vertex<T> >::iterator i_vert = vertices.begin() + i;
+			for (int j = vert_start[i] ; j < vert_start[i+1] ; ++j)
+			{
+				const float* n = &face_normals[3*vert_faces[j]];
+				i_vert->nx  +=   n[0];
+				i_vert->ny  +=   n[1];
+				i_vert->nz  +=   n[2];
+			}
+			
+			if (normalize)
+			{
+				float norm = sqrt( i_vert->nx* i_vert->nx +  i_vert->ny* i_vert->ny + i_vert->nz* i_vert->nz);
+				i_vert->nx /= norm;
+				i_vert->ny /= norm;
+				i_vert->nz /= norm;
+			}
+			
+			if (reverse_winding)
+			{
+				i_vert->nx *= -1;
+				i_vert->ny *= -1;
+				i_vert->nz *= -1;
+			}
 		}
-        
-        if (reverse_winding)
-        {
-            for ( typename vector< vertex<T> >::iterator i_vert = vertices.begin(); i_vert != vertices.end() ; i_vert++)
-            {
-                i_vert->nx *= -1;
-                i_vert->ny *= -1;
-                i_vert->nz *= -1;
-            }
-        }
 		
     }
 	
@@ -295,6 +295,8 @@ namespace fslsurface_name{
 		template<class U,class U2>
 		friend int readGIFTI( fslSurface<U,U2>& surf, const std::string & filename );
 		template<class U,class U2>
+		friend int readGIFTI( fslSurface<U,U2>& surf, const std::string & filename, const std::vector<int> & da_list );
+		template<class U,class U2>
 		friend int readVTK( fslSurface<U,U2>& surf, const std::string & filename );
 		template<class U,class U2>
 		friend int readPLY( fslSurface<U,U2>& surf, const std::string & filename );
@@ -68,6 +68,8 @@
 #include <set>
 #include <queue>
 #include<cmath>
+#include <stdexcept>
+#include "utils/threading.h"
 using namespace std;
 
 #define PI 3.141592653589793238462643383
@@ -980,6 +982,126 @@ namespace fslsurface_name {
 
     
     
+	//Output of marchingCubesSlab for one slab of cube planes. Faces index the slab's own vertices,
+	//or, when negative, an edge (-face-1) of the previous slab's last edge table.
+	template<class T>
+	struct mcubesSlab
+	{
+		vector< vertex<T> > vertices;
+		vector<int> faces;
+		vector<int> edges;
+	};
+
+	//Triangulates the cube planes z0 <= z < z1. Vertices on edges shared with an earlier cube are looked up in
+	//edge index tables (12 entries per cube) for the current and previous plane, in the same order as a single
+	//sweep over the volume; edges shared with the plane below z0 are left for the caller to stitch.
+	template<class T, class T3>
+	void marchingCubesSlab( mcubesSlab<T>& slab, const T3* imth, const fslsurface_name::image_dims & dims, const T3 & thresh, const T & label, const int* edgeTable, const int (*triTable)[16], const int & z0, const int & z1 )
+	{
+		//edge p0-p1,p1-p2,p2-p3,p3-p0,p4-p5,p5-p6,p6-p7,p7-p4,p0-p4,p1-p5,p2-p6,p3-p7
+		const int edgeVerts[12][2] = { {0,1}, {1,2}, {2,3}, {3,0}, {4,5}, {5,6}, {6,7}, {7,4}, {0,4}, {1,5}, {2,6}, {3,7} };
+		//corner offsets of p0..p7
+		const int cornerOffset[8][3] = { {0,1,0}, {1,1,0}, {1,0,0}, {0,0,0}, {0,1,1}, {1,1,1}, {1,0,1}, {0,0,1} };
+		
+		int ystride = static_cast<int>(dims.xsize);
+		int zstride = static_cast<int>(dims.xsize * dims.ysize);
+		
+		vector<int> prev, cur(zstride*12,-1);
+		float vertVals[8];
+		
+		for ( int z = z0 ; z < z1; ++z)
+		{
+			if (z > z0)
+			{
+				prev.swap(cur);
+				cur.assign(zstride*12,-1);
+			}
+			for ( int y = 0 ; y < dims.ysize-1; ++y)
+				for ( int x = 0 ; x < dims.xsize-1; ++x)
+				{
+					int cell = x + y*ystride;
+					int index = cell + z*zstride;
+					
+					vertVals[0] = imth[index + ystride   ];
+					vertVals[1] = imth[index + ystride  +1];
+					vertVals[2] = imth[index + 1];
+					vertVals[3] = imth[index ];
+					vertVals[4] = imth[index +zstride + ystride    ];
+					vertVals[5] = imth[index +zstride + ystride  +1];
+					vertVals[6] = imth[index +zstride + 1       ];
+					vertVals[7] = imth[index +zstride           ];
+					
+					int cubeindex = 0;
+					for (int i = 0; i < 8; ++i)
+						if ( vertVals[i] < thresh) cubeindex |= (1 << i);
+					
+					if (edgeTable[cubeindex] == 0)
+						continue;
+					
+					int* edges = &cur[cell*12];
+					for (int i = 0; i < 12; ++i)
+					{
+						if (!(edgeTable[cubeindex] & (1 << i)))
+							continue;
+						
+						bool shared = true;
+						switch (i)
+						{
+							case 0: case 1: case 2: case 3:
+								if (z > z0)
+									edges[i] = prev[cell*12 + i + 4];
+								else if (z > 0)
+									edges[i] = -(cell*12 + i + 4) - 1;
+								else if ((i == 2) && (y > 0))
+									edges[i] = cur[(cell - ystride)*12];
+								else if ((i == 3) && (x > 0))
+									edges[i] = cur[(cell - 1)*12 + 1];
+								else
+									shared = false;
+								break;
+							case 6:
+								if (y > 0) edges[i] = cur[(cell - ystride)*12 + 4]; else shared = false;
+								break;
+							case 7:
+								if (x > 0) edges[i] = cur[(cell - 1)*12 + 5]; else shared = false;
+								break;
+							case 8:
+								if (x > 0) edges[i] = cur[(cell - 1)*12 + 9]; else shared = false;
+								break;
+							case 10:
+								if (y > 0) edges[i] = cur[(cell - ystride)*12 + 9]; else shared = false;
+								break;
+							case 11:
+								if (x > 0) edges[i] = cur[(cell - 1)*12 + 10];
+								else if (y > 0) edges[i] = cur[(cell - ystride)*12 + 8];
+								else shared = false;
+								break;
+							default:
+								shared = false;
+						}
+						
+						if (!shared)
+						{
+							const int* c0 = cornerOffset[edgeVerts[i][0]];
+							const int* c1 = cornerOffset[edgeVerts[i][1]];
+							vertex<T> vnew(label);
+							vertexInterp(thresh, \
+										 vec3<float>((x+c0[0])*dims.xdim,(y+c0[1])*dims.ydim, (z+c0[2])*dims.zdim), \
+										 vertVals[edgeVerts[i][0]], \
+										 vec3<float>((x+c1[0])*dims.xdim,(y+c1[1])*dims.ydim, (z+c1[2])*dims.zdim), \
+										 vertVals[edgeVerts[i][1]], vnew );
+							edges[i] = slab.vertices.size();
+							slab.vertices.push_back(vnew);
+						}
+					}
+					
+					for (int i_tri = 0 ; triTable[cubeindex][i_tri] != -1 ; ++i_tri)
+						slab.faces.push_back( edges[triTable[cubeindex][i_tri]] );
+				}
+		}
+		slab.edges.swap(cur);
+	}
+	
 	template<class T, class T2,class T3>
 	void runMarchingCubesOnAllLabels( fslSurface<T,T2>& surf, const T3* image,  const fslsurface_name::image_dims & dims, const T3 & thresh_in)
 	{
@@ -1382,386 +1504,53 @@ namespace fslsurface_name {
 		 tells us which vertices are inside of the surface
 		 */
 		
-		//	int ElCount =0;
-		int cubeindex = 0;
-		float* vertVals = new float[8];
-		int index  = 0 ; 
-		vector< map<int, unsigned int> > index_2_index_all;
+		//The cube planes are split into slabs which are triangulated concurrently, then stitched together in
+		//order: vertex and face ordering is the same as for a single sweep through the volume.
+		int nplanes = static_cast<int>(dims.zsize) - 1;
+		int nslabs = std::min(nplanes, 2*Utilities::max_threads());
+		vector< mcubesSlab<T> > slabs(std::max(nslabs,0));
+		Utilities::ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1) if(nslabs > 1)
+#endif
+		for (int s = 0; s < nslabs; ++s)
+		{
+			if (err.occurred()) continue;
+			try {
+				marchingCubesSlab<T,T3>(slabs[s], imth, dims, thresh, label, edgeTable, triTable, (nplanes*s)/nslabs, (nplanes*(s+1))/nslabs);
+			} catch (const std::exception& e) {
+				err.set(e.what());
+			} catch (...) {
+				err.set("marchingCubes: unknown exception");
+			}
+		}
+		if (err.occurred())
+		{
+			delete[] imth;
+			throw std::runtime_error(err.what());
+		}
 		
-		for ( int z = 0 ; z < dims.zsize-1; ++z)
+		T2 vert_index = surf.vertices.size();
+		T2 prev_index = vert_index;
+		for (int s = 0; s < nslabs; ++s)
 		{
-		//cout<<"xyz "<<z<<endl;
-
-			for ( int y = 0 ; y < dims.ysize-1; ++y)
+			for (vector<int>::iterator i_f = slabs[s].faces.begin(); i_f != slabs[s].faces.end(); ++i_f)
 			{
-				////cout<<"xy "<<y<<endl;
-
-				for ( int x = 0 ; x < dims.xsize-1; ++x, ++index)
-				{
-				//	if ((z==158)&&(y==153))
-				//		//cout<<"vert "<<x<<" "<<y<<" "<<z<<endl;
-					//vertVal
-					//	//cout<<"new vert "<<x<<" "<<y<<" "<<z<<" "<<index<<" "<<" ."<<static_cast<int>(x + y*ystride	+ z*zstride)<<". "<<imth[index]<<" "<<image[index]<<" "<<image[static_cast<int>(x + y*ystride	+ z*zstride)]<<endl;
-					////cout<<"new vert test "<<x<<" "<<y<<" "<<z<<" "<<imth[index]<<" "<<im_ptr[index]<<" "<<im_ptr[static_cast<int>(x + y*ystride	+ z*zstride)]<<endl;
-					//	image[static_cast<int>(x + y*ystride	+ z*zstride)]
-					cubeindex = 0;
-					/*	vertVals[0] = imth[x + (y+1)*ystride	+ z*zstride   ];
-					 vertVals[1] = imth[(x+1) + (y+1)*ystride	+ z*zstride   ];
-					 vertVals[2] = imth[(x+1) + y*ystride	+ z*zstride   ];
-					 vertVals[3] = imth[x + (y+1)*ystride	+ z*zstride   ];
-					 vertVals[4] = imth[x + (y+1)*ystride	+ z*zstride   ];
-					 vertVals[5] = imth[x + (y+1)*ystride	+ z*zstride   ];
-					 vertVals[6] = imth[x + (y+1)*ystride	+ z*zstride   ];
-					 vertVals[7] = imth[x + (y+1)*ystride	+ z*zstride   ];
-					 
-					 */
-					
-					vertVals[0] = imth[index + ystride   ];
-					vertVals[1] = imth[index + ystride  +1];
-					vertVals[2] = imth[index + 1];
-					vertVals[3] = imth[index ];
-					vertVals[4] = imth[index +zstride + ystride    ];
-					vertVals[5] = imth[index +zstride + ystride  +1];
-					vertVals[6] = imth[index +zstride + 1       ];
-					vertVals[7] = imth[index +zstride           ];
-				//	if ((z==158)&&(y==153))
-				//		//cout<<"cube vals:"<<endl;
-					//		for (int i =0 ; i < 8 ; ++i)
-					//			//cout<<vertVals[i]<<" ";
-					//		//cout<<endl;
-					if ( vertVals[0] < thresh) cubeindex |= 1; 
-					if ( vertVals[1] < thresh) cubeindex |= 2; 
-					if ( vertVals[2] < thresh) cubeindex |= 4; 
-					if ( vertVals[3] < thresh) cubeindex |= 8; 
-					
-					if ( vertVals[4] < thresh) cubeindex |= 16; 
-					if ( vertVals[5] < thresh) cubeindex |= 32; 
-					if ( vertVals[6] < thresh) cubeindex |= 64; 
-					if ( vertVals[7] < thresh) cubeindex |= 128; 
-					
-					
-					map<int, unsigned int> index_2_index;
-				//	if ((z==158)&&(y==153))
-				//		//cout<<"check edge table "<<index_2_index_all.max_size()<<endl;
-					if (edgeTable[cubeindex] == 0)
-					{
-				//		if ((z==158)&&(y==153))
-				//		//cout<<"enter edge table check "<<index_2_index_all.size()<<" "<<index_2_index.size()<<" "<<cubeindex<<endl;
-						index_2_index_all.push_back(index_2_index);
-				//		if ((z==158)&&(y==153))
-				//		//cout<<"go to continue "<<endl;
-						continue;
-					}
-				//	//cout<<"check edge table end"<<endl;
-					////cout<<"new vert "<<x<<" "<<y<<" "<<z<<" "<<index<<" "<<" ."<<static_cast<int>(x + y*ystride	+ z*zstride)<<". "<<imth[index]<<" "<<image[index]<<" "<<image[static_cast<int>(x + y*ystride	+ z*zstride)]<<endl;
-
-					T2 vert_count=0;
-					T2 vert_index = surf.vertices.size();
-					/// Find the vertices where the surface intersects the cube 
-					if (edgeTable[cubeindex] & 1)
-					{	//edge p0-p1
-						if (z==0)
-						{
-							vertex<T> vnew(label);
-							vertexInterp(thresh, \
-										 vec3<float>(x*dims.xdim,(y+1)*dims.ydim, z*dims.zdim),\
-										 vertVals[0], \
-										 vec3<float>((x+1)*dims.xdim,(y+1)*dims.ydim, z*dims.zdim), \
-										 vertVals[1], vnew ); 
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							index_2_index.insert( pair<int, unsigned int> (0,vert_index+vert_count) );
-							++vert_count;
-						}else {
-							index_2_index.insert( pair<int,unsigned int>(0, index_2_index_all[x +y*ystride + (z-1)*zstride].find(4)->second) );
-							
-						}
-						
-					}
-					if (edgeTable[cubeindex] & 2)
-					{	//edge p1-p2
-						if (z==0)
-						{
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>((x+1)*dims.xdim,(y+1)*dims.ydim, z*dims.zdim), \
-										 vertVals[1], \
-										 vec3<float>((x+1)*dims.xdim,y*dims.ydim, z*dims.zdim), \
-										 vertVals[2], vnew ); 
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							
-							index_2_index.insert( pair<int, unsigned int> (1,vert_index+vert_count) );
-							++vert_count;
-							
-						}else {
-							index_2_index.insert( pair<int,unsigned int>(1, index_2_index_all[x +y*ystride + (z-1)*zstride].find(5)->second) );
-							
-						}
-						
-						
-						
-					}if (edgeTable[cubeindex] & 4)
-					{	//edge p2-p3
-						if ((z==0)&&(y==0))
-						{
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>((x+1)*dims.xdim,y*dims.ydim, z*dims.zdim), \
-										 vertVals[2], \
-										 vec3<float>(x*dims.xdim,y*dims.ydim, z*dims.zdim), \
-										 vertVals[3], vnew ); 
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							
-							index_2_index.insert( pair<int, unsigned int> (2,vert_index+vert_count) );
-							++vert_count;
-							
-						}else if (z==0){
-							index_2_index.insert( pair<int,unsigned int>(2, index_2_index_all[x + (y-1)*ystride ].find(0)->second) );
-						}else{	
-							index_2_index.insert( pair<int,unsigned int>(2, index_2_index_all[x +y*ystride + (z-1)*zstride].find(6)->second) );
-						}
-						
-					}if (edgeTable[cubeindex] & 8)
-					{	//edge p3-p0
-						if ((x==0)&&(z==0))
-						{
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>(x*dims.xdim,y*dims.ydim, z*dims.zdim), \
-										 vertVals[3], \
-										 vec3<float>(x*dims.xdim,(y+1)*dims.ydim, z*dims.zdim), \
-										 vertVals[0], vnew ); 
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							index_2_index.insert( pair<int, unsigned int> (3,vert_index+vert_count) );
-							++vert_count;
-							
-						}else if (z==0) {
-							index_2_index.insert( pair<int,unsigned int>(3, index_2_index_all[x-1 +y*ystride].find(1)->second) );
-						}else{
-							index_2_index.insert( pair<int,unsigned int>(3, index_2_index_all[x +y*ystride + (z-1)*zstride].find(7)->second) );
-						}
-						
-						
-					}	if (edgeTable[cubeindex] & 16)
-					{	//edge p4-p5
-						vertex<T> vnew(label);
-						
-						vertexInterp(thresh, \
-									 vec3<float>(x*dims.xdim,(y+1)*dims.ydim, (z+1)*dims.zdim), \
-									 vertVals[4], \
-									 vec3<float>((x+1)*dims.xdim,(y+1)*dims.ydim, (z+1)*dims.zdim), \
-									 vertVals[5], vnew ); 
-						surf.vertices.push_back(vnew);
-						surf.scalar_data[0].push_back(label);
-						index_2_index.insert( pair<int, unsigned int> (4,vert_index+vert_count) );
-						++vert_count;
-						
-						
-						
-					}
-					if (edgeTable[cubeindex] & 32)
-					{	//edge p1-p2
-						//	//cout<<"edge 5 "<<endl;
-						
-						vertex<T> vnew(label);
-						
-						vertexInterp(thresh, \
-									 vec3<float>((x+1)*dims.xdim,(y+1)*dims.ydim, (z+1)*dims.zdim), \
-									 vertVals[5], \
-									 vec3<float>((x+1)*dims.xdim,y*dims.ydim, (z+1)*dims.zdim), \
-									 vertVals[6], vnew ); 
-						surf.vertices.push_back(vnew);
-						surf.scalar_data[0].push_back(label);
-						index_2_index.insert( pair<int, unsigned int> (5,vert_index+vert_count) );
-						++vert_count;
-						
-						
-						
-					}if (edgeTable[cubeindex] & 64)
-					{	//edge p2-p3
-						if (y==0)
-						{
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>((x+1)*dims.xdim,y*dims.ydim, (z+1)*dims.zdim), \
-										 vertVals[6], \
-										 vec3<float>(x*dims.xdim,y*dims.ydim, (z+1)*dims.zdim), \
-										 vertVals[7], vnew ); 
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							index_2_index.insert( pair<int, unsigned int> (6,vert_index+vert_count) );
-							++vert_count;
-							
-						}else {
-							index_2_index.insert( pair<int,unsigned int>(6, index_2_index_all[x +(y-1)*ystride + z*zstride].find(4)->second) );
-							
-						}
-						
-						
-					}if (edgeTable[cubeindex] & 128)
-					{	//edge p3-p0
-						////cout<<"edge 7 "<<endl;
-						if (x==0)
-						{
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>(x*dims.xdim,y*dims.ydim, (z+1)*dims.zdim), \
-										 vertVals[7], \
-										 vec3<float>(x*dims.xdim,(y+1)*dims.ydim, (z+1)*dims.zdim), \
-										 vertVals[4], vnew );
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							index_2_index.insert( pair<int, unsigned int> (7,vert_index+vert_count) );
-							++vert_count;
-							
-						}	else {
-							////cout<<"find previous index "<<index_2_index_all.size()<<" "<<y*ystride<<" "<<z*zstride<<" "<<(x-1) +y*ystride + z*zstride<<" "<<index<<endl;
-							index_2_index.insert( pair<int,unsigned int>(7, index_2_index_all[(x-1) +y*ystride + z*zstride].find(5)->second) );
-							
-						}
-						////cout<<"done edge 7 "<<endl;
-						
-					}
-					if (edgeTable[cubeindex] & 256){	//edge p0-p4
-						
-						if (x==0)
-						{
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>(x*dims.xdim,(y+1)*dims.ydim, z*dims.zdim), \
-										 vertVals[0], \
-										 vec3<float>(x*dims.xdim,(y+1)*dims.ydim, (z+1)*dims.zdim), \
-										 vertVals[4], vnew ); 
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							index_2_index.insert( pair<int, unsigned int> (8,vert_index+vert_count) );
-							++vert_count;
-							
-						}else {
-							index_2_index.insert( pair<int,unsigned int>(8, index_2_index_all[(x-1) +y*ystride + z*zstride].find(9)->second) );
-							
-						}
-						
-						
-					}
-					if (edgeTable[cubeindex] & 512){	//edge p1-p5
-						
-						vertex<T> vnew(label);
-						
-						vertexInterp(thresh, \
-									 vec3<float>((x+1)*dims.xdim,(y+1)*dims.ydim, z*dims.zdim), \
-									 vertVals[1], \
-									 vec3<float>((x+1)*dims.xdim,(y+1)*dims.ydim, (z+1)*dims.zdim), \
-									 vertVals[5], vnew ); 
-						surf.vertices.push_back(vnew);
-						surf.scalar_data[0].push_back(label);
-						index_2_index.insert( pair<int, unsigned int> (9,vert_index+vert_count) );
-						++vert_count;
-						
-						
-						
-					}
-					if (edgeTable[cubeindex] & 1024){	//edge p2-p6
-						if (y==0) {
-							
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>((x+1)*dims.xdim,y*dims.ydim, z*dims.zdim), \
-										 vertVals[2], \
-										 vec3<float>((x+1)*dims.xdim,y*dims.ydim, (z+1)*dims.zdim), \
-										 vertVals[6], vnew );
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							index_2_index.insert( pair<int, unsigned int> (10,vert_index+vert_count) );
-							++vert_count;
-							
-						}else {
-							index_2_index.insert( pair<int,unsigned int>(10, index_2_index_all[x +(y-1)*ystride + z*zstride].find(9)->second) );
-							
-						}
-						
-					}
-					if (edgeTable[cubeindex] & 2048){	//edge p3-p7
-						if ((y==0)&&(x==0)) {
-							
-							vertex<T> vnew(label);
-							
-							vertexInterp(thresh, \
-										 vec3<float>(x*dims.xdim,y*dims.ydim, z*dims.zdim), \
-										 vertVals[3], \
-										 vec3<float>(x*dims.xdim,y*dims.ydim, (z+1)*dims.zdim), \
-										 vertVals[7], vnew ); 
-							surf.vertices.push_back(vnew);
-							surf.scalar_data[0].push_back(label);
-							index_2_index.insert( pair<int, unsigned int> (11,vert_index+vert_count) );
-							++vert_count;
-							
-						}else if (x==0) {
-							index_2_index.insert( pair<int,unsigned int>(11, index_2_index_all[x +(y-1)*ystride + z*zstride].find(8)->second) );
-							
-						}else {
-							index_2_index.insert( pair<int,unsigned int>(11, index_2_index_all[(x-1) +y*ystride + z*zstride].find(10)->second) );
-							
-						}
-						
-						
-						
-					}
-					index_2_index_all.push_back(index_2_index);
-					//	//cout<<x<<" "<<y<<" "<<z<<" index2index "<<endl;
-					//		for (map<int,unsigned int>::iterator i=index_2_index.begin(); i != index_2_index.end(); ++i)
-					//			//cout<<i->first<<" "<<i->second<<endl;
-			//	//cout<<"do trinagles "<<x<<" "<<y<<" "<<z<<" "<<cubeindex<<" "<<triTable[cubeindex][0]<<endl;
-					//do trinagles now that edges/verts are done
-					for (int i_tri = 0 ; triTable[cubeindex][i_tri] != -1 ; i_tri+=3)
-					{
-						
-						//						//cout<<"Push back triangle i_tri "<<i_tri<<endl;
-						//	//cout<<index_2_index.find(triTable[cubeindex][i_tri  ])->second<<" "<<index_2_index.find(triTable[cubeindex][i_tri +1 ])->second<<" "<<index_2_index.find(triTable[cubeindex][i_tri +2 ])->second<<endl;
-						//						//cout<<triTable[cubeindex][i_tri]<<endl;
-						//						//cout<<triTable[cubeindex][i_tri+1]<<endl;
-						//						//cout<<triTable[cubeindex][i_tri+2]<<endl;
-						//						//cout<<triTable[cubeindex][i_tri]<<endl;
-						//						//cout<<triTable[cubeindex][i_tri+1]<<endl;
-						//						//cout<<index_2_index.find(triTable[cubeindex][i_tri+0])->second<<endl;
-						//						//cout<<index_2_index.find(triTable[cubeindex][i_tri+1])->second<<endl;
-						
-						//						//cout<<index_2_index.find(triTable[cubeindex][i_tri+2])->second<<endl;
-						surf.faces.push_back( index_2_index.find(triTable[cubeindex][i_tri  ])->second);
-						surf.faces.push_back( index_2_index.find(triTable[cubeindex][i_tri+1])->second);
-						surf.faces.push_back( index_2_index.find(triTable[cubeindex][i_tri+2])->second);
-						
-					}
-				//	//cout<<"done triangles"<<endl;
-					/*	ElCount++;
-					 if (ElCount==12)
-					 {
-					 x=1e6;
-					 y=1e6;
-					 z=1e6;
-					 }
-					 */
-					
-				}
-				map<int, unsigned int> index_2_index;
-				index_2_index_all.push_back(index_2_index);
-				
-				++index;//because only going to -1
+				if (*i_f >= 0)
+					surf.faces.push_back(vert_index + *i_f);
+				else
+					surf.faces.push_back(prev_index + slabs[s-1].edges[-(*i_f) - 1]);
 			}
-			map<int, unsigned int> index_2_index;
-			for (int i=0;i<ystride;++i)
-				index_2_index_all.push_back(index_2_index);
-			index+=ystride;
+			surf.vertices.insert(surf.vertices.end(), slabs[s].vertices.begin(), slabs[s].vertices.end());
+			surf.scalar_data[0].insert(surf.scalar_data[0].end(), slabs[s].vertices.size(), label);
+			prev_index = vert_index;
+			vert_index += slabs[s].vertices.size();
+			
+			//only the last edge table is needed by the next slab
+			vector< vertex<T> >().swap(slabs[s].vertices);
+			vector<int>().swap(slabs[s].faces);
+			if (s > 0)
+				vector<int>().swap(slabs[s-1].edges);
 		}
 		//cout<<"Number of Vertices "<<surf.vertices.size()<<endl;	
 		//	cout<<"faces "<<endl;
@@ -1772,7 +1561,6 @@ namespace fslsurface_name {
 		//	scalar_data.push_back(sc_label);
 		surf.N_vertices = surf.vertices.size();
 		surf.N_triangles = surf.faces.size()/3;
-		delete[] vertVals;
 		
 		delete[] imth;
 		/* Create the triangle
@@ -205,10 +205,36 @@ namespace fslsurface_name {
   }
 
 	
+	vector<int> readGIFTIIntents( const string & filename ){
+		//parses the XML only, so the data arrays to load can be chosen before any decoding
+		gifti_image* gii_surf = gifti_read_image(filename.c_str(), 0);
+		if (gii_surf == NULL)
+			throw fslSurfaceException("Error in Reading GIFTI image");
+		vector<int> intents(gii_surf->numDA);
+		for ( int i_da = 0 ; i_da < gii_surf->numDA ; ++i_da )
+			intents[i_da] = gii_surf->darray[i_da]->intent;
+		gifti_free_image(gii_surf);
+		return intents;
+	}
+
 	template<class T, class T2>
 	int readGIFTI( fslSurface<T,T2>& surf, const string & filename){
+		return readGIFTI(surf,filename,vector<int>());
+	}
+
+	template<class T, class T2>
+	int readGIFTI( fslSurface<T,T2>& surf, const string & filename, const vector<int> & da_list){
         cout<<"read gifti "<<endl;
-		gifti_image* gii_surf = gifti_read_image(filename.c_str(), 1);
+		//an empty list reads every data array, otherwise only the listed ones are decoded, in the order given
+		gifti_image* gii_surf = NULL;
+		if (da_list.empty())
+			gii_surf = gifti_read_image(filename.c_str(), 1);
+		else
+			gii_surf = gifti_read_da_list(filename.c_str(), 1, const_cast<int*>(&da_list[0]), da_list.size());
+		if (gii_surf == NULL)
+			throw fslSurfaceException("Error in Reading GIFTI image");
+		if (surf.scalar_indices.empty())
+			surf.scalar_indices.push_back(vector<int>());
 	
 		//if (	gii_surf->labeltable == NULL)
 		////cout<<"label table "<<gii_surf->labeltable.length<<endl;
@@ -238,8 +264,6 @@ namespace fslsurface_name {
 			surf.dataTable[*key] = float4(r,g,b,*rgba);
 		}
 		////cout<<"done reading"<<endl;
-		if (gii_surf == NULL)
-			throw("Error in Reading GIFTI image");
 		int NumberOfDataArrays = gii_surf->numDA;
 		////cout<<"Numver of Data arrays "<<NumberOfDataArrays<<endl;
 		//	////cout<<"GIFTI meta data : length "<<gii_surf->meta.length<<" "<<string(*(gii_surf->meta.name))<<" "<<string(*(gii_surf->meta.value))<<endl;
@@ -486,7 +510,8 @@ namespace fslsurface_name {
 				      *i_sc2 = static_cast<float>(*data);
 				    }
 				  sc_type=1;//used at the moment to know where to put the names
-				  surf.nonvert_float_sc_data.push_back( sc_float );
+				  surf.nonvert_float_sc_data.push_back( vector<float>() );
+				  surf.nonvert_float_sc_data.back().swap( sc_float );
 				  //	for (int val = 0 ; val < Nvals ; ++val, ++data )
 				  //		scalars.push_back(*data);
 				}
@@ -522,7 +547,8 @@ namespace fslsurface_name {
 				}
                 if (sc_type==0)
                 {
-                    surf.scalar_data.push_back( scalars );
+                    surf.scalar_data.push_back( vector<T>() );
+                    surf.scalar_data.back().swap( scalars );
                     surf.scalar_indices.back().push_back( surf.scalar_data.size()-1 );
                     surf.scalar_names.push_back(name);
                 
@@ -555,7 +581,8 @@ namespace fslsurface_name {
                         *i_sc2 = static_cast<float>(*data);
                     }
                     sc_type=1;//used at the moment to know where to put the names
-                    surf.nonvert_int_sc_data.push_back( sc_int );
+                    surf.nonvert_int_sc_data.push_back( vector<int>() );
+                    surf.nonvert_int_sc_data.back().swap( sc_int );
                     //	for (int val = 0 ; val < Nvals ; ++val, ++data )
                     
                     
@@ -607,7 +634,8 @@ namespace fslsurface_name {
                 
                 if (sc_type==0)
                 {
-                    surf.scalar_data.push_back( scalars );
+                    surf.scalar_data.push_back( vector<T>() );
+                    surf.scalar_data.back().swap( scalars );
                     surf.scalar_indices.back().push_back( surf.scalar_data.size()-1 );
                     surf.scalar_names.push_back(name);
                     
@@ -645,7 +673,8 @@ namespace fslsurface_name {
                     *i=*data;
 
                 }
-                surf.vector_data.push_back(vecs);
+                surf.vector_data.push_back( vector<T>() );
+                surf.vector_data.back().swap( vecs );
                 
                 //get names
                 giiMetaData sc_meta = gii_surf->darray[i_da]->meta;
@@ -696,6 +725,7 @@ namespace fslsurface_name {
         return 1;
 		//cout<<"done GIFTI read"<<endl;
 	}
+	template int readGIFTI<float,unsigned int>(fslSurface<float,unsigned int>& surf, const string & filename, const vector<int> & da_list);
 	
 	template<class T, class T2>
 	unsigned int readPLYVertices( fslSurface<T,T2> & surf, ifstream & fin , const unsigned int & index)
@@ -88,6 +88,11 @@ namespace fslsurface_name {
 		int read_surface( fslSurface<T,T2>& surf, const std::string & filename);
 		template<class T, class T2>
 		int readGIFTI( fslSurface<T,T2>& surf, const std::string & filename );
+		//reads only the data arrays in da_list (all of them if empty)
+		template<class T, class T2>
+		int readGIFTI( fslSurface<T,T2>& surf, const std::string & filename, const std::vector<int> & da_list );
+		//intent of each data array, without decoding any data
+		std::vector<int> readGIFTIIntents( const std::string & filename );
 		template<class T, class T2>
 		int readVTK( fslSurface<T,T2>& surf, const std::string & filename );
 		template<class T, class T2>
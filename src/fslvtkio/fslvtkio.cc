@@ -67,6 +67,7 @@
 #include "meshclass/meshclass.h"
 #include "newimage/newimageall.h"
 #include <sstream>
+#include <cstring>
 
 
 using namespace std;
@@ -407,20 +408,20 @@ void  fslvtkIO::writePointData(ofstream & fshape, const string & str_typename )
 		{
 			fshape<<"SCALARS "<<scalarsName<<" "<<str_typename<<endl;
 			fshape<<"LOOKUP_TABLE default"<<endl;
+			if (BINARY)
+			{
+				vector<T> buf(Scalars.Storage());
+				const Real* sc=Scalars.Store();
+				for (unsigned int i=0;i<buf.size();i++)
+					buf[i]=static_cast<T>(sc[i]);
+				writeBinaryBlock(fshape,buf);
+			}else
 			for (int i=0;i<Scalars.Nrows();i++){
 				for (int j=0;j<Scalars.Ncols();j++){
-					if (BINARY)
-					{
-						T val=Scalars.element(i,j);
-						Swap_Nbytes(1,sizeof(val),&val);	
-						fshape.write(reinterpret_cast<char *>(&val),sizeof(val));
-					}else
-					{
-						if (j==(Scalars.Ncols()-1)){
-							fshape<<Scalars.element(i,j)<<endl;
-						}else{
-							fshape<<Scalars.element(i,j)<<" ";
-						}
+					if (j==(Scalars.Ncols()-1)){
+						fshape<<Scalars.element(i,j)<<endl;
+					}else{
+						fshape<<Scalars.element(i,j)<<" ";
 					}
 				}
 #ifdef PPC64
@@ -432,21 +433,20 @@ void  fslvtkIO::writePointData(ofstream & fshape, const string & str_typename )
 		if (Vectors.Nrows()>0)
 		{
 			fshape<<"VECTORS "<<vectorsName<<" "<<str_typename<<endl;
+			if (BINARY)
+			{
+				vector<T> buf(Vectors.Storage());
+				const Real* vec=Vectors.Store();
+				for (unsigned int i=0;i<buf.size();i++)
+					buf[i]=static_cast<T>(vec[i]);
+				writeBinaryBlock(fshape,buf);
+			}else
 			for (int i=0;i<Vectors.Nrows();i++){
 				for (int j=0;j<Vectors.Ncols();j++){
-					if (BINARY)
-					{
-						T val=Vectors.element(i,j);
-						
-						Swap_Nbytes(1,sizeof(val),&val);	
-						fshape.write(reinterpret_cast<char *>(&val),sizeof(val));
-					}else
-					{
-						if (j==(Vectors.Ncols()-1)){
-							fshape<<Vectors.element(i,j)<<endl;
-						}else{
-							fshape<<Vectors.element(i,j)<<" ";
-						}
+					if (j==(Vectors.Ncols()-1)){
+						fshape<<Vectors.element(i,j)<<endl;
+					}else{
+						fshape<<Vectors.element(i,j)<<" ";
 					}
 				}
 #ifdef PPC64
@@ -473,24 +473,18 @@ void  fslvtkIO::writePoints(ofstream & fshape, const string & str_typename ){
 		if (Points.Ncols()!=3)
 			throw fslvtkIOException("Points does not have 3 columns");
 		
+		if (BINARY)
+		{
+			//cols should always be three, stored row-major as x y z
+			vector<T> buf(Points.Storage());
+			const Real* pts=Points.Store();
+			for (unsigned int i=0;i<buf.size();i++)
+				buf[i]=static_cast<T>(pts[i]);
+			writeBinaryBlock(fshape,buf);
+		}else
 		for (int i=0;i<Points.Nrows();i++)
 		{
-			//cols should always be three
-			if (BINARY)
-			{
-				T tX=Points.element(i,0);
-				T tY=Points.element(i,1);
-				T tZ=Points.element(i,2);
-
-				Swap_Nbytes(1,sizeof(tX),&tX);	
-				Swap_Nbytes(1,sizeof(tY),&tY);	
-				Swap_Nbytes(1,sizeof(tZ),&tZ);	
-				
-				fshape.write(reinterpret_cast<char *>(&tX),sizeof(tX));
-				fshape.write(reinterpret_cast<char *>(&tY),sizeof(tY));
-				fshape.write(reinterpret_cast<char *>(&tZ),sizeof(tZ));
-			}else
-				fshape<<Points.element(i,0)<<" "<<Points.element(i,1)<<" "<<Points.element(i,2)<<endl;
+			fshape<<Points.element(i,0)<<" "<<Points.element(i,1)<<" "<<Points.element(i,2)<<endl;
 		}
 #ifdef PPC64
 		if ((m_n++ % 20) == 0) fshape.flush();
@@ -517,28 +511,16 @@ bool  fslvtkIO::readPoints(ifstream & fvtk)
 	Points.ReSize(Npts,3);
 	
 	if (BINARY) 
+	{
 		getline(fvtk,stemp); //gets rid of newline		
+		readBinaryBlock<float>(fvtk,Points.Store(),Points.Storage());
+		return true;
+	}
 	
 	for (int i=0 ; i < Npts ; i++)
 	{
 		float x,y,z;
-		if (!BINARY)
-			fvtk>>x>>y>>z;
-		else
-		{
-			fvtk.read(reinterpret_cast<char*>(&x),sizeof(float));
-			fvtk.read(reinterpret_cast<char*>(&y),sizeof(float));
-			fvtk.read(reinterpret_cast<char*>(&z),sizeof(float));
-			
-			if (SWAP_BYTES)
-			{
-				Swap_Nbytes(1,sizeof(x),&x);
-				Swap_Nbytes(1,sizeof(y),&y);	
-				Swap_Nbytes(1,sizeof(z),&z);
-			}
-			
-			
-		}
+		fvtk>>x>>y>>z;
 		Points.element(i,0)=x;
 		Points.element(i,1)=y;
 		Points.element(i,2)=z;
@@ -568,26 +550,31 @@ bool  fslvtkIO::readPolygons(ifstream & fvtk)
 	
 	Polygons.ReSize(NPolys,3);
 	
-	if (BINARY) getline(fvtk,stemp); 
-	for (int i=0 ; i < NPolys ; i++)
+	if (BINARY) 
 	{
-		unsigned int x,y,z;
-		
-		if (!BINARY)
-			fvtk>>x>>x>>y>>z;//just ignore number of connections assumed to be 3 for polydata
-		else
+		getline(fvtk,stemp); 
+		//whole block in one read, number of connections is assumed to be 3 for polydata and ignored
+		vector<unsigned int> buf(4*NPolys);
+		if (NPolys>0)
 		{
-			fvtk.read(reinterpret_cast<char*>(&x),sizeof(unsigned int)); //just ignore number of connections assumed to be 3 for polydata
-			fvtk.read(reinterpret_cast<char*>(&x),sizeof(unsigned int));
-			fvtk.read(reinterpret_cast<char*>(&y),sizeof(unsigned int));
-			fvtk.read(reinterpret_cast<char*>(&z),sizeof(unsigned int));
+			fvtk.read(reinterpret_cast<char*>(&buf[0]),buf.size()*sizeof(unsigned int));
 			if (SWAP_BYTES)
-			{
-				Swap_Nbytes(1,sizeof(x),&x);
-				Swap_Nbytes(1,sizeof(y),&y);	
-				Swap_Nbytes(1,sizeof(z),&z);
-			}
+				Swap_Nbytes(buf.size(),sizeof(unsigned int),&buf[0]);
 		}
+		Real* poly=Polygons.Store();
+		for (int i=0 ; i < NPolys ; i++,poly+=3)
+		{
+			poly[0]=buf[4*i+1];
+			poly[1]=buf[4*i+2];
+			poly[2]=buf[4*i+3];
+		}
+		return true;
+	}
+	for (int i=0 ; i < NPolys ; i++)
+	{
+		unsigned int x,y,z;
+		
+		fvtk>>x>>x>>y>>z;//just ignore number of connections assumed to be 3 for polydata
 		Polygons.element(i,0)=x;
 		Polygons.element(i,1)=y;
 		Polygons.element(i,2)=z;
@@ -601,31 +588,33 @@ void  fslvtkIO::writePolygons(ofstream & fshape)
 	
 	if (Polygons.Nrows()>0){
 		fshape<<"POLYGONS "<<Polygons.Nrows()<<"  "<<Polygons.Nrows()*(Polygons.Ncols()+1)<<endl;
+		if (BINARY)
+		{
+			//each row is preceded by its number of connections
+			const int ncols=Polygons.Ncols();
+			vector<unsigned int> buf(Polygons.Nrows()*(ncols+1));
+			const Real* poly=Polygons.Store();
+			vector<unsigned int>::iterator i_b=buf.begin();
+			for (int i=0;i<Polygons.Nrows();i++)
+			{
+				*(i_b++)=static_cast<unsigned int>(ncols);
+				for (int j=0;j<ncols;j++,++poly)
+					*(i_b++)=static_cast<unsigned int>(*poly);
+			}
+			writeBinaryBlock(fshape,buf);
+			return;
+		}
 		for (int i=0;i<Polygons.Nrows();i++)
 		{
 			for (int j=0;j<Polygons.Ncols();j++)
 			{
-				if (BINARY)
-				{
-					if (j==0)
-					{
-						unsigned int val=static_cast<unsigned int>(Polygons.Ncols());
-						Swap_Nbytes(1,sizeof(val),&val);	
-						fshape.write(reinterpret_cast<char *>(&val),sizeof(val));
-					}
-					unsigned int val=static_cast<unsigned int>(Polygons.element(i,j));
-					Swap_Nbytes(1,sizeof(val),&val);	
-					fshape.write(reinterpret_cast<char *>(&val),sizeof(val));
-				}else
-				{
-					if (j==0)
-						fshape<<Polygons.Ncols()<<" ";
-					
-					if (j==(Polygons.Ncols()-1))
-						fshape<<Polygons.element(i,j)<<endl;
-					else
-						fshape<<Polygons.element(i,j)<<" ";
-				}
+				if (j==0)
+					fshape<<Polygons.Ncols()<<" ";
+				
+				if (j==(Polygons.Ncols()-1))
+					fshape<<Polygons.element(i,j)<<endl;
+				else
+					fshape<<Polygons.element(i,j)<<" ";
 			}
 #ifdef PPC64
 			if ((m_n++ % 20) == 0) fshape.flush();
@@ -756,21 +745,23 @@ void fslvtkIO::writeNumericField(ofstream & fvtk, const string & name, const str
 	unsigned int ncols=Data.Ncols();
 	fvtk<<name<<" "<<nrows<<" "<<ncols<<" "<<type<<endl;
 	
+	if (BINARY)
+	{
+		vector<T> buf(Data.Storage());
+		const Real* data=Data.Store();
+		for (unsigned int i=0;i<buf.size();i++)
+			buf[i]=static_cast<T>(data[i]);
+		writeBinaryBlock(fvtk,buf);
+		return;
+	}
+	
 	for (unsigned int i=0; i<nrows ;i++)
 		for (unsigned int j=0;j<ncols;j++)
 		{
-			if (!BINARY)
-			{
-				if (j==(ncols-1))
-					fvtk<<Data.element(i,j)<<endl;
-				else
-					fvtk<<Data.element(i,j)<<" ";
-			}else
-			{
-				T val=static_cast<T>(Data.element(i,j));
-				Swap_Nbytes(1,sizeof(val),&val);	
-				fvtk.write(reinterpret_cast<char*>(&val),sizeof(val));
-			}
+			if (j==(ncols-1))
+				fvtk<<Data.element(i,j)<<endl;
+			else
+				fvtk<<Data.element(i,j)<<" ";
 			
 #ifdef PPC64
 			if ((m_n++ % 20) == 0) fvtk.flush();
@@ -783,18 +774,17 @@ template <class T>
 ReturnMatrix fslvtkIO::readField(ifstream & fvtk, const int & nrows,const int & mcols)
 {
 	Matrix fieldM(nrows,mcols);
+	if (BINARY)
+	{
+		readBinaryBlock<T>(fvtk,fieldM.Store(),fieldM.Storage());
+		fieldM.Release();
+		return fieldM;
+	}
 	T val;
 	for (int i=0; i<nrows ;i++){
 		for (int j=0;j<mcols;j++){
 			
-			if (!BINARY)
-				fvtk>>val;
-			else
-			{
-				fvtk.read(reinterpret_cast<char*>(&val),sizeof(T));
-				if (SWAP_BYTES)
-					Swap_Nbytes(1,sizeof(val),&val);	
-			}
+			fvtk>>val;
 			fieldM.element(i,j)=val;
 			//	cout<<"val "<<val<<endl;
 		}
@@ -804,6 +794,36 @@ ReturnMatrix fslvtkIO::readField(ifstream & fvtk, const int & nrows,const int &
 	return fieldM;
 }
 
+template <class T>
+void fslvtkIO::readBinaryBlock(ifstream & fvtk, Real* dest, const long int & n)
+{
+	//reads n packed values of type T straight into the front of dest and then
+	//widens them in place, working backwards so no value is overwritten before it is read
+	if (n<=0) return;
+	if (sizeof(T)>sizeof(Real))
+		throw fslvtkIOException("Binary data type is wider than matrix storage");
+	
+	char* raw=reinterpret_cast<char*>(dest);
+	fvtk.read(raw,n*sizeof(T));
+	if (SWAP_BYTES)
+		Swap_Nbytes(n,sizeof(T),raw);
+	for (long int i=n-1; i>=0 ; i--)
+	{
+		T val;
+		memcpy(&val,raw+i*sizeof(T),sizeof(T));
+		dest[i]=val;
+	}
+}
+
+template <class T>
+void fslvtkIO::writeBinaryBlock(ofstream & fvtk, vector<T> & buf)
+{
+	//byte swaps the buffer in place and writes it out in one go
+	if (buf.empty()) return;
+	Swap_Nbytes(buf.size(),sizeof(T),&buf[0]);
+	fvtk.write(reinterpret_cast<char*>(&buf[0]),buf.size()*sizeof(T));
+}
+
 void fslvtkIO::readFieldData(ifstream & fvtk){
 	//blanks out previous field data
 	fieldDataNumName.clear();
@@ -209,6 +209,10 @@ public:
 		
 		template <class T>
 			ReturnMatrix readField(ifstream & fvtk, const int & nrows,const int & mcols);
+		template <class T>
+			void readBinaryBlock(ifstream & fvtk, Real* dest, const long int & n);
+		template <class T>
+			void writeBinaryBlock(ofstream & fvtk, vector<T> & buf);
 		
 		void displayNumericFieldDataNames(); 				
 				void displayNumericField(const string & name);
@@ -71,6 +71,8 @@
 #include "miscmaths/miscprob.h"
 #include "utils/options.h"
 #include <vector>
+#include <fstream>
+#include <sstream>
 #include "newimage/newimageall.h"
 #include "melhlprfns.h"
 
@@ -90,7 +92,7 @@ using namespace std;
 //Command line Options {
   Option<string> fnin(string("-i,--in"), string(""),
 		string("        input file name (text matrix or 3D/4D image file)"),
-		true, requires_argument);
+		false, requires_argument);
   Option<string> fnout(string("-o,--out"), string(""),
 		string("output file name for GLM parameter estimates (GLM betas)"),
 		false, requires_argument);
@@ -167,6 +169,9 @@ using namespace std;
         Option<vector<string> > voxelwiseConfounds(string("--vxf"), vector<string>(), 
          string("\tlist of 4D images containing voxelwise confounds. caution BETA option."), 
          false, requires_argument);
+	Option<string> fnbatch(string("--batch"), string(""),
+		string("\tdual regression batch file (lines: <input> <stage-1 out> <stage-2 out> [<stage-2 Z out>])"),
+		false, requires_argument);
 		/*
 }
 */
@@ -362,7 +367,89 @@ void write_res(){
 		saveit(vnscales,outvnscales.value());
 }
 
+// Dual regression of one subject, equivalent to running fsl_glm with
+// --demean on the group maps (stage 1) and then on the resulting time
+// courses (stage 2), but reading the subject's data only once
+int dual_regression(const string& input, const Matrix& maps, int dof1, 
+	const string& out1, const string& out2, const string& out2z){
+	volume4D<float> tmpdata;
+	read_volume4D(tmpdata,input);
+	if(!samesize(tmpdata[0],mask)){
+		cerr << "ERROR: Mask image does not match input image " << input << endl;
+		return 1;
+	}
+	Matrix subjdata = tmpdata.matrix(mask);
+	tmpdata.destroy();
+
+	// stage 1: spatial regression of the group maps against each volume
+	glm.olsfit(remmean(subjdata.t(),1),maps,IdentityMatrix(maps.Ncols()),dof1);
+	Matrix tcs = glm.get_beta().t();
+	write_ascii_matrix(tcs,out1);
+
+	// stage 2: temporal regression of the time courses against each voxel
+	int dof2 = (int) ols_dof(tcs);
+	tcs = remmean(tcs,1);
+	dof2 -= 1;
+	if(normdes.value())
+		tcs = SP(tcs,ones(tcs.Nrows(),1)*pow(stdev(tcs,1),-1));
+	glm.olsfit(remmean(subjdata,1),tcs,IdentityMatrix(tcs.Ncols()),dof2);
+
+	volume4D<float> tempVol;
+	tempVol.setmatrix(glm.get_beta(),mask);
+	save_volume4D(tempVol,out2);
+	if(out2z.length()>0){
+		tempVol.setmatrix(glm.get_z(),mask);
+		save_volume4D(tempVol,out2z);
+	}
+	return 0;
+}
+
+int do_batch(){
+	if(!fsl_imageexists(fndesign.value()) || fnmask.value()==""){
+		cerr << "ERROR: --batch needs the group maps as image design (-d) and a mask (-m)" << endl;
+		return 1;
+	}
+	read_volume(mask,fnmask.value());
+
+	volume4D<float> tmpmaps;
+	read_volume4D(tmpmaps,fndesign.value());
+	if(!samesize(tmpmaps[0],mask)){
+		cerr << "ERROR: GLM design does not match mask image in size" << endl;
+		return 1;
+	}
+	Matrix maps = tmpmaps.matrix(mask).t();
+	tmpmaps.destroy();
+	int dof1 = (int) ols_dof(maps);
+	maps = remmean(maps,1);
+	dof1 -= 1;
+
+	ifstream fs(fnbatch.value().c_str());
+	if(!fs){
+		cerr << "ERROR: Could not open batch file " << fnbatch.value() << endl;
+		return 1;
+	}
+	string line;
+	while(getline(fs,line)){
+		istringstream ls(line);
+		string input, out1, out2, out2z;
+		if(!(ls >> input))
+			continue;
+		if(!(ls >> out1 >> out2)){
+			cerr << "ERROR: Batch file line needs input, stage-1 and stage-2 output names: " << line << endl;
+			return 1;
+		}
+		ls >> out2z;
+		if(debug.value())
+			cout << "Dual regression of " << input << endl;
+		if(dual_regression(input,maps,dof1,out1,out2,out2z))
+			return 1;
+	}
+	return 0;
+}
+
 int do_work(int argc, char* argv[]) {
+  if(fnbatch.value()>"")
+    return do_batch();
   int dof(-1);
   if(setup(dof))
     exit(1);
@@ -405,11 +492,13 @@ int main(int argc,char *argv[]){
 			options.add(outvnscales);
 			options.add(textConfounds);
 			options.add(voxelwiseConfounds);
+			options.add(fnbatch);
 	    options.parse_command_line(argc, argv);
 
 	    // line below stops the program if the help was requested or 
 	    //  a compulsory option was not set
-	    if ( (help.value()) || (!options.check_compulsory_arguments(true)) ){
+	    if ( (help.value()) || (!options.check_compulsory_arguments(true)) ||
+	         (fnin.value()=="" && fnbatch.value()=="") ){
 				options.usage();
 				exit(EXIT_FAILURE);
 	    }else{
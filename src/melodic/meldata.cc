@@ -514,11 +514,11 @@ namespace Melodic{
 				Matrix newWM,newDWM; 
 				if(!opts.joined_whiten.value()){	  
 					message("  Individual whitening in a " << order << " dimensional subspace " << endl);
-      	  			std_pca(tmpData, RXweight, Corr, pcaE, pcaD, opts.econ.value());
+      	  			std_pca(tmpData, RXweight, Corr, pcaE, pcaD);
 	  				calc_white(pcaE, pcaD, order, newWM, newDWM);
 				}else{
 					if(!opts.dr_pca.value()){
-						std_pca(whiteMatrix*tmpData, RXweight, Corr, pcaE, pcaD, opts.econ.value());
+						std_pca(whiteMatrix*tmpData, RXweight, Corr, pcaE, pcaD);
 						calc_white(pcaE, pcaD, order, newWM, newDWM);		
 						newDWM=(dewhiteMatrix*newDWM);
 						newWM=(newWM*whiteMatrix);
@@ -531,7 +531,7 @@ namespace Melodic{
 						remmean(tmp1,2);
 						tmp1 *= tmpData.t();
 						tmp2 = pinv(tmp1.t()).t();  
-						std_pca(tmp1 * tmpData, RXweight, Corr, pcaE, pcaD, opts.econ.value());
+						std_pca(tmp1 * tmpData, RXweight, Corr, pcaE, pcaD);
 						calc_white(pcaE, pcaD, order, newWM, newDWM);		
 						newDWM=(tmp2*newDWM);
 						newWM=(newWM * tmp1);
@@ -566,6 +566,7 @@ namespace Melodic{
 	}
 	
 	Matrix tmpData;
+	streamCov DataCov(RXweight);
 	bool tmpvarnorm = opts.varnorm.value();
 
 	if(numfiles > 1 && opts.joined_vn.value()){
@@ -585,6 +586,8 @@ namespace Melodic{
 			Data = tmpData;
 		else
   			Data &= tmpData;
+		// only the new subject's rows need a pass over the voxels
+		DataCov.append(Data, tmpData.Nrows());
 
 		outMsize("Data", Data);
 		//reduce dim down to manageable level
@@ -592,10 +595,11 @@ namespace Melodic{
 			message("  Reducing data matrix to a  " << opt.migpN.value() << " dimensional subspace " << endl);
 			Matrix pcaE;
 			SymmetricMatrix Corr;
-			RowVector pcaD;
-			std_pca(Data, RXweight, Corr, pcaE, pcaD, opts.econ.value());
+			DiagonalMatrix pcaD;
+			Corr << DataCov.cov();
+			EigenValues(Corr, pcaD, pcaE);
 		    pcaE = pcaE.Columns(pcaE.Ncols()-opts.migpN.value()+1,pcaE.Ncols());
-		    Data = pcaE.t() * Data;	
+		    DataCov.project(pcaE, Data);	
 		}
 		outMsize("Data", Data);
 		
@@ -74,6 +74,7 @@
 #include "miscmaths/miscprob.h"
 #include "miscmaths/t2z.h"
 #include "miscmaths/f2z.h"
+#include "utils/threading.h"
 
 namespace Melodic{
 
@@ -189,7 +190,7 @@ namespace Melodic{
   {
     SymmetricMatrix Corr(cov_r(in,false,econ));
     RowVector out;
-    out = varnorm(in,Corr,dim,level, econ);
+    out = varnorm(in,Corr,dim,level);
     return out;
   }  //RowVector varnorm
 
@@ -199,13 +200,13 @@ namespace Melodic{
       in.Row(ctr) = SD(in.Row(ctr),vars);
   }
 	
-  RowVector varnorm(Matrix& in, SymmetricMatrix& Corr, int dim, float level, int econ)
+  RowVector varnorm(Matrix& in, SymmetricMatrix& Corr, int dim, float level)
   { 
 	
     Matrix tmpE, white, dewhite;
     RowVector tmpD, tmpD2;
 
-    std_pca(remmean(in,2), Corr, tmpE, tmpD, econ);
+    std_pca(remmean(in,2), Corr, tmpE, tmpD);
     calc_white(tmpE,tmpD, dim, white, dewhite);
     
     Matrix ws = white * in;
@@ -359,22 +360,21 @@ namespace Melodic{
   }  //Matrix calc_white
   
  
-  void std_pca(const Matrix& Mat, const Matrix& weights, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals, int econ)
+  void std_pca(const Matrix& Mat, const Matrix& weights, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals)
   {
-    if(weights.Storage()>0)
-      Corr = cov_r(Mat, weights, econ);
-    else
-      Corr = cov_r(Mat,false,econ);
+    streamCov tmpC(weights);
+    tmpC.append(Mat, Mat.Nrows());
+    Corr << tmpC.cov();
 
     DiagonalMatrix tmpD;
     EigenValues(Corr,tmpD,evecs);
     evals = tmpD.AsRow();
   }  //void std_pca
 
-  void std_pca(const Matrix& Mat, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals, int econ)
+  void std_pca(const Matrix& Mat, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals)
   {
     Matrix weights;
-    std_pca(Mat,weights,Corr,evecs,evals, econ);
+    std_pca(Mat,weights,Corr,evecs,evals);
   }  //void std_pca
 
   void em_pca(const Matrix& Mat, Matrix& evecs, RowVector& evals, int num_pc, int iter)
@@ -924,6 +924,9 @@ namespace Melodic{
     return res;
   }  //Matrix gen_arCorr
 
+	// voxels per block in the threaded GLM fit
+	static const int GLM_BLOCK = 128;
+
 	void basicGLM::olsfit(const Matrix& data, const Matrix& design, 
 		const Matrix& contrasts, int requestedDOF)
 	{
@@ -933,41 +936,260 @@ namespace Melodic{
 		dof = (int)-1; cbeta = -1.0*ones(1); 
 
 		if(data.Nrows()==design.Nrows()){
-			Matrix dat = data;
 			Matrix tmp = design.t()*design;
 			Matrix pinvdes = tmp.i()*design.t();
 			
-			beta = pinvdes * dat;
-			residu = dat - design*beta;
 			dof = ols_dof(design);
 			if ( requestedDOF>0)
 			  dof = requestedDOF;
-			sigsq = sum(SP(residu,residu))/dof;
-			
 			float fact = float(dof) / design.Ncols();
-			f_fmf =  SP(sum(SP(design*beta,design*beta)),pow(sum(SP(residu,residu)),-1)) * fact;
-		
-			pf_fmf = f_fmf.Row(1); 
-			for(int ctr1=1;ctr1<=f_fmf.Ncols();ctr1++)
-				pf_fmf(1,ctr1) = 1.0-MISCMATHS::fdtr(design.Ncols(),dof,f_fmf.Column(ctr1).AsScalar());
-				
-			if(contrasts.Storage()>0 && contrasts.Ncols()==beta.Nrows()){
-				cbeta = contrasts*beta;
-				Matrix tmp = contrasts*pinvdes*pinvdes.t()*contrasts.t();
-				varcb = diag(tmp)*sigsq;
-				t = SP(cbeta,pow(varcb,-0.5));
-				z = t; p=t; 
-				for(int ctr1=1;ctr1<=t.Ncols();ctr1++){
-					ColumnVector tmp = t.Column(ctr1);
-					T2z::ComputeZStats(varcb.Column(ctr1),cbeta.Column(ctr1),dof, tmp);
-					z.Column(ctr1) << tmp;
-					T2z::ComputePs(varcb.Column(ctr1),cbeta.Column(ctr1),dof, tmp);
-					p.Column(ctr1) << exp(tmp);
+
+			bool docon = contrasts.Storage()>0 && contrasts.Ncols()==design.Ncols();
+			int T = data.Nrows(), V = data.Ncols(), P = design.Ncols();
+			int C = docon ? contrasts.Nrows() : 0;
+
+			// everything that does not depend on the voxel is shared by all
+			// threads: the pseudo-inverse and the contrast variance factors
+			Matrix cpinv;
+			ColumnVector cvar;
+			if(docon){
+				cpinv = contrasts*pinvdes;
+				Matrix tmp2 = cpinv*cpinv.t();
+				cvar = diag(tmp2);
+			}
+
+			beta.ReSize(P,V); residu.ReSize(T,V);
+			sigsq.ReSize(1,V); f_fmf.ReSize(1,V); pf_fmf.ReSize(1,V);
+			if(docon){
+				cbeta.ReSize(C,V); varcb.ReSize(C,V);
+				t.ReSize(C,V); z.ReSize(C,V); p.ReSize(C,V);
+			}
+
+			const Real *D = data.Store(), *X = design.Store(), *PI = pinvdes.Store();
+			const Real *CON = docon ? contrasts.Store() : 0;
+			Real *B = beta.Store(), *R = residu.Store();
+			T2z& t2z = T2z::getInstance();
+			const int nblocks = (V + GLM_BLOCK - 1) / GLM_BLOCK;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+			for(int blk = 0; blk < nblocks; blk++){
+				int v0 = blk*GLM_BLOCK;
+				int len = std::min(GLM_BLOCK, V - v0);
+				vector<double> fit(len), ssfit(len, 0.0), ssres(len, 0.0);
+
+				// beta = pinv(design) * data
+				for(int i = 0; i < P; i++){
+					Real *bi = B + (long)i*V + v0;
+					for(int v = 0; v < len; v++) bi[v] = 0.0;
+					for(int k = 0; k < T; k++){
+						Real pik = PI[i*T+k];
+						const Real *dk = D + (long)k*V + v0;
+						for(int v = 0; v < len; v++) bi[v] += pik*dk[v];
+					}
+				}
+
+				// residuals and sums of squares of fit and residuals
+				for(int k = 0; k < T; k++){
+					for(int v = 0; v < len; v++) fit[v] = 0.0;
+					for(int i = 0; i < P; i++){
+						Real xki = X[k*P+i];
+						const Real *bi = B + (long)i*V + v0;
+						for(int v = 0; v < len; v++) fit[v] += xki*bi[v];
+					}
+					const Real *dk = D + (long)k*V + v0;
+					Real *rk = R + (long)k*V + v0;
+					for(int v = 0; v < len; v++){
+						rk[v] = dk[v] - fit[v];
+						ssfit[v] += fit[v]*fit[v];
+						ssres[v] += rk[v]*rk[v];
+					}
+				}
+
+				for(int v = 0; v < len; v++){
+					int col = v0 + v + 1;
+					sigsq(1,col) = ssres[v]/dof;
+					f_fmf(1,col) = ssfit[v]/ssres[v] * fact;
+					pf_fmf(1,col) = 1.0-MISCMATHS::fdtr(P,dof,f_fmf(1,col));
+				}
+
+				// contrasts, with the same conventions as T2z::ComputeZStats
+				// and T2z::ComputePs for zero or negative variances
+				for(int c = 0; c < C; c++){
+					for(int v = 0; v < len; v++){
+						int col = v0 + v + 1;
+						double cb = 0.0;
+						for(int i = 0; i < P; i++)
+							cb += CON[c*P+i] * B[(long)i*V + v0 + v];
+						double vcb = cvar(c+1)*sigsq(1,col);
+						cbeta(c+1,col) = cb;
+						varcb(c+1,col) = vcb;
+						t(c+1,col) = cb*std::pow(vcb,-0.5);
+						if(vcb != 0.0 && cb != 0.0 && !(vcb < 0.0)){
+							z(c+1,col) = t2z.convert(cb/std::sqrt(vcb),dof);
+							p(c+1,col) = std::exp(t2z.converttologp(cb/std::sqrt(vcb),dof));
+						}
+						else{
+							z(c+1,col) = 0.0;
+							p(c+1,col) = 1.0;
+						}
+					}
 				}
 			}
 		}	
 	
 	}
 
+	// columns per cache block in the streamCov kernels
+	static const int STREAMCOV_BLOCK = 256;
+
+	streamCov::streamCov(const Matrix& weights) : nvox(0)
+	{
+		if(weights.Storage()>0)
+			w = (weights/weights.Sum()).AsRow();
+	}
+
+	void streamCov::append(const Matrix& data, int nnew)
+	{
+		int N = data.Nrows(), V = data.Ncols(), nold = N - nnew;
+		if(nnew <= 0)
+			return;
+		if(scatter.Nrows() != nold || (nold > 0 && V != nvox) || 
+			(w.Storage() > 0 && w.Ncols() != V)){
+			cerr << "ERROR:: streamCov: data does not match accumulated covariance" << endl;
+			exit(2);
+		}
+		nvox = V;
+
+		const Real* X = data.Store();
+		const Real* W = (w.Storage() > 0) ? w.Store() : 0;
+		const int nblocks = (V + STREAMCOV_BLOCK - 1) / STREAMCOV_BLOCK;
+
+		// the new rows' (weighted) means come first, so that the cross 
+		// products below are of centred rows and a large mean cannot cancel
+		vector<double> m(N, 0.0);
+		for(int b = 0; b < nold; b++) m[b] = means(b+1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for(int a = nold; a < N; a++){
+			const Real* xa = X + (long)a*V;
+			double s = 0.0;
+			if(W)
+				for(int j = 0; j < V; j++) s += W[j]*xa[j];
+			else{
+				for(int j = 0; j < V; j++) s += xa[j];
+				s /= V;
+			}
+			m[a] = s;
+		}
+
+		// centred cross products of the new rows with all rows; threads take
+		// whole column blocks and add up their partial sums
+		vector<double> cross(nnew*N, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			vector<double> acc(nnew*N, 0.0), wx(STREAMCOV_BLOCK);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+			for(int blk = 0; blk < nblocks; blk++){
+				int c0 = blk*STREAMCOV_BLOCK;
+				int len = std::min(STREAMCOV_BLOCK, V - c0);
+				for(int b = 0; b < N; b++){
+					const Real* xb = X + (long)b*V + c0;
+					const double mb = m[b];
+					if(W)
+						for(int j = 0; j < len; j++) wx[j] = W[c0+j]*(xb[j]-mb);
+					else
+						for(int j = 0; j < len; j++) wx[j] = xb[j]-mb;
+					for(int a = std::max(0, b-nold); a < nnew; a++){
+						const Real* xa = X + (long)(nold+a)*V + c0;
+						const double ma = m[nold+a];
+						double s = 0.0;
+						for(int j = 0; j < len; j++) s += wx[j]*(xa[j]-ma);
+						acc[a*N+b] += s;
+					}
+				}
+			}
+#ifdef _OPENMP
+#pragma omp critical(streamcov_reduce)
+#endif
+			{
+				for(int i = 0; i < nnew*N; i++) cross[i] += acc[i];
+			}
+		}
+
+		SymmetricMatrix tmpS(N);
+		ColumnVector tmpM(N);
+		for(int i = 1; i <= N; i++)
+			tmpM(i) = m[i-1];
+		for(int i = 1; i <= nold; i++)
+			for(int j = 1; j <= i; j++)
+				tmpS(i,j) = scatter(i,j);
+		for(int a = 0; a < nnew; a++)
+			for(int b = 0; b <= nold+a; b++)
+				tmpS(nold+a+1,b+1) = cross[a*N+b];
+		scatter << tmpS;
+		means = tmpM;
+	}
+
+	void streamCov::project(const Matrix& basis, Matrix& data)
+	{
+		int N = data.Nrows(), V = data.Ncols(), k = basis.Ncols();
+		if(basis.Nrows() != N || scatter.Nrows() != N){
+			cerr << "ERROR:: streamCov: projection does not match data" << endl;
+			exit(2);
+		}
+
+		Matrix out(k, V);
+		const Real* X = data.Store();
+		const Real* B = basis.Store();
+		Real* O = out.Store();
+		const int nblocks = (V + STREAMCOV_BLOCK - 1) / STREAMCOV_BLOCK;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for(int blk = 0; blk < nblocks; blk++){
+			int c0 = blk*STREAMCOV_BLOCK;
+			int len = std::min(STREAMCOV_BLOCK, V - c0);
+			for(int i = 0; i < k; i++){
+				Real* oi = O + (long)i*V + c0;
+				for(int j = 0; j < len; j++) oi[j] = 0.0;
+			}
+			for(int r = 0; r < N; r++){
+				const Real* xr = X + (long)r*V + c0;
+				for(int i = 0; i < k; i++){
+					Real bri = B[r*k+i];
+					Real* oi = O + (long)i*V + c0;
+					for(int j = 0; j < len; j++) oi[j] += bri*xr[j];
+				}
+			}
+		}
+		data = out;
+
+		// centring commutes with the projection, so the covariance of the
+		// projected rows follows without another pass
+		Matrix tmpS;
+		tmpS = basis.t() * scatter * basis;
+		scatter << tmpS;
+		means = basis.t() * means;
+	}
+
+	ReturnMatrix streamCov::cov() const
+	{
+		int N = scatter.Nrows();
+		SymmetricMatrix res(N);
+		double denom = (w.Storage() > 0) ? 1.0 - w.SumSquare() : (double)nvox;
+		for(int i = 1; i <= N; i++)
+			for(int j = 1; j <= i; j++)
+				res(i,j) = scatter(i,j) / denom;
+		res.Release();
+		return res;
+	}
 
 }
@@ -104,7 +104,7 @@ namespace Melodic{
 
   RowVector varnorm(Matrix& in, int dim = 30, float level = 1.6, int econ = 20000);
        void varnorm(Matrix& in, const RowVector& vars);
-  RowVector varnorm(Matrix& in, SymmetricMatrix& Corr, int dim = 30, float level = 1.6, int econ = 20000);
+  RowVector varnorm(Matrix& in, SymmetricMatrix& Corr, int dim = 30, float level = 1.6);
 
   Matrix SP2(const Matrix& in, const Matrix& weights, int econ = 20000);
   void SP3(Matrix& in, const Matrix& weights);
@@ -120,8 +120,8 @@ namespace Melodic{
   void calc_white(const Matrix& tmpE, const RowVector& tmpD, int dim, Matrix& white, Matrix& dewhite);
   void calc_white(const SymmetricMatrix& Corr, int dim, Matrix& white, Matrix& dewhite);
   
-  void std_pca(const Matrix& Mat, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals, int econ = 20000);
-  void std_pca(const Matrix& Mat, const Matrix& weights, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals, int econ = 20000);
+  void std_pca(const Matrix& Mat, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals);
+  void std_pca(const Matrix& Mat, const Matrix& weights, SymmetricMatrix& Corr, Matrix& evecs, RowVector& evals);
   void em_pca(const Matrix& Mat, Matrix& evecs, RowVector& evals, int num_pc = 1, int iter = 20);
   void em_pca(const Matrix& Mat, Matrix& guess, Matrix& evecs, RowVector& evals, int num_pc = 1, int iter = 20);
 
@@ -184,6 +184,38 @@ namespace Melodic{
 			Matrix z;
 			Matrix p;
   };
+
+	// Row covariance (as cov_r) of a wide time x voxel matrix, kept up to
+	// date while rows are appended to the matrix or it is projected onto a
+	// subspace, so that the voxel dimension is only streamed once per row.
+	// Only the row means and the centred cross products are kept, and the
+	// voxels are processed in fixed-size blocks, so memory does not grow
+	// with the number of voxels.
+	class streamCov{
+		public:
+		
+			//constructor
+			streamCov(const Matrix& weights = Matrix());
+		
+			//destructor
+			~streamCov(){}
+
+			// data has just had its last nnew rows appended
+			void append(const Matrix& data, int nnew);
+
+			// data <- basis.t() * data
+			void project(const Matrix& basis, Matrix& data);
+
+			void reset(){scatter.ReSize(0); means.ReSize(0); nvox = 0;}
+
+			ReturnMatrix cov() const;
+			
+		private:
+			RowVector w;
+			SymmetricMatrix scatter;
+			ColumnVector means;
+			int nvox;
+	};
 //	Matrix glm_ols(const Matrix& dat, const Matrix& design);
 }
 
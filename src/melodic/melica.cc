@@ -70,6 +70,7 @@
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 
 #include <stdlib.h>
+#include <algorithm>
 #include "utils/log.h"
 #include "meloptions.h"
 #include "meldata.h"
@@ -86,13 +87,120 @@ using namespace NEWIMAGE;
 
 namespace Melodic {
     
+  // voxels per block in the FastICA fixed-point update
+  static const int FASTICA_BLOCK = 64;
+
+  void MelodicICA::fastica_step(const Matrix &Data, const Matrix &W, Matrix &G, RowVector &dG) const{
+    // G = Data * g(Data.t() * W) and dG = column sums of the derivative
+    // term g'(Data.t() * W), for the nonlinearity g selected by the options.
+    // The voxels are processed in blocks, split over threads, so that the
+    // voxels x components matrix of IC estimates is never formed.
+    enum { NL_NONE, NL_POW4, NL_POW3, NL_TANH, NL_GAUSS } nl = NL_NONE;
+    if(opts.nonlinearity.value()=="pow4") nl = NL_POW4;
+    if(opts.nonlinearity.value()=="pow3") nl = NL_POW3;
+    if(opts.nonlinearity.value()=="tanh") nl = NL_TANH;
+    if(opts.nonlinearity.value()=="gauss") nl = NL_GAUSS;
+
+    const int n = Data.Nrows(), V = Data.Ncols(), m = W.Ncols();
+    const double c1 = opts.nlconst1.value(), c2 = opts.nlconst2.value();
+    const Real *D = Data.Store();
+    const Real *Wp = W.Store();
+    const int nblocks = (V + FASTICA_BLOCK - 1) / FASTICA_BLOCK;
+
+    vector<double> gsum(n*m, 0.0), dsum(m, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+      vector<double> gacc(n*m, 0.0), dacc(m, 0.0), u(FASTICA_BLOCK*m);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(int blk = 0; blk < nblocks; blk++){
+        int v0 = blk*FASTICA_BLOCK;
+        int len = std::min(FASTICA_BLOCK, V - v0);
+
+        // IC estimates for this block: u = Data(:,block).t() * W
+        std::fill(u.begin(), u.begin() + len*m, 0.0);
+        for(int i = 0; i < n; i++){
+          const Real *di = D + (long)i*V + v0;
+          const Real *wi = Wp + i*m;
+          for(int v = 0; v < len; v++){
+            double d = di[v];
+            double *uv = &u[v*m];
+            for(int j = 0; j < m; j++) uv[j] += d*wi[j];
+          }
+        }
+
+        // nonlinearity in place, derivative terms summed per component
+        for(int v = 0; v < len; v++){
+          double *uv = &u[v*m];
+          switch(nl){
+          case NL_POW4:
+            for(int j = 0; j < m; j++) uv[j] = uv[j]*uv[j]*uv[j];
+            break;
+          case NL_POW3:
+            for(int j = 0; j < m; j++){
+              double x = uv[j] / c1;
+              dacc[j] += x;
+              uv[j] = x*x;
+            }
+            break;
+          case NL_TANH:
+            for(int j = 0; j < m; j++){
+              double t = std::tanh(c1*uv[j]);
+              dacc[j] += 1 - t*t;
+              uv[j] = t;
+            }
+            break;
+          case NL_GAUSS:
+            for(int j = 0; j < m; j++){
+              double x2 = uv[j]*uv[j];
+              double e = std::exp(-(c2/2) * x2);
+              dacc[j] += (1 - c2*x2) * e;
+              uv[j] *= e;
+            }
+            break;
+          default:
+            break;
+          }
+        }
+
+        // G += Data(:,block) * g(u)
+        for(int i = 0; i < n; i++){
+          const Real *di = D + (long)i*V + v0;
+          double *gi = &gacc[i*m];
+          for(int v = 0; v < len; v++){
+            double d = di[v];
+            const double *uv = &u[v*m];
+            for(int j = 0; j < m; j++) gi[j] += d*uv[j];
+          }
+        }
+      }
+#ifdef _OPENMP
+#pragma omp critical(melica_reduce)
+#endif
+      {
+        for(int k = 0; k < n*m; k++) gsum[k] += gacc[k];
+        for(int j = 0; j < m; j++) dsum[j] += dacc[j];
+      }
+    }
+
+    G.ReSize(n,m);
+    Real *Gp = G.Store();
+    for(int k = 0; k < n*m; k++) Gp[k] = gsum[k];
+    dG.ReSize(m);
+    for(int j = 0; j < m; j++) dG(j+1) = dsum[j];
+  }
+
   void MelodicICA::ica_fastica_symm(const Matrix &Data){
     // based on Aapo Hyvrinen's fastica method
     // see www.cis.hut.fi/projects/ica/fastica/
     
     //initialize matrices
     Matrix redUMM_old, rank1_old;
-    Matrix tmpU;    
+    Matrix gU;
+    RowVector dgU;
     //srand((unsigned int)timer(NULL));
     redUMM = melodat.get_white()*
        unifrnd(melodat.get_white().Ncols(),dim); // got to start somewhere
@@ -122,35 +230,24 @@ namespace Melodic {
       itt_ctr = 1;
       do{ // da loop!!!
 				redUMM_old = redUMM;      
-				//calculate IC estimates
-				tmpU = Data.t() * redUMM;
+				//calculate IC estimates and the nonlinearity terms
+				fastica_step(Data, redUMM, gU, dgU);
 					
 				//update redUMM depending on nonlinearity
 				if(opts.nonlinearity.value()=="pow4"){
-	  			redUMM = (Data * pow(tmpU,3.0)) / samples - 3 * redUMM;
+	  			redUMM = gU / samples - 3 * redUMM;
 				}
 				if(opts.nonlinearity.value()=="pow3"){
-	  			tmpU /= opts.nlconst1.value();
-	  			redUMM = 3 * (Data * pow(tmpU,2.0)) / samples  - 
-	    			(SP(ones(dim,1)*sum(tmpU,1),redUMM))/ samples;
+	  			redUMM = 3 * gU / samples  - 
+	    			(SP(ones(dim,1)*dgU,redUMM))/ samples;
 				}
 				if(opts.nonlinearity.value()=="tanh"){
-	  			Matrix hyptanh;
-	  			hyptanh = tanh(opts.nlconst1.value()*tmpU);
-	  			redUMM = (Data * hyptanh - opts.nlconst1.value()*SP(ones(dim,1)*
-						sum(1-pow(hyptanh,2),1),redUMM))/samples;						
+	  			redUMM = (gU - opts.nlconst1.value()*SP(ones(dim,1)*
+						dgU,redUMM))/samples;						
 				}
 				if(opts.nonlinearity.value()=="gauss"){
-	  			Matrix tmpUsq;
-	  			Matrix tmpU2;
-	  			Matrix gauss;
-	  			Matrix dgauss;
-	  			tmpUsq = pow(tmpU,2);
-	  			tmpU2 = exp(-(opts.nlconst2.value()/2) * tmpUsq);
-	  			gauss = SP(tmpU,tmpU2);
-	  			dgauss = SP(1-opts.nlconst2.value()*tmpUsq,tmpU2);
-	  			redUMM = (Data * gauss - SP(ones(dim,1)*
-				    sum(dgauss,1),redUMM))/samples;
+	  			redUMM = (gU - SP(ones(dim,1)*
+				    dgU,redUMM))/samples;
 				}
            
 				// orthogonalize the unmixing-matrix 
@@ -227,7 +324,8 @@ namespace Melodic {
      	message("  Extracting IC " << ctrIC << "  ... ");
       ColumnVector w;
       ColumnVector w_old;   
-      ColumnVector tmpU;
+      Matrix gU;
+      RowVector dgU;
       if(ctrIC <= guesses){
       	w = w - redUMM * redUMM.t() * w;
       	w = w / norm2(w);  
@@ -235,32 +333,21 @@ namespace Melodic {
       	int itt_ctr = 1; 
       	do{
 	 				w_old = w;
-	 				tmpU = Data.t() * w; 
+	 				fastica_step(Data, w, gU, dgU); 
 					if(opts.nonlinearity.value()=="pow4"){
-	  				w =  (Data * pow(tmpU,3.0)) / samples - 3 * w;
+	  				w =  gU / samples - 3 * w;
 					}
 					if(opts.nonlinearity.value()=="tanh"){
-	  				ColumnVector hyptanh;
-          	hyptanh = tanh(opts.nlconst1.value()*tmpU);
- 	  				w = (Data * hyptanh - opts.nlconst1.value()*SP(ones(dim,1)*
-          		sum(1-pow(hyptanh,2),1),w))/samples;
+ 	  				w = (gU - opts.nlconst1.value()*SP(ones(dim,1)*
+          		dgU,w))/samples;
 					} 
 					if(opts.nonlinearity.value()=="pow3"){
-	  				tmpU /= opts.nlconst1.value();
- 	  				w = 3*(Data * pow(tmpU,2.0)) / samples - 2*(SP(ones(dim,1)*
-           		sum(tmpU,1),w))/samples;
+ 	  				w = 3*gU / samples - 2*(SP(ones(dim,1)*
+           		dgU,w))/samples;
 					} 
 					if(opts.nonlinearity.value()=="gauss"){
-	  				ColumnVector tmpUsq;
-	  				ColumnVector tmpU2;
-	  				ColumnVector gauss;
-	  				ColumnVector dgauss;
-	  				tmpUsq = pow(tmpU,2);
-	  				tmpU2 = exp(-(opts.nlconst2.value()/2) * tmpUsq);
-	  				gauss = SP(tmpU,tmpU2);
-	  				dgauss = SP(1-opts.nlconst2.value()*tmpUsq,tmpU2);
-          	w = (Data * gauss - SP(ones(dim,1)*
-				 			sum(dgauss,1),w))/samples;
+          	w = (gU - SP(ones(dim,1)*
+				 			dgU,w))/samples;
 					}
 
 					// orthogonalize w
@@ -110,6 +110,7 @@ namespace Melodic{
 
       void ica_fastica_symm(const Matrix &Data);
       void ica_fastica_defl(const Matrix &Data);
+      void fastica_step(const Matrix &Data, const Matrix &W, Matrix &G, RowVector &dG) const;
       void ica_maxent(const Matrix &Data);
       void ica_jade(const Matrix &Data);
       //void tica();
@@ -0,0 +1,135 @@
+/*  Copyright (C) 2016 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include <algorithm>
+#include <cmath>
+
+#include "bbox_grid.h"
+
+namespace mesh{
+
+  Bbox_grid::Bbox_grid(const Pt& lo, const Pt& hi, double cellsize, int maxcells)
+    : _lo(lo), _cellsize(cellsize)
+  {
+    double ex = hi.X - lo.X, ey = hi.Y - lo.Y, ez = hi.Z - lo.Z;
+    if (!(ex >= 0 && ex < HUGE_VAL)) ex = 0;
+    if (!(ey >= 0 && ey < HUGE_VAL)) ey = 0;
+    if (!(ez >= 0 && ez < HUGE_VAL)) ez = 0;
+    if (maxcells < 1) maxcells = 1;
+    if (!(_cellsize > 0)) _cellsize = max(max(ex, ey), max(ez, 1.));
+    //grow the cells until there are no more than maxcells of them
+    for (;;)
+      {
+	double nx = floor(ex / _cellsize) + 1, ny = floor(ey / _cellsize) + 1, nz = floor(ez / _cellsize) + 1;
+	if (nx * ny * nz <= maxcells)
+	  {
+	    _nx = (int) nx; _ny = (int) ny; _nz = (int) nz;
+	    break;
+	  }
+	_cellsize *= 1.5;
+      }
+    _cells.resize(_nx * _ny * _nz);
+  }
+
+  void Bbox_grid::cell_range(const Pt& lo, const Pt& hi, int *range) const
+  {
+    const double l[3] = {lo.X - _lo.X, lo.Y - _lo.Y, lo.Z - _lo.Z};
+    const double h[3] = {hi.X - _lo.X, hi.Y - _lo.Y, hi.Z - _lo.Z};
+    const int n[3] = {_nx, _ny, _nz};
+    for (int d = 0; d < 3; d++)
+      {
+	double a = floor(l[d] / _cellsize), b = floor(h[d] / _cellsize);
+	//clamp to the grid; a box with undefined bounds covers the whole range
+	range[2*d] = (a >= 0) ? ((a > n[d] - 1) ? n[d] - 1 : (int) a) : 0;
+	range[2*d+1] = (b <= n[d] - 1) ? ((b < 0) ? 0 : (int) b) : n[d] - 1;
+      }
+  }
+
+  void Bbox_grid::insert(int item, const Pt& lo, const Pt& hi)
+  {
+    int r[6];
+    cell_range(lo, hi, r);
+    for (int k = r[4]; k <= r[5]; k++)
+      for (int j = r[2]; j <= r[3]; j++)
+	for (int i = r[0]; i <= r[1]; i++)
+	  _cells[(k * _ny + j) * _nx + i].push_back(item);
+  }
+
+  void Bbox_grid::candidates(const Pt& lo, const Pt& hi, vector<int>& items) const
+  {
+    items.clear();
+    int r[6];
+    cell_range(lo, hi, r);
+    for (int k = r[4]; k <= r[5]; k++)
+      for (int j = r[2]; j <= r[3]; j++)
+	for (int i = r[0]; i <= r[1]; i++)
+	  {
+	    const vector<int>& c = _cells[(k * _ny + j) * _nx + i];
+	    items.insert(items.end(), c.begin(), c.end());
+	  }
+    sort(items.begin(), items.end());
+    items.erase(unique(items.begin(), items.end()), items.end());
+  }
+
+}
@@ -0,0 +1,160 @@
+/*  Copyright (C) 2016 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include <map>
+
+#include "flat_mesh.h"
+#include "mesh.h"
+#include "mpoint.h"
+#include "triangle.h"
+
+namespace mesh{
+
+  Flat_mesh::Flat_mesh(const Mesh& m)
+  {
+    const int np = m._points.size();
+    map<const Mpoint*, int> pindex;
+    map<const Triangle*, int> tindex;
+    _x.resize(np); _y.resize(np); _z.resize(np);
+    for (int i = 0; i < np; i++)
+      {
+	pindex[m._points[i]] = i;
+	Pt p = m._points[i]->get_coord();
+	_x[i] = p.X; _y[i] = p.Y; _z[i] = p.Z;
+      }
+    _ux = _x; _uy = _y; _uz = _z;
+
+    int t = 0;
+    for (list<Triangle*>::const_iterator i = m._triangles.begin(); i != m._triangles.end(); i++, t++)
+      {
+	tindex[*i] = t;
+	for (int e = 0; e < 3; e++)
+	  _vertices.push_back(pindex[(*i)->get_vertice(e)]);
+      }
+
+    _neighbours_start.push_back(0);
+    _triangles_start.push_back(0);
+    for (int i = 0; i < np; i++)
+      {
+	const Mpoint* p = m._points[i];
+	for (list<Mpoint*>::const_iterator n = p->_neighbours.begin(); n != p->_neighbours.end(); n++)
+	  _neighbours.push_back(pindex[*n]);
+	for (list<Triangle*>::const_iterator n = p->_triangles.begin(); n != p->_triangles.end(); n++)
+	  _triangles.push_back(tindex[*n]);
+	_neighbours_start.push_back(_neighbours.size());
+	_triangles_start.push_back(_triangles.size());
+      }
+  }
+
+  void Flat_mesh::copy_to(Mesh& m) const
+  {
+    for (int i = 0; i < nvertices(); i++)
+      {
+	m._points[i]->set_coord(get_coord(i));
+	m._points[i]->_update_coord = get_coord(i);
+      }
+  }
+
+  void Flat_mesh::update()
+  {
+    _x.swap(_ux); _y.swap(_uy); _z.swap(_uz);
+  }
+
+  const Vec Flat_mesh::local_normal(int n) const
+  {
+    Vec v(0, 0, 0);
+    for (int i = _triangles_start[n]; i < _triangles_start[n+1]; i++)
+      {
+	const int *t = &_vertices[3 * _triangles[i]];
+	v += (get_coord(t[2]) - get_coord(t[0])) * (get_coord(t[1]) - get_coord(t[0]));
+      }
+    v.normalize();
+    return v;
+  }
+
+  const Pt Flat_mesh::medium_neighbours(int n) const
+  {
+    Pt resul(0, 0, 0);
+    int counter = _neighbours_start[n+1] - _neighbours_start[n];
+    for (int i = _neighbours_start[n]; i < _neighbours_start[n+1]; i++)
+      resul += get_coord(_neighbours[i]);
+    resul = Pt(resul.X/counter, resul.Y/counter, resul.Z/counter);
+    return resul;
+  }
+
+  const Vec Flat_mesh::difference_vector(int n) const
+  {
+    return medium_neighbours(n) - get_coord(n);
+  }
+
+  const double Flat_mesh::medium_distance_of_neighbours(int n) const
+  {
+    double l = 0;
+    for (int i = _neighbours_start[n]; i < _neighbours_start[n+1]; i++)
+      l += (get_coord(_neighbours[i]) - get_coord(n)).norm();
+    l /= (_neighbours_start[n+1] - _neighbours_start[n]);
+    return l;
+  }
+
+}
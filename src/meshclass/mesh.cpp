@@ -66,6 +66,7 @@
 #include "triangle.h"
 #include "mpoint.h"
 #include "pt_special.h"
+#include "bbox_grid.h"
 
 
 namespace mesh {
@@ -956,22 +957,40 @@ const double Mesh::self_intersection(const Mesh& original) const
   mlo/=counter;
 
 
-  io = original._points.begin();
-  vector<Mpoint*>::const_iterator jo = original._points.begin();
-  
-   for (vector<Mpoint*>::const_iterator i = _points.begin(); i!=_points.end(); i++, io++)
-     {
-       jo = original._points.begin();
-    for (vector<Mpoint*>::const_iterator j = _points.begin(); j!=_points.end(); j++, jo++)
-      if (!((*i)==(*j)) && !((**i)<(**j)))
-	if (((*i)->get_coord().X -  (*j)->get_coord().X) * ((*i)->get_coord().X -  (*j)->get_coord().X) + ((*i)->get_coord().Y -  (*j)->get_coord().Y) * ((*i)->get_coord().Y -  (*j)->get_coord().Y) + ((*i)->get_coord().Z -  (*j)->get_coord().Z) * ((*i)->get_coord().Z -  (*j)->get_coord().Z)< ml * ml)
-	  {
-	    double dist = (((**i) - (**j)).norm())/ml;
-	    double disto = (((**io) - (**jo)).norm())/mlo;
-	    intersection += (dist - disto)*(dist - disto);
-	  }
-     }
-   return intersection;
+  if (!(ml > 0)) return intersection;
+
+  //only pairs closer than ml count : bin the points in cells of that size
+  //and look at the neighbouring cells only
+  const int npoints = _points.size();
+  Pt lo = _points[0]->get_coord(), hi = lo;
+  for (int i = 1; i < npoints; i++)
+    {
+      Pt p = _points[i]->get_coord();
+      lo.X = min(lo.X, p.X); lo.Y = min(lo.Y, p.Y); lo.Z = min(lo.Z, p.Z);
+      hi.X = max(hi.X, p.X); hi.Y = max(hi.Y, p.Y); hi.Z = max(hi.Z, p.Z);
+    }
+  Bbox_grid grid(lo, hi, ml, 4 * npoints);
+  for (int i = 0; i < npoints; i++)
+    grid.insert(i, _points[i]->get_coord(), _points[i]->get_coord());
+
+  vector<int> near;
+  for (int i = 0; i < npoints; i++)
+    {
+      const Pt p = _points[i]->get_coord();
+      grid.candidates(Pt(p.X - ml, p.Y - ml, p.Z - ml), Pt(p.X + ml, p.Y + ml, p.Z + ml), near);
+      for (vector<int>::const_iterator n = near.begin(); n != near.end(); n++)
+	{
+	  int j = *n;
+	  if (!(_points[i]==_points[j]) && !((*_points[i])<(*_points[j])))
+	    if ((p.X -  _points[j]->get_coord().X) * (p.X -  _points[j]->get_coord().X) + (p.Y -  _points[j]->get_coord().Y) * (p.Y -  _points[j]->get_coord().Y) + (p.Z -  _points[j]->get_coord().Z) * (p.Z -  _points[j]->get_coord().Z)< ml * ml)
+	      {
+		double dist = (((*_points[i]) - (*_points[j])).norm())/ml;
+		double disto = (((*original._points[i]) - (*original._points[j])).norm())/mlo;
+		intersection += (dist - disto)*(dist - disto);
+	      }
+	}
+    }
+  return intersection;
 }
 
 void Mesh::stream_mesh(ostream& flot,int type) const{ 
@@ -1046,89 +1065,57 @@ ostream& operator <<(ostream& flot,const Mesh & m){
 
 const bool Mesh::real_self_intersection()
 {
-  vector<Pt_special *> v;
-  for (vector<Mpoint *>::const_iterator i = this->_points.begin(); i != this->_points.end(); i++)
+  //bin the triangles by their bounding boxes, and test each one only
+  //against the triangles whose boxes overlap its own
+  vector<Triangle *> tri(_triangles.begin(), _triangles.end());
+  const int ntri = tri.size();
+  if (ntri == 0) return false;
+
+  vector<Pt> lo(ntri), hi(ntri);
+  double size = 0;
+  for (int t = 0; t < ntri; t++)
     {
-      Pt_special * p = new (Pt_special); 
-      p->P = (*i);
-      for (list<Triangle *>::const_iterator i2 = (*i)->_triangles.begin(); i2 != (*i)->_triangles.end(); i2++)
-	{p->T.push_back(*i2);}
-      v.push_back(p); 
+      lo[t] = hi[t] = tri[t]->get_vertice(0)->get_coord();
+      for (int e = 1; e < 3; e++)
+	{
+	  Pt p = tri[t]->get_vertice(e)->get_coord();
+	  lo[t].X = min(lo[t].X, p.X); lo[t].Y = min(lo[t].Y, p.Y); lo[t].Z = min(lo[t].Z, p.Z);
+	  hi[t].X = max(hi[t].X, p.X); hi[t].Y = max(hi[t].Y, p.Y); hi[t].Z = max(hi[t].Z, p.Z);
+	}
+      size += max(max(hi[t].X - lo[t].X, hi[t].Y - lo[t].Y), hi[t].Z - lo[t].Z);
     }
-  
 
-
-  for (list<Triangle *>::const_iterator i = this->_triangles.begin(); i != this->_triangles.end(); i++)
+  Pt glo = lo[0], ghi = hi[0];
+  for (int t = 1; t < ntri; t++)
     {
-      //initialize
-      (*i)->data.clear();
-      (*i)->data.push_back(0);
-
-      //compute the center
-      Pt centre(0, 0, 0);
-      centre += (*i)->get_vertice(0)->get_coord();
-      centre += (*i)->get_vertice(1)->get_coord();
-      centre += (*i)->get_vertice(2)->get_coord();
-      centre *= 1/3;
-      (*i)->data.push_back(centre.X);
-      (*i)->data.push_back(centre.Y);
-      (*i)->data.push_back(centre.Z);
-      
-      //compute the max distance to the center
-      double max = 0;
-      for (int e = 0; e < 3; e++)
-	{
-	  double c = (centre.X - (*i)->get_vertice(e)->get_coord().X)*(centre.X - (*i)->get_vertice(e)->get_coord().X) + (centre.Y - (*i)->get_vertice(e)->get_coord().Y)*(centre.Y - (*i)->get_vertice(e)->get_coord().Y) + (centre.Z - (*i)->get_vertice(e)->get_coord().Z)*(centre.Z - (*i)->get_vertice(e)->get_coord().Z);
-	  if (c > max) max = c;
-	}
-      (*i)->data.push_back(max);
-      
+      glo.X = min(glo.X, lo[t].X); glo.Y = min(glo.Y, lo[t].Y); glo.Z = min(glo.Z, lo[t].Z);
+      ghi.X = max(ghi.X, hi[t].X); ghi.Y = max(ghi.Y, hi[t].Y); ghi.Z = max(ghi.Z, hi[t].Z);
     }
-  sort(v.begin(), v.end(), compPt());
-  
-  bool result = false;
-  
-  //swipping
-  list<Triangle *> l;
-  l.clear();
-  for (vector<Pt_special *>::iterator i = v.begin(); i != v.end(); i++)
+  Bbox_grid grid(glo, ghi, size / ntri, 2 * ntri);
+  for (int t = 0; t < ntri; t++)
+    grid.insert(t, lo[t], hi[t]);
+
+  vector<int> near;
+  for (int t = 0; t < ntri; t++)
     {
-      if (result) break;
-      for (list<Triangle *>::iterator tr = (*i)->T.begin(); tr != (*i)->T.end(); tr++)
+      grid.candidates(lo[t], hi[t], near);
+      for (vector<int>::const_iterator n = near.begin(); n != near.end() && *n < t; n++)
 	{
-	  if (result) break;
-	  if ((*tr)->data[0] == 0)
-	    {
-	      //main loop
-	      for (list<Triangle *>::const_iterator tr2 = l.begin(); tr2 != l.end(); tr2++)
-		{
-		  bool res = false;
-		  for (int i = 0; i < 3; i++)
-		    for (int j = 0; j < 3; j++)
-		      {
-			if (!res) if ((*tr2)->get_vertice(i)->get_coord() == (*tr)->get_vertice(j)->get_coord()) res = true;
-		      }
-		  if (!res)
-		    {
-		      double d = ((*tr)->data[1] - (*tr2)->data[1]) * ((*tr)->data[1] - (*tr2)->data[1]) + ((*tr)->data[2] - (*tr2)->data[2]) * ((*tr)->data[2] - (*tr2)->data[2]) + ((*tr)->data[3] - (*tr2)->data[3]) * ((*tr)->data[3] - (*tr2)->data[3]);
-		      if (d < (*tr)->data[4] + (*tr2)->data[4] )
-			
-			{
-			  result = result | (*tr)->intersect(**tr2);
-			}
-		    }
-		}
-	      l.push_back(*tr);
-	      (*tr)->data[0] = 1;
-	    }
-	  else 
-	    if ((*tr)->data[0] == 1) (*tr)->data[0] = 2; 
-	    else if ((*tr)->data[0] == 2) {l.remove(*tr);}
+	  int t2 = *n;
+	  if (lo[t].X > hi[t2].X || lo[t2].X > hi[t].X || lo[t].Y > hi[t2].Y || lo[t2].Y > hi[t].Y
+	      || lo[t].Z > hi[t2].Z || lo[t2].Z > hi[t].Z) continue;
+
+	  //triangles sharing a vertex are neighbours, not intersections
+	  bool res = false;
+	  for (int i = 0; i < 3; i++)
+	    for (int j = 0; j < 3; j++)
+	      if (!res) if (tri[t2]->get_vertice(i)->get_coord() == tri[t]->get_vertice(j)->get_coord()) res = true;
+
+	  if (!res && tri[t]->intersect(*tri[t2])) return true;
 	}
     }
 
-  return result;
-
+  return false;
 }
 
 }
@@ -69,6 +69,8 @@
 #include "mpoint.h"
 #include "triangle.h"
 #include "pt_special.h"
+#include "bbox_grid.h"
+#include "flat_mesh.h"
 #include "profile.h"
 #include "point.h"
 
@@ -77,7 +77,9 @@ Copyright (C) 1999-2000 University of Oxford  */
 #include "mmoptions.h"
 #include "newimage/newimagefns.h"
 #include "miscmaths/sparsefn.h"
+#include "utils/threading.h"
 #include <utility>
+#include <algorithm>
 #include <iomanip>
 
 using namespace NEWMAT;
@@ -967,6 +969,54 @@ namespace Mm {
 	      
 	    }
     
+    // neighbour lists and a greedy colouring of the lattice for the
+    // voxel-wise tildew updates (the neighbourhood is symmetric, so
+    // voxels of one colour never read each other's tildew)
+    neighbour_start.assign(1,0);
+    neighbour_index.clear();
+    for(int z = 0; z < mask.zsize(); z++)
+      for(int y = 0; y < mask.ysize(); y++)
+	for(int x = 0; x < mask.xsize(); x++)
+	  if(mask(x,y,z))
+	    {
+	      for(unsigned int i = 0; i < connected_offsets.size(); i++)
+		{
+		  int xi = x+connected_offsets[i].x;
+		  int yi = y+connected_offsets[i].y;
+		  int zi = z+connected_offsets[i].z;
+
+		  if(mask(xi,yi,zi))
+		    neighbour_index.push_back(indices(xi,yi,zi)-1);
+		}
+	      neighbour_start.push_back(neighbour_index.size());
+	    }
+
+    vector<int> colour(num_superthreshold,-1);
+    int ncolours = 0;
+    for(int r = 0; r < num_superthreshold; r++)
+      {
+	vector<bool> used(ncolours+1,false);
+	for(int j = neighbour_start[r]; j < neighbour_start[r+1]; j++)
+	  if(colour[neighbour_index[j]] >= 0)
+	    used[colour[neighbour_index[j]]] = true;
+
+	int col = 0;
+	while(used[col]) col++;
+	colour[r] = col;
+	if(col == ncolours) ncolours++;
+      }
+
+    colour_start.assign(ncolours+1,0);
+    for(int r = 0; r < num_superthreshold; r++)
+      colour_start[colour[r]+1]++;
+    for(int col = 0; col < ncolours; col++)
+      colour_start[col+1] += colour_start[col];
+
+    colour_voxels.resize(num_superthreshold);
+    vector<int> next(colour_start.begin(),colour_start.end()-1);
+    for(int r = 0; r < num_superthreshold; r++)
+      colour_voxels[next[colour[r]]++] = r;
+
     // initialise tildew
     for(int r = 1; r<=num_superthreshold; r++)
       {
@@ -1103,14 +1153,59 @@ namespace Mm {
     OUT(tmp); 
   }
 
+  // Inverse of the n x n symmetric matrix a (destroyed) by Gauss-Jordan
+  // elimination with partial pivoting; false if a is singular
+  static bool invert_symmetric(vector<double>& a, vector<double>& ainv, int n)
+  {
+    for(int i = 0; i < n*n; i++) ainv[i] = 0;
+    for(int i = 0; i < n; i++) ainv[i*n+i] = 1;
+
+    for(int col = 0; col < n; col++)
+      {
+	int piv = col;
+	for(int row = col+1; row < n; row++)
+	  if(std::fabs(a[row*n+col]) > std::fabs(a[piv*n+col])) piv = row;
+	if(a[piv*n+col] == 0) return false;
+
+	if(piv != col)
+	  for(int k = 0; k < n; k++)
+	    {
+	      std::swap(a[piv*n+k],a[col*n+k]);
+	      std::swap(ainv[piv*n+k],ainv[col*n+k]);
+	    }
+
+	double d = 1.0/a[col*n+col];
+	for(int k = 0; k < n; k++)
+	  {
+	    a[col*n+k] *= d;
+	    ainv[col*n+k] *= d;
+	  }
+
+	for(int row = 0; row < n; row++)
+	  if(row != col && a[row*n+col] != 0)
+	    {
+	      double f = a[row*n+col];
+	      for(int k = 0; k < n; k++)
+		{
+		  a[row*n+k] -= f*a[col*n+k];
+		  ainv[row*n+k] -= f*ainv[col*n+k];
+		}
+	    }
+      }
+
+    for(int i = 0; i < n; i++)
+      for(int k = i+1; k < n; k++)
+	ainv[k*n+i] = ainv[i*n+k];
+
+    return true;
+  }
+
   void Mixture_Model::update_voxel_tildew_vb()
   {
     Tracer_Plus trace("Mixture_Model::update_voxel_tildew_vb");
 
     cout << "Doing voxel-wise tildew VB" << endl;
 
-    ColumnVector m_tildew_new = m_tildew;
-
     SparseMatrix Lambda;
     Lambda = precision_lik;
     symmetric_addto(Lambda,D,mrf_precision);
@@ -1119,178 +1214,130 @@ namespace Mm {
     multiply(precision_lik,m_tildew,beta);
     beta -= derivative_lik;
 
-    float count = 0;
-    for(int z = 0; z < mask.zsize(); z++)
-      for(int y = 0; y < mask.ysize(); y++)
-	for(int x = 0; x < mask.xsize(); x++)
-	  if(mask(x,y,z))
+    // Gauss-Seidel sweep taken a colour at a time: voxels of one colour
+    // are not neighbours, so they are updated concurrently, each against
+    // the latest tildew of the other colours.  Only Lambda lookups and
+    // plain arrays are used inside the threads.
+    const int N = num_superthreshold;
+    const int nc = nclasses;
+    double* tildew = m_tildew.Store();
+    const double* betap = beta.Store();
+
+    vector<double> prec(N*nc*nc,0);
+    vector<double> cov(N*nc*nc,0);
+    vector<double> sumneighs(N*nc,0);
+    vector<char> updated(N,0);
+    vector<char> singular(N,0);
+
+    for(unsigned int col = 0; col+1 < colour_start.size(); col++)
+      {
+#ifdef _OPENMP
+#pragma omp parallel if(Utilities::max_threads() > 1)
+#endif
+	{
+	  vector<double> a(nc*nc), ainv(nc*nc), wtilde(nc);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,256)
+#endif
+	  for(int v = colour_start[col]; v < colour_start[col+1]; v++)
 	    {
-	      ColumnVector sumneighs(nclasses);
-	      sumneighs = 0;
-
-	      int r = indices(x,y,z);   
-	     
-// 	      if(it>0 && r==17)
-// 	      {
-// 		OUT(r);
-// 		RowVector cv(nclasses);
-// 		cv = 0;		
-// 		for(int c = 0; c < nclasses; c++)
-// 		  {
-// 		    cv(c+1) = m_tildew(c*num_superthreshold+r);
-// 		  }
-		
-// 		matout(cv,"cv");
-// 		RowVector w = logistic_transform(cv,lambda,log_bound);
-// 		OUT(w);
-// 	      }
-	   
-	      int xi=0,yi=0,zi=0;
-	      for(unsigned int i = 0; i < connected_offsets.size(); i++) 
-		{
-		  xi = x+connected_offsets[i].x;
-		  yi = y+connected_offsets[i].y;
-		  zi = z+connected_offsets[i].z;
-		  
-		  if(mask(xi,yi,zi))
-		    {
-		      int r2 = indices(xi,yi,zi);
-
-		      ColumnVector ck(nclasses);
-		      ck = 0;
-		     
-		      DiagonalMatrix lam_vk(nclasses);
-		      lam_vk = 0;
-
-		      for(int c = 0; c < nclasses; c++)
-			{
-			  ck(c+1) = m_tildew(c*num_superthreshold+r2);
-			  lam_vk(c+1,c+1) =  Lambda(c*num_superthreshold+r2,c*num_superthreshold+r);
-			  
-			}
-
-		      sumneighs += lam_vk*ck;
-// 		      if(it>0 && r==17)
-// 			{
-// 			  OUT(lam_vk);
-// 			  OUT(ck);
-// 			  OUT(lam_vk*ck);
-// 			}
-		    }
-		}	    
+	      const int r = colour_voxels[v];
+	      double* sn = &sumneighs[r*nc];
 
-	      ColumnVector betav(nclasses);
-	      for(int c=0; c < nclasses; c++)
+	      for(int j = neighbour_start[r]; j < neighbour_start[r+1]; j++)
 		{
-		  betav(c+1) = beta(c*num_superthreshold+r);
+		  const int r2 = neighbour_index[j];
+		  for(int c = 0; c < nc; c++)
+		    sn[c] += Lambda(c*N+r2+1,c*N+r+1)*tildew[c*N+r2];
 		}
 
 	      // get wtildecov
-	      SymmetricMatrix wtildeprec(nclasses);
-	      wtildeprec = 0;
-	      SymmetricMatrix wtildecov(nclasses);
-	      wtildecov = 0;
-
-	      for(int c=0; c < nclasses; c++)
+	      double* p = &prec[r*nc*nc];
+	      for(int c = 0; c < nc; c++)
 		{
-		  wtildeprec(c+1,c+1) = Lambda(c*num_superthreshold+r,c*num_superthreshold+r);
-		  for(int k=c+1; k < nclasses; k++)
-		    {
-		      wtildeprec(c+1,k+1) = Lambda(c*num_superthreshold+r,k*num_superthreshold+r); 
-		    }
+		  p[c*nc+c] = Lambda(c*N+r+1,c*N+r+1);
+		  for(int k = c+1; k < nc; k++)
+		    p[c*nc+k] = p[k*nc+c] = Lambda(c*N+r+1,k*N+r+1);
 		}
 
-	      try{
-		wtildecov = wtildeprec.i();
-	      }
-	      catch(Exception& exp)
+	      a.assign(p,p+nc*nc);
+	      if(!invert_symmetric(a,ainv,nc))
 		{
-		  OUT(exp.what());
-		  matout(wtildeprec,"wtildeprec");
-		  matout(betav.t(),"betav");
-		  matout(sumneighs.t(),"sumneighs");
-		  RowVector cv(nclasses);
-		  cv = 0;		
-		  for(int c = 0; c < nclasses; c++)
-		    {
-		      cv(c+1) = m_tildew(c*num_superthreshold+r);
-		    }		
-		  matout(cv,"cv");
-		  RowVector w = logistic_transform(cv,lambda,log_bound);
-		  matout(w,"w");
-		  OUT(r);
-		  exit(0);
+		  singular[r] = 1;
+		  continue;
 		}
-	    
+	      std::copy(ainv.begin(),ainv.end(),&cov[r*nc*nc]);
 
-	      ColumnVector wtilde = wtildecov*(betav - sumneighs);
+	      double mn = 0;
+	      for(int c = 0; c < nc; c++)
+		{
+		  wtilde[c] = 0;
+		  for(int k = 0; k < nc; k++)
+		    wtilde[c] += ainv[c*nc+k]*(betap[k*N+r] - sn[k]);
+		  mn += wtilde[c]/nc;
+		}
 
-	      wtilde = wtilde - mean(wtilde).AsScalar();
-	
 	      bool valid = true;
-	      for(int c=0; c < nclasses; c++)
+	      for(int c = 0; c < nc; c++)
 		{
-		  if(std::fabs(wtilde(c+1)) > 10)
-		    {
-		      // 		      OUT(r);
-		      valid = false;
-		    }
-
-		  // 		  if(wtilde(c+1) > 10)
-		  // 		    {
-		  // 		      wtilde(c+1) = 10;
-		  // 		      count++;
-		  
-		  // 		    }
-		  // 		  if(wtilde(c+1) < -10)
-		  // 		    {
-		  // 		      wtilde(c+1) = -10;
-		  // 		      count++;
-		  // 		    }
+		  wtilde[c] -= mn;
+		  if(std::fabs(wtilde[c]) > 10)
+		    valid = false;
 		}
-	  
-	      //if(it>0 && r==11335)
-	      // 	      if(!valid)
-// 		{	
-// 		  OUT(r);		
-// 		  RowVector w = logistic_transform(wtilde.t(),lambda,log_bound);
-// 		  matout(wtildeprec,"wtildeprec");
-// 		  matout(wtildecov,"wtildecov");
-// 		  matout(betav.t(),"betav");
-// 		  matout(sumneighs.t(),"sumneighs");
-// 		  matout((betav-sumneighs).t(),"betav-sumneighs");
-// 		  matout(wtilde.t(),"wtilde");
-// 		  matout(w,"w");
-
-// 		  RowVector cv(nclasses);
-// 		  cv = 0;		
-// 		  for(int c = 0; c < nclasses; c++)
-// 		    {
-// 		      cv(c+1) = m_tildew(c*num_superthreshold+r);
-// 		    }		
-// 		  matout(cv,"cv");
-// 		  w = logistic_transform(cv,lambda,log_bound);
-// 		  matout(w,"w");
 
-// 		}	
-    
 	      if(valid || it<2)
 		{
-		  count++;
-		  prec_tildew[r-1] = wtildeprec;
-		  cov_tildew[r-1] = wtildecov;
-		  
-		  for(int c=0; c < nclasses; c++)
-		    {
-		      //m_tildew_new(c*num_superthreshold+r) = wtilde(c+1);
-		      m_tildew(c*num_superthreshold+r) = wtilde(c+1);
-		    }
- 		}
+		  updated[r] = 1;
+		  for(int c = 0; c < nc; c++)
+		    tildew[c*N+r] = wtilde[c];
+		}
 	    }
+	}
 
-    OUT(num_superthreshold - count);
+	for(int v = colour_start[col]; v < colour_start[col+1]; v++)
+	  {
+	    const int r = colour_voxels[v];
+	    if(!singular[r]) continue;
+
+	    SymmetricMatrix wtildeprec(nc);
+	    RowVector betav(nc), sn(nc), cv(nc);
+	    for(int c = 0; c < nc; c++)
+	      {
+		for(int k = c; k < nc; k++)
+		  wtildeprec(c+1,k+1) = prec[(r*nc+c)*nc+k];
+		betav(c+1) = beta(c*N+r+1);
+		sn(c+1) = sumneighs[r*nc+c];
+		cv(c+1) = m_tildew(c*N+r+1);
+	      }
+
+	    OUT("singular wtildeprec");
+	    matout(wtildeprec,"wtildeprec");
+	    matout(betav,"betav");
+	    matout(sn,"sumneighs");
+	    matout(cv,"cv");
+	    RowVector w = logistic_transform(cv,lambda,log_bound);
+	    matout(w,"w");
+	    OUT(r+1);
+	    exit(0);
+	  }
+      }
 
-    //    m_tildew = m_tildew_new;
+    float count = 0;
+    for(int r = 0; r < N; r++)
+      if(updated[r])
+	{
+	  count++;
+	  prec_tildew[r].ReSize(nc);
+	  cov_tildew[r].ReSize(nc);
+	  for(int c = 0; c < nc; c++)
+	    for(int k = c; k < nc; k++)
+	      {
+		prec_tildew[r](c+1,k+1) = prec[(r*nc+c)*nc+k];
+		cov_tildew[r](c+1,k+1) = cov[(r*nc+c)*nc+k];
+	      }
+	}
+
+    OUT(num_superthreshold - count);
   }
 
   void Mixture_Model::update_mrf_precision()
@@ -1368,241 +1415,192 @@ namespace Mm {
     
   }
 
-  void Mixture_Model::calculate_taylor_lik()
+  // Working storage for taylor_lik_voxel, one per thread
+  struct TaylorWork
+  {
+    TaylorWork(int nc) : wtilde(nc), w(nc), R(nc), pdf(nc), dwdydy(nc*nc*nc), dwdy(nc*nc), dfdwdw(nc*nc), dfdw(nc) {}
+
+    vector<double> wtilde, w, R;
+    vector<float> pdf;
+    vector<double> dwdydy, dwdy, dfdwdw, dfdw;
+  };
+
+  // 2nd order Taylor terms of the likelihood for one voxel with tildew
+  // wtildetmp and class likelihoods in work.pdf; same arithmetic as the
+  // RowVector/SymmetricMatrix version, in plain arrays so that it can run
+  // in a thread.  hessanal is nc x nc (full), derivanal nc.
+  static void taylor_lik_voxel(const double* wtildetmp, int nc, float lambda, float log_bound, TaylorWork& work, double* hessanal, double* derivanal)
   {
-    Tracer_Plus trace("Mixture_Model::calculate_taylor_lik");
-
-    cout << "Doing 2nd Order Taylor Expansion of Likelihood" << endl; 
-
-    // build up precision/hessian matrix for tildew (aka x)
-    //    float A = 1.0/std::sqrt(2*M_PI);
     float lamsqr = Sqr(lambda*log_bound);
+    const vector<float>& pdf = work.pdf;
+    vector<double>& wtilde = work.wtilde;
+    vector<double>& w = work.w;
+    vector<double>& R = work.R;
 
-    derivative_lik.ReSize(num_superthreshold*nclasses);
-    derivative_lik = 0;
-    precision_lik.ReSize(num_superthreshold*nclasses,num_superthreshold*nclasses);
+    // LT of y = LT of demean(y)
+    double mn = 0;
+    for(int c = 0; c < nc; c++) mn += wtildetmp[c]/nc;
+    for(int c = 0; c < nc; c++) wtilde[c] = wtildetmp[c] - mn;
 
-    for(int r = 1; r<=num_superthreshold; r++)
-      {
-	RowVector wtildetmp(nclasses);
-	wtildetmp = 0;
-	for(int c=1; c <= nclasses; c++)
-	  {	
-	    // calculate terms for use in calculating hessian and deriv of likelihood:
-	    wtildetmp(c) = m_tildew((c-1)*num_superthreshold+r);
-	  }
+    // logistic transform
+    double mn2 = 0;
+    for(int c = 0; c < nc; c++) mn2 += wtilde[c]/nc;
+    double phi = lambda*log_bound;
+    double sum = 0.0;
+    for(int c = 0; c < nc; c++) sum += boundexp((wtilde[c]-mn2)/phi);
+    for(int c = 0; c < nc; c++) w[c] = boundexp((wtilde[c]-mn2)/phi)/sum;
 
-	// LT of y = LT of demean(y)
-	    
-	const RowVector wtilde = wtildetmp - mean(wtildetmp,2).AsScalar();
+    double P = 0;
+    double h = 0;
+    for(int c = 0; c < nc; c++)
+      {
+	h += w[c]*pdf[c];
+	R[c] = boundexp(wtilde[c]/(lambda*log_bound));
+	P += R[c];
+      }
 
-	RowVector w = logistic_transform(wtilde,lambda,log_bound);
+    // calculate dw_k/dx and d^2w_k/dx^2
+    for(int k = 0; k < nc; k++)
+      {
+	double* dd = &work.dwdydy[k*nc*nc];
+	double* d = &work.dwdy[k*nc];
 
-	if(it>0 && r==-1)
+	for(int c2 = 0; c2 < nc; c2++)
 	  {
-	    OUT(wtildetmp);
-	    OUT(mean(wtildetmp,2).AsScalar());
-	    OUT(wtilde);
-	    matout(w,"w");
-	  }
-
-	RowVector gamma(nclasses);
-	gamma = 0;
-	vector<double> R(nclasses,0);
-	    
-	double P = 0;
-	double h = 0;
-
-	for(int c=1; c <= nclasses; c++)
-	  {	
-	    // calculate terms for use in calculating hessian and deriv of likelihood:	    
-	    h += w(c)*dists[c-1]->pdf(Y(r));
-	    R[c-1] = boundexp(wtilde(c)/(lambda*log_bound));
-	    P += R[c-1];
-	    if(it>0 && r==-1)
+	    if(c2==k)
 	      {
-		OUT(dists[c-1]->pdf(Y(r)));
+		dd[k*nc+k] = R[k]/(lamsqr*P)*(1-3*R[k]/P+2*Sqr(R[k]/P));
+		d[k] = R[k]*(1-R[k]/P)/(lambda*log_bound*P);
+	      }
+	    else
+	      {
+		dd[c2*nc+c2] = R[k]*R[c2]/(lamsqr*Sqr(P))*(2*R[c2]/P-1);
+		d[c2] = -R[k]*R[c2]/(lambda*log_bound*Sqr(P));
 	      }
-	  }
-
-	if(it>0 && r==-1)
-	  {
-	    OUT(r);
-	    OUT(Y(r));
-	    matout(w,"w");
-	    matout(wtilde,"wtilde");
-	    for(int c=1; c <= nclasses; c++)
-	      OUT(R[c-1]);
-	    OUT(P);
-	    OUT(h);
-	    OUT(Sqr(h));
-	  }
 
-	// calculate dw_k/dx and d^2w_k/dx^2 
-	vector<SymmetricMatrix> dwdydy(nclasses);
-	vector<ColumnVector> dwdy(nclasses);
-	for(int k=1; k <= nclasses; k++)
-	  {	
-	    dwdydy[k-1].ReSize(nclasses);
-	    dwdydy[k-1] = 0;
-	    dwdy[k-1].ReSize(nclasses);
-	    dwdy[k-1] = 0;
-	    
-	    for(int c2=1; c2 <= nclasses; c2++)
-	      {		
-		
+	    for(int c3 = c2+1; c3 < nc; c3++)
+	      {
+		double val;
 		if(c2==k)
-		  {
-		    dwdydy[k-1](k,k) = R[k-1]/(lamsqr*P)*(1-3*R[k-1]/P+2*Sqr(R[k-1]/P));
-		    dwdy[k-1](k) = R[k-1]*(1-R[k-1]/P)/(lambda*log_bound*P);
-		  }
+		  val = R[k]*R[c3]/(lamsqr*Sqr(P))*(2*R[k]/P-1);
+		else if(c3==k)
+		  val = R[k]*R[c2]/(lamsqr*Sqr(P))*(2*R[k]/P-1);
 		else
-		  {
-		    dwdydy[k-1](c2,c2) = R[k-1]*R[c2-1]/(lamsqr*Sqr(P))*(2*R[c2-1]/P-1);	
-		    dwdy[k-1](c2) = -R[k-1]*R[c2-1]/(lambda*log_bound*Sqr(P));
-		  }
-
-		for(int c3=c2+1; c3 <= nclasses; c3++)
-		  {
-		    if(c2==k) // we know that c3 != c2
-		      {
-			dwdydy[k-1](k,c3) = R[k-1]*R[c3-1]/(lamsqr*Sqr(P))*(2*R[k-1]/P-1);
-		      }
-		    else if(c3==k) // we know that c3 != c2
-		      {
-			dwdydy[k-1](k,c2) = R[k-1]*R[c2-1]/(lamsqr*Sqr(P))*(2*R[k-1]/P-1);
-		      }
-		    else
-		      {
-			dwdydy[k-1](c2,c3) = 2*R[k-1]*R[c2-1]*R[c3-1]/(lamsqr*Sqr(P)*P);
-		      }
-		  }
+		  val = 2*R[k]*R[c2]*R[c3]/(lamsqr*Sqr(P)*P);
+		dd[c2*nc+c3] = dd[c3*nc+c2] = val;
 	      }
 	  }
+      }
 
-	// calculate d^2f/dw^2 and df/dw
-	SymmetricMatrix dfdwdw(nclasses);
-	dfdwdw = 0;
-	ColumnVector dfdw(nclasses);
-	dfdw = 0;
-
-	//	float premult = Sqr(A/h);
+    // calculate d^2f/dw^2 and df/dw
+    vector<double>& dfdwdw = work.dfdwdw;
+    vector<double>& dfdw = work.dfdw;
+    for(int c = 0; c < nc; c++)
+      {
+	dfdwdw[c*nc+c] = Sqr(pdf[c]/h);
+	dfdw[c] = -pdf[c]/h;
+	for(int c2 = c+1; c2 < nc; c2++)
+	  dfdwdw[c*nc+c2] = dfdwdw[c2*nc+c] = pdf[c]*pdf[c2]/Sqr(h);
+      }
 
-	for(int c=1; c <= nclasses; c++)
+    // Now fill up precision/Hessian for tildew (aka x) for this voxel
+    const vector<double>& dwdy = work.dwdy;
+    const vector<double>& dwdydy = work.dwdydy;
+    for(int k = 0; k < nc; k++)
+      {
+	// diagonal terms k=j
+	float sum_l = 0;
+	float sum_l2 = 0;
+	for(int l = 0; l < nc; l++)
 	  {
-	    dfdwdw(c,c) =  Sqr(dists[c-1]->pdf(Y(r))/h);
-	    dfdw(c) = -dists[c-1]->pdf(Y(r))/h;
+	    float sum_m = 0;
+	    for(int m = 0; m < nc; m++)
+	      sum_m += dfdwdw[m*nc+l]*dwdy[m*nc+k];
 
-	    for(int c2=c+1; c2 <= nclasses; c2++)
-	      {
-		dfdwdw(c,c2) = dists[c-1]->pdf(Y(r))*dists[c2-1]->pdf(Y(r))/Sqr(h);
-		//dfdwdw(c2,c) = dists[c-1]->pdf(Y(r))*dists[c2-1]->pdf(Y(r))/Sqr(h);
-	      }
-	  }
-
-	if(it>0 && r==-1)
-	  {
-	    matout(dfdwdw,"dfdwdw");
-	    matout(dfdw,"dfdw");
+	    sum_l += sum_m*dwdy[l*nc+k] + dfdw[l]*dwdydy[(l*nc+k)*nc+k];
+	    sum_l2 += dfdw[l]*dwdy[l*nc+k];
 	  }
 
-	// Now fill up precision/Hessian for tildew (aka x) for this voxel
-	SymmetricMatrix hessanal(nclasses);
-	hessanal = 0;
-	ColumnVector derivanal(nclasses);
-	derivanal = 0;
+	derivanal[k] = sum_l2;
+	hessanal[k*nc+k] = sum_l;
 
-	for(int k=1; k <= nclasses; k++)
+	// off-diagonal terms jk (j is called n here)
+	for(int n = k+1; n < nc; n++)
 	  {
-	    // diagonal terms k=j
 	    float sum_l = 0;
-	    float sum_l2 = 0;
-	    for(int l=1; l <= nclasses; l++)
+	    for(int l = 0; l < nc; l++)
 	      {
 		float sum_m = 0;
-		for(int m=1; m <= nclasses; m++)
-		  {
-		    sum_m += dfdwdw(m,l)*dwdy[m-1](k);
-		  }
-		if(it==-1 && r==40 && k==1)
-		  {
-		    matout(dfdwdw,"dfdwdw");
-		    matout(dwdy[l-1],"dwdy");
-		    OUT(l);
-		    OUT(sum_m);
-		    OUT(dwdydy[l-1](k,k));
-		    OUT(dwdy[l-1](k));
-		    OUT(dfdw(l));
-		  }
+		for(int m = 0; m < nc; m++)
+		  sum_m += dfdwdw[m*nc+l]*dwdy[m*nc+k];
+		sum_l += sum_m*dwdy[l*nc+n] + dfdw[l]*dwdydy[(l*nc+n)*nc+k];
+	      }
+	    hessanal[n*nc+k] = hessanal[k*nc+n] = sum_l;
+	  }
+      }
+  }
 
-		sum_l += sum_m*dwdy[l-1](k) + dfdw(l)*dwdydy[l-1](k,k);
+  void Mixture_Model::calculate_taylor_lik()
+  {
+    Tracer_Plus trace("Mixture_Model::calculate_taylor_lik");
 
-		sum_l2 += dfdw(l)*dwdy[l-1](k);
-	      }
+    cout << "Doing 2nd Order Taylor Expansion of Likelihood" << endl; 
 
-	    derivanal(k) = sum_l2;
+    const int N = num_superthreshold;
+    const int nc = nclasses;
 
-	    if(it==-1 && r==40 && k==1)
-	      {
-		OUT(sum_l);
-	      }
-	    hessanal(k,k) = sum_l;
+    derivative_lik.ReSize(N*nc);
+    derivative_lik = 0;
+    precision_lik.ReSize(N*nc,N*nc);
 
-	    // off-diagonal terms jk (j is called n here)
-	    for(int n=k+1; n <= nclasses; n++)
-	      {
-		float sum_l = 0;
-		for(int l=1; l <= nclasses; l++)
-		  {
-		    float sum_m = 0;
-		    for(int m=1; m <= nclasses; m++)
-		      {
-			sum_m += dfdwdw(m,l)*dwdy[m-1](k);
-		      }
-		    sum_l += sum_m*dwdy[l-1](n) + dfdw(l)*dwdydy[l-1](n,k);		 
-		  }
+    // class likelihoods of all voxels, a class at a time
+    vector<float> data(N);
+    for(int r = 1; r <= N; r++)
+      data[r-1] = Y(r);
 
-		hessanal(n,k) = sum_l;
-	      }
-	  }
+    vector<float> lik(nc*N);
+    for(int c = 0; c < nc; c++)
+      dists[c]->pdfs(&data[0],&lik[c*N],N);
 
-	for(int k=1; k <= nclasses; k++)
-	  {
-	    derivative_lik((k-1)*num_superthreshold+r) += derivanal(k);
+    // build up precision/hessian matrix for tildew (aka x), voxels in
+    // parallel, then add into the sparse matrices in voxel order
+    const double* tildew = m_tildew.Store();
+    vector<double> hess(N*nc*nc), deriv(N*nc);
 
-	    precision_lik.addto((k-1)*num_superthreshold+r,(k-1)*num_superthreshold+r,hessanal(k,k));	    
-	    for(int l=k+1; l <= nclasses; l++)
-	      {
-		precision_lik.addto((k-1)*num_superthreshold+r,(l-1)*num_superthreshold+r,hessanal(k,l));
-		precision_lik.addto((l-1)*num_superthreshold+r,(k-1)*num_superthreshold+r,hessanal(k,l));
-	      }	
-	  }      
+#ifdef _OPENMP
+#pragma omp parallel if(Utilities::max_threads() > 1)
+#endif
+    {
+      TaylorWork work(nc);
+      vector<double> wtildetmp(nc);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,256)
+#endif
+      for(int r = 0; r < N; r++)
+	{
+	  for(int c = 0; c < nc; c++)
+	    {
+	      wtildetmp[c] = tildew[c*N+r];
+	      work.pdf[c] = lik[c*N+r];
+	    }
+	  taylor_lik_voxel(&wtildetmp[0],nc,lambda,log_bound,work,&hess[r*nc*nc],&deriv[r*nc]);
+	}
+    }
 
-	////////////////////
-	if(it>0 && r==-1)  
+    for(int r = 1; r <= N; r++)
+      {
+	const double* hessanal = &hess[(r-1)*nc*nc];
+	for(int k = 1; k <= nc; k++)
 	  {
-	    matout(derivanal,"derivanal");
-	    matout(hessanal,"hessanal");
-	  }
+	    derivative_lik((k-1)*N+r) += deriv[(r-1)*nc+k-1];
 
-// 	if(it>5 && r==-1)  
-// 	  {
-// 	    SmmVoxelFunction smmfunc(Y(r),dists,lambda,log_bound);
-// 	    ColumnVector deriv1 = gradient(wtilde.t(),smmfunc,1e-2,1);
-// 	    ColumnVector deriv2 = gradient(wtilde.t(),smmfunc,1e-2,2);
-// 	    ColumnVector deriv4 = gradient(wtilde.t(),smmfunc,1e-2,4);
-// 	    OUT(r);
-// 	    matout(derivanal,"derivanal");
-// 	    matout(deriv2, "deriv2");
-// 	    matout(deriv4, "deriv4");
-// 	    SymmetricMatrix hess1 = hessian(wtilde.t(),smmfunc,1e-2,1);
-// 	    SymmetricMatrix hess2 = hessian(wtilde.t(),smmfunc,1e-2,2);
-// 	    SymmetricMatrix hess4 = hessian(wtilde.t(),smmfunc,1e-2,4);
-// 	    matout(hessanal,"hessanal");
-// 	    matout(hess2,"hess2");
-// 	    matout(hess4,"hess4");
-// 	  }
-	//////////////
+	    precision_lik.addto((k-1)*N+r,(k-1)*N+r,hessanal[(k-1)*nc+k-1]);
+	    for(int l = k+1; l <= nc; l++)
+	      {
+		precision_lik.addto((k-1)*N+r,(l-1)*N+r,hessanal[(k-1)*nc+l-1]);
+		precision_lik.addto((l-1)*N+r,(k-1)*N+r,hessanal[(k-1)*nc+l-1]);
+	      }
+	  }
       }
   }
 
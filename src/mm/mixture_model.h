@@ -108,6 +108,11 @@ namespace Mm{
     virtual float dpdfdmn(float val) const = 0;
     virtual float dpdfdvar(float val) const  = 0;
 
+    // pdf of each of n values, a whole class at a time
+    virtual void pdfs(const float* vals, float* ret, int n) const {
+      for(int i = 0; i < n; i++) ret[i] = pdf(vals[i]);
+    }
+
     virtual ~Distribution(){}
 
     float getmean() const {return mn;}
@@ -146,6 +151,10 @@ namespace Mm{
       float ret = premult*0.5*(Sqr(val-mn)-var)/std::pow(var,2)*std::exp(-0.5/var*Sqr(val-mn));
       
       return ret;
+    }
+
+    virtual void pdfs(const float* vals, float* ret, int n) const {
+      for(int i = 0; i < n; i++) ret[i] = GaussianDistribution::pdf(vals[i]);
     }
 
     virtual ~GaussianDistribution(){}
@@ -201,6 +210,10 @@ namespace Mm{
 	ret = dpdfda(val)*(-Sqr(mn)/Sqr(var))+dpdfdb(val)*(-mn/Sqr(var));
 
       return ret;
+    }
+
+    virtual void pdfs(const float* vals, float* ret, int n) const {
+      for(int i = 0; i < n; i++) ret[i] = GammaDistribution::pdf(vals[i]);
     }
 
     virtual ~GammaDistribution(){}
@@ -287,6 +300,10 @@ namespace Mm{
 	ret = dpdfda(val)*(-Sqr(pmn)/Sqr(var))+dpdfdb(val)*(-pmn/Sqr(var));
 
       return ret;
+    }
+
+    virtual void pdfs(const float* vals, float* ret, int n) const {
+      for(int i = 0; i < n; i++) ret[i] = FlippedGammaDistribution::pdf(vals[i]);
     }
 
     virtual ~FlippedGammaDistribution(){}
@@ -478,6 +495,15 @@ namespace Mm{
 
       volume<int> indices;
 
+      // masked neighbours of voxel r are neighbour_index[neighbour_start[r-1]]
+      // up to neighbour_start[r] (as 0-based voxel indices); colour_voxels
+      // holds the 0-based voxels grouped by colour, no two voxels of one
+      // colour being neighbours
+      vector<int> neighbour_start;
+      vector<int> neighbour_index;
+      vector<int> colour_start;
+      vector<int> colour_voxels;
+
       ColumnVector& Y;
       SparseMatrix D;
 
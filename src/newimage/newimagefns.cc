@@ -993,6 +993,41 @@ bool rowentry_lessthan(const rowentry& r1, const rowentry& r2)
   return r1.d < r2.d ;
 }
 
+// One pass of the exact squared Euclidean distance transform of 
+// Felzenszwalb and Huttenlocher (the lower envelope of the parabolas
+// rooted at each sample) along a line of n samples spaced h mm apart.
+// On input f holds the squared distance to the nearest feature found so
+// far and fi its index (<0 if none); on output d and di hold the nearest
+// along the line. v (n) and z (n+1) are workspace.
+void edt_line(int n, float h, const float *f, const int *fi, 
+	      float *d, int *di, int *v, double *z)
+{
+  double h2=h*h;
+  int k=-1;
+  for (int q=0; q<n; q++) {
+    if (fi[q]<0) continue;
+    double s=0.0;
+    while (k>=0) {
+      s = ((f[q] + h2*q*q) - (f[v[k]] + h2*v[k]*v[k])) / (2.0*h2*(q-v[k]));
+      if (s<=z[k]) k--; else break;
+    }
+    k++;
+    v[k]=q;
+    z[k]= (k==0) ? -1e30 : s;
+  }
+  if (k<0) {  // no features along this line
+    for (int q=0; q<n; q++) { d[q]=0.0f; di[q]=-1; }
+    return;
+  }
+  z[k+1]=1e30;
+  int j=0;
+  for (int q=0; q<n; q++) {
+    while (z[j+1]<q) j++;
+    d[q] = h2*(q-v[j])*(q-v[j]) + f[v[j]];
+    di[q] = fi[v[j]];
+  }
+}
+
 
 
   ///////////////////////////////////////////////////////////////////////////
@@ -82,6 +82,7 @@
 #include "miscmaths/miscmaths.h"
 #include "complexvolume.h"
 #include "imfft.h"
+#include "utils/threading.h"
 #include <queue>
 
 #ifndef MAX
@@ -468,6 +469,12 @@ namespace NEWIMAGE {
                                    const volume<T>& mask, 
                                    bool (*binaryrelation)(T , T), ColumnVector& clustersize);
 
+  // as above, but also returns the sum of massvol over each component
+  template <class T, class S>
+    volume<int> connected_components(const volume<T>& vol, const volume<S>& massvol,
+				     ColumnVector& clustersize, ColumnVector& clustermass, 
+				     int numconnected=26);
+
   template <class T>
   volume<int> connected_components(const volume<T>& vol, 
 				   int numconnected=26);
@@ -2672,15 +2679,156 @@ volume<S> extractpart(const volume<T>& v1, const volume<S>& v2, const volume<U>&
     }
 
 
+  // Union-find on voxel indices. Each set is rooted at its lowest index,
+  //  i.e. at the first voxel of the component in raster order.
+  inline int component_root(std::vector<int>& parent, int i)
+    {
+      while (parent[i]!=i) { parent[i]=parent[parent[i]]; i=parent[i]; }
+      return i;
+    }
+
+  inline void merge_components(std::vector<int>& parent, int i, int j)
+    {
+      i=component_root(parent,i);
+      j=component_root(parent,j);
+      if (i<j) parent[j]=i; else if (j<i) parent[i]=j;
+    }
+
+  // The labelling behind connected_components. Slabs of slices are labelled 
+  //  in parallel with union-find, the slabs are then joined across their 
+  //  boundaries, and a final raster pass numbers the components in order of
+  //  their first voxel (as the two-pass labelling did) while adding up their
+  //  sizes and, if massvol is given, the sum of massvol over each.
+  template <class T, class S>
+  void label_components(const volume<T>& vol, const volume<S> *massvol, 
+			volume<int>& labelvol, ColumnVector& clustersize,
+			ColumnVector *clustermass, int numconnected)
+    {
+      copyconvert(vol,labelvol);
+      labelvol = 0;
+      int x0=vol.minx(), y0=vol.miny(), z0=vol.minz();
+      int nx=vol.maxx()-x0+1, ny=vol.maxy()-y0+1, nz=vol.maxz()-z0+1;
+      if (nx<=0 || ny<=0 || nz<=0) {
+	clustersize.ReSize(0);
+	if (clustermass) clustermass->ReSize(0);
+	return;
+      }
+      int nxy=nx*ny;
+
+      // The neighbours that precede a voxel in raster order
+      std::vector<int> ndx, ndy, ndz;
+      for (int dz=-1; dz<=0; dz++) {
+	for (int dy=-1; dy<=1; dy++) {
+	  for (int dx=-1; dx<=1; dx++) {
+	    if (!((dz<0) || (dz==0 && dy<0) || (dz==0 && dy==0 && dx<0))) continue;
+	    int nnonzero = std::abs(dx) + std::abs(dy) + std::abs(dz);
+	    if ((numconnected==6 && nnonzero>1) || (numconnected==18 && nnonzero>2)) continue;
+	    ndx.push_back(dx);  ndy.push_back(dy);  ndz.push_back(dz);
+	  }
+	}
+      }
+
+      std::vector<int> parent(nxy*nz,-1);
+      int nslab = std::max(1,std::min(Utilities::max_threads(),nz));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,1) if(nslab > 1)
+#endif
+      for (int s=0; s<nslab; s++) {
+	int zs=(s*nz)/nslab, ze=((s+1)*nz)/nslab;
+	for (int z=zs; z<ze; z++) {
+	  for (int y=0; y<ny; y++) {
+	    for (int x=0; x<nx; x++) {
+	      T val = vol(x+x0,y+y0,z+z0);
+	      if (val>0.5) {  // The eligibility test
+		int i = x + nx*y + nxy*z;
+		parent[i] = i;
+		for (unsigned int n=0; n<ndx.size(); n++) {
+		  int xn=x+ndx[n], yn=y+ndy[n], zn=z+ndz[n];
+		  if (xn<0 || xn>=nx || yn<0 || yn>=ny || zn<zs) continue;  // z-1 in another slab is joined below
+		  T val2 = vol(xn+x0,yn+y0,zn+z0);
+		  if ((val2>0.5) && (MISCMATHS::round(val2-val)==0)) {  // Binary relation
+		    merge_components(parent,i,xn + nx*yn + nxy*zn);
+		  }
+		}
+	      }
+	    }
+	  }
+	}
+      }
+      // Join the slabs across their boundaries
+      for (int s=1; s<nslab; s++) {
+	int z=(s*nz)/nslab;
+	for (int y=0; y<ny; y++) {
+	  for (int x=0; x<nx; x++) {
+	    int i = x + nx*y + nxy*z;
+	    if (parent[i]<0) continue;
+	    T val = vol(x+x0,y+y0,z+z0);
+	    for (unsigned int n=0; n<ndx.size(); n++) {
+	      if (ndz[n]==0) continue;
+	      int xn=x+ndx[n], yn=y+ndy[n], zn=z-1;
+	      if (xn<0 || xn>=nx || yn<0 || yn>=ny) continue;
+	      T val2 = vol(xn+x0,yn+y0,zn+z0);
+	      if ((val2>0.5) && (MISCMATHS::round(val2-val)==0)) {
+		merge_components(parent,i,xn + nx*yn + nxy*zn);
+	      }
+	    }
+	  }
+	}
+      }
+      // Find the root of every voxel (read only, so can be shared out)
+      std::vector<int> root(nxy*nz,-1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(nslab > 1)
+#endif
+      for (int i=0; i<nxy*nz; i++) {
+	if (parent[i]<0) continue;
+	int r=i;
+	while (parent[r]!=r) r=parent[r];
+	root[i]=r;
+      }
+      // Number the components, write the labels and add up sizes/masses
+      std::vector<int> size;
+      std::vector<double> mass;
+      for (int z=0, i=0; z<nz; z++) {
+	for (int y=0; y<ny; y++) {
+	  for (int x=0; x<nx; x++, i++) {
+	    if (root[i]<0) continue;
+	    if (root[i]==i) {  // first voxel of a new component
+	      size.push_back(0);
+	      if (massvol) mass.push_back(0.0);
+	      parent[i] = size.size();  // parent is now the label of the root
+	    }
+	    int label = parent[root[i]];
+	    labelvol(x+x0,y+y0,z+z0) = label;
+	    size[label-1]++;
+	    if (massvol) mass[label-1] += (*massvol)(x+x0,y+y0,z+z0);
+	  }
+	}
+      }
+      clustersize.ReSize(size.size());
+      for (unsigned int n=0; n<size.size(); n++) clustersize(n+1) = size[n];
+      if (clustermass) {
+	clustermass->ReSize(mass.size());
+	for (unsigned int n=0; n<mass.size(); n++) (*clustermass)(n+1) = mass[n];
+      }
+    }
+
   template <class T>
   volume<int> connected_components(const volume<T>& vol, ColumnVector& clustersize, int numconnected)
     {
       volume<int> labelvol;
-      copyconvert(vol,labelvol);
-      std::vector<int> equivlista, equivlistb;
-      nonunique_component_labels(vol,labelvol,
-				 equivlista,equivlistb,numconnected);
-      relabel_components_uniquely(labelvol,equivlista,equivlistb,clustersize);
+      label_components(vol,(const volume<T> *) 0,labelvol,clustersize,(ColumnVector *) 0,numconnected);
+      return labelvol;
+    }
+
+  template <class T, class S>
+  volume<int> connected_components(const volume<T>& vol, const volume<S>& massvol,
+				   ColumnVector& clustersize, ColumnVector& clustermass, 
+				   int numconnected)
+    {
+      if (!samesize(vol,massvol)) imthrow("connected_components: vol and massvol not the same size",3);
+      volume<int> labelvol;
+      label_components(vol,&massvol,labelvol,clustersize,&clustermass,numconnected);
       return labelvol;
     }
 
@@ -2722,6 +2870,9 @@ class rowentry { public: int x; int y; int z; float d; } ;
 
 bool rowentry_lessthan(const rowentry& r1, const rowentry& r2);
 
+void edt_line(int n, float h, const float *f, const int *fi, 
+	      float *d, int *di, int *v, double *z);
+
 template <class T>
 class distancemapper {
 private:
@@ -2729,6 +2880,8 @@ private:
   const volume<T> &mask;
   vector<rowentry> schedule;
   Matrix octantsign;
+  bool globals_ok;
+  bool exact;
 public:
   // basic constructor takes binaryvol (mask of valid values) 
   //   + maskvol (non-zero at desired calculated points only)
@@ -2737,8 +2890,12 @@ public:
   volume<float> distancemap();
   volume4D<float> sparseinterpolate(const volume4D<float>& values, 
 				    const string& interpmethod="general");
+  // distances and "nn" interpolation use an exact distance transform 
+  //  unless this is set to false (then the slower search is used)
+  void setexactdistance(bool flag) { exact=flag; }
 private:
   int setup_globals();  
+  bool find_all_nearest(vector<int>& nearest) const;
   int find_nearest(int x, int y, int z, int& x1, int& y1, int& z1, 
 		   bool findav, ColumnVector& localav, const volume4D<float>& vals);
   int find_nearest(int x, int y, int z, int& x1, int& y1, int& z1);
@@ -2751,11 +2908,11 @@ private:
 
 template <class T>
 distancemapper<T>::distancemapper(const volume<T>& binaryvol, const volume<T>& maskvol) :
-  bvol(binaryvol), mask(maskvol)
+  bvol(binaryvol), mask(maskvol), globals_ok(false), exact(true)
 {
   if (!samesize(bvol,mask)) imthrow("Mask and image not the same size",20);
   octantsign.ReSize(8,3);
-  setup_globals();
+  // the search schedule is only set up if find_nearest is needed
 }
 
 template <class T>
@@ -2803,9 +2960,61 @@ int distancemapper<T>::setup_globals()
 
   // sort schedule to get ascending d2
   sort(schedule.begin(),schedule.end(),NEWIMAGE::rowentry_lessthan);
+  globals_ok=true;
   return 0;
 }
 
+// Finds the nearest non-zero voxel of bvol (as index x+xsize*(y+ysize*z)) for
+//  every voxel, using separable passes of an exact squared distance transform
+//  along x, y and z (taking voxel sizes into account), each parallel over lines.
+//  Returns false if bvol has no non-zero voxels.
+template <class T>
+bool distancemapper<T>::find_all_nearest(vector<int>& nearest) const
+{
+  int xs=bvol.xsize(), ys=bvol.ysize(), zs=bvol.zsize();
+  int nvox=xs*ys*zs;
+  vector<float> d2(nvox,0.0f);
+  nearest.resize(nvox);
+  bool anyfeature=false;
+  for (int z=0, n=0; z<zs; z++) {
+    for (int y=0; y<ys; y++) {
+      for (int x=0; x<xs; x++, n++) {
+	if (bvol.value(x,y,z)>0.5) { nearest[n]=n; anyfeature=true; }
+	else nearest[n]=-1;
+      }
+    }
+  }
+  if (!anyfeature) return false;
+
+  int sz[3] = { xs, ys, zs };
+  int stride[3] = { 1, xs, xs*ys };
+  float dim[3] = { bvol.xdim(), bvol.ydim(), bvol.zdim() };
+  for (int dir=0; dir<3; dir++) {
+    int n=sz[dir];
+    // the other two directions enumerate the lines
+    int a = (dir==0) ? 1 : 0, b = (dir==2) ? 1 : 2;
+    int nlines=sz[a]*sz[b];
+#ifdef _OPENMP
+#pragma omp parallel if(Utilities::max_threads() > 1)
+#endif
+    {
+      vector<float> f(n), d(n);
+      vector<int> fi(n), di(n), v(n);
+      vector<double> zb(n+1);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,64)
+#endif
+      for (int line=0; line<nlines; line++) {
+	int start = (line%sz[a])*stride[a] + (line/sz[a])*stride[b];
+	for (int q=0, m=start; q<n; q++, m+=stride[dir]) { f[q]=d2[m]; fi[q]=nearest[m]; }
+	edt_line(n,dim[dir],&f[0],&fi[0],&d[0],&di[0],&v[0],&zb[0]);
+	for (int q=0, m=start; q<n; q++, m+=stride[dir]) { d2[m]=d[q]; nearest[m]=di[q]; }
+      }
+    }
+  }
+  return true;
+}
+
 // findav determines whether to do interpolation calculations or just
 //  return the location only
 template <class T>
@@ -2815,6 +3024,7 @@ int distancemapper<T>::find_nearest(int x, int y, int z, int& x1, int& y1, int&
 {
   float sumw=0.0, mindist=0.0, maxdist=0.0, weight;
   ColumnVector sumvw;
+  if (!globals_ok) setup_globals();
   if (findav) { 
     localav.ReSize(vals.tsize()); 
     localav=0.0;
@@ -2964,11 +3174,19 @@ int distancemapper<T>::basic_create_distancemap(volume4D<float>& vout,
   if ((interp>0) && (!samesize(bvol,valim[0])))
     {  print_volume_info(bvol,"bvol"); print_volume_info(mask,"mask");   print_volume_info(valim[0],"valim"); 
        imthrow("Binary image and interpolant not the same size",21); }
+  vector<int> nearest;
+  bool useexact = exact && (interp<2) && find_all_nearest(nearest);
+  int xs=bvol.xsize(), ys=bvol.ysize();
   for (int z=vout.minz(); z<=vout.maxz(); z++) {
     for (int y=vout.miny(); y<=vout.maxy(); y++) {
       for (int x=vout.minx(); x<=vout.maxx(); x++) {
 	if (mask(x,y,z)>((T) 0.5)) {
-	  if (interp>=2) {
+	  // the search finds the nearest *other* non-zero voxel, so that 
+	  //  is still used where the mask and bvol overlap
+	  int n = (useexact) ? nearest[x+xs*(y+ys*z)] : -1;
+	  if (useexact && n!=x+xs*(y+ys*z)) {
+	    x1=n%xs;  y1=(n/xs)%ys;  z1=n/(xs*ys);
+	  } else if (interp>=2) {
 	    find_nearest(x,y,z,x1,y1,z1,true,localav,valim);
 	  } else {
 	    find_nearest(x,y,z,x1,y1,z1);
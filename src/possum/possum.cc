@@ -85,6 +85,7 @@
 #include "utils/options.h"
 #include "newimage/costfns.h"
 #include "miscmaths/miscmaths.h"
+#include "utils/threading.h"
 
 #define _GNU_SOURCE 1
 #define POSIX_SOURCE 1
@@ -192,6 +193,90 @@ Option<bool> opt_kcoord(string("-k,--kcoord"), false,
 
 int nonoptarg;
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// THREADED SIMULATION
+// The object voxels do not interact, so they are listed in the order of the
+// serial loops and simulated over threads, each thread adding into its own
+// copy of the signal. The first voxel (v==1) sets up the look up tables and
+// the gradient integrals used by all the others, so it is always finished
+// before any other voxel starts.
+
+struct PossumVoxel {
+  int xx, yy, zz, tt, xxx;
+};
+
+void list_voxels(vector<PossumVoxel>& vox, const volume4D<double>& phantom, const int Nt,
+                 const int xstart, const int xend, const int ystart, const int yend,
+                 const int zstart, const int zend, const int myid, const int numprocs){
+  vox.clear();
+  PossumVoxel p;
+  for (int tt=0;tt<Nt;tt++){
+    for (int zz=zstart;zz<zend;zz++){
+      for (int yy=ystart;yy<yend;yy++){
+        int xxx=myid+xstart;
+        for (int xx=xstart;xx<xend;xx++){
+          if (phantom.value(xx,yy,zz,tt)!=0){
+            p.xx=xx; p.yy=yy; p.zz=zz; p.tt=tt; p.xxx=xxx;
+            vox.push_back(p);
+          }
+          xxx=xxx+numprocs;
+        }
+      }
+    }
+  }
+}
+
+void voxel_activation(const PossumVoxel& p, const volume<double>& activation, const volume4D<double>& activation4D,
+                      const double* timecourse_2, const Matrix& tissue, const int Nact, double* activation4D_voxel){
+  if (opt_activation.set()) {
+    for (int n=0;n<=Nact-1;n++){
+      double a=activation.value(p.xx,p.yy,p.zz)*timecourse_2[n];
+      double b=tissue(p.tt+1,2);
+      activation4D_voxel[n]=a*b/(a+b);// conversion of beta into beta1 because of the integral (see possum no 7 page 121)
+    }
+  }
+  else if (opt_activation4D.set()){
+    for (int n=0;n<=Nact-1;n++){
+      double a=activation4D.value(p.xx,p.yy,p.zz,n);
+      double b=tissue(p.tt+1,2);
+      activation4D_voxel[n]=a*b/(a+b);
+    }
+  }
+}
+
+// Signal of one thread: the master thread adds straight into the output,
+// the others into private arrays that reduce() adds into the output once
+// all the voxels are done
+class ThreadSignal {
+ public:
+  ThreadSignal(double* sreal_out, double* simag_out, const int n) : 
+    sreal_total(sreal_out), simag_total(simag_out), nreadp(n) {
+    if (thread_num()==0) { sreal=sreal_total; simag=simag_total; }
+    else {
+      sreal=new double[nreadp];
+      simag=new double[nreadp];
+      for (int i=0;i<nreadp;i++) { sreal[i]=0.0; simag[i]=0.0; }
+    }
+  }
+  ~ThreadSignal() { if (sreal!=sreal_total) { delete[] sreal; delete[] simag; } }
+  void reduce() {
+    if (sreal==sreal_total) return;
+#ifdef _OPENMP
+#pragma omp critical(possum_signal)
+#endif
+    for (int i=0;i<nreadp;i++) {
+      sreal_total[i]+=sreal[i];
+      simag_total[i]+=simag[i];
+    }
+  }
+  double* sreal;
+  double* simag;
+ private:
+  double* sreal_total;
+  double* simag_total;
+  int nreadp;
+};
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 int compute_volume(int argc, char *argv[])
 {
@@ -518,6 +603,7 @@ cout << "possum-start-time\t"<< opt_procid.value() << "\t" << theTime << endl;
   if (verbose.value()) {
     opt_test=1;
     cout<<"Verbose is ON"<<endl;
+    set_max_threads(1);// keeps the per voxel test output in order
   }
   ///////////////////////////////////////////////////////////////////////
   //K-SPACE COORDINATES
@@ -556,6 +642,9 @@ cout << "possum-start-time\t"<< opt_procid.value() << "\t" << theTime << endl;
 	    cout<<"Reading the pulse sequence..."<<endl;
 	    PMatrix pulse;
 	    read_binary_matrix(pulse, opt_pulse.value());
+	    PulseTable events;
+	    events.compile(pulse,timecourse,Nact);
+	    cout<<"Kept "<<events.Nevents()<<" of "<<pulse.Nrows()<<" pulse sequence events"<<endl;
 	    ////////////////////////
 	    // B0 PERTURBATION 
 	    ////////////////////////
@@ -582,52 +671,45 @@ cout << "possum-start-time\t"<< opt_procid.value() << "\t" << theTime << endl;
 	    //MAIN LOOP
 	    /////////////
 	    cout<<"Main loop..."<<endl;
-	    for (register int tt=0;tt<Nt;tt++){
-	      for (register int zz=zstart;zz<zend;zz++){
-		cout<<"Tissue type="<<tt<<"; zstart="<<zstart<<"; zz="<<zz<<"; zend="<<zend<<"; Voxelnumber="<<voxelcounter<<endl;
-		for (register int yy=ystart;yy<yend;yy++){
-		  int xxx=myid+xstart;
-		  for (register int xx=xstart;xx<xend;xx++){
-		    //slice speed up stuff
-		    if (fabs((float)slcdir)==1) sszz=zz;
-		    else if (fabs((float)slcdir)==2) sszz=yy;
-		    else sszz=xx;
-	      	    float slctmp=(sszz-sszstart_p)/(slcthk*nvox);
-		    if(ceil(slctmp) == slctmp) {
-		      sszz_slc=(int)(ceil(slctmp)+1);
-		    } else {
-		      sszz_slc=(int) (ceil(slctmp));
-		    }
-		    if (phantom(xx,yy,zz,tt)!=0){
-		      voxelcounter=voxelcounter+1;
-		      double den=phantom(xx,yy,zz,tt)*RFrec(xx,yy,zz)*cxyz;
-		      if (opt_activation.set()) {
-		        for (int n=0;n<=Nact-1;n++){
-			  double a=activation(xx,yy,zz)*timecourse_2[n];
-			  double b=tissue(tt+1,2);
-			  activation4D_voxel[n]=a*b/(a+b);// conversion of beta into beta1 because of the integral (see possum no 7 page 121)
-			}
-		      }
-		     else if (opt_activation4D.set()){
-		       for (int n=0;n<=Nact-1;n++){
-			 double a=activation4D(xx,yy,zz,n);//zz-zstart_p when having only a pieace of the activation volume so we start from where the phantom starts 
-		         double b=tissue(tt+1,2);
-		         activation4D_voxel[n]=a*b/(a+b);
-		       }              
-		     }
-		      voxel1(posx(xxx+1),posy(yy+1),posz(zz+1),tissue.Row(tt+1),
-		             pulse,nreadp,voxelcounter,xdim,ydim,zdim,
-		             b0(xx,yy,zz),b0x(xx,yy,zz),b0y(xx,yy,zz),b0z(xx,yy,zz),
-		             timecourse,activation4D_voxel,Nact,outputname,
-		             table_slcprof,dslcp,dslcp_first,Nslc,den,RFtrans(xx,yy,zz),
-		             opt_test,nospeedup,save_kcoord,sreal,simag);   
-		      //srealT+=sreal*coil(xx,yy,zz); //Ivana 01.11.12 -trial		      
-		    }
-		  xxx=xxx+numprocs;
+	    vector<PossumVoxel> vox;
+	    list_voxels(vox,phantom,Nt,xstart,xend,ystart,yend,zstart,zend,myid,numprocs);
+	    voxelcounter=vox.size();
+	    cout<<"Number of object voxels is "<<voxelcounter<<"; simulating on "<<max_threads()<<" threads"<<endl;
+	    ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	    {
+	      ThreadSignal sig(sreal,simag,nreadp);
+	      vector<double> act(Nact,0.0);
+	      for (int part=0;part<2;part++){
+		int vbeg=(part==0)?0:1;
+		int vend=(part==0)?min(1,voxelcounter):voxelcounter;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+		for (int v=vbeg;v<vend;v++){
+		  if (err.occurred()) continue;
+		  try {
+		    const PossumVoxel& p=vox[v];
+		    double den=phantom.value(p.xx,p.yy,p.zz,p.tt)*RFrec.value(p.xx,p.yy,p.zz)*cxyz;
+		    voxel_activation(p,activation,activation4D,timecourse_2,tissue,Nact,&act[0]);
+		    voxel1(posx(p.xxx+1),posy(p.yy+1),posz(p.zz+1),tissue.Row(p.tt+1),
+		           events,nreadp,v+1,xdim,ydim,zdim,
+		           b0.value(p.xx,p.yy,p.zz),b0x.value(p.xx,p.yy,p.zz),b0y.value(p.xx,p.yy,p.zz),b0z.value(p.xx,p.yy,p.zz),
+		           timecourse,&act[0],Nact,outputname,
+		           table_slcprof,dslcp,dslcp_first,Nslc,den,RFtrans.value(p.xx,p.yy,p.zz),
+		           opt_test,nospeedup,save_kcoord,sig.sreal,sig.simag);
+		  }
+		  catch(Exception& e) {
+		    err.set(e.what());
 		  }
 		}
 	      }
+	      sig.reduce();
 	    }
+	    if (err.occurred())
+	      throw Exception(err.what().c_str());
 	  }
 	  ////////////////////////////////////////////////////////////
 	  //MOTION WHEN ONLY POSSIBLE ROTATION CAN BE IN PLANE
@@ -664,52 +746,45 @@ cout << "possum-start-time\t"<< opt_procid.value() << "\t" << theTime << endl;
 	    //MAIN LOOP
 	    ////////////////
 	    cout<<"Main loop..."<<endl;
-	    for (register int tt=0;tt<Nt;tt++){
-	      for (register int zz=zstart;zz<zend;zz++){
-		cout<<"Tissue type="<<tt<<"; zstart="<<zstart<<"; zz="<<zz<<"; zend="<<zend<<"; Voxelnumber="<<voxelcounter<<endl;
-		for (register int yy=ystart;yy<yend;yy++){
-		  int xxx=myid+xstart;
-		  for (register int xx=xstart;xx<xend;xx++){
-		      //slice speed up stuff
-		    if (fabs((float)slcdir)==1) sszz=zz;
-		    else if (fabs((float)slcdir)==2) sszz=yy;
-		    else sszz=xx;
-		    float slctmp=(sszz-sszstart_p)/(slcthk*nvox);
-		    if(ceil(slctmp) == slctmp) {
-		      sszz_slc=(int)(ceil(slctmp)+1);
-		    } else {
-		      sszz_slc=(int) (ceil(slctmp));
-		    }
-		    if (phantom(xx,yy,zz,tt)!=0){
-		      voxelcounter=voxelcounter+1;
-		      //cout<<"xx= "<<xx<<"; yy= "<<yy<<"; zz= "<<zz<<"; RFrec(xx,yy,zz)= "<<RFrec(xx,yy,zz)<<"; RFtrans(xx,yy,zz)= "<<RFtrans(xx,yy,zz)<<endl;
-		      double den=phantom(xx,yy,zz,tt)*RFrec(xx,yy,zz)*cxyz;
-		      if (opt_activation.set()) {
-		        for (int n=0;n<=Nact-1;n++){
-		          double a=activation(xx,yy,zz)*timecourse_2[n];
-			  double b=tissue(tt+1,2);
-			  activation4D_voxel[n]=a*b/(a+b);// conversion of beta into beta1 because of the integral (see possum no 7 page 121)
-		        }
-		      }
-		      else if (opt_activation4D.set()){
-		        for (int n=0;n<=Nact-1;n++){
-		          double a=activation4D(xx,yy,zz,n);//zz-zstart_p when having only a pieace of the activation volume so we start from where the phantom starts 
-		          double b=tissue(tt+1,2);
-		          activation4D_voxel[n]=a*b/(a+b);
-		        }
-		      }
-		      voxel2(posx(xxx+1),posy(yy+1),posz(zz+1),tissue.Row(tt+1),
-		             pulse,nrf,nreadp,voxelcounter,xdim,ydim,zdim,
-		             b0(xx,yy,zz),b0x(xx,yy,zz),b0y(xx,yy,zz),b0z(xx,yy,zz),
-		             timecourse,activation4D_voxel,Nact,outputname,
-		             table_slcprof,dslcp,dslcp_first,Nslc,den,RFtrans(xx,yy,zz),
-		             opt_test,nospeedup,save_kcoord,sreal,simag);
-		      }
-		      xxx=xxx+numprocs;
+	    vector<PossumVoxel> vox;
+	    list_voxels(vox,phantom,Nt,xstart,xend,ystart,yend,zstart,zend,myid,numprocs);
+	    voxelcounter=vox.size();
+	    cout<<"Number of object voxels is "<<voxelcounter<<"; simulating on "<<max_threads()<<" threads"<<endl;
+	    ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	    {
+	      ThreadSignal sig(sreal,simag,nreadp);
+	      vector<double> act(Nact,0.0);
+	      for (int part=0;part<2;part++){
+		int vbeg=(part==0)?0:1;
+		int vend=(part==0)?min(1,voxelcounter):voxelcounter;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+		for (int v=vbeg;v<vend;v++){
+		  if (err.occurred()) continue;
+		  try {
+		    const PossumVoxel& p=vox[v];
+		    double den=phantom.value(p.xx,p.yy,p.zz,p.tt)*RFrec.value(p.xx,p.yy,p.zz)*cxyz;
+		    voxel_activation(p,activation,activation4D,timecourse_2,tissue,Nact,&act[0]);
+		    voxel2(posx(p.xxx+1),posy(p.yy+1),posz(p.zz+1),tissue.Row(p.tt+1),
+		           pulse,nrf,nreadp,v+1,xdim,ydim,zdim,
+		           b0.value(p.xx,p.yy,p.zz),b0x.value(p.xx,p.yy,p.zz),b0y.value(p.xx,p.yy,p.zz),b0z.value(p.xx,p.yy,p.zz),
+		           timecourse,&act[0],Nact,outputname,
+		           table_slcprof,dslcp,dslcp_first,Nslc,den,RFtrans.value(p.xx,p.yy,p.zz),
+		           opt_test,nospeedup,save_kcoord,sig.sreal,sig.simag);
+		  }
+		  catch(Exception& e) {
+		    err.set(e.what());
 		  }
 		}
 	      }
+	      sig.reduce();
 	    }
+	    if (err.occurred())
+	      throw Exception(err.what().c_str());
 	  }
 	  ////////////////////////////////////////////////////////////
 	  //MOTION INVOLVING ROTATION Rx or Ry or both
@@ -876,18 +951,10 @@ cout << "possum-start-time\t"<< opt_procid.value() << "\t" << theTime << endl;
 	    Matrix b0timecourse_tmp;
 	    double* b0timecourse;
 	    double* b0timecourse_2;
-	    double* b0time;
-	    double* b0xtime;
-	    double* b0ytime; 
-	    double* b0ztime;
 	    b0timecourse_tmp=read_ascii_matrix(opt_b0timecourse4D.value());
 	    int Nb0=b0timecourse_tmp.Nrows();
 	    b0timecourse=new double[Nb0];
 	    b0timecourse_2=new double[Nb0];
-	    b0time=new double[Nb0];
-	    b0xtime=new double[Nb0];
-	    b0ytime=new double[Nb0];
-	    b0ztime=new double[Nb0];
 	    for (int n=0;n<=Nb0-1;n++){
 	      b0timecourse[n]=b0timecourse_tmp(n+1,1);
 	      b0timecourse_2[n]=b0timecourse_tmp(n+1,2);
@@ -920,61 +987,56 @@ cout << "possum-start-time\t"<< opt_procid.value() << "\t" << theTime << endl;
 	    //MAIN LOOP
 	    /////////////
 	    cout<<"Main loop..."<<endl;
-	    for (register int tt=0;tt<Nt;tt++){
-	      for (register int zz=zstart;zz<zend;zz++){
-		cout<<"Tissue type="<<tt<<"; zstart="<<zstart<<"; zz="<<zz<<"; zend="<<zend<<"; Voxelnumber="<<voxelcounter<<endl;
-		for (register int yy=ystart;yy<yend;yy++){
-		  int xxx=myid+xstart;
-		  for (register int xx=xstart;xx<xend;xx++){
-		    //slice speed up stuff
-		    if (fabs((float)slcdir)==1) sszz=zz;
-		    else if (fabs((float)slcdir)==2) sszz=yy;
-		    else sszz=xx;
-		    float slctmp=(sszz-sszstart_p)/(slcthk*nvox);
-		    if(ceil(slctmp) == slctmp) {
-		      sszz_slc=(int)(ceil(slctmp)+1);
-		      } else {
-		      sszz_slc=(int) (ceil(slctmp));
+	    vector<PossumVoxel> vox;
+	    list_voxels(vox,phantom,Nt,xstart,xend,ystart,yend,zstart,zend,myid,numprocs);
+	    voxelcounter=vox.size();
+	    cout<<"Number of object voxels is "<<voxelcounter<<"; simulating on "<<max_threads()<<" threads"<<endl;
+	    ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	    {
+	      ThreadSignal sig(sreal,simag,nreadp);
+	      vector<double> act(Nact,0.0);
+	      vector<double> b0time(Nb0),b0xtime(Nb0),b0ytime(Nb0),b0ztime(Nb0);
+	      for (int part=0;part<2;part++){
+		int vbeg=(part==0)?0:1;
+		int vend=(part==0)?min(1,voxelcounter):voxelcounter;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+		for (int v=vbeg;v<vend;v++){
+		  if (err.occurred()) continue;
+		  try {
+		    const PossumVoxel& p=vox[v];
+		    double den=phantom.value(p.xx,p.yy,p.zz,p.tt)*RFrec.value(p.xx,p.yy,p.zz)*cxyz;
+		    voxel_activation(p,activation,activation4D,timecourse_2,tissue,Nact,&act[0]);
+		    for (int n=0;n<=Nb0-1;n++){
+		      b0time[n]=b0extra.value(p.xx,p.yy,p.zz)*b0timecourse_2[n];
+		      b0xtime[n]=b0xextra.value(p.xx,p.yy,p.zz)*b0timecourse_2[n];
+		      b0ytime[n]=b0yextra.value(p.xx,p.yy,p.zz)*b0timecourse_2[n];
+		      b0ztime[n]=b0zextra.value(p.xx,p.yy,p.zz)*b0timecourse_2[n];
+		      if (v==0){
+			cout<<"b0time[n]="<<b0time[n]<<"b0xtime[n]="<<b0xtime[n]<<"b0ytime[n]="<<b0ytime[n]<<"b0ztime[n]="<<b0ztime[n]<<endl;
 		      }
-		    if (phantom(xx,yy,zz,tt)!=0){
-		        voxelcounter=voxelcounter+1;
-		        double den=phantom(xx,yy,zz,tt)*RFrec(xx,yy,zz)*cxyz;
-		        if (opt_activation.set()) {
-		          for (int n=0;n<=Nact-1;n++){
-		            double a=activation(xx,yy,zz)*timecourse_2[n];
-			    double b=tissue(tt+1,2);
-			    activation4D_voxel[n]=a*b/(a+b);// conversion of beta into beta1 because of the integral (see possum no 7 page 121)
-			  }
-			}
-			else if (opt_activation4D.set()){
-		          for (int n=0;n<=Nact-1;n++){
-		            double a=activation4D(xx,yy,zz,n);//zz-zstart_p when having only a pieace of the activation volume so we start from where the phantom starts 
-		            double b=tissue(tt+1,2);
-		            activation4D_voxel[n]=a*b/(a+b); 
-			  }              
-			}
-		        for (int n=0;n<=Nb0-1;n++){
-		          b0time[n]=b0extra(xx,yy,zz)*b0timecourse_2[n];
-		          b0xtime[n]=b0xextra(xx,yy,zz)*b0timecourse_2[n];
-		          b0ytime[n]=b0yextra(xx,yy,zz)*b0timecourse_2[n];
-		          b0ztime[n]=b0zextra(xx,yy,zz)*b0timecourse_2[n];
-			  if (voxelcounter==1){
-			    cout<<"b0time[n]="<<b0time[n]<<"b0xtime[n]="<<b0xtime[n]<<"b0ytime[n]="<<b0ytime[n]<<"b0ztime[n]="<<b0ztime[n]<<endl;
-			  }
-			} 
-		    	voxel4(posx(xxx+1),posy(yy+1),posz(zz+1),tissue.Row(tt+1),
-		               pulse,nreadp,voxelcounter,xdim,ydim,zdim,
-		               b0time,b0xtime,b0ytime,b0ztime, b0timecourse, Nb0,
-		               b0(xx,yy,zz),b0x(xx,yy,zz),b0y(xx,yy,zz),b0z(xx,yy,zz),
-		               timecourse,activation4D_voxel,Nact,outputname,table_slcprof,
-		               dslcp,dslcp_first,Nslc,den,RFtrans(xx,yy,zz),opt_test,
-		               nospeedup,save_kcoord,sreal,simag);  
 		    }
-		    xxx=xxx+numprocs;
+		    voxel4(posx(p.xxx+1),posy(p.yy+1),posz(p.zz+1),tissue.Row(p.tt+1),
+		           pulse,nreadp,v+1,xdim,ydim,zdim,
+		           &b0time[0],&b0xtime[0],&b0ytime[0],&b0ztime[0],b0timecourse,Nb0,
+		           b0.value(p.xx,p.yy,p.zz),b0x.value(p.xx,p.yy,p.zz),b0y.value(p.xx,p.yy,p.zz),b0z.value(p.xx,p.yy,p.zz),
+		           timecourse,&act[0],Nact,outputname,table_slcprof,
+		           dslcp,dslcp_first,Nslc,den,RFtrans.value(p.xx,p.yy,p.zz),opt_test,
+		           nospeedup,save_kcoord,sig.sreal,sig.simag);
+		  }
+		  catch(Exception& e) {
+		    err.set(e.what());
 		  }
 		}
 	      }
+	      sig.reduce();
 	    }
+	    if (err.occurred())
+	      throw Exception(err.what().c_str());
 	  }
 
   /////////////////
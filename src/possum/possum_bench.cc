@@ -0,0 +1,234 @@
+/*  possum_bench.cc
+
+    Times the voxel simulation with and without the compiled pulse sequence
+
+    Copyright (C) 2014 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+
+// Runs voxel1 over the same voxels once reading the full event matrix and
+// once from the compiled PulseTable, and reports the times and the largest
+// difference between the two signals. Use it on the standard EPI pulse
+// (from the pulse program) to check a change to the voxel simulation.
+
+#define _GNU_SOURCE 1
+#define POSIX_SOURCE 1
+
+#include "utils/options.h"
+#include "newimage/newimageall.h"
+#include "miscmaths/miscmaths.h"
+#include "possumfns.h"
+#include <sys/time.h>
+
+using namespace MISCMATHS;
+using namespace NEWIMAGE;
+using namespace Utilities;
+
+string title="possum_bench\nCopyright(c) 2014, University of Oxford";
+string examples="possum_bench -p <pulse> -f <slcprof> [-n <nvoxels>]";
+
+
+Option<bool> verbose(string("-v,--verbose"), false, 
+		     string("switch on diagnostic messages"), 
+		     false, no_argument);
+Option<bool> help(string("-h,--help"), false,
+		  string("display this message"),
+		  false, no_argument);
+Option<string> opt_pulse(string("-p,--pulse"), string(""),
+		  string("<inputmatrix-basename> (Pulse sequence - .posx,.posy,.posz expected in the same directory)"),
+		  true, requires_argument);
+Option<string> opt_slcprof(string("-f,--slcprof"), string(""),
+		  string("<input-filename> (Slice profile)"),
+		  true, requires_argument);
+Option<int> opt_nvox(string("-n,--nvox"), 200,
+		  string("number of voxels to simulate (default 200)"),
+		  false, requires_argument);
+Option<string> opt_tissue(string("--tissue"), string(""),
+		  string("<inputmatrix-filename> (row of T1(s) T2(s) PD chemshift; default grey matter)"),
+		  false, requires_argument);
+
+int nonoptarg;
+
+////////////////////////////////////////////////////////////////////////////
+
+double seconds()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+int do_work(int argc, char* argv[]) 
+{
+  PMatrix pulse;
+  read_binary_matrix(pulse,opt_pulse.value());
+  RowVector posx=read_ascii_matrix(opt_pulse.value()+".posx");
+  RowVector posy=read_ascii_matrix(opt_pulse.value()+".posy");
+  RowVector posz=read_ascii_matrix(opt_pulse.value()+".posz");
+  double xdim=fabs(posx(2)-posx(1)), ydim=fabs(posy(2)-posy(1)), zdim=fabs(posz(2)-posz(1));
+
+  Matrix slcprof=read_ascii_matrix(opt_slcprof.value());
+  int Nslc=slcprof.Nrows();
+  double* table_slcprof=new double[Nslc];
+  for (int n=0;n<Nslc;n++) table_slcprof[n]=slcprof(n+1,2);
+  double dslcp=(slcprof(Nslc,1)-slcprof(1,1))/(Nslc-1);
+  double dslcp_first=slcprof(1,1);
+
+  RowVector tissue(4);
+  tissue << 1.331 << 0.051 << 0.86 << 0.0;
+  if (opt_tissue.set()) tissue=read_ascii_matrix(opt_tissue.value()).Row(1);
+
+  int nreadp=0;
+  for (int step=1;step<=pulse.Nrows();step++) if (pulse(step,5)!=0) nreadp++;
+
+  // no activation
+  int Nact=1;
+  double timecourse[1]={0.0};
+  double activation[1]={0.0};
+
+  // voxels spread evenly over the volume
+  int nvox=opt_nvox.value();
+  int Nx=posx.Ncols(), Ny=posy.Ncols(), Nz=posz.Ncols();
+  vector<double> vx(nvox), vy(nvox), vz(nvox);
+  for (int v=0;v<nvox;v++) {
+    int n=(int) ((double) v*Nx*Ny*Nz/nvox);
+    vx[v]=posx(n%Nx+1);
+    vy[v]=posy((n/Nx)%Ny+1);
+    vz[v]=posz(n/(Nx*Ny)+1);
+  }
+  cout<<"Pulse sequence: "<<pulse.Nrows()<<" events, "<<nreadp<<" read out points; "<<nvox<<" voxels"<<endl;
+
+  vector<double> sreal0(nreadp,0.0), simag0(nreadp,0.0);
+  vector<double> sreal1(nreadp,0.0), simag1(nreadp,0.0);
+  double den=xdim*ydim*zdim;
+
+  double t=seconds();
+  for (int v=0;v<nvox;v++)
+    voxel1(vx[v],vy[v],vz[v],tissue,pulse,nreadp,v+1,xdim,ydim,zdim,0.0,0.0,0.0,0.0,
+           timecourse,activation,Nact,"possum_bench",table_slcprof,dslcp,dslcp_first,Nslc,
+           den,1.0,0,0,0,&sreal0[0],&simag0[0]);
+  double tmatrix=seconds()-t;
+
+  t=seconds();
+  PulseTable events;
+  events.compile(pulse,timecourse,Nact);
+  double tcompile=seconds()-t;
+  if (verbose.value()) cout<<"Compiled sequence keeps "<<events.Nevents()<<" events"<<endl;
+
+  t=seconds();
+  for (int v=0;v<nvox;v++)
+    voxel1(vx[v],vy[v],vz[v],tissue,events,nreadp,v+1,xdim,ydim,zdim,0.0,0.0,0.0,0.0,
+           timecourse,activation,Nact,"possum_bench",table_slcprof,dslcp,dslcp_first,Nslc,
+           den,1.0,0,0,0,&sreal1[0],&simag1[0]);
+  double ttable=seconds()-t;
+
+  double maxsig=0.0, maxdiff=0.0;
+  for (int n=0;n<nreadp;n++) {
+    maxsig=Max(maxsig,Max(fabs(sreal0[n]),fabs(simag0[n])));
+    maxdiff=Max(maxdiff,Max(fabs(sreal1[n]-sreal0[n]),fabs(simag1[n]-simag0[n])));
+  }
+
+  cout<<"event matrix:    "<<1e3*tmatrix/nvox<<" ms per voxel"<<endl;
+  cout<<"compiled events: "<<1e3*ttable/nvox<<" ms per voxel (compiled in "<<1e3*tcompile<<" ms)"<<endl;
+  cout<<"speed up:        "<<tmatrix/Max(ttable,1e-9)<<endl;
+  cout<<"max difference:  "<<maxdiff<<" (max signal "<<maxsig<<")"<<endl;
+
+  delete[] table_slcprof;
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+int main(int argc,char *argv[])
+{
+
+  Tracer tr("main");
+  OptionParser options(title, examples);
+
+  try {
+    options.add(opt_pulse);
+    options.add(opt_slcprof);
+    options.add(opt_nvox);
+    options.add(opt_tissue);
+    options.add(help);
+    options.add(verbose);
+   
+    nonoptarg = options.parse_command_line(argc, argv);
+
+    if ( (help.value()) || (!options.check_compulsory_arguments(true)) )
+      {
+	options.usage();
+	exit(EXIT_FAILURE);
+      }
+    
+  }  catch(X_OptionError& e) {
+    options.usage();
+    cerr << endl << e.what() << endl;
+    exit(EXIT_FAILURE);
+  } catch(std::exception &e) {
+    cerr << e.what() << endl;
+  } 
+
+  return do_work(argc,argv);
+}
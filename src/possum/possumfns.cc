@@ -1215,6 +1215,65 @@ double b0freq(const double v1i,const double v1j,const double v2i, const double v
 /////////////////
 //MAIN FUNCTIONS
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+//LOOK UP TABLES FOR SINC, SIN AND COS (set up by the first voxel)
+///////////////////////////////////////////////////////////////////////////
+void lookup_tables(const double xdim,const double ydim,const double zdim,const int opt_test)
+{
+	table_sinc = new double[glo_Nsinc+1];
+	table_sin = new double[glo_Nsin+1];
+	table_cos = new double[glo_Nsin+1];
+	if (opt_test==1)
+	{
+		cout<<"Stepsize for Table for SINC: dsinc= "<<glo_dsinc<<endl;
+		cout<<"Stepsize for Table for SIN: dsin="<<glo_dsin<<endl;
+	}
+
+	for (int n=0;n<=glo_Nsinc;n++)
+		table_sinc[n]=Sinc(n*glo_dsinc);
+
+	for (int n=0;n<=glo_Nsin;n++)
+	{
+		table_sin[n]=sin(n*glo_dsin);
+		table_cos[n]=cos(n*glo_dsin);
+	}
+
+	glo_cx=gammabar*xdim;	//(Hz*m/T)
+	glo_cy=gammabar*ydim;
+	glo_cz=gammabar*zdim;
+	cout.precision(20);
+}
+
+inline double lookup_sinc(const double val)
+{
+	double off = val*glo_idsinc;
+	int nbin = (int) off;
+	off -= nbin;
+	double ts = table_sinc[nbin];
+	return (table_sinc[nbin+1]-ts)*off + ts;
+}
+
+inline double lookup_sinc3(const double xval,const double yval,const double zval)
+{
+	if (xval<=glo_Dsinc && yval<=glo_Dsinc && zval<=glo_Dsinc)
+		return lookup_sinc(xval)*lookup_sinc(yval)*lookup_sinc(zval);
+	return Sinc(xval)*Sinc(yval)*Sinc(zval);
+}
+
+inline void lookup_sincos(const double phase, double& wanted_sin, double& wanted_cos)
+{
+	double phase_2pi;
+	if (phase>0)
+		phase_2pi = phase - ((int) (phase*glo_itwopi))*glo_twopi;
+	else
+		phase_2pi = phase - ((int) (phase*glo_itwopi))*glo_twopi+glo_twopi;
+	double off = phase_2pi*glo_idsin;
+	int nphase = (int) off;		off -= nphase;
+	double ts1 = table_sin[nphase],	tc1 = table_cos[nphase];
+	wanted_cos = (table_cos[nphase+1] - tc1)*off+tc1;
+	wanted_sin = (table_sin[nphase+1] - ts1)*off+ts1;
+}
+
 void voxel1(const double x,const double y,double z, 
             const RowVector& tissue,const PMatrix& H,
             const int nreadp,const int v,
@@ -1277,7 +1336,8 @@ void voxel1(const double x,const double y,double z,
 	int rftest = 0;
 	double g1,g2,g3,grf1,grf2,grf3; 
 	g1=0.0; g2=0.0; g3=0.0; grf1=0.0; grf2=0.0; grf3=0.0;
-	Matrix coord(3,nreadp);
+	Matrix coord;		//k-space coordinates, only kept for the first voxel
+	if (v==1 && save_kcoord==1)	coord.ReSize(3,nreadp);
 
 	if ( v==1 )
 	{
@@ -1285,30 +1345,7 @@ void voxel1(const double x,const double y,double z,
 		g2static = new double[numpoints];
 		g3static = new double[numpoints];
 
-		////////////////////////////////////////////////////////////////////////
-		//LOOK UP TABLES
-		////////////////////////////////////////////////////////////////////////
-		table_sinc = new double[glo_Nsinc+1];
-		table_sin = new double[glo_Nsin+1];
-		table_cos = new double[glo_Nsin+1];
-		if (opt_test==1)
-		{
-			cout<<"Stepsize for Table for SINC: dsinc= "<<glo_dsinc<<endl;
-			cout<<"Stepsize for Table for SIN: dsin="<<glo_dsin<<endl;
-		}
-
-		for (int n=0;n<=glo_Nsinc;n++)
-			table_sinc[n]=Sinc(n*glo_dsinc);
-
-		for (int n=0;n<=glo_Nsin;n++)
-		{
-			table_sin[n]=sin(n*glo_dsin);
-			table_cos[n]=cos(n*glo_dsin);
-		}
-
-		glo_cx=gammabar*xdim;	//(Hz*m/T)
-		glo_cy=gammabar*ydim;
-		glo_cz=gammabar*zdim;
+		lookup_tables(xdim,ydim,zdim,opt_test);
 	} 
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1358,7 +1395,6 @@ void voxel1(const double x,const double y,double z,
 		double gg3 = g3 - grf3;
 
 		double tt = tnew - trf;//time since the last rf pulse
-		cout.precision(20);
 
 //		if (v==1 && readstep%4096==1 && opt_test==1)cout<<"tnew "<<tnew<<";told "<<told<<";trf "<<trf<<";tt=tnew-trf "<<tt<<";tnew-told "<<tnew-told<<endl; 
 //		if (v==1 && readstep%4096==1 && opt_test==1)cout<<"g1 "<<g1<<";grf1 "<<grf1<<";gg1 "<<gg1<<endl;
@@ -1558,6 +1594,186 @@ void voxel1(const double x,const double y,double z,
 	}
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//COMPILED PULSE SEQUENCE
+/////////////////////////////////////////////////////////////////////////////
+
+void PulseTable::compile(const PMatrix& H, const double* timecourse, const int Nact)
+{
+	// Walks the sequence once, as voxel1 does for every voxel: integrates the
+	// gradient moments and keeps the events that do anything to the signal.
+	// The activation time course is the same for all voxels, so the events at
+	// which voxel1 moves on to its next point are known here as well.
+	events.clear();
+	rfs.clear();
+	int numpoints = H.Nrows();
+	t0 = (numpoints>0) ? H.time(1) : 0.0;
+	double g1=0.0, g2=0.0, g3=0.0;
+	int actstep=0;
+	for (int step=2; step <= numpoints; step++)
+	{
+		double tnew = H.time(step);
+		double told = H.time(step-1);
+		double gxnew = H(step,6), gynew = H(step,7), gznew = H(step,8);
+		double gxold = H(step-1,6), gyold = H(step-1,7), gzold = H(step-1,8);
+		g1 += i1(gxold,gxnew,told,tnew);
+		if (gynew!=0 || gyold!=0)	g2+=i1(gyold,gynew,told,tnew);
+		if (gznew!=0 || gzold!=0)	g3+=i1(gzold,gznew,told,tnew);
+
+		PulseEvent e;
+		e.actupdate = ( told >= timecourse[actstep] && actstep <= (Nact-2) );
+		if (e.actupdate)	actstep++;
+		e.read = ( H(step,5) != 0 );
+		e.rf = -1;
+		if (H(step,2) != 0)
+		{
+			PulseRF r;
+			r.angle = H(step,2);
+			r.df = H(step,3);
+			r.fc = H(step,4);
+			r.gx = gxnew;	r.gy = gynew;	r.gz = gznew;
+			e.rf = rfs.size();
+			rfs.push_back(r);
+		}
+		if (e.read || e.rf>=0 || e.actupdate)
+		{
+			e.told = told;	e.tnew = tnew;
+			e.g1 = g1;	e.g2 = g2;	e.g3 = g3;
+			events.push_back(e);
+		}
+	}
+}
+
+void voxel1(const double x,const double y,const double z, 
+            const RowVector& tissue,const PulseTable& P,
+            const int nreadp,const int v,
+            const double xdim,const double ydim,const double zdim,
+            const double b0, const double b0x,const double b0y,const double b0z,
+            const double* timecourse, const double* activation,const int Nact,
+	    const string outputname,  
+	    const double* table_slcprof, const double dslcp, const double dslcp_first, const int Nslc,
+            const double den,const double RFtrans,const int opt_test,
+            const int nospeedup,
+            const int save_kcoord,
+            double* sreal, double* simag)
+{
+  //  As voxel1 above, but driven by the compiled pulse sequence P. Between two
+  //  kept events nothing happens to the magnetisation, and the activation
+  //  coefficients are constant so their integral is taken in one go.
+
+	if (v==1)	lookup_tables(xdim,ydim,zdim,opt_test);
+
+	ColumnVector m(3);	//magnetization vector
+	m(1)=0;
+	m(2)=0;
+	m(3)=tissue(3);
+	double m00=0;		//the magnitude of the transverse magnetization vector
+
+	double chshift = tissue(4);	//chemical shift
+	double iT2 = 1/tissue(2);
+	int readstep = 0;		//keeps track of readout points
+	int excitation = 0;
+	double trf = 0;			//rftime
+	double grf1=0.0, grf2=0.0, grf3=0.0;
+	double gx = gama*x, gy = gama*y, gz = gama*z;	//phase per unit gradient moment
+	double gb0 = gama*(b0+chshift);			//off resonance phase per unit time
+	Matrix coord;		//k-space coordinates, only kept for the first voxel
+	if (v==1 && save_kcoord==1)	coord.ReSize(3,nreadp);
+
+	double actint = 0.0;
+	int actstep = 0;
+	double dT2_1 = 0.0;
+	double dT2_2 = 0.0;
+	double tlast = P.start_time();
+
+	for (int k=0; k<P.Nevents(); k++)
+	{
+		const PulseEvent& e = P.event(k);
+		actint += dT2_1*(e.told-tlast) + dT2_2*(e.told*e.told-tlast*tlast)/2;
+		if (e.actupdate)
+		{
+			coeff(activation[actstep],activation[actstep+1],timecourse[actstep],timecourse[actstep+1],dT2_1,dT2_2);
+			dT2_1 = dT2_1*iT2*iT2;
+			dT2_2 = dT2_2*iT2*iT2;
+			actstep = actstep+1;
+		}
+		actint += (dT2_1+dT2_2*(e.tnew + e.told)/2)*(e.tnew - e.told);
+		tlast = e.tnew;
+
+		double gg1 = e.g1 - grf1;
+		double gg2 = e.g2 - grf2;
+		double gg3 = e.g3 - grf3;
+		double tt = e.tnew - trf;//time since the last rf pulse
+		double phase = gx*gg1 + gy*gg2 + gz*gg3 + gb0*tt;
+
+		if (e.rf >= 0)
+		{
+			const PulseRF& r = P.rf(e.rf);
+			excitation = 0;
+			double f = gammabar*(r.gx*x+r.gy*y+r.gz*z+b0+chshift);
+			double fval = (f - r.fc)/r.df;
+			double off = (fval - dslcp_first)/dslcp;
+			int nf = (int) off;
+			if (nf >= 0 && nf <= (Nslc-2))
+			{
+				off -= nf;
+				double ts = table_slcprof[nf];
+				double sx = (table_slcprof[nf+1]-ts)*off + ts;
+				double rfangle_f = sx*r.angle*RFtrans;
+				if (rfangle_f>0)
+				{
+					excitation = 1;
+					m = free(m,tt,tissue,phase,actint);
+					//dephasing over the voxel since the last pulse
+					double xyzrf = Sinc(fabs(glo_cx*(gg1 + b0x*tt)))*Sinc(fabs(glo_cy*(gg2 + b0y*tt)))*Sinc(fabs(glo_cz*(gg3 + b0z*tt)));
+					m(1) = m(1)*xyzrf;
+					m(2) = m(2)*xyzrf;
+					m = rot(rfangle_f,"x")*m;
+					m00 = sqrt( m(1)*m(1)+m(2)*m(2) );
+					trf = e.tnew;
+					grf1 = e.g1;
+					grf2 = e.g2;
+					grf3 = e.g3;
+					actint = 0.0;
+				}
+			}
+		}
+
+		if (e.read)
+		{
+			readstep = readstep+1;
+			if (excitation == 1 || nospeedup == 1)
+			{
+				double xval = fabs(glo_cx*(gg1 + b0x*tt));
+				double yval = fabs(glo_cy*(gg2 + b0y*tt));
+				double zval = fabs(glo_cz*(gg3 + b0z*tt));
+				if (v==1 && save_kcoord==1)
+				{
+					coord(1,readstep) = gammabar*(gg1 + b0x*tt);
+					coord(2,readstep) = gammabar*(gg2 + b0y*tt);
+					coord(3,readstep) = gammabar*(gg3 + b0z*tt);
+				}
+	#ifdef NOTABLE
+				double tmp = m00*exp(-tt*iT2+actint)*Sinc(xval)*Sinc(yval)*Sinc(zval);
+				sreal[readstep-1] += den*tmp*cos(phase);
+				simag[readstep-1] += den*tmp*sin(phase);
+	#else
+				double tmp = m00*exp(-tt*iT2+actint)*lookup_sinc3(xval,yval,zval);
+				double wanted_sin, wanted_cos;
+				lookup_sincos(phase,wanted_sin,wanted_cos);
+				sreal[readstep-1] += den*tmp*wanted_cos;
+				simag[readstep-1] += den*tmp*wanted_sin;
+	#endif
+			}
+		}
+	}
+
+	if (v==1 && save_kcoord==1)
+	{
+		write_binary_matrix(coord,outputname+"_kcoord" );
+	}
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 void voxel2(const double x,const double y,const double z, 
@@ -1614,7 +1830,8 @@ void voxel2(const double x,const double y,const double z,
   double gxnew=0;//gradient strength at tnew
   double gynew=0;
   double gznew=0;
-  Matrix coord(3,nreadp);
+  Matrix coord;//k-space coordinates, only kept for the first voxel
+  if (v==1 && save_kcoord==1) coord.ReSize(3,nreadp);
   if (v==1) {
     g1motion.resize(numpoints,0.0);
     g2motion.resize(numpoints,0.0);
@@ -2034,7 +2251,8 @@ void voxel3(const double x,const double y,const double z,
   double iT2=1/T2;
   double g1,g2,g3,g4;
   double rr1,rr2,rr3,trr;
-  Matrix coord(3,nreadp);
+  Matrix coord;//k-space coordinates, only kept for the first voxel
+  if (v==1 && save_kcoord==1) coord.ReSize(3,nreadp);
   RowVector rnew(4),rmnew(4);//angle, axis values
   double trnew1=0.0;//translation
   double trnew2=0.0;
@@ -2615,7 +2833,8 @@ void voxel4(const double x,const double y,double z,
   int rftest=0;
   double g1,g2,g3,grf1,grf2,grf3; 
   g1=0.0; g2=0.0; g3=0.0; grf1=0.0; grf2=0.0; grf3=0.0;
-  Matrix coord(3,nreadp); 
+  Matrix coord;//k-space coordinates, only kept for the first voxel
+  if (v==1 && save_kcoord==1) coord.ReSize(3,nreadp);
   if (v==1) {
      g1static=new double[numpoints];
      g2static=new double[numpoints];
@@ -2640,6 +2859,7 @@ void voxel4(const double x,const double y,double z,
      glo_cx=gammabar*xdim; //(Hz*m/T)
      glo_cy=gammabar*ydim;
      glo_cz=gammabar*zdim;
+     cout.precision(20);
      ////////////////////////////////////////////////////////////////////////
   } 
   ///////////////////////////////////////////////////////////////////////////
@@ -2701,7 +2921,6 @@ void voxel4(const double x,const double y,double z,
     double gg2=g2-grf2;
     double gg3=g3-grf3;
     double tt=tnew-trf;//time since the last rf pulse
-    cout.precision(20);
     //if (v==1 && readstep%4096==1 && opt_test==1)cout<<"tnew "<<tnew<<";told "<<told<<";trf "<<trf<<";tt=tnew-trf "<<tt<<";tnew-told "<<tnew-told<<endl; 
     //if (v==1 && readstep%4096==1 && opt_test==1)cout<<"g1 "<<g1<<";grf1 "<<grf1<<";gg1 "<<gg1<<endl;
      if (told>=timecourse[actstep] && actstep<=(Nact-2)){
@@ -4,6 +4,7 @@
 #include "newmat.h"
 #include "newimage/newimageall.h"
 #include "newimage/costfns.h"
+#include <vector>
 
 using namespace NEWMAT;
 using namespace NEWIMAGE;
@@ -34,6 +35,38 @@ public:
   int Ncols() const { return cols; }
 };
 
+// Pulse sequence compiled for the simulation without motion (level 1).
+// Only the events that excite, read out or move the activation time course
+// on are kept, each with the gradient moments accumulated up to it, so the
+// work per voxel and event is a dot product of the moments with the voxel
+// position. Built once and shared by all voxels.
+struct PulseRF {
+  double angle, df, fc;		// flip angle, bandwidth and centre frequency
+  double gx, gy, gz;		// gradients during the pulse (slice selection)
+};
+
+struct PulseEvent {
+  double told, tnew;		// times of the previous and of this step of the sequence
+  double g1, g2, g3;		// gradient moments at tnew
+  int rf;			// index of the RF block or -1
+  bool read;			// readout point
+  bool actupdate;		// activation time course moves on to its next point
+};
+
+class PulseTable {
+private:
+  vector<PulseEvent> events;
+  vector<PulseRF> rfs;
+  double t0;
+public:
+  PulseTable() : t0(0.0) {}
+  void compile(const PMatrix& H, const double* timecourse, const int Nact);
+  int Nevents() const { return events.size(); }
+  const PulseEvent& event(int k) const { return events[k]; }
+  const PulseRF& rf(int k) const { return rfs[k]; }
+  double start_time() const { return t0; }
+};
+
 int write_binary_matrix(const PMatrix& mat, const string& filename);
 int read_binary_matrix(PMatrix& mres, const string& filename);
 int read_binary_matrix(PMatrix& mres, const string& filename,
@@ -88,6 +121,17 @@ void voxel1(const double x,const double y,const double z,
             const int save_kcoord,
             double* sreal, double* simag);
 
+void voxel1(const double x,const double y,const double z, 
+            const RowVector& tissue,const PulseTable& P,const int nreadp,const int v,
+            const double xdim,const double ydim,const double zdim,
+            const double b0, const double b0gxx,const double b0gyy,const double b0gzz, 
+            const double* timecourse,const double* activation,const int Nact,
+	    const string outputname, const double* table_slcprof, const double dslcp, const double dslcp_first, const int Nslc,
+            const double den,const double RFtrans, const int opt_test,
+            const int nospeedup,
+            const int save_kcoord,
+            double* sreal, double* simag);
+
 
 int calc_gradientsROI(volume<double>& b, volume<double>& b0gx, volume<double>& b0gy, volume<double>& b0gz, 
                       const int myid, const int Nxx, const int numprocs);
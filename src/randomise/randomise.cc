@@ -286,19 +286,13 @@ volume4D<float> spatialStatistic;
 
 void clusterMassStatistic(ParametricStatistic& output, const Matrix& inputStatistic, const volume<float>& mask, const float threshold, const int permutationNo, const bool outputPerms)
 {
-ColumnVector clusterSizes;
+ColumnVector clusterSizes, clusterMasses;
 volume4D<float> spatialStatistic, originalSpatialStatistic;  
    spatialStatistic.setmatrix(inputStatistic,mask);
    originalSpatialStatistic=spatialStatistic;
    spatialStatistic.binarise(threshold);
-   volume<int> clusterLabels=connected_components(spatialStatistic[0],clusterSizes,CLUST_CON);
-   clusterSizes=0;	
-   for(int z=0; z<mask.zsize(); z++)
-     for(int y=0; y<mask.ysize(); y++)
-       for(int x=0; x<mask.xsize(); x++)
-	 if(clusterLabels(x,y,z)>0)
-	   clusterSizes(clusterLabels(x,y,z))=clusterSizes(clusterLabels(x,y,z))+originalSpatialStatistic[0](x,y,z);
-   output.store(clusterLabels,clusterSizes,mask,1,permutationNo,outputPerms);
+   volume<int> clusterLabels=connected_components(spatialStatistic[0],originalSpatialStatistic[0],clusterSizes,clusterMasses,CLUST_CON);
+   output.store(clusterLabels,clusterMasses,mask,1,permutationNo,outputPerms);
 }
 
 Matrix tfceStatistic(ParametricStatistic& output, const Matrix& inputStatistic, const volume<float>& mask, float& tfceDelta, const float tfceHeight, const float tfceSize, const int tfceConnectivity, const int permutationNo, const bool isF, const int numContrasts, const vector<int>& dof, const bool outputPerms, const bool overrideDelta)
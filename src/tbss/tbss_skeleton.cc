@@ -74,6 +74,7 @@
 #include "newimage/newimageall.h"
 #include "miscmaths/miscmaths.h"
 #include "utils/options.h"
+#include "utils/threading.h"
 
 using namespace MISCMATHS;
 using namespace NEWIMAGE;
@@ -113,6 +114,172 @@ int nonoptarg;
 #define SEARCHSIGMA 10 /* length in linear voxel dimensions */
 #define MAXSEARCHLENGTH (3*SEARCHSIGMA)
 
+// {{{ search precalculation
+
+// reads outside the image are zero (the default padding), without going
+// through extrapolate(), which writes to the volume and so can't be shared
+// between threads
+template <class T>
+inline T zeropadded(const volume<T>& vol, int x, int y, int z)
+{
+  if (vol.in_bounds(x,y,z)) return vol.value(x,y,z);
+  return (T)0;
+}
+
+inline int voxel_index(const volume<float>& im, int x, int y, int z)
+{
+  return (z*im.ysize()+y)*im.xsize()+x;
+}
+
+// an in-plane offset of the tube search, in the order it is tested
+class tube_offset {
+public:
+  short xxx, yyy;
+  float r, weight;
+};
+
+// The voxels searched from one skeleton voxel only depend on the skeleton,
+// its perpendicular and the distancemap, so they are found once and then
+// reused for every subject and for the alternative data.
+class skeleton_search {
+public:
+  int x, y, z;
+  short xxx, yyy, zzz;        // perpendicular to the sheet
+  short nplus, nminus;        // steps that pass the distancemap test along +perp, -perp
+  bool tube_search;
+  vector<short> tube;         // entries of the tube offset table that pass the test
+};
+
+void make_tube_offsets(vector<tube_offset>& offsets)
+{
+  offsets.clear();
+  for(int yyy=-MAXSEARCHLENGTH; yyy<=MAXSEARCHLENGTH; yyy++) for(int xxx=-MAXSEARCHLENGTH; xxx<=MAXSEARCHLENGTH; xxx++) 
+    {
+      tube_offset o;
+      o.xxx=xxx; o.yyy=yyy;
+      o.weight = exp(-0.5 * (xxx*xxx+yyy*yyy) / (float)(SEARCHSIGMA*SEARCHSIGMA) );
+      o.r=sqrt((float)(xxx*xxx+yyy*yyy));
+      if (o.r>0) offsets.push_back(o);
+    }
+}
+
+void find_search(skeleton_search& s, const volume<float>& distancemap, const volume<int>& lowercingulum,
+		 const vector<tube_offset>& offsets)
+{
+  int x=s.x, y=s.y, z=s.z;
+  s.tube_search = (lowercingulum.value(x,y,z) != 0);
+
+  if (!s.tube_search)
+    // {{{ search perp to sheet: walk out while the distancemap does not decrease
+
+{
+  for(int iters=0;iters<2;iters++)
+    {
+      float distance=0;
+      short n=0;
+
+      for(int d=1;d<MAXSEARCHLENGTH;d++)
+	{
+	  int D=d;
+	  if (iters==1) D=-d;
+
+	  float dist=zeropadded(distancemap,x+s.xxx*D,y+s.yyy*D,z+s.zzz*D);
+	  if (!(dist>=distance)) break;
+	  distance=dist;
+	  n=d;
+	}
+
+      if (iters==0) s.nplus=n; else s.nminus=n;
+    }
+}
+
+// }}}
+  else
+    // {{{ search all around tube: keep offsets reached with the distancemap always increasing
+
+{
+  for(unsigned int i=0; i<offsets.size(); i++)
+    {
+      int xxx=offsets[i].xxx, yyy=offsets[i].yyy;
+      float r=offsets[i].r;
+      int allok=1;
+
+      for(float rr=1; rr<=r+0.1 && allok; rr++)
+	{
+	  int xxx1=MISCMATHS::round(rr*xxx/r);
+	  int yyy1=MISCMATHS::round(rr*yyy/r);
+	  int xxx2=MISCMATHS::round((rr+1)*xxx/r);
+	  int yyy2=MISCMATHS::round((rr+1)*yyy/r);
+	  if ( zeropadded(distancemap,x+xxx1,y+yyy1,z) > zeropadded(distancemap,x+xxx2,y+yyy2,z) )
+	    allok=0;
+	}
+
+      if (allok) s.tube.push_back((short)i);
+    }
+}
+
+// }}}
+}
+
+// search one subject's data from s; returns the (alternative) data value
+// found and its offset from the skeleton voxel
+float project_voxel(const skeleton_search& s, const vector<tube_offset>& offsets,
+		    const float sheetweight[4][MAXSEARCHLENGTH],
+		    const volume<float>& data, const volume<float>* alt,
+		    short& maxvalX, short& maxvalY, short& maxvalZ)
+{
+  int x=s.x, y=s.y, z=s.z;
+  float maxval=data.value(x,y,z), maxval_weighted=maxval;
+  if (alt) maxval=alt->value(x,y,z);
+  maxvalX=0; maxvalY=0; maxvalZ=0;
+
+  if (!s.tube_search)
+    {
+      const float *weight = sheetweight[s.xxx*s.xxx+s.yyy*s.yyy+s.zzz*s.zzz];
+      for(int iters=0;iters<2;iters++)
+	{
+	  int n = (iters==0) ? s.nplus : s.nminus;
+	  for(int d=1;d<=n;d++)
+	    {
+	      int D=d;
+	      if (iters==1) D=-d;
+
+	      float val=zeropadded(data,x+s.xxx*D,y+s.yyy*D,z+s.zzz*D);
+	      if (weight[d] * val > maxval_weighted)
+		{
+		  maxval=val;
+		  maxval_weighted=maxval*weight[d];
+		  maxvalX=s.xxx*D;
+		  maxvalY=s.yyy*D;
+		  maxvalZ=s.zzz*D;
+		  if (alt) maxval=zeropadded(*alt,x+s.xxx*D,y+s.yyy*D,z+s.zzz*D);
+		}
+	    }
+	}
+    }
+  else
+    {
+      for(unsigned int i=0; i<s.tube.size(); i++)
+	{
+	  const tube_offset& o = offsets[s.tube[i]];
+	  float val=zeropadded(data,x+o.xxx,y+o.yyy,z);
+	  if (o.weight * val > maxval_weighted)
+	    {
+	      maxval=val;
+	      maxval_weighted=maxval*o.weight;
+	      maxvalX=o.xxx;
+	      maxvalY=o.yyy;
+	      maxvalZ=0;
+	      if (alt) maxval=zeropadded(*alt,x+o.xxx,y+o.yyy,z);
+	    }
+	}
+    }
+
+  return maxval;
+}
+
+// }}}
+
 int main(int argc,char *argv[])
 {
   // {{{ parse options
@@ -161,9 +328,22 @@ volume<short> X(im.xsize(),im.ysize(),im.zsize()),
 
 X=0; Y=0; Z=0;
 
-for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im.xsize()-1;x++)
+// slices are independent: read through a const ref and write through the raw
+// data so that no thread touches the volumes' shared cache flags
+const volume<float>& cim = im;
+short *Xp=X.nsfbegin(), *Yp=Y.nsfbegin(), *Zp=Z.nsfbegin();
+ThreadedError err;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+for(int z=1;z<im.zsize()-1;z++) 
+  {
+    if (err.occurred()) continue;
+    try {
+for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im.xsize()-1;x++)
   {
-    float theval = im(x,y,z);
+    float theval = cim(x,y,z);
 
     if ( theval != 0 )
       {
@@ -172,7 +352,7 @@ for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im
 
 	for(int zz=-1; zz<=1; zz++) for(int yy=-1; yy<=1; yy++) for(int xx=-1; xx<=1; xx++)
 	  {
-	    float val = im(x+xx,y+yy,z+zz);
+	    float val = cim(x+xx,y+yy,z+zz);
 	    Sum   += val;
 	    CofGx += xx * val;  CofGy += yy * val;  CofGz += zz * val;
 	  }	      
@@ -200,8 +380,8 @@ for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im
 		  {
 		    float weighting = pow( (float)(xx*xx+yy*yy+zz*zz) , -0.7 ); /* power is arbitrary: maybe test other functions here */
 		    float cost = weighting * ( centreval 
-					       - (float)im(x+xx,y+yy,z+zz)
-					       - (float)im(x-xx,y-yy,z-zz) );
+					       - (float)cim(x+xx,y+yy,z+zz)
+					       - (float)cim(x-xx,y-yy,z-zz) );
 
 		    if (cost>maxcost)
 		      {
@@ -215,12 +395,18 @@ for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im
 
 // }}}
 							   
-	  X(x,y,z)=xxx;
-	  Y(x,y,z)=yyy;
-	  Z(x,y,z)=zzz;
+	  int i=voxel_index(im,x,y,z);
+	  Xp[i]=xxx;
+	  Yp[i]=yyy;
+	  Zp[i]=zzz;
       }
 
   }
+    } catch(const std::exception& e) { err.set(e.what()); }
+    catch(NEWMAT::Exception) { err.set(NEWMAT::Exception::what()); }
+    catch(...) { err.set("tbss_skeleton: unknown exception"); }
+  }
+if (err.occurred()) { cerr << err.what() << endl; exit(EXIT_FAILURE); }
 
 // {{{ save perp image
 
@@ -257,18 +443,29 @@ volume<short> XX(im.xsize(),im.ysize(),im.zsize()),
 
 XX=0; YY=0; ZZ=0;
 
-for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im.xsize()-1;x++)
+{
+const volume<short> &cX=X, &cY=Y, &cZ=Z;
+short *XXp=XX.nsfbegin(), *YYp=YY.nsfbegin(), *ZZp=ZZ.nsfbegin();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+for(int z=1;z<im.zsize()-1;z++) 
   {
-    int* localsum = new int[27];
-    int localmax=0, xxx, yyy, zzz;
+    if (err.occurred()) continue;
+    try {
+for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im.xsize()-1;x++)
+  {
+    int localsum[27];
+    int localmax=0, xxx, yyy, zzz, i=voxel_index(im,x,y,z);
 
     for(int zz=0; zz<27; zz++) localsum[zz]=0;
 
     for(int zz=-1; zz<=1; zz++) for(int yy=-1; yy<=1; yy++) for(int xx=-1; xx<=1; xx++)
       {
-	xxx = X(x+xx,y+yy,z+zz);
-	yyy = Y(x+xx,y+yy,z+zz);
-	zzz = Z(x+xx,y+yy,z+zz);
+	xxx = cX(x+xx,y+yy,z+zz);
+	yyy = cY(x+xx,y+yy,z+zz);
+	zzz = cZ(x+xx,y+yy,z+zz);
 	// cout << xxx << " " << yyy << " " << zzz << " " << (1+zzz)*9+(1+yyy)*3+1+xxx << endl;
 	localsum[(1+zzz)*9+(1+yyy)*3+1+xxx]++;
 	localsum[(1-zzz)*9+(1-yyy)*3+1-xxx]++;
@@ -279,14 +476,18 @@ for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im
 	if (localsum[(1+zz)*9+(1+yy)*3+1+xx]>localmax)
 	  {
 	    localmax=localsum[(1+zz)*9+(1+yy)*3+1+xx];
-	    XX(x,y,z)=xx;
-	    YY(x,y,z)=yy;
-	    ZZ(x,y,z)=zz;
+	    XXp[i]=xx;
+	    YYp[i]=yy;
+	    ZZp[i]=zz;
 	  }
       }
-
-    delete localsum;
   }
+    } catch(const std::exception& e) { err.set(e.what()); }
+    catch(NEWMAT::Exception) { err.set(NEWMAT::Exception::what()); }
+    catch(...) { err.set("tbss_skeleton: unknown exception"); }
+  }
+}
+if (err.occurred()) { cerr << err.what() << endl; exit(EXIT_FAILURE); }
 
 X.destroy();
 Y.destroy();
@@ -323,21 +524,29 @@ if (debugging.set())
 
 volume<float> tmpim(im);
 tmpim=0;
+const volume<short> &cXX=XX, &cYY=YY, &cZZ=ZZ;
+
+{
+float *tmpimp=tmpim.nsfbegin();
 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
 for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im.xsize()-1;x++)
   {
-    float theval = im(x,y,z);
-    int xxx=XX(x,y,z);
-    int yyy=YY(x,y,z);
-    int zzz=ZZ(x,y,z);
+    float theval = cim(x,y,z);
+    int xxx=cXX(x,y,z);
+    int yyy=cYY(x,y,z);
+    int zzz=cZZ(x,y,z);
     
     if ( ( (xxx!=0) || (yyy!=0) || (zzz!=0) ) &&
-	 ( theval >= im(x+xxx,y+yyy,z+zzz) ) &&
-	 ( theval >  im(x-xxx,y-yyy,z-zzz) ) &&
-	 ( theval >= im(x+2*xxx,y+2*yyy,z+2*zzz) ) &&
-	 ( theval >  im(x-2*xxx,y-2*yyy,z-2*zzz) ) )
-      tmpim(x,y,z) = theval;
+	 ( theval >= cim(x+xxx,y+yyy,z+zzz) ) &&
+	 ( theval >  cim(x-xxx,y-yyy,z-zzz) ) &&
+	 ( theval >= zeropadded(cim,x+2*xxx,y+2*yyy,z+2*zzz) ) &&
+	 ( theval >  zeropadded(cim,x-2*xxx,y-2*yyy,z-2*zzz) ) )
+      tmpimp[voxel_index(im,x,y,z)] = theval;
   }
+}
 
 if (outname.set())
   save_volume(tmpim,outname.value());
@@ -397,107 +606,119 @@ if (outname.set())
 
 // }}}
 
-  for(int T=0;T<data_4d.tsize();T++) for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im.xsize()-1;x++)
+  // {{{ find what to search from each skeleton voxel, once for all subjects
+
+  vector<skeleton_search> searches;
+  for(int z=1;z<im.zsize()-1;z++) for(int y=1;y<im.ysize()-1;y++) for(int x=1;x<im.xsize()-1;x++)
     if (tmpim(x,y,z) > origthresh)
       {
-	int xxx=XX(x,y,z), yyy=YY(x,y,z), zzz=ZZ(x,y,z);
-	short maxvalX=0, maxvalY=0, maxvalZ=0;
-	float maxval=data_4d(x,y,z,T), maxval_weighted=maxval,
-	  exponentfactor = -0.5 * (xxx*xxx+yyy*yyy+zzz*zzz) / (float)(SEARCHSIGMA*SEARCHSIGMA);
-	if (alt4Dname.set()) maxval=alt_data_4d(x,y,z,T);
+	skeleton_search s;
+	s.x=x; s.y=y; s.z=z;
+	s.xxx=cXX(x,y,z); s.yyy=cYY(x,y,z); s.zzz=cZZ(x,y,z);
+	s.nplus=0; s.nminus=0;
+	searches.push_back(s);
+      }
 
-	if (lowercingulum(x,y,z) == 0)
-	  // {{{ search perp to sheet
+  vector<tube_offset> offsets;
+  make_tube_offsets(offsets);
 
-{
-  for(int iters=0;iters<2;iters++)
+  float sheetweight[4][MAXSEARCHLENGTH];
+  for(int n2=0;n2<4;n2++)
     {
-      float distance=0;
-
-      for(int d=1;d<MAXSEARCHLENGTH;d++)
-	{
-	  int D=d;
-	  if (iters==1) D=-d;
-		    
-	  if (distancemap(x+xxx*D,y+yyy*D,z+zzz*D)>=distance)
-	    {
-	      float distanceweight = exp(d * d * exponentfactor);
-	      distance=distancemap(x+xxx*D,y+yyy*D,z+zzz*D);
-	      if (distanceweight * data_4d(x+xxx*D,y+yyy*D,z+zzz*D,T)>maxval_weighted)
-		{
-		  maxval=data_4d(x+xxx*D,y+yyy*D,z+zzz*D,T);
-		  maxval_weighted=maxval*distanceweight;
-		  maxvalX=xxx*D;
-		  maxvalY=yyy*D;
-		  maxvalZ=zzz*D;
-		  if (alt4Dname.set()) maxval=alt_data_4d(x+xxx*D,y+yyy*D,z+zzz*D,T);
-		}
-	    }
-	  else
-	    d=MAXSEARCHLENGTH;
-	}
+      float exponentfactor = -0.5 * n2 / (float)(SEARCHSIGMA*SEARCHSIGMA);
+      for(int d=0;d<MAXSEARCHLENGTH;d++)
+	sheetweight[n2][d] = exp(d * d * exponentfactor);
     }
-}
 
-// }}}
-	else
-	  // {{{ search all around tube
+  const volume<float>& cdistancemap = distancemap;
+  const volume<int>& clowercingulum = lowercingulum;
+  int nsearch = searches.size();
 
-{
-  for(int yyy=-MAXSEARCHLENGTH; yyy<=MAXSEARCHLENGTH; yyy++) for(int xxx=-MAXSEARCHLENGTH; xxx<=MAXSEARCHLENGTH; xxx++) 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,64) if(Utilities::max_threads() > 1)
+#endif
+  for(int i=0;i<nsearch;i++)
     {
-      float distanceweight = exp(-0.5 * (xxx*xxx+yyy*yyy) / (float)(SEARCHSIGMA*SEARCHSIGMA) );
-
-      float r=sqrt((float)(xxx*xxx+yyy*yyy));
+      if (err.occurred()) continue;
+      try {
+	find_search(searches[i],cdistancemap,clowercingulum,offsets);
+      } catch(const std::exception& e) { err.set(e.what()); }
+      catch(NEWMAT::Exception) { err.set(NEWMAT::Exception::what()); }
+      catch(...) { err.set("tbss_skeleton: unknown exception"); }
+    }
+  if (err.occurred()) { cerr << err.what() << endl; exit(EXIT_FAILURE); }
 
-      if (r>0)
+// }}}
+  // {{{ project each subject, in parallel over subjects and skeleton slabs
+
+  // all writes go through raw pointers fetched here, so threads working on
+  // the same subject never touch a shared volume4D/volume object
+  int tsize=data_4d.tsize();
+  vector<float*> projp(tsize), debug2p(tsize);
+  vector<short*> flowxp(tsize), flowyp(tsize), flowzp(tsize);
+  for(int T=0;T<tsize;T++)
+    {
+      projp[T]=data_4d_projected[T].nsfbegin();
+      if (debugging.set())
 	{
-	  int allok=1;
-	  
-	  for(float rr=1; rr<=r+0.1; rr++) /* search outwards from centre to current voxel - test that distancemap always increasing */
-	    {
-	      int xxx1=MISCMATHS::round(rr*xxx/r);
-	      int yyy1=MISCMATHS::round(rr*yyy/r);
-	      int xxx2=MISCMATHS::round((rr+1)*xxx/r);
-	      int yyy2=MISCMATHS::round((rr+1)*yyy/r);
-	      if ( distancemap(x+xxx1,y+yyy1,z) > distancemap(x+xxx2,y+yyy2,z) )
-		allok=0;
-	    }
-
-	  if ( allok &&
-	       ( distanceweight * data_4d(x+xxx,y+yyy,z,T) > maxval_weighted ) )
-	    {
-	      maxval=data_4d(x+xxx,y+yyy,z,T);
-	      maxval_weighted=maxval*distanceweight;
-	      maxvalX=xxx;
-	      maxvalY=yyy;
-	      maxvalZ=0;
-	      if (alt4Dname.set()) maxval=alt_data_4d(x+xxx,y+yyy,z,T);
-	    }
+	  flowxp[T]=tmpimFLOWx[T].nsfbegin();
+	  flowyp[T]=tmpimFLOWy[T].nsfbegin();
+	  flowzp[T]=tmpimFLOWz[T].nsfbegin();
 	}
+      if (debugging2.set()) debug2p[T]=debug2out[T].nsfbegin();
     }
+  const volume4D<float> &cdata_4d=data_4d, &calt_data_4d=alt_data_4d;
+  const volume<float>& cdebug2in=debug2in;
+
+  // de-projected points can collide, so with -D each subject is kept in one
+  // piece to write them in the original order
+  int nslab=1;
+  if (!debugging2.set() && tsize<Utilities::max_threads())
+    nslab=MISCMATHS::Min((Utilities::max_threads()+tsize-1)/tsize,MISCMATHS::Max(nsearch,1));
+  int ntask=tsize*nslab;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+  for(int task=0;task<ntask;task++)
+    {
+      if (err.occurred()) continue;
+      try {
+	int T=task/nslab, slab=task%nslab;
+	const volume<float>& data=cdata_4d[T];
+	const volume<float>* alt = alt4Dname.set() ? &calt_data_4d[T] : 0;
+	int first=(int)(((long)nsearch*slab)/nslab), last=(int)(((long)nsearch*(slab+1))/nslab);
+
+	for(int i=first;i<last;i++)
+	  {
+	    const skeleton_search& s=searches[i];
+	    int x=s.x, y=s.y, z=s.z, v=voxel_index(im,x,y,z);
+	    short maxvalX, maxvalY, maxvalZ;
 
-}
+	    projp[T][v]=project_voxel(s,offsets,sheetweight,data,alt,maxvalX,maxvalY,maxvalZ); /* output maxsearch data */
 
-// }}}
-	
-	  data_4d_projected(x,y,z,T)=maxval; /* output maxsearch data */
+	    // {{{ debugging search
 
-	  // {{{ debugging search
+	    if (debugging.set())
+	      {
+		flowxp[T][v]=maxvalX;
+		flowyp[T][v]=maxvalY;
+		flowzp[T][v]=maxvalZ;
+	      }
 
-	  if (debugging.set())
-	    {
-	      tmpimFLOWx(x,y,z,T)=maxvalX;
-	      tmpimFLOWy(x,y,z,T)=maxvalY;
-	      tmpimFLOWz(x,y,z,T)=maxvalZ;
-	    }
+	    if (debugging2.set())
+	      if (cdebug2in(x,y,z)>0 && im.in_bounds(x+maxvalX,y+maxvalY,z+maxvalZ))
+		debug2p[T][voxel_index(im,x+maxvalX,y+maxvalY,z+maxvalZ)]=cdebug2in(x,y,z);
 
-	  if (debugging2.set())
-	    if (debug2in(x,y,z)>0)
-	      debug2out(x+maxvalX,y+maxvalY,z+maxvalZ,T)=debug2in(x,y,z);
+// }}}
+	  }
+      } catch(const std::exception& e) { err.set(e.what()); }
+      catch(NEWMAT::Exception) { err.set(NEWMAT::Exception::what()); }
+      catch(...) { err.set("tbss_skeleton: unknown exception"); }
+    }
+  if (err.occurred()) { cerr << err.what() << endl; exit(EXIT_FAILURE); }
 
 // }}}
-      }
 
   data_4d.destroy();
   alt_data_4d.destroy();
@@ -70,7 +70,10 @@
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 
 #include <cstring>
+#include <map>
+#include <stdexcept>
 #include "utils/options.h"
+#include "utils/threading.h"
 #include "newmat.h"
 #ifndef EXPOSE_TREACHEROUS
 #define EXPOSE_TREACHEROUS           // To allow us to use .set_sform etc
@@ -1151,6 +1154,53 @@ MISCMATHS::SpMat<double> GetS_Matrix(const std::vector<int>&   isz,
 }
 */
 
+// The displacement field and the Jacobian of the field for one row of
+// the --datain file.
+
+void displacement_field_and_jacobian(const TopupDatafileReader&      datafile,
+                                     const TopupFileReader&          topupfile,
+                                     unsigned int                    index,
+                                     const NEWIMAGE::volume<float>&  tmpl,
+                                     NEWIMAGE::volume4D<float>&      df,
+                                     NEWIMAGE::volume<float>&        jac)
+{
+  df.reinitialize(tmpl.xsize(),tmpl.ysize(),tmpl.zsize(),3);
+  copybasicproperties(tmpl,df[0]); copybasicproperties(tmpl,df[1]); copybasicproperties(tmpl,df[2]);
+  df[0] = topupfile.FieldAsVolume();
+  df[1] = float((datafile.PhaseEncodeVector(index))(2) * datafile.ReadOutTime(index) * tmpl.ydim()) * df[0];
+  df[0] *= ((datafile.PhaseEncodeVector(index))(1) * datafile.ReadOutTime(index) * tmpl.xdim());
+  df[2] = 0.0;
+  BASISFIELD::splinefield xcomp = topupfile.Field();
+  BASISFIELD::splinefield ycomp = xcomp;
+  BASISFIELD::splinefield zcomp = xcomp;
+  xcomp.ScaleField((datafile.PhaseEncodeVector(index))(1) * datafile.ReadOutTime(index) * tmpl.xdim());
+  ycomp.ScaleField((datafile.PhaseEncodeVector(index))(2) * datafile.ReadOutTime(index) * tmpl.ydim());
+  zcomp.ScaleField(0.0);
+  jac = tmpl;
+  jac = 0.0;
+  NEWIMAGE::deffield2jacobian(xcomp,ycomp,zcomp,jac);
+}
+
+// Sets interpolation and extrapolation for the i'th acquisition
+
+void set_interpolation(const TopupDatafileReader&                datafile,
+                       const std::vector<unsigned int>&          inindices,
+                       unsigned int                              i,
+                       NEWIMAGE::volume4D<float>&                scan,
+                       NEWIMAGE::interpolation                   interp)
+{
+  scan.setinterpolationmethod(interp);
+  if (interp == NEWIMAGE::spline) scan.setsplineorder(3);
+  scan.setextrapolationmethod(NEWIMAGE::periodic);
+  if ((datafile.PhaseEncodeVector(inindices[i]))(1) && !(datafile.PhaseEncodeVector(inindices[i]))(2)) scan.setextrapolationvalidity(true,false,false);
+  else if (!(datafile.PhaseEncodeVector(inindices[i]))(1) && (datafile.PhaseEncodeVector(inindices[i]))(2)) scan.setextrapolationvalidity(false,true,false);
+  else scan.setextrapolationvalidity(false,false,false);
+}
+
+// The displacement field and Jacobian are calculated once for each row
+// of --datain that is used, and the volumes (diffusion directions) of
+// each acquisition are then resampled in parallel.
+
 NEWIMAGE::volume4D<float> jac_resample(const TopupDatafileReader&                       datafile, 
                                        const TopupFileReader&                           topupfile, 
                                        const std::vector<unsigned int>&                 inindices, 
@@ -1158,45 +1208,81 @@ NEWIMAGE::volume4D<float> jac_resample(const TopupDatafileReader&
                                        std::vector<NEWIMAGE::volume4D<float> >&         scans,
                                        NEWIMAGE::interpolation                          interp)
 {
-  NEWIMAGE::volume<float>  tmp = scans[0][0]; 
-  NEWIMAGE::volume4D<float> df(tmp.xsize(),tmp.ysize(),tmp.zsize(),3);
-  copybasicproperties(tmp,df[0]); copybasicproperties(tmp,df[1]); copybasicproperties(tmp,df[2]);
+  const NEWIMAGE::volume<float>  tmp = scans[0][0]; 
   NEWIMAGE::volume4D<float> ovol = scans[0];
   ovol = 0.0;
+
+  std::map<unsigned int,unsigned int>      field_of_index;  // Index into dfs/jacs for each row of datain
+  std::vector<NEWIMAGE::volume4D<float> >  dfs;
+  std::vector<NEWIMAGE::volume<float> >    jacs;
+  for (unsigned int i=0; i<scans.size(); i++) {
+    if (field_of_index.find(inindices[i]) == field_of_index.end()) {
+      field_of_index[inindices[i]] = dfs.size();
+      dfs.push_back(NEWIMAGE::volume4D<float>());
+      jacs.push_back(NEWIMAGE::volume<float>());
+      displacement_field_and_jacobian(datafile,topupfile,inindices[i],tmp,dfs.back(),jacs.back());
+    }
+  }
+
+  // Output volumes are picked out here, since non-const access
+  // to ovol from within the threads would write its cache flags
+  std::vector<NEWIMAGE::volume<float> *>  ovols(ovol.tsize());
+  for (int j=0; j<ovol.tsize(); j++) ovols[j] = &ovol[j];
+
   for (unsigned int i=0; i<scans.size(); i++) {        // Loop over acquistions
-    scans[i].setinterpolationmethod(interp);
-    if (interp == NEWIMAGE::spline) scans[i].setsplineorder(3);
-    scans[i].setextrapolationmethod(NEWIMAGE::periodic);
-    if ((datafile.PhaseEncodeVector(inindices[i]))(1) && !(datafile.PhaseEncodeVector(inindices[i]))(2)) scans[i].setextrapolationvalidity(true,false,false);
-    else if (!(datafile.PhaseEncodeVector(inindices[i]))(1) && (datafile.PhaseEncodeVector(inindices[i]))(2)) scans[i].setextrapolationvalidity(false,true,false);
-    else scans[i].setextrapolationvalidity(false,false,false);
-    df[0] = topupfile.FieldAsVolume();
-    df[1] = float((datafile.PhaseEncodeVector(inindices[i]))(2) * datafile.ReadOutTime(inindices[i]) * ovol.ydim()) * df[0];
-    df[0] *= ((datafile.PhaseEncodeVector(inindices[i]))(1) * datafile.ReadOutTime(inindices[i]) * ovol.xdim());
-    df[2] = 0.0;
-    BASISFIELD::splinefield xcomp = topupfile.Field();
-    BASISFIELD::splinefield ycomp = xcomp;
-    BASISFIELD::splinefield zcomp = xcomp;
-    xcomp.ScaleField((datafile.PhaseEncodeVector(inindices[i]))(1) * datafile.ReadOutTime(inindices[i]) * ovol.xdim());
-    ycomp.ScaleField((datafile.PhaseEncodeVector(inindices[i]))(2) * datafile.ReadOutTime(inindices[i]) * ovol.ydim());
-    zcomp.ScaleField(0.0);
-    NEWIMAGE::volume<float>  jac = tmp;
-    NEWIMAGE::volume<char>   tmpmask = mask;
-    jac = 0.0;
-    NEWIMAGE::deffield2jacobian(xcomp,ycomp,zcomp,jac);
-    NEWMAT::Matrix  M = topupfile.MoveMatrix(inindices[i]);
-    for (int j=0; j<scans[0].tsize(); j++) {           // Loop over diffusion gradient direction    
-      tmp = 0.0;
-      tmpmask = 0;
-      general_transform((scans[i])[j],M,df,tmp,tmpmask);
-      mask *= tmpmask;
-      ovol[j] += tmp*jac;  
-    }      
+    set_interpolation(datafile,inindices,i,scans[i],interp);
+    const NEWIMAGE::volume4D<float>&  scan = scans[i];
+    const NEWIMAGE::volume4D<float>&  df = dfs[field_of_index[inindices[i]]];
+    const NEWIMAGE::volume<float>&    jac = jacs[field_of_index[inindices[i]]];
+    const NEWMAT::Matrix              M = topupfile.MoveMatrix(inindices[i]);
+    Utilities::ThreadedError          err;
+#ifdef _OPENMP
+#pragma omp parallel if(Utilities::max_threads() > 1)
+#endif
+    {
+      // general_transform changes the extrapolation settings of the
+      // displacement field while it runs, so each thread has its own.
+      NEWIMAGE::volume4D<float>  tdf = df;
+      NEWIMAGE::volume<float>    ttmp = tmp;
+      NEWIMAGE::volume<char>     tmask = mask;
+      NEWIMAGE::volume<char>     tmpmask = mask;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+      for (int j=0; j<scan.tsize(); j++) {           // Loop over diffusion gradient direction    
+        if (err.occurred()) continue;
+        try {
+          ttmp = 0.0;
+          tmpmask = 0;
+          general_transform(scan[j],M,tdf,ttmp,tmpmask);
+          tmask *= tmpmask;
+          *ovols[j] += ttmp*jac;  
+        }
+        catch (const std::exception& e) {
+          err.set(e.what());
+        }
+        catch (NEWMAT::Exception) {
+          err.set(NEWMAT::Exception::what());
+        }
+        catch (...) {
+          err.set("jac_resample: unknown exception");
+        }
+      }
+#ifdef _OPENMP
+#pragma omp critical(applytopup_mask)
+#endif
+      mask *= tmask;
+    }
+    if (err.occurred()) throw std::runtime_error(err.what());
   }
   ovol /= scans.size();
   return(ovol);
 }
 
+// Each row/column is restored independently, with the K-matrix factorised
+// once and used for all diffusion directions. Slices are shared out between
+// threads.
+
 NEWIMAGE::volume4D<float> lsr_resample(const TopupDatafileReader&                       datafile, 
                                        const TopupFileReader&                           topupfile, 
                                        const std::vector<unsigned int>&                 inindices, 
@@ -1208,6 +1294,8 @@ NEWIMAGE::volume4D<float> lsr_resample(const TopupDatafileReader&
   std::vector<NEWMAT::Matrix>  mis_map(collections.NCollections());    // Indicator of "missing" data
   NEWIMAGE::volume4D<float>    ovol = scans[0];                        // N.B. that scans is a vector
   ovol = 0.0;
+  const std::vector<NEWIMAGE::volume4D<float> >&  cscans = scans;      // Read-only access from the threads
+  const NEWIMAGE::volume<char>&                   cmask = mask;
 
   for (unsigned int c=0; c<collections.NCollections(); c++) {          // Loop over collections
     bool row = false;
@@ -1218,42 +1306,66 @@ NEWIMAGE::volume4D<float> lsr_resample(const TopupDatafileReader&
     }
     mis_map[c].ReSize(scans[0].zsize(),(row) ? scans[0].ysize() : scans[0].xsize());
     mis_map[c] = 0;
-    DispVec               dv(sz);
-    NEWMAT::Matrix        K(collections.NScans(c)*sz,sz);             // Vertical concat of K-matrices
-    NEWMAT::Matrix        Y(collections.NScans(c)*sz,ovol.tsize());   // All data-vectors for a given row
-    NEWMAT::Matrix        StS=dv.GetS_Matrix(false);                  // Laplacian for regularisation
+    std::vector<double>   sfs(collections.NScans(c));                 // Scale factors for the K-matrices
+    std::vector<unsigned int>  scan_at(collections.NScans(c));
+    for (unsigned int a=0; a<collections.NScans(c); a++) {
+      sfs[a] = (datafile.PhaseEncodeVector(collections.IndexAt(c,a)))(2) * datafile.ReadOutTime(collections.IndexAt(c,a));
+      if (row) sfs[a] = (datafile.PhaseEncodeVector(collections.IndexAt(c,a)))(1) * datafile.ReadOutTime(collections.IndexAt(c,a));
+      scan_at[a] = collections.ScanAt(c,a);
+    }
+    NEWMAT::Matrix        StS=DispVec(sz).GetS_Matrix(false);         // Laplacian for regularisation
     StS = StS.t()*StS;
+    int nij = (row) ? scans[0].ysize() : scans[0].xsize();
+    Utilities::ThreadedError  err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
     for (int k=0; k<scans[0].zsize(); k++) {
-      // cout << "k = " << k << endl;
-      for (int ij=0; ij<((row) ? scans[0].ysize() : scans[0].xsize()); ij++) {
-        if (row_col_is_alright(mask,k,ij,row)) {  // If there is not "too much" missing data in this row/column
-          // Create K-matrix for this row/column (common to all diffusion directions)
-          if (row) dv.SetFromRow(field,k,ij);
-          else dv.SetFromColumn(field,k,ij);
-          for (unsigned int a=0; a<collections.NScans(c); a++) { // Loop over acquisitions in collection
-            double sf = (datafile.PhaseEncodeVector(collections.IndexAt(c,a)))(2) * datafile.ReadOutTime(collections.IndexAt(c,a));
-            if (row) sf = (datafile.PhaseEncodeVector(collections.IndexAt(c,a)))(1) * datafile.ReadOutTime(collections.IndexAt(c,a));
-            K.Rows(a*sz+1,(a+1)*sz) = dv.GetK_Matrix(sf);
-          }
-          // Prepare for multiple matrix-solve
-          NEWMAT::Matrix       KtK = K.t()*K + 0.01*StS;
-          NEWMAT::CroutMatrix  XtX = KtK;
-          // Fill a matrix with data from all acquisitions and directions
-          for (int d=0; d<ovol.tsize(); d++) {                              // Loop over diffusion directions
-            for (unsigned int a=0; a<collections.NScans(c); a++) {  // Copy data from each acquisition
-              // cout << "Indexing the scan array with " << (collected_indices[c])[a]-1 << ", direction = " << d << endl;
-              Y.SubMatrix(a*sz+1,(a+1)*sz,d+1,d+1) = extract_row_col((scans[collections.ScanAt(c,a)])[d],k,ij,row);
+      if (err.occurred()) continue;
+      try {
+        DispVec               dv(sz);
+        NEWMAT::Matrix        K(sfs.size()*sz,sz);                    // Vertical concat of K-matrices
+        NEWMAT::Matrix        Y(sfs.size()*sz,ovol.tsize());          // All data-vectors for a given row
+        for (int ij=0; ij<nij; ij++) {
+          if (row_col_is_alright(cmask,k,ij,row)) {  // If there is not "too much" missing data in this row/column
+            // Create K-matrix for this row/column (common to all diffusion directions)
+            if (row) dv.SetFromRow(field,k,ij);
+            else dv.SetFromColumn(field,k,ij);
+            for (unsigned int a=0; a<sfs.size(); a++) { // Loop over acquisitions in collection
+              K.Rows(a*sz+1,(a+1)*sz) = dv.GetK_Matrix(sfs[a]);
+            }
+            // Prepare for multiple matrix-solve
+            NEWMAT::Matrix       KtK = K.t()*K + 0.01*StS;
+            NEWMAT::CroutMatrix  XtX = KtK;
+            // Fill a matrix with data from all acquisitions and directions
+            for (int d=0; d<Y.Ncols(); d++) {                    // Loop over diffusion directions
+              for (unsigned int a=0; a<sfs.size(); a++) {        // Copy data from each acquisition
+                Y.SubMatrix(a*sz+1,(a+1)*sz,d+1,d+1) = extract_row_col((cscans[scan_at[a]])[d],k,ij,row);
+              }
             }
+            NEWMAT::Matrix KtY = K.t()*Y;
+            NEWMAT::Matrix B = XtX.i() * KtY;
+#ifdef _OPENMP
+#pragma omp critical(applytopup_output)
+#endif
+            add_to_rows_cols(ovol,B,k,ij,row);  // Write into output for all directions
+          }
+          else {  // Indicate missing data
+            mis_map[c](k+1,ij+1) = 1;
           }
-          NEWMAT::Matrix KtY = K.t()*Y;
-          NEWMAT::Matrix B = XtX.i() * KtY;
-          add_to_rows_cols(ovol,B,k,ij,row);  // Write into output for all directions
-        }
-        else {  // Indicate missing data
-          mis_map[c](k+1,ij+1) = 1;
         }
       }
+      catch (const std::exception& e) {
+        err.set(e.what());
+      }
+      catch (NEWMAT::Exception) {
+        err.set(NEWMAT::Exception::what());
+      }
+      catch (...) {
+        err.set("lsr_resample: unknown exception");
+      }
     }
+    if (err.occurred()) throw std::runtime_error(err.what());
   }
   // Mask out rows/columns with "too much" missing data
   for (unsigned int c=0; c<collections.NCollections(); c++) {             // Loop over collections
@@ -1272,25 +1384,51 @@ void resample_using_movement_parameters(const TopupDatafileReader&
                                         std::vector<NEWIMAGE::volume4D<float> >&        scans,
                                         NEWIMAGE::interpolation                         interp)
 {
-  NEWIMAGE::volume<char>  tmpmask = mask;
-  NEWIMAGE::volume<float> tmp = scans[0][0];
-  tmp = 0.0;
+  const NEWIMAGE::volume<float> tmp = scans[0][0];
 
   for (unsigned int i=0; i<scans.size(); i++) {        // Loop over acquistions
-    scans[i].setinterpolationmethod(interp);
-    if (interp == NEWIMAGE::spline) scans[i].setsplineorder(3);
-    scans[i].setextrapolationmethod(NEWIMAGE::periodic);
-    if ((datafile.PhaseEncodeVector(inindices[i]))(1) && !(datafile.PhaseEncodeVector(inindices[i]))(2)) scans[i].setextrapolationvalidity(true,false,false);
-    else if (!(datafile.PhaseEncodeVector(inindices[i]))(1) && (datafile.PhaseEncodeVector(inindices[i]))(2)) scans[i].setextrapolationvalidity(false,true,false);
-    else scans[i].setextrapolationvalidity(false,false,false);
-    NEWMAT::Matrix  M = topupfile.MoveMatrix(inindices[i]);
-    for (int j=0; j<scans[0].tsize(); j++) {           // Loop over diffusion gradient direction    
-      tmp = 0.0;
-      tmpmask = 0;
-      affine_transform((scans[i])[j],M,tmp,tmpmask);
-      mask *= tmpmask;
-      (scans[i])[j] = tmp;  // Overwrite original data  
-    }      
+    set_interpolation(datafile,inindices,i,scans[i],interp);
+    const NEWMAT::Matrix  M = topupfile.MoveMatrix(inindices[i]);
+    // The volumes are picked out here, since non-const access to
+    // scans[i] from within the threads would write its cache flags
+    std::vector<NEWIMAGE::volume<float> *>  vols(scans[i].tsize());
+    for (int j=0; j<scans[i].tsize(); j++) vols[j] = &(scans[i])[j];
+    Utilities::ThreadedError  err;
+#ifdef _OPENMP
+#pragma omp parallel if(Utilities::max_threads() > 1)
+#endif
+    {
+      NEWIMAGE::volume<float>  ttmp = tmp;
+      NEWIMAGE::volume<char>   tmask = mask;
+      NEWIMAGE::volume<char>   tmpmask = mask;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+      for (int j=0; j<int(vols.size()); j++) {           // Loop over diffusion gradient direction    
+        if (err.occurred()) continue;
+        try {
+          ttmp = 0.0;
+          tmpmask = 0;
+          affine_transform(*vols[j],M,ttmp,tmpmask);
+          tmask *= tmpmask;
+          *vols[j] = ttmp;  // Overwrite original data  
+        }
+        catch (const std::exception& e) {
+          err.set(e.what());
+        }
+        catch (NEWMAT::Exception) {
+          err.set(NEWMAT::Exception::what());
+        }
+        catch (...) {
+          err.set("resample_using_movement_parameters: unknown exception");
+        }
+      }
+#ifdef _OPENMP
+#pragma omp critical(applytopup_mask)
+#endif
+      mask *= tmask;
+    }
+    if (err.occurred()) throw std::runtime_error(err.what());
   }
   return;
 }
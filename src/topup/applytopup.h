@@ -158,6 +158,17 @@ std::vector<std::vector<MISCMATHS::SpMat<double> > > GetLijk(int
 std::vector<MISCMATHS::SpMat<double> > GetLij(int                                       sz, 
                                    double                                               sf);
 MISCMATHS::SpMat<double> GetLii(int                                                     sz);
+void displacement_field_and_jacobian(const TopupDatafileReader&                datafile,
+                                     const TopupFileReader&                    topupfile,
+                                     unsigned int                              index,
+                                     const NEWIMAGE::volume<float>&            tmpl,
+                                     NEWIMAGE::volume4D<float>&                df,
+                                     NEWIMAGE::volume<float>&                  jac);
+void set_interpolation(const TopupDatafileReader&                              datafile,
+                       const std::vector<unsigned int>&                        inindices,
+                       unsigned int                                            i,
+                       NEWIMAGE::volume4D<float>&                              scan,
+                       NEWIMAGE::interpolation                                 interp);
 NEWIMAGE::volume4D<float> jac_resample(const TopupDatafileReader&                       datafile, 
                                        const TopupFileReader&                           topupfile, 
                                        const std::vector<unsigned int>&                 inindices, 
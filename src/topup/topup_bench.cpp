@@ -0,0 +1,229 @@
+// Topup - FMRIB's Tool for correction of susceptibility induced distortions
+//
+// topup_bench.cpp
+//
+// Times a complete topup run (e.g. --config=b02b0.cnf) with and without
+// keeping resampled images and derivatives between iterations, and checks
+// that the two runs give the same estimates. Takes the same arguments as
+// topup, but writes no output files.
+//
+// FMRIB Image Analysis Group
+//
+// Copyright (C) 2014 University of Oxford 
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include <boost/shared_ptr.hpp>
+#include "newmat.h"
+#include "newmatio.h"
+#ifndef EXPOSE_TREACHEROUS
+#define EXPOSE_TREACHEROUS           // To allow us to use .set_sform etc
+#endif
+#include "newimage/newimageall.h"
+#include "miscmaths/miscmaths.h"
+#include "miscmaths/nonlin.h"
+#include "utils/stack_dump.h"
+#include "utils/threading.h"
+#include "basisfield/basisfield.h"
+#include "basisfield/splinefield.h"
+#include "topup_costfunctions.h"
+#include "topupfns.h"
+
+using namespace std;
+using namespace NEWMAT;
+using namespace NEWIMAGE;
+using namespace MISCMATHS;
+using namespace TOPUP;
+
+// Counts the evaluations requested by the minimiser
+class CountingTopupCF: public TopupCF
+{
+public:
+  CountingTopupCF(const NEWIMAGE::volume4D<float>&     scans,
+                  const NEWMAT::Matrix&                pevecs,
+                  const NEWMAT::ColumnVector&          rotimes,
+                  double                               warpres,
+                  unsigned int                         sporder)
+  : TopupCF(scans,pevecs,rotimes,warpres,sporder), _ncf(0), _ngrad(0), _nhess(0) {}
+
+  virtual double cf(const NEWMAT::ColumnVector& p) const { _ncf++; return(TopupCF::cf(p)); }
+  virtual NEWMAT::ReturnMatrix grad(const NEWMAT::ColumnVector& p) const { _ngrad++; return(TopupCF::grad(p)); }
+  virtual boost::shared_ptr<BFMatrix> hess(const NEWMAT::ColumnVector&  p,
+                                           boost::shared_ptr<BFMatrix>  iptr=boost::shared_ptr<BFMatrix>()) const
+  { _nhess++; return(TopupCF::hess(p,iptr)); }
+
+  void ResetCounts() const { _ncf=0; _ngrad=0; _nhess=0; }
+  unsigned int NCF() const { return(_ncf); }
+  unsigned int NGrad() const { return(_ngrad); }
+  unsigned int NHess() const { return(_nhess); }
+private:
+  mutable unsigned int _ncf;
+  mutable unsigned int _ngrad;
+  mutable unsigned int _nhess;
+};
+
+double seconds()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return(tv.tv_sec + 1e-6*tv.tv_usec);
+}
+
+// Runs all the levels of the schedule in clp, the same way as topup does,
+// and returns the total time. The final parameters are returned in par.
+double run_topup(const NEWIMAGE::volume4D<float>&  in,
+                 const topup_clp&                  clp,
+                 bool                              cache,
+                 NEWMAT::ColumnVector&             par)
+{
+  cout << "Running topup " << ((cache) ? "with" : "without") << " caching" << endl;
+
+  boost::shared_ptr<CountingTopupCF> cf(new CountingTopupCF(in,clp.PhaseEncodeVectors(),clp.ReadoutTimes(),clp.WarpRes(1),clp.SplineOrder()));
+  cf->SetCaching(cache);
+  cf->SetInterpolationModel(clp.InterpolationModel());
+  cf->SetRegridding(clp.Regridding(in));
+  cf->SetSSQLambda(clp.SSQLambda());
+  cf->SetHessianPrecision(clp.HessianPrecision());
+
+  double total = 0.0;
+  for (unsigned int l=1; l<=clp.NoOfLevels(); l++) {
+    double t = seconds();
+    cf->SetLevel(l);
+    cf->SubSample(clp.SubSampling(l));
+    cf->Smooth(clp.FWHM(l));
+    cf->SetWarpResolution(clp.WarpRes(l));
+    cf->SetMovementsFixed(!clp.EstimateMovements(l));
+    cf->SetRegularisation(clp.Lambda(l),clp.RegularisationModel());
+    ColumnVector spar(cf->NPar());
+    if (l == 1) spar = 0;
+    else spar = cf->Par();
+    NonlinParam nlpar(cf->NPar(),clp.OptimisationMethod(l),spar);
+    if (nlpar.Method() == MISCMATHS::NL_LM) {
+      nlpar.SetEquationSolverMaxIter(500);
+      nlpar.SetEquationSolverTol(1.0e-3);
+    }
+    nlpar.SetMaxIter(clp.MaxIter(l));
+    cf->ResetCounts();
+    nonlin(nlpar,*cf);
+    t = seconds() - t;
+    total += t;
+    cout << "  level " << l << ": " << setw(8) << setprecision(3) << t << " s, "
+         << cf->NCF() << " cf, " << cf->NGrad() << " grad, " << cf->NHess() << " hess evaluations" << endl;
+  }
+  cout << "  total:   " << setw(8) << setprecision(3) << total << " s" << endl;
+  par = cf->Par();
+
+  return(total);
+}
+
+int main(int   argc,
+         char  *argv[])
+{
+  StackDump::Install(); // Gives us informative stack dump if/when program crashes
+
+  try {
+    boost::shared_ptr<topup_clp> clp = parse_topup_command_line(argc,argv);
+    NEWIMAGE::volume4D<float>  in;
+    read_volume4D(in,clp->ImaFname());
+
+    // Same scaling as in topup
+    std::vector<double> means(in.tsize());
+    double gmean = 0.0;
+    for (int i=0; i<in.tsize(); i++) {
+      means[i] = in[i].mean();
+      gmean += means[i];
+    }
+    gmean /= in.tsize();
+    if (clp->IndividualScaling()) {
+      for (int i=0; i<in.tsize(); i++) in[i] *= 100.0/means[i];
+    }
+    else in *= 100.0/gmean;
+
+    cout << in.tsize() << " scans of size " << in.xsize() << "x" << in.ysize() << "x" << in.zsize()
+         << ", " << clp->NoOfLevels() << " levels, " << Utilities::max_threads() << " threads" << endl;
+
+    ColumnVector par0, par1;
+    double t0 = run_topup(in,*clp,false,par0);
+    double t1 = run_topup(in,*clp,true,par1);
+
+    double maxdiff = 0.0;
+    for (int i=1; i<=par0.Nrows(); i++) maxdiff = std::max(maxdiff,std::fabs(par1(i)-par0(i)));
+    cout << "speed up:        " << t0/std::max(t1,1e-9) << endl;
+    cout << "max difference:  " << maxdiff << " (max parameter " << par0.MaximumAbsoluteValue() << ")" << endl;
+  }
+  catch (const std::exception& error) {
+    cerr << "topup_bench: Exception thrown with message: " << error.what() << endl; 
+    exit(EXIT_FAILURE);
+  }
+
+  exit(EXIT_SUCCESS);
+}
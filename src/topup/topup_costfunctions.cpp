@@ -74,6 +74,8 @@
 #include <vector>
 #include <ctime>
 #include <cmath>
+#include <stdexcept>
+#include <algorithm>
 #include <boost/shared_ptr.hpp>
 #include "newmat.h"
 #include "newmatio.h"
@@ -87,6 +89,7 @@
 #include "basisfield/splinefield.h"
 #include "basisfield/dctfield.h"
 #include "warpfns/fnirt_file_reader.h"
+#include "utils/threading.h"
 #include "topup_file_io.h"
 #include "topup_costfunctions.h"
 
@@ -110,8 +113,9 @@ using namespace TOPUP;
 TopupScan::TopupScan(const NEWIMAGE::volume<float>& scan, 
                      const NEWMAT::ColumnVector&    pevec, 
                      double                         rotime)
-: _pevec(pevec), _rotime(rotime), _uptodate(false), _tp(false)
+: _mderivs(6), _pevec(pevec), _rotime(rotime), _uptodate(false), _field_uptodate(false), _cache(true), _tp(false)
 {
+  for (unsigned int i=0; i<6; i++) _mderivs_ok[i] = false;
   if (_pevec.Nrows() != 3) throw TopupException("TopupScan::TopupScan: pevec must have three elements");
   if (_pevec(3) != 0.0) throw TopupException("TopupScan::TopupScan: third element of pevec must be zero");
   _orig = boost::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(scan));
@@ -290,6 +294,33 @@ NEWIMAGE::volume<float> TopupScan::GetMovementDerivative(unsigned int i,
 
   update(field);
 
+  if (TracePrint()) cout << "Leaving TopupScan::GetMovementDerivative" << endl;
+
+  if (_mderivs_ok[i]) return(_mderivs[i]);
+  else return(movement_derivative(i,field));
+}
+
+// Calculates and keeps the derivative w.r.t. the i'th movement parameter
+// until the scan next changes. Different i may be updated concurrently.
+void TopupScan::UpdateMovementDerivative(unsigned int i,
+                                         const BASISFIELD::splinefield& field) const
+{
+  if (TracePrint()) cout << "Entering TopupScan::UpdateMovementDerivative" << endl;
+
+  if (i >= 6) throw TopupException("TopupScan::UpdateMovementDerivative: i must be in range 0...5");
+
+  update(field);
+  if (_cache && !_mderivs_ok[i]) {
+    _mderivs[i] = movement_derivative(i,field);
+    _mderivs_ok[i] = true;
+  }
+
+  if (TracePrint()) cout << "Leaving TopupScan::UpdateMovementDerivative" << endl;
+}
+
+NEWIMAGE::volume<float> TopupScan::movement_derivative(unsigned int i,
+                                                       const BASISFIELD::splinefield& field) const
+{
   std::vector<unsigned int> isz = this->ImageSize(Target);
   std::vector<double> idim = this->ImageVxs(Target); 
   NEWIMAGE::volume<float>  rval; rval.reinitialize(int(isz[0]),int(isz[1]),int(isz[2]));
@@ -308,6 +339,9 @@ NEWIMAGE::volume<float> TopupScan::GetMovementDerivative(unsigned int i,
   NEWMAT::Matrix T1 = rval.sampling_mat().i() * mp_to_matrix(_mp).i() * rval.sampling_mat();
   NEWMAT::Matrix T2 = rval.sampling_mat().i() * mp_to_matrix(p).i() * rval.sampling_mat();
 
+  // May be called for several parameters of the same scan at once, so read
+  // the derivatives through a const reference.
+  const NEWIMAGE::volume4D<float>& derivs = _derivs;
   NEWMAT::ColumnVector x(4);
   x(4) = 1.0;  
   for (int k=0; k<rval.zsize(); k++) {
@@ -318,15 +352,13 @@ NEWIMAGE::volume<float> TopupScan::GetMovementDerivative(unsigned int i,
         x(1) = i;
 	NEWMAT::ColumnVector y1 = T1*x;
 	NEWMAT::ColumnVector y2 = T2*x;
-        rval(i,j,k) = float(sf[0]*(y2(1)-y1(1))*_derivs[0](i,j,k) + sf[1]*(y2(2)-y1(2))*_derivs[1](i,j,k) + sf[2]*(y2(3)-y1(3))*_derivs[2](i,j,k));
+        rval(i,j,k) = float(sf[0]*(y2(1)-y1(1))*derivs[0](i,j,k) + sf[1]*(y2(2)-y1(2))*derivs[1](i,j,k) + sf[2]*(y2(3)-y1(3))*derivs[2](i,j,k));
       }
     }
   }
   rval /= tiny;
   rval *= GetJacobian(field);
 
-  if (TracePrint()) cout << "Leaving TopupScan::GetMovementDerivative" << endl;
-
   return(rval);
 }
 
@@ -454,6 +486,7 @@ void TopupScan::SubSample(unsigned int ss)
     }
   }
   _uptodate = false;
+  _field_uptodate = false; // New matrix size
   _smooth = _subsamp;
 
   if (TracePrint()) cout << "Leaving TopupScan::SubSample" << endl;
@@ -534,27 +567,52 @@ void TopupScan::update(const BASISFIELD::splinefield&  field) const
 
     // cout << "_mp = " << _mp(1) << ", " << _mp(2) << ", " << _mp(3) << ", " << _mp(4) << ", " << _mp(5) << ", " << _mp(6) << endl;
     NEWMAT::Matrix rb = mp_to_matrix(_mp);
-
-    // Map field(Hz)->displacement_fields _for_ _the_ _non-subsampled_ _data_
-    // Note that general_transform expects displacement fields in mm, hence the multiplication with voxel-size.
     std::vector<unsigned int> isz = this->ImageSize(Target);
     std::vector<double> idim = this->ImageVxs(Target); 
-    NEWIMAGE::volume4D<float> df(isz[0],isz[1],isz[2],3);
-    df.setdims(float(idim[0]),float(idim[1]),float(idim[2]),1.0);  
-    // I am forced to cast away constness on field here. When I have more
-    // time I should address this in the splinefield class instead.
-    BASISFIELD::splinefield& tmpfield = const_cast<BASISFIELD::splinefield& >(field);
-    tmpfield.AsVolume(df[0]);
-    df[1] = float(_rotime * _pevec(2) * _orig->ydim()) * df[0];
-    df[0] *= _rotime * _pevec(1) * _orig->xdim(); 
-    df[2] = 0; // Don't allow any component in the z-direction
+    // The images below are only re-allocated when the matrix size changes,
+    // i.e. when going to a new sub-sampling level.
+    bool new_size = (_resampled.xsize() != int(isz[0]) || _resampled.ysize() != int(isz[1]) || _resampled.zsize() != int(isz[2]));
+
+    // The displacement field and the Jacobian depend only on the field, so
+    // they are kept if it is only the movement parameters (or smoothing)
+    // that have changed.
+    if (!_field_uptodate || !_cache || new_size) {
+      // Map field(Hz)->displacement_fields _for_ _the_ _non-subsampled_ _data_
+      // Note that general_transform expects displacement fields in mm, hence the multiplication with voxel-size.
+      if (new_size) _df.reinitialize(int(isz[0]),int(isz[1]),int(isz[2]),3);
+      _df.setdims(float(idim[0]),float(idim[1]),float(idim[2]),1.0);  
+      // I am forced to cast away constness on field here. When I have more
+      // time I should address this in the splinefield class instead.
+      BASISFIELD::splinefield& tmpfield = const_cast<BASISFIELD::splinefield& >(field);
+      tmpfield.AsVolume(_df[0]);
+      _df[1] = float(_rotime * _pevec(2) * _orig->ydim()) * _df[0];
+      _df[0] *= _rotime * _pevec(1) * _orig->xdim(); 
+      _df[2] = 0; // Don't allow any component in the z-direction
+
+      // Get Jacobian
+      BASISFIELD::splinefield xcomp = field;
+      BASISFIELD::splinefield ycomp = field;
+      BASISFIELD::splinefield zcomp = field;
+      xcomp.ScaleField(_rotime * _pevec(1) * _orig->xdim());
+      ycomp.ScaleField(_rotime * _pevec(2) * _orig->ydim());
+      zcomp.ScaleField(0.0);
+      if (new_size) _jac.reinitialize(int(isz[0]),int(isz[1]),int(isz[2]));
+      _jac.setdims(float(idim[0]),float(idim[1]),float(idim[2])); 
+      NEWIMAGE::deffield2jacobian(xcomp,ycomp,zcomp,_jac);
+      _field_uptodate = true;
+    }
 
     // Get resampled data, resampled derivatives and mask
-    _resampled.reinitialize(int(isz[0]),int(isz[1]),int(isz[2])); _resampled.setdims(float(idim[0]),float(idim[1]),float(idim[2])); 
-    _mask.reinitialize(int(isz[0]),int(isz[1]),int(isz[2])); _mask.setdims(float(idim[0]),float(idim[1]),float(idim[2])); 
-    _derivs.reinitialize(int(isz[0]),int(isz[1]),int(isz[2]),3); _derivs.setdims(float(idim[0]),float(idim[1]),float(idim[2]),1.0);  
+    if (new_size) {
+      _resampled.reinitialize(int(isz[0]),int(isz[1]),int(isz[2]));
+      _mask.reinitialize(int(isz[0]),int(isz[1]),int(isz[2]));
+      _derivs.reinitialize(int(isz[0]),int(isz[1]),int(isz[2]),3);
+    }
+    _resampled.setdims(float(idim[0]),float(idim[1]),float(idim[2])); 
+    _mask.setdims(float(idim[0]),float(idim[1]),float(idim[2])); 
+    _derivs.setdims(float(idim[0]),float(idim[1]),float(idim[2]),1.0);  
     _resampled = 0.0; _derivs = 0.0; _mask = 0;
-    general_transform_3partial(*_smooth,rb,df,_resampled,_derivs,_mask);
+    general_transform_3partial(*_smooth,rb,_df,_resampled,_derivs,_mask);
 
     // Set a "frame" in the non-phase-encode directions of
     // the mask to zero. This is to prevent small movements
@@ -583,15 +641,8 @@ void TopupScan::update(const BASISFIELD::splinefield&  field) const
       }
     } 
 
-    // Get Jacobian
-    BASISFIELD::splinefield xcomp = field;
-    BASISFIELD::splinefield ycomp = field;
-    BASISFIELD::splinefield zcomp = field;
-    xcomp.ScaleField(_rotime * _pevec(1) * _orig->xdim());
-    ycomp.ScaleField(_rotime * _pevec(2) * _orig->ydim());
-    zcomp.ScaleField(0.0);
-    _jac.reinitialize(int(isz[0]),int(isz[1]),int(isz[2])); _jac.setdims(float(idim[0]),float(idim[1]),float(idim[2])); 
-    NEWIMAGE::deffield2jacobian(xcomp,ycomp,zcomp,_jac);
+    // Any movement derivatives kept are for the old state
+    for (unsigned int i=0; i<6; i++) _mderivs_ok[i] = false;
   
     _uptodate = true;
   }
@@ -615,7 +666,7 @@ void TopupScan::update(const BASISFIELD::splinefield&  field) const
 TopupScanManager::TopupScanManager(const NEWIMAGE::volume4D<float>&   scans,
                                    const NEWMAT::Matrix&              pevecs,
                                    const NEWMAT::ColumnVector&        rotimes)
-  : _ss(1), _fwhm(0.0), _mpi(scans.tsize()), _tp(false)
+  : _update_count(0), _cache(true), _ss(1), _fwhm(0.0), _mpi(scans.tsize()), _tp(false)
 {
   if (scans.tsize() != pevecs.Ncols() || scans.tsize() != rotimes.Nrows()) throw TopupException("TopupScanManager::TopupScanManage: Mismatched input parameters");
 
@@ -808,6 +859,41 @@ NEWIMAGE::volume<float> TopupScanManager::GetMovementDerivative(unsigned int sca
   return(_scans[scan]->GetMovementDerivative(_mpi[scan][deriv],field));
 }
 
+void TopupScanManager::UpdateMovementDerivatives(const BASISFIELD::splinefield& field) const
+{
+  if (TracePrint()) cout << "Entering TopupScanManager::UpdateMovementDerivatives" << endl;
+
+  update(field);
+  std::vector<unsigned int> task_scan, task_deriv;
+  for (unsigned int s=0; s<_scans.size(); s++) {
+    for (unsigned int d=0; d<_mpi[s].size(); d++) {
+      task_scan.push_back(s); task_deriv.push_back(_mpi[s][d]);
+    }
+  }
+  Utilities::ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+  for (int t=0; t<int(task_scan.size()); t++) {
+    if (err.occurred()) continue;
+    try {
+      _scans[task_scan[t]]->UpdateMovementDerivative(task_deriv[t],field);
+    }
+    catch (const std::exception& e) {
+      err.set(e.what());
+    }
+    catch (NEWMAT::Exception) {
+      err.set(NEWMAT::Exception::what());
+    }
+    catch (...) {
+      err.set("TopupScanManager::UpdateMovementDerivatives: unknown exception");
+    }
+  }
+  if (err.occurred()) throw std::runtime_error(err.what());
+
+  if (TracePrint()) cout << "Leaving TopupScanManager::UpdateMovementDerivatives" << endl;
+}
+
 NEWIMAGE::volume<float> TopupScanManager::GetNumericalMovementDerivative(unsigned int scan,
                                                                          unsigned int deriv,
                                                                          const BASISFIELD::splinefield& field) const
@@ -840,7 +926,7 @@ void TopupScanManager::FieldUpdated() const
   if (TracePrint()) cout << "Entering TopupScanManager::FieldUpdated" << endl;
 
   _up_to_date = false;
-  for (unsigned int i=0; i<_scans.size(); i++) _scans[i]->SetUpToDate(false);
+  for (unsigned int i=0; i<_scans.size(); i++) _scans[i]->FieldUpdated();
 
   if (TracePrint()) cout << "Leaving TopupScanManager::FieldUpdated" << endl;
 }
@@ -937,6 +1023,34 @@ void TopupScanManager::update(const BASISFIELD::splinefield& field) const
   if (!_up_to_date) {
     if (TracePrint()) cout << "TopupScanManager::update: Things not up to date, proceeds with updating." << endl;
 
+    // The scans are resampled independently of each other, so do that in
+    // parallel. They all read the same field, which is calculated from the
+    // coefficients on first use, so make sure that has happened first.
+    if (!field.UpToDate(BASISFIELD::FIELD)) {
+      BASISFIELD::splinefield& tmpfield = const_cast<BASISFIELD::splinefield& >(field);
+      tmpfield.Update(BASISFIELD::FIELD);
+    }
+    Utilities::ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+    for (int i=0; i<int(_scans.size()); i++) {
+      if (err.occurred()) continue;
+      try {
+        _scans[i]->Update(field);
+      }
+      catch (const std::exception& e) {
+        err.set(e.what());
+      }
+      catch (NEWMAT::Exception) {
+        err.set(NEWMAT::Exception::what());
+      }
+      catch (...) {
+        err.set("TopupScanManager::update: unknown exception when resampling scan");
+      }
+    }
+    if (err.occurred()) throw std::runtime_error(err.what());
+
     _mean = _scans[0]->GetResampled(field);
     _mask = _scans[0]->GetMask(field);
     _mean_alpha = _scans[0]->GetAlpha(field);
@@ -955,6 +1069,7 @@ void TopupScanManager::update(const BASISFIELD::splinefield& field) const
     _mean_gamma /= _scans.size();
 
     _up_to_date = true;
+    _update_count++;
   }
 
   if (TracePrint()) cout << "Leaving TopupScanManager::update" << endl;
@@ -976,7 +1091,7 @@ TopupCF::TopupCF(const NEWIMAGE::volume4D<float>&     scans,
                  const NEWMAT::ColumnVector&          rotimes,
                  double                               warpres,
                  unsigned int                         sporder)
-  : _sm(scans,pevecs,rotimes), _field(field_factory(scans,warpres,sporder)), _wr(warpres), _lambda(10), _ssql(true), _rt(BendingEnergy), _mf(false), _hp(MISCMATHS::BFMatrixDoublePrecision), _dl(0), _level(0), _iter(0), _attempt(0)
+  : _sm(scans,pevecs,rotimes), _field(field_factory(scans,warpres,sporder)), _wr(warpres), _lambda(10), _ssql(true), _rt(BendingEnergy), _mf(false), _hp(MISCMATHS::BFMatrixDoublePrecision), _dl(0), _level(0), _iter(0), _attempt(0), _diffs_count(0), _abg_diffs_count(0)
 {
   _sm.SetInterpolationModel(LinearInterp);
 }
@@ -1285,23 +1400,34 @@ double TopupCF::cf(const NEWMAT::ColumnVector& p) const
   set_field_params(p);
   set_movement_params(p);
 
-  const NEWIMAGE::volume<float>&   mean = _sm.GetMean(_field);
   const NEWIMAGE::volume<char>&    mask = _sm.GetMask(_field);
-
-  double ssd = 0.0;
-  unsigned int n = static_cast<unsigned int>(mask.sum());
-  for (unsigned int s=0; s<_sm.NoOfScans(); s++) {
-    const NEWIMAGE::volume<float>&  scan = _sm.GetScan(s,_field);
-    for (int k=0; k<mean.zsize(); k++) {
-      for (int j=0; j<mean.ysize(); j++) {
-	for (int i=0; i<mean.xsize(); i++) {
-	  if (mask(i,j,k)) {
-	    ssd += SQR(mean(i,j,k)-scan(i,j,k));
-	  }
+  update_diffs(true,false);
+  const std::vector<NEWIMAGE::volume<float> >& diffs = _diffs;
+
+  // Sum over each slice of each scan in parallel, and then add those up in
+  // a fixed order so that the cost doesn't depend on the number of threads.
+  int nz = mask.zsize();
+  int nsk = int(_sm.NoOfScans()) * nz;
+  std::vector<double> slice_ssd(nsk,0.0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+  for (int sk=0; sk<nsk; sk++) {
+    const NEWIMAGE::volume<float>&  diff = diffs[sk/nz];
+    int k = sk%nz;
+    double sum = 0.0;
+    for (int j=0; j<mask.ysize(); j++) {
+      for (int i=0; i<mask.xsize(); i++) {
+	if (mask(i,j,k)) {
+	  sum += SQR(diff(i,j,k));
 	}
       }
     }
+    slice_ssd[sk] = sum;
   }
+  double ssd = 0.0;
+  for (int sk=0; sk<nsk; sk++) ssd += slice_ssd[sk];
+  unsigned int n = static_cast<unsigned int>(mask.sum());
   ssd /= double(n*(_sm.NoOfScans()-1));
   set_latest_ssd(ssd);
 
@@ -1344,9 +1470,6 @@ NEWMAT::ReturnMatrix TopupCF::grad(const NEWMAT::ColumnVector& p) const
   // The top part of the gradient pertains to the non-linear displacements
 
   const NEWIMAGE::volume<float>&   mean = _sm.GetMean(_field);
-  const NEWIMAGE::volume<float>&   mean_alpha = _sm.GetMeanAlpha(_field);
-  const NEWIMAGE::volume<float>&   mean_beta = _sm.GetMeanBeta(_field);
-  const NEWIMAGE::volume<float>&   mean_gamma = _sm.GetMeanGamma(_field);
   const NEWIMAGE::volume<char>&    mask = _sm.GetMask(_field);
   unsigned int n = static_cast<unsigned int>(mask.sum());
   unsigned int m = _sm.NoOfScans();
@@ -1366,18 +1489,74 @@ NEWMAT::ReturnMatrix TopupCF::grad(const NEWMAT::ColumnVector& p) const
     copybasicproperties(mean,*(abf[2])); *(abf[2]) = 0.0;
   }
 
-  // Then calculate them
+  // Then calculate them, slice by slice in parallel. Each voxel still sums
+  // over the scans in the same order.
+
+  update_diffs(true,true);
+  const std::vector<NEWIMAGE::volume<float> >& diffs = _diffs;
+  const std::vector<NEWIMAGE::volume<float> >& alpha_diffs = _alpha_diffs;
+  const std::vector<NEWIMAGE::volume<float> >& beta_diffs = _beta_diffs;
+  const std::vector<NEWIMAGE::volume<float> >& gamma_diffs = _gamma_diffs;
+  std::vector<bool> hasb(m,false), hasg(m,false);
+  for (unsigned int s=0; s<m; s++) { hasb[s] = _sm.HasBeta(s); hasg[s] = _sm.HasGamma(s); }
+  // Write through raw pointers, taken here so that the volumes' cache
+  // flags are invalidated once rather than by every thread.
+  std::vector<float *> abfp(3,static_cast<float *>(0));
+  for (int t=0; t<3; t++) if (abf[t]) abfp[t] = abf[t]->nsfbegin();
+  const int xs = mean.xsize(), ys = mean.ysize();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+  for (int k=0; k<mean.zsize(); k++) {
+    for (int j=0; j<mean.ysize(); j++) {
+      for (int i=0; i<mean.xsize(); i++) {
+        int vox = i + xs*(j + ys*k);
+        for (unsigned int s=0; s<m; s++) {
+          const NEWIMAGE::volume<float>& diff = diffs[s];
+          const NEWIMAGE::volume<float>& alpha_diff = alpha_diffs[s];
+          abfp[0][vox] += alpha_diff(i,j,k) * diff(i,j,k);
+          if (hasb[s]) {
+            const NEWIMAGE::volume<float>& beta_diff = beta_diffs[s];
+            abfp[1][vox] += beta_diff(i,j,k) * diff(i,j,k);
+          }
+          if (hasg[s]) {
+            const NEWIMAGE::volume<float>& gamma_diff = gamma_diffs[s];
+            abfp[2][vox] += gamma_diff(i,j,k) * diff(i,j,k);
+          }
+        }
+      }
+    }
+  }
+  for (int t=0; t<3; t++) if (abf[t]) abf[t]->set_whole_cache_validity(false);
 
-  for (unsigned int i=0; i<_sm.NoOfScans(); i++) {
-    NEWIMAGE::volume<float>  diff = mean - _sm.GetScan(i,_field);    
-    *(abf[0]) += (mean_alpha - _sm.GetAlpha(i,_field)) * diff;
-    if (_sm.HasBeta(i)) *(abf[1]) += (mean_beta - _sm.GetBeta(i,_field)) * diff;
-    if (_sm.HasGamma(i)) *(abf[2]) += (mean_gamma - _sm.GetGamma(i,_field)) * diff;
+  // The (up to) three J'e products are independent
+  std::vector<NEWMAT::ColumnVector> jte(3);
+  Utilities::ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+  for (int t=0; t<3; t++) {
+    if (!abf[t] || err.occurred()) continue;
+    try {
+      std::vector<unsigned int> deriv(3,0);
+      if (t == 0) jte[t] = _field.Jte(*(abf[t]),&mask);
+      else { deriv[t-1] = 1; jte[t] = _field.Jte(deriv,*(abf[t]),&mask); }
+    }
+    catch (const std::exception& e) {
+      err.set(e.what());
+    }
+    catch (NEWMAT::Exception) {
+      err.set(NEWMAT::Exception::what());
+    }
+    catch (...) {
+      err.set("TopupCF::grad: unknown exception in Jte");
+    }
   }
-  gradient.Rows(1,NDefPar()) += 2.0 * _field.Jte(*(abf[0]),&mask) / (n*(m - 1));
-  std::vector<unsigned int> deriv(3,0);
-  if (_sm.HasBeta()) { deriv[0] = 1; gradient.Rows(1,NDefPar()) += 2.0 * _field.Jte(deriv,*(abf[1]),&mask) / (n*(m - 1)); deriv[0] = 0; }
-  if (_sm.HasGamma()) { deriv[1] = 1; gradient.Rows(1,NDefPar()) += 2.0 * _field.Jte(deriv,*(abf[2]),&mask) / (n*(m - 1)); deriv[1] = 0; }
+  if (err.occurred()) throw std::runtime_error(err.what());
+  gradient.Rows(1,NDefPar()) += 2.0 * jte[0] / (n*(m - 1));
+  if (_sm.HasBeta()) gradient.Rows(1,NDefPar()) += 2.0 * jte[1] / (n*(m - 1));
+  if (_sm.HasGamma()) gradient.Rows(1,NDefPar()) += 2.0 * jte[2] / (n*(m - 1));
 
   delete abf[0];
   if (_sm.HasBeta()) delete abf[1];
@@ -1386,16 +1565,34 @@ NEWMAT::ReturnMatrix TopupCF::grad(const NEWMAT::ColumnVector& p) const
   // Now do the movement bit
 
   if (!MovementsFixed()) {
-    unsigned int gi = NDefPar()+1;
+    _sm.UpdateMovementDerivatives(_field); // Kept for hess at the same point
+    // One task per movement parameter
+    std::vector<unsigned int> task_scan, task_deriv;
     for (unsigned int s=0; s<_sm.NoOfScans(); s++) {
-      NEWIMAGE::volume<float>  diff = mean - _sm.GetScan(s,_field);
-      // cout << "Scan s = " << s << ", No d = " << _sm.NoOfMovementParametersForScan(s) << endl;
       for (unsigned int d=0; d<_sm.NoOfMovementParametersForScan(s); d++) {
-	NEWIMAGE::volume<float> deriv = _sm.GetMovementDerivative(s,d,_field);
-        gradient(gi) = - (2.0 / (n*(m - 1))) * sum_of_prod(diff,deriv,mask);
-        gi++;
+        task_scan.push_back(s); task_deriv.push_back(d);
+      }
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+    for (int t=0; t<int(task_scan.size()); t++) {
+      if (err.occurred()) continue;
+      try {
+	NEWIMAGE::volume<float> deriv = _sm.GetMovementDerivative(task_scan[t],task_deriv[t],_field);
+        gradient(NDefPar()+t+1) = - (2.0 / (n*(m - 1))) * sum_of_prod(diffs[task_scan[t]],deriv,mask);
+      }
+      catch (const std::exception& e) {
+        err.set(e.what());
+      }
+      catch (NEWMAT::Exception) {
+        err.set(NEWMAT::Exception::what());
+      }
+      catch (...) {
+        err.set("TopupCF::grad: unknown exception in movement gradient");
       }
     }
+    if (err.occurred()) throw std::runtime_error(err.what());
     // gradient.Rows(NDefPar()+1,NPar()) = numerical_gradient(p,NDefPar()+1,NPar(),1e-4,false); // Uncomment for numerical derivatives
   }
  
@@ -1471,9 +1668,6 @@ boost::shared_ptr<MISCMATHS::BFMatrix> TopupCF::hess(const NEWMAT::ColumnVector&
   if (!MovementsFixed()) set_movement_params(p);
 
   const NEWIMAGE::volume<float>&   mean = _sm.GetMean(_field);
-  const NEWIMAGE::volume<float>&   mean_alpha = _sm.GetMeanAlpha(_field);
-  const NEWIMAGE::volume<float>&   mean_beta = _sm.GetMeanBeta(_field);
-  const NEWIMAGE::volume<float>&   mean_gamma = _sm.GetMeanGamma(_field);
   const NEWIMAGE::volume<char>&    mask = _sm.GetMask(_field);
   unsigned int n = static_cast<unsigned int>(mask.sum());
   unsigned int m = _sm.NoOfScans();
@@ -1502,59 +1696,102 @@ boost::shared_ptr<MISCMATHS::BFMatrix> TopupCF::hess(const NEWMAT::ColumnVector&
     copybasicproperties(mean,*(abc[4])); *(abc[4]) = 0.0;    
   }
   
-  // Now calculate aa ab ac bb bc cc as needed
-  for (unsigned int i=0; i<_sm.NoOfScans(); i++) {
-    NEWIMAGE::volume<float>  alpha_diff = mean_alpha - _sm.GetAlpha(i,_field);
-    *(abc[0]) += (alpha_diff * alpha_diff);
-    if (_sm.HasBeta()) {
-      NEWIMAGE::volume<float> beta_diff = mean_beta - _sm.GetBeta(i,_field);
-      *(abc[1]) += (alpha_diff * beta_diff);
-      *(abc[3]) += (beta_diff * beta_diff);
-      if (_sm.HasGamma()) {
-	NEWIMAGE::volume<float> gamma_diff = mean_gamma - _sm.GetGamma(i,_field);
-        *(abc[2]) += (alpha_diff * gamma_diff);
-        *(abc[4]) += (beta_diff * gamma_diff);
-        *(abc[5]) += (gamma_diff * gamma_diff);
+  // Now calculate aa ab ac bb bc cc as needed, slice by slice in parallel.
+  // Each voxel still sums over the scans in the same order.
+  update_diffs(false,true);
+  const std::vector<NEWIMAGE::volume<float> >& alpha_diffs = _alpha_diffs;
+  const std::vector<NEWIMAGE::volume<float> >& beta_diffs = _beta_diffs;
+  const std::vector<NEWIMAGE::volume<float> >& gamma_diffs = _gamma_diffs;
+  // As in grad(), write through raw pointers taken outside the parallel region
+  std::vector<float *> abcp(6,static_cast<float *>(0));
+  for (int t=0; t<6; t++) if (abc[t]) abcp[t] = abc[t]->nsfbegin();
+  const int xs = mean.xsize(), ys = mean.ysize();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+  for (int k=0; k<mean.zsize(); k++) {
+    for (int j=0; j<mean.ysize(); j++) {
+      for (int i=0; i<mean.xsize(); i++) {
+        int vox = i + xs*(j + ys*k);
+        for (unsigned int s=0; s<m; s++) {
+          const NEWIMAGE::volume<float>& alpha_diff = alpha_diffs[s];
+          float ad = alpha_diff(i,j,k);
+          float bd = 0.0;
+          float gd = 0.0;
+          abcp[0][vox] += ad * ad;
+          if (abcp[3]) {
+            const NEWIMAGE::volume<float>& beta_diff = beta_diffs[s];
+            bd = beta_diff(i,j,k);
+            abcp[1][vox] += ad * bd;
+            abcp[3][vox] += bd * bd;
+          }
+          if (abcp[5]) {
+            const NEWIMAGE::volume<float>& gamma_diff = gamma_diffs[s];
+            gd = gamma_diff(i,j,k);
+            abcp[2][vox] += ad * gd;
+            abcp[5][vox] += gd * gd;
+          }
+          if (abcp[4]) abcp[4][vox] += bd * gd;
+        }
       }
     }
-    else if (_sm.HasGamma()) {
-      NEWIMAGE::volume<float> gamma_diff = mean_gamma - _sm.GetGamma(i,_field);
-      *(abc[2]) += (alpha_diff * gamma_diff);
-      *(abc[5]) += (gamma_diff * gamma_diff);
-    }
   }
+  for (int t=0; t<6; t++) if (abc[t]) abc[t]->set_whole_cache_validity(false);
         
-  // And use these to calculate the non-linear part of the Hessian
-  NEWIMAGE::volume<float> ones(mean.xsize(),mean.ysize(),mean.zsize());
-  copybasicproperties(mean,ones); ones = 1.0;
-  boost::shared_ptr<MISCMATHS::BFMatrix> nonlin_bit = _field.JtJ(*(abc[0]),ones,&mask,HessianPrecision());
-  std::vector<unsigned int> deriv1(3,0);
-  std::vector<unsigned int> deriv2(3,0);
-  if (_sm.HasBeta()) {
-    deriv2[0] = 1;      
-    boost::shared_ptr<MISCMATHS::BFMatrix> tmp = _field.JtJ(deriv1,*(abc[1]),deriv2,ones,&mask,HessianPrecision());
-    nonlin_bit->AddToMe(*tmp);
-    nonlin_bit->AddToMe(*(tmp->Transpose()));
-    tmp = _field.JtJ(deriv2,*(abc[3]),ones,&mask,HessianPrecision());
-    nonlin_bit->AddToMe(*tmp);
-    deriv2[0] = 0;
-  }
-  if (_sm.HasGamma()) {
-    deriv2[1] = 1;
-    boost::shared_ptr<MISCMATHS::BFMatrix> tmp = _field.JtJ(deriv1,*(abc[2]),deriv2,ones,&mask,HessianPrecision());
-    nonlin_bit->AddToMe(*tmp);
-    nonlin_bit->AddToMe(*(tmp->Transpose()));
-    tmp = _field.JtJ(deriv2,*(abc[5]),ones,&mask,HessianPrecision());
-    nonlin_bit->AddToMe(*tmp);
-    deriv2[1] = 0;
-  }
-  if (_sm.HasBeta() && _sm.HasGamma()) {
-    deriv1[0] = 1;
-    deriv2[1] = 1;
-    boost::shared_ptr<MISCMATHS::BFMatrix> tmp = _field.JtJ(deriv1,*(abc[4]),deriv2,ones,&mask,HessianPrecision());
-    nonlin_bit->AddToMe(*tmp);
-    nonlin_bit->AddToMe(*(tmp->Transpose()));
+  // And use these to calculate the non-linear part of the Hessian. The
+  // JtJ products are sums over voxels, so with several threads the mask
+  // is split into slabs along z, the slabs are done in parallel and their
+  // contributions are added up (in slab order) as they become available.
+  boost::shared_ptr<MISCMATHS::BFMatrix> nonlin_bit;
+  int nslab = no_of_hessian_slabs();
+  if (nslab > 1) {
+    Utilities::ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for ordered schedule(static,1)
+#endif
+    for (int sl=0; sl<nslab; sl++) {
+      boost::shared_ptr<MISCMATHS::BFMatrix> part;
+      if (!err.occurred()) {
+        try {
+          NEWIMAGE::volume<char> slab_mask = mask;
+          int z0 = (sl*mask.zsize())/nslab;
+          int z1 = ((sl+1)*mask.zsize())/nslab;
+          for (int k=0; k<mask.zsize(); k++) {
+            if (k >= z0 && k < z1) continue;
+            for (int j=0; j<mask.ysize(); j++) {
+              for (int i=0; i<mask.xsize(); i++) slab_mask(i,j,k) = 0;
+            }
+          }
+          part = field_hessian(abc,slab_mask);
+        }
+        catch (const std::exception& e) {
+          err.set(e.what());
+        }
+        catch (NEWMAT::Exception) {
+          err.set(NEWMAT::Exception::what());
+        }
+        catch (...) {
+          err.set("TopupCF::hess: unknown exception in JtJ");
+        }
+      }
+#ifdef _OPENMP
+#pragma omp ordered
+#endif
+      {
+        if (part && !err.occurred()) {
+          try {
+            if (!nonlin_bit) nonlin_bit = part;
+            else nonlin_bit->AddToMe(*part);
+          }
+          catch (...) {
+            err.set("TopupCF::hess: failed to add up slab contributions");
+          }
+        }
+      }
+    }
+    if (err.occurred()) throw std::runtime_error(err.what());
   }
+  else nonlin_bit = field_hessian(abc,mask);
   nonlin_bit->MulMeByScalar(2.0/(n*(m-1)));
 
   // Add regularisation
@@ -1587,17 +1824,47 @@ boost::shared_ptr<MISCMATHS::BFMatrix> TopupCF::hess(const NEWMAT::ColumnVector&
   }
 
   if (!MovementsFixed()) {
+    // Each movement derivative image is used many times below
+    _sm.UpdateMovementDerivatives(_field);
     // Now calculate the movement bit (lower right corner).
     std::vector<unsigned int> tile_sizes(_sm.NoOfScans());
     for (unsigned int s=1; s<_sm.NoOfScans(); s++) tile_sizes[s] = _sm.NoOfMovementParametersForScan(s);
     TiledMatrix tiled_move_bit(tile_sizes);
+    // The tiles are independent of each other, so calculate them in parallel
+    std::vector<unsigned int> tile_s1, tile_s2;
     for (unsigned int s1=1; s1<_sm.NoOfScans(); s1++) {
       for (unsigned int s2=s1; s2<_sm.NoOfScans(); s2++) {
-        if (s1 == s2) tiled_move_bit.SetTile(s1,s2,((2.0/(n*(m-1))) * (1.0 - 1.0/m)) * movement_hessian(s1,s2,mask,_field));
-        else {
-          tiled_move_bit.SetTile(s1,s2,- ((1.0/(n*(m-1))) * (2.0/m)) * movement_hessian(s1,s2,mask,_field));
-          tiled_move_bit.SetTile(s2,s1,tiled_move_bit.GetTile(s1,s2).t());
-        }
+        tile_s1.push_back(s1); tile_s2.push_back(s2);
+      }
+    }
+    std::vector<NEWMAT::Matrix> tiles(tile_s1.size());
+    Utilities::ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+    for (int t=0; t<int(tiles.size()); t++) {
+      if (err.occurred()) continue;
+      try {
+        tiles[t] = movement_hessian(tile_s1[t],tile_s2[t],mask,_field);
+      }
+      catch (const std::exception& e) {
+        err.set(e.what());
+      }
+      catch (NEWMAT::Exception) {
+        err.set(NEWMAT::Exception::what());
+      }
+      catch (...) {
+        err.set("TopupCF::hess: unknown exception in movement Hessian");
+      }
+    }
+    if (err.occurred()) throw std::runtime_error(err.what());
+    for (unsigned int t=0; t<tiles.size(); t++) {
+      unsigned int s1 = tile_s1[t];
+      unsigned int s2 = tile_s2[t];
+      if (s1 == s2) tiled_move_bit.SetTile(s1,s2,((2.0/(n*(m-1))) * (1.0 - 1.0/m)) * tiles[t]);
+      else {
+        tiled_move_bit.SetTile(s1,s2,- ((1.0/(n*(m-1))) * (2.0/m)) * tiles[t]);
+        tiled_move_bit.SetTile(s2,s1,tiled_move_bit.GetTile(s1,s2).t());
       }
     }
     boost::shared_ptr<MISCMATHS::BFMatrix> move_bit = boost::shared_ptr<MISCMATHS::BFMatrix>(new FullBFMatrix(tiled_move_bit.Untile()));
@@ -1605,22 +1872,39 @@ boost::shared_ptr<MISCMATHS::BFMatrix> TopupCF::hess(const NEWMAT::ColumnVector&
     // And finally the interaction (the left and bottom "stripes");
 
     NEWMAT::Matrix interaction(NDefPar(),NMovPar());
-    NEWIMAGE::volume<float> beta_diff;
-    NEWIMAGE::volume<float> gamma_diff;
-    std::vector<unsigned int> deriv(3,0);
-    unsigned int offset = 0;
+    // One column (movement parameter) per task
+    std::vector<unsigned int> task_scan, task_deriv;
     for (unsigned int s=1; s<_sm.NoOfScans(); s++) {
-      NEWIMAGE::volume<float> alpha_diff = mean_alpha - _sm.GetAlpha(s,_field);
-      if (_sm.HasBeta()) beta_diff = mean_beta - _sm.GetBeta(s,_field);
-      if (_sm.HasGamma()) gamma_diff = mean_gamma - _sm.GetGamma(s,_field);
-      for (unsigned d=0; d<_sm.NoOfMovementParametersForScan(s); d++) {
-	NEWIMAGE::volume<float> deriv_wrt_move = _sm.GetMovementDerivative(s,d,_field);
-        interaction.Column(offset+d+1) = - _field.Jte(deriv_wrt_move,alpha_diff,&mask);
-        if (_sm.HasBeta()) { deriv[0]=1; interaction.Column(offset+d+1) -=  _field.Jte(deriv,deriv_wrt_move,beta_diff,&mask); deriv[0]=0; }
-        if (_sm.HasGamma()) { deriv[1]=1; interaction.Column(offset+d+1) -=  _field.Jte(deriv,deriv_wrt_move,gamma_diff,&mask); deriv[1]=0; }
+      for (unsigned int d=0; d<_sm.NoOfMovementParametersForScan(s); d++) {
+        task_scan.push_back(s); task_deriv.push_back(d);
       }
-      offset += _sm.NoOfMovementParametersForScan(s);
     }
+    std::vector<NEWMAT::ColumnVector> columns(task_scan.size());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+    for (int t=0; t<int(columns.size()); t++) {
+      if (err.occurred()) continue;
+      try {
+        unsigned int s = task_scan[t];
+        std::vector<unsigned int> deriv(3,0);
+	NEWIMAGE::volume<float> deriv_wrt_move = _sm.GetMovementDerivative(s,task_deriv[t],_field);
+        columns[t] = - _field.Jte(deriv_wrt_move,alpha_diffs[s],&mask);
+        if (_sm.HasBeta()) { deriv[0]=1; columns[t] -=  _field.Jte(deriv,deriv_wrt_move,beta_diffs[s],&mask); deriv[0]=0; }
+        if (_sm.HasGamma()) { deriv[1]=1; columns[t] -=  _field.Jte(deriv,deriv_wrt_move,gamma_diffs[s],&mask); deriv[1]=0; }
+      }
+      catch (const std::exception& e) {
+        err.set(e.what());
+      }
+      catch (NEWMAT::Exception) {
+        err.set(NEWMAT::Exception::what());
+      }
+      catch (...) {
+        err.set("TopupCF::hess: unknown exception in interaction Hessian");
+      }
+    }
+    if (err.occurred()) throw std::runtime_error(err.what());
+    for (unsigned int t=0; t<columns.size(); t++) interaction.Column(t+1) = columns[t];
     interaction *= 2.0/(n*(m-1));
 
     boost::shared_ptr<MISCMATHS::BFMatrix> bf_interaction = boost::shared_ptr<MISCMATHS::BFMatrix>(new FullBFMatrix(interaction));
@@ -1726,6 +2010,116 @@ double TopupCF::sum_of_prod(const NEWIMAGE::volume<float>& i1,
   return(sum);
 }
 
+// Differences between the mean and each resampled scan (if scans is set),
+// and between the mean alpha, beta and gamma images and those of each scan
+// (if derivs is set). They are kept in _diffs, _alpha_diffs etc until the
+// scans change, so that e.g. grad and hess at the same point can share them.
+// The scans are independent so they are done in parallel.
+void TopupCF::update_diffs(bool scans, bool derivs) const
+{
+  if (TracePrint()) cout << "Entering TopupCF::update_diffs" << endl;
+
+  const NEWIMAGE::volume<float>&   mean = _sm.GetMean(_field);
+  const NEWIMAGE::volume<float>&   mean_alpha = _sm.GetMeanAlpha(_field);
+  const NEWIMAGE::volume<float>&   mean_beta = _sm.GetMeanBeta(_field);
+  const NEWIMAGE::volume<float>&   mean_gamma = _sm.GetMeanGamma(_field);
+  unsigned int count = _sm.UpdateCount();
+  bool do_scans = scans && (!_sm.Caching() || _diffs_count != count);
+  bool do_derivs = derivs && (!_sm.Caching() || _abg_diffs_count != count);
+  unsigned int m = _sm.NoOfScans();
+  if (do_scans) _diffs.resize(m);
+  if (do_derivs) {
+    _alpha_diffs.resize(m);
+    _beta_diffs.resize((_sm.HasBeta()) ? m : 0);
+    _gamma_diffs.resize((_sm.HasGamma()) ? m : 0);
+  }
+
+  if (do_scans || do_derivs) {
+    Utilities::ThreadedError err;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(Utilities::max_threads() > 1)
+#endif
+    for (int s=0; s<int(m); s++) {
+      if (err.occurred()) continue;
+      try {
+        if (do_scans) _diffs[s] = mean - _sm.GetScan(s,_field);
+        if (do_derivs) {
+          _alpha_diffs[s] = mean_alpha - _sm.GetAlpha(s,_field);
+          if (_sm.HasBeta()) _beta_diffs[s] = mean_beta - _sm.GetBeta(s,_field);
+          if (_sm.HasGamma()) _gamma_diffs[s] = mean_gamma - _sm.GetGamma(s,_field);
+        }
+      }
+      catch (const std::exception& e) {
+        err.set(e.what());
+      }
+      catch (NEWMAT::Exception) {
+        err.set(NEWMAT::Exception::what());
+      }
+      catch (...) {
+        err.set("TopupCF::update_diffs: unknown exception");
+      }
+    }
+    if (err.occurred()) throw std::runtime_error(err.what());
+    if (do_scans) _diffs_count = count;
+    if (do_derivs) _abg_diffs_count = count;
+  }
+
+  if (TracePrint()) cout << "Leaving TopupCF::update_diffs" << endl;
+}
+
+// The non-linear (field) part of the Hessian, before scaling, for the
+// voxels in mask. abc is organised as in TopupCF::hess.
+boost::shared_ptr<MISCMATHS::BFMatrix> TopupCF::field_hessian(const std::vector<NEWIMAGE::volume<float> *>& abc,
+                                                              const NEWIMAGE::volume<char>&                 mask) const
+{
+  if (TracePrint()) cout << "Entering TopupCF::field_hessian" << endl;
+
+  NEWIMAGE::volume<float> ones(mask.xsize(),mask.ysize(),mask.zsize());
+  copybasicproperties(*(abc[0]),ones); ones = 1.0;
+  boost::shared_ptr<MISCMATHS::BFMatrix> nonlin_bit = _field.JtJ(*(abc[0]),ones,&mask,HessianPrecision());
+  std::vector<unsigned int> deriv1(3,0);
+  std::vector<unsigned int> deriv2(3,0);
+  if (_sm.HasBeta()) {
+    deriv2[0] = 1;      
+    boost::shared_ptr<MISCMATHS::BFMatrix> tmp = _field.JtJ(deriv1,*(abc[1]),deriv2,ones,&mask,HessianPrecision());
+    nonlin_bit->AddToMe(*tmp);
+    nonlin_bit->AddToMe(*(tmp->Transpose()));
+    tmp = _field.JtJ(deriv2,*(abc[3]),ones,&mask,HessianPrecision());
+    nonlin_bit->AddToMe(*tmp);
+    deriv2[0] = 0;
+  }
+  if (_sm.HasGamma()) {
+    deriv2[1] = 1;
+    boost::shared_ptr<MISCMATHS::BFMatrix> tmp = _field.JtJ(deriv1,*(abc[2]),deriv2,ones,&mask,HessianPrecision());
+    nonlin_bit->AddToMe(*tmp);
+    nonlin_bit->AddToMe(*(tmp->Transpose()));
+    tmp = _field.JtJ(deriv2,*(abc[5]),ones,&mask,HessianPrecision());
+    nonlin_bit->AddToMe(*tmp);
+    deriv2[1] = 0;
+  }
+  if (_sm.HasBeta() && _sm.HasGamma()) {
+    deriv1[0] = 1;
+    deriv2[1] = 1;
+    boost::shared_ptr<MISCMATHS::BFMatrix> tmp = _field.JtJ(deriv1,*(abc[4]),deriv2,ones,&mask,HessianPrecision());
+    nonlin_bit->AddToMe(*tmp);
+    nonlin_bit->AddToMe(*(tmp->Transpose()));
+  }
+
+  if (TracePrint()) cout << "Leaving TopupCF::field_hessian" << endl;
+
+  return(nonlin_bit);
+}
+
+// Number of z-slabs to split the field part of the Hessian into. Splines
+// that straddle a slab boundary get visited once for each slab, so each
+// slab should span a few knots or the overhead outweighs the gain. Each
+// slab also holds a full-size partial Hessian while it is being added.
+int TopupCF::no_of_hessian_slabs() const
+{
+  int nslab = std::min(Utilities::max_threads(),int(_field.CoefSz_z())/4);
+  return((nslab > 1) ? nslab : 1);
+}
+
 NEWMAT::ReturnMatrix TopupCF::movement_hessian(unsigned int s1, // Scan 1, row
                                                unsigned int s2, // Scan 2, col
                                                const NEWIMAGE::volume<char>&   mask,
@@ -87,10 +87,10 @@ class TopupException: public std::exception
 private:
   std::string m_msg;
 public:
-  TopupException(const std::string& msg) throw(): m_msg(msg) {}
+  TopupException(const std::string& msg) throw(): m_msg("Topup: msg=" + msg) {}
 
   virtual const char * what() const throw() {
-    return string("Topup: msg=" + m_msg).c_str();
+    return m_msg.c_str();
   }
 
   ~TopupException() throw() {}
@@ -222,6 +222,7 @@ public:
   NEWIMAGE::volume<float> GetGamma(const BASISFIELD::splinefield& field) const;
   NEWIMAGE::volume<float> GetMovementDerivative(unsigned int i,
                                                 const BASISFIELD::splinefield& field) const;
+  void UpdateMovementDerivative(unsigned int i, const BASISFIELD::splinefield& field) const;
   NEWIMAGE::volume<float> GetNumericalMovementDerivative(unsigned int i,
                                                          const BASISFIELD::splinefield& field) const;
   NEWIMAGE::volume<float> GetJacobian(const BASISFIELD::splinefield& field) const;
@@ -229,6 +230,9 @@ public:
   NEWMAT::ColumnVector GetMovementParameters() const { return(_mp); }  // Will always serve up six elements
   NEWMAT::Matrix GetRigidBodyMatrix() const { return(mp_to_matrix(_mp)); }
   void SetUpToDate(bool flag) const { _uptodate=flag; }
+  void FieldUpdated() const { _uptodate=false; _field_uptodate=false; }
+  void Update(const BASISFIELD::splinefield& field) const { update(field); }
+  void SetCaching(bool val=true) const { _cache=val; }
   void SetMovementParameters(const NEWMAT::ColumnVector& mp) const;    // mp must contain six elements
   void SetInterpolationModel(TopupInterpolationType it) const;
   void ReGrid(int xsz, int ysz, int zsz);
@@ -244,13 +248,19 @@ private:
   mutable NEWIMAGE::volume4D<float>             _derivs;
   mutable NEWIMAGE::volume<float>               _jac; 
   mutable NEWIMAGE::volume<char>                _mask;
+  mutable NEWIMAGE::volume4D<float>             _df;        // Displacement field (mm), depends only on the field
+  mutable std::vector<NEWIMAGE::volume<float> > _mderivs;   // Derivatives w.r.t. movement parameters
+  mutable bool                                  _mderivs_ok[6]; // Not vector<bool>, it is written by several threads
   NEWMAT::ColumnVector                          _pevec;
   double                                        _rotime;
   mutable bool                                  _uptodate;
+  mutable bool                                  _field_uptodate; // _df and _jac up to date
+  mutable bool                                  _cache;     // Keep _df, _jac and _mderivs while still valid
   mutable NEWMAT::ColumnVector                  _mp;        // dx dy dz rx ry rz, N.B. different from MJ
   bool                                          _tp;        // Trace-print
 
   NEWMAT::Matrix mp_to_matrix(const NEWMAT::ColumnVector& mp) const;
+  NEWIMAGE::volume<float> movement_derivative(unsigned int i, const BASISFIELD::splinefield& field) const;
   NEWIMAGE::interpolation translate_interp_type(TopupInterpolationType it) const { if (it==LinearInterp) return(NEWIMAGE::trilinear); else return(NEWIMAGE::spline); }
   TopupInterpolationType translate_interp_type(NEWIMAGE::interpolation it) const { if (it==NEWIMAGE::trilinear) return(LinearInterp); else if (it==NEWIMAGE::spline) return(SplineInterp); else return(UnknownInterp); }
 
@@ -319,6 +329,8 @@ public:
   NEWIMAGE::volume<float> GetMovementDerivative(unsigned int scan,
                                                 unsigned int deriv,
                                                 const BASISFIELD::splinefield& field) const;
+  // Calculates (in parallel) and keeps all the movement derivatives for the current state
+  void UpdateMovementDerivatives(const BASISFIELD::splinefield& field) const;
   NEWIMAGE::volume<float> GetNumericalMovementDerivative(unsigned int scan,
                                                          unsigned int deriv,
                                                          const BASISFIELD::splinefield& field) const;
@@ -333,8 +345,13 @@ public:
   }
 
 
+  // Incremented each time the mean, mask etc are recalculated
+  unsigned int UpdateCount() const { return(_update_count); }
+
   // Routines that set/change the state of the scans
   void FieldUpdated() const;
+  void SetCaching(bool val=true) const { _cache=val; for (unsigned int i=0; i<_scans.size(); i++) _scans[i]->SetCaching(val); }
+  bool Caching() const { return(_cache); }
   void ReGrid(unsigned int xsz, unsigned int ysz, unsigned int zsz);
   void ReGrid(const std::vector<unsigned int>& sz) { ReGrid(sz[0],sz[1],sz[2]); }
   void SubSample(unsigned int ss);
@@ -350,6 +367,8 @@ private:
   mutable NEWIMAGE::volume<float>               _mean_beta;
   mutable NEWIMAGE::volume<float>               _mean_gamma;
   mutable bool                                  _up_to_date;
+  mutable unsigned int                          _update_count;
+  mutable bool                                  _cache;
   std::vector<unsigned int>                     _regrid_sz;
   unsigned int                                  _ss;
   mutable TopupInterpolationType                _it;
@@ -413,6 +432,7 @@ public:
   void SetSSQLambda(bool val=true) { _ssql=val; }
   void SetHessianPrecision(MISCMATHS::BFMatrixPrecisionType hp) { _hp = hp; }
   void SetInterpolationModel(TopupInterpolationType it) { _sm.SetInterpolationModel(it); }
+  void SetCaching(bool val=true) { _sm.SetCaching(val); }
 
   // Routines for writing results/information to file.
 
@@ -465,6 +485,13 @@ private:
   mutable unsigned int              _level;   // Unwarping level
   mutable unsigned int              _iter;    // Unwarping iteration (within level)
   mutable unsigned int              _attempt; // Unwarping attempt (within iter)
+  // Differences between the means and the individual scans, kept until the scans change
+  mutable std::vector<NEWIMAGE::volume<float> >  _diffs;
+  mutable std::vector<NEWIMAGE::volume<float> >  _alpha_diffs;
+  mutable std::vector<NEWIMAGE::volume<float> >  _beta_diffs;
+  mutable std::vector<NEWIMAGE::volume<float> >  _gamma_diffs;
+  mutable unsigned int              _diffs_count;     // _sm.UpdateCount() for _diffs
+  mutable unsigned int              _abg_diffs_count; // _sm.UpdateCount() for _alpha_diffs etc
 
   void set_latest_ssd(double ssd) const { _lssd=ssd; }
   void set_field_params(const NEWMAT::ColumnVector& p) const;
@@ -476,6 +503,10 @@ private:
                                         unsigned int s2,
                                         const NEWIMAGE::volume<char>&   mask,
                                         const BASISFIELD::splinefield&  field) const;
+  void update_diffs(bool scans, bool derivs) const;
+  boost::shared_ptr<MISCMATHS::BFMatrix> field_hessian(const std::vector<NEWIMAGE::volume<float> *>& abc,
+                                                       const NEWIMAGE::volume<char>&                 mask) const;
+  int no_of_hessian_slabs() const;
   BASISFIELD::splinefield field_factory(const NEWIMAGE::volume4D<float>& scans,
                                         double                           warpres,
                                         unsigned int                     sporder) const;